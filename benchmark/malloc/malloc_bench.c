@@ -13,8 +13,12 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,16 +29,38 @@
 #include "lran2.h"
 #include "opic/op_malloc.h"
 
+/* Time one out of this many operations for the latency percentiles. */
+#define LATENCY_SAMPLE_RATE 64
+/* Slots of the queue between a producer and its consumer. */
+#define RING_SIZE 4096
+
+enum workload { WORKLOAD_RANDOM, WORKLOAD_PRODCONS };
+
 static OPHeap* heap;
+static bool use_glibc;
 #ifdef DEBUG
 static int counter;
 #endif
 
+/* Block sizes and cumulative weights read from a trace. */
+static size_t *dist_sizes;
+static unsigned long *dist_weights;
+static size_t dist_num;
+
 static void usage(const char *name)
 {
     printf("run a malloc benchmark.\n"
-           "usage: %s [-s blk-size|blk-min:blk-max] [-l loop-count] "
-           "[-n num-blocks] [-c]\n",
+           "usage: %s [-s blk-size|blk-min:blk-max] [-d size-dist-file] "
+           "[-l loop-count] [-n num-blocks] [-t num-threads] "
+           "[-w random|prodcons] [-a opic|glibc] [-c]\n"
+           "\n"
+           "  -d  sample block sizes from a trace; each line of the file "
+           "is\n"
+           "      \"size [count]\", lines starting with # are ignored.\n"
+           "  -w  random: each thread frees and allocates blocks at random\n"
+           "      slots.  prodcons: threads are paired, the first thread\n"
+           "      of a pair allocates and the second one frees.\n"
+           "  -a  allocator to benchmark, OPHeap or the system malloc.\n",
            name);
     exit(-1);
 }
@@ -81,13 +107,68 @@ parse_size_arg(const char *arg, const char *exe_name,
         usage(exe_name);
 }
 
-/* Get a random block size between blk_min and blk_max. */
+/* Read a size distribution, one "size [count]" pair per line. */
+static void parse_dist_file(const char *path, const char *exe_name)
+{
+    FILE *fp;
+    char line[256];
+    unsigned long size, count, total = 0;
+    size_t cap = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        usage(exe_name);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#')
+            continue;
+        count = 1;
+        if (sscanf(line, "%lu %lu", &size, &count) < 1 ||
+            size == 0 || count == 0)
+            continue;
+        if (dist_num == cap) {
+            cap = cap ? cap * 2 : 64;
+            dist_sizes = realloc(dist_sizes, cap * sizeof(size_t));
+            dist_weights = realloc(dist_weights, cap * sizeof(unsigned long));
+            assert(dist_sizes && dist_weights);
+        }
+        total += count;
+        dist_sizes[dist_num] = size;
+        dist_weights[dist_num] = total;
+        dist_num++;
+    }
+    fclose(fp);
+    if (!dist_num) {
+        fprintf(stderr, "%s: no sizes found\n", path);
+        usage(exe_name);
+    }
+}
+
+/* Get a random block size between blk_min and blk_max, or from the
+   trace distribution if there is one. */
 static size_t
 get_random_block_size(size_t blk_min, size_t blk_max,
                       struct lran2_st *lran2_state)
 {
     size_t blk_size;
 
+    if (dist_num) {
+        unsigned long total = dist_weights[dist_num - 1];
+        unsigned long r = ((unsigned long)lran2(lran2_state) * LRAN2_MAX +
+                           lran2(lran2_state)) % total;
+        size_t lo = 0, hi = dist_num - 1;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (dist_weights[mid] > r)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return dist_sizes[lo];
+    }
+
     if (blk_max > blk_min) {
         blk_size = blk_min + (lran2(lran2_state) % (blk_max - blk_min));
     } else
@@ -96,14 +177,115 @@ get_random_block_size(size_t blk_min, size_t blk_max,
     return blk_size;
 }
 
+struct latency {
+    size_t ops;
+    uint64_t *samples;
+    size_t num;
+    size_t cap;
+};
+
+/* Single producer single consumer queue of allocated blocks. */
+struct ring {
+    atomic_size_t head;
+    atomic_size_t tail;
+    void *slots[RING_SIZE];
+};
+
+struct alloc_desc {
+    /* Generic fields. */
+    pthread_t thread;
+    unsigned int seed;
+    int loops;
+    size_t blk_min;
+    size_t blk_max;
+    void **blk_array;
+    size_t num_blks;
+    bool clear;
+    /* Producer/consumer fields. */
+    struct ring *ring;
+    bool consumer;
+    /* Results. */
+    struct latency malloc_lat;
+    struct latency free_lat;
+};
+
+static inline void *bench_malloc(size_t size)
+{
+    return use_glibc ? malloc(size) : OPMalloc(heap, size);
+}
+
+static inline void bench_free(void *addr)
+{
+    if (use_glibc)
+        free(addr);
+    else
+        OPDealloc(addr);
+}
+
+static inline uint64_t elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+           end->tv_nsec - start->tv_nsec;
+}
+
+static void latency_init(struct latency *lat, size_t ops)
+{
+    lat->ops = 0;
+    lat->num = 0;
+    lat->cap = ops / LATENCY_SAMPLE_RATE + 1;
+    lat->samples = malloc(lat->cap * sizeof(uint64_t));
+    assert(lat->samples != NULL);
+}
+
+static inline void
+latency_record(struct latency *lat, struct timespec *start,
+               struct timespec *end)
+{
+    if (lat->num < lat->cap)
+        lat->samples[lat->num++] = elapsed_ns(start, end);
+}
+
+static void *timed_malloc(struct alloc_desc *desc, size_t size)
+{
+    struct timespec start, end;
+    void *addr;
+
+    if (desc->malloc_lat.ops++ % LATENCY_SAMPLE_RATE)
+        return bench_malloc(size);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    addr = bench_malloc(size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latency_record(&desc->malloc_lat, &start, &end);
+    return addr;
+}
+
+static void timed_free(struct alloc_desc *desc, void *addr)
+{
+    struct timespec start, end;
+
+    if (desc->free_lat.ops++ % LATENCY_SAMPLE_RATE) {
+        bench_free(addr);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bench_free(addr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latency_record(&desc->free_lat, &start, &end);
+}
+
 static void
-run_alloc_benchmark(int loops, size_t blk_min, size_t blk_max,
-                    void **blk_array, size_t num_blks, bool clear,
-                    struct lran2_st *lran2_state)
+run_alloc_benchmark(struct alloc_desc *desc, struct lran2_st *lran2_state)
 {
+    void **blk_array = desc->blk_array;
+    size_t num_blks = desc->num_blks;
+    int loops = desc->loops;
+
     while (loops--) {
         int next_idx = lran2(lran2_state) % num_blks;
-        size_t blk_size = get_random_block_size(blk_min, blk_max, lran2_state);
+        size_t blk_size = get_random_block_size(desc->blk_min, desc->blk_max,
+                                                lran2_state);
 
 #ifdef DEBUG
         printf("%06d malloc size %zu ", counter++, blk_size);
@@ -112,45 +294,76 @@ run_alloc_benchmark(int loops, size_t blk_min, size_t blk_max,
 #ifdef DEBUG
           printf("free addr %p ", blk_array[next_idx]);
 #endif
-          OPDealloc(blk_array[next_idx]);
+          timed_free(desc, blk_array[next_idx]);
         }
 
         /* Insert the newly alloced block into the array at a random point. */
-        blk_array[next_idx] = OPMalloc(heap, blk_size);
+        blk_array[next_idx] = timed_malloc(desc, blk_size);
 #ifdef DEBUG
         printf("got addr %p\n", blk_array[next_idx]);
 #endif
-        if (clear)
+        if (desc->clear)
             memset(blk_array[next_idx], 0, blk_size);
     }
 
     /* Free up all allocated blocks. */
     for (size_t i = 0; i < num_blks; i++) {
         if (blk_array[i])
-            OPDealloc(blk_array[i]);
+            timed_free(desc, blk_array[i]);
     }
 }
 
-struct alloc_desc {
-    /* Generic fields. */
-    int loops;
-    size_t blk_min;
-    size_t blk_max;
-    void **blk_array;
-    size_t num_blks;
-    bool clear;
-};
+/* Allocate blocks and hand them over to the paired consumer thread. */
+static void
+run_producer(struct alloc_desc *desc, struct lran2_st *lran2_state)
+{
+    struct ring *ring = desc->ring;
+    size_t head = 0;
+
+    for (int i = 0; i < desc->loops; i++) {
+        size_t blk_size = get_random_block_size(desc->blk_min, desc->blk_max,
+                                                lran2_state);
+        void *addr = timed_malloc(desc, blk_size);
+
+        if (desc->clear)
+            memset(addr, 0, blk_size);
+        while (head - atomic_load_explicit(&ring->tail, memory_order_acquire)
+               == RING_SIZE)
+            sched_yield();
+        ring->slots[head % RING_SIZE] = addr;
+        atomic_store_explicit(&ring->head, ++head, memory_order_release);
+    }
+}
+
+/* Free the blocks allocated by the paired producer thread. */
+static void run_consumer(struct alloc_desc *desc)
+{
+    struct ring *ring = desc->ring;
+    size_t tail = 0;
+
+    for (int i = 0; i < desc->loops; i++) {
+        while (atomic_load_explicit(&ring->head, memory_order_acquire)
+               == tail)
+            sched_yield();
+        timed_free(desc, ring->slots[tail % RING_SIZE]);
+        atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+    }
+}
 
-static void start_bench(void *arg)
+static void *start_bench(void *arg)
 {
     struct alloc_desc *desc = arg;
     struct lran2_st lran2_state;
 
-    lran2_init(&lran2_state, time(NULL) ^ getpid());
+    lran2_init(&lran2_state, desc->seed);
 
-    run_alloc_benchmark(desc->loops, desc->blk_min, desc->blk_max,
-                        desc->blk_array, desc->num_blks, desc->clear,
-                        &lran2_state);
+    if (!desc->ring)
+        run_alloc_benchmark(desc, &lran2_state);
+    else if (desc->consumer)
+        run_consumer(desc);
+    else
+        run_producer(desc, &lran2_state);
+    return NULL;
 }
 
 static void stop_bench(void *arg)
@@ -158,26 +371,107 @@ static void stop_bench(void *arg)
     struct alloc_desc *desc = arg;
     if (!desc) return;
     free(desc->blk_array);
+    free(desc->malloc_lat.samples);
+    free(desc->free_lat.samples);
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Merge the latency samples of every thread and print percentiles. */
+static void
+report_latency(const char *name, struct alloc_desc *descs, int num_threads,
+               bool is_malloc)
+{
+    size_t num = 0, idx = 0;
+    uint64_t *samples;
+
+    for (int i = 0; i < num_threads; i++)
+        num += is_malloc ? descs[i].malloc_lat.num : descs[i].free_lat.num;
+    if (!num)
+        return;
+
+    samples = malloc(num * sizeof(uint64_t));
+    assert(samples != NULL);
+    for (int i = 0; i < num_threads; i++) {
+        struct latency *lat = is_malloc ?
+            &descs[i].malloc_lat : &descs[i].free_lat;
+        memcpy(&samples[idx], lat->samples, lat->num * sizeof(uint64_t));
+        idx += lat->num;
+    }
+    qsort(samples, num, sizeof(uint64_t), cmp_uint64);
+    printf("%-6s latency p50 %" PRIu64 " ns, p99 %" PRIu64
+           " ns, max %" PRIu64 " ns (%zu samples)\n",
+           name, samples[num / 2], samples[num * 99 / 100],
+           samples[num - 1], num);
+    free(samples);
+}
+
+/* Current resident set size in kilobytes, or 0 if unknown. */
+static long current_rss_kb(void)
+{
+    FILE *fp;
+    long pages = 0;
+
+    fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%*s %ld", &pages) != 1)
+        pages = 0;
+    fclose(fp);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
 }
 
 int main(int argc, char **argv)
 {
     size_t blk_min = 512, blk_max = 512, num_blks = 10000;
     int loops = 10000000;
+    int num_threads = 1;
+    enum workload workload = WORKLOAD_RANDOM;
     bool clear = false;
     int opt;
+    struct timespec start, end;
+    struct rusage usage_info;
+    struct ring *rings = NULL;
+    size_t total_ops = 0;
+    long rss_kb;
 
-    while ((opt = getopt(argc, argv, "s:l:r:t:n:b:ch")) > 0) {
+    while ((opt = getopt(argc, argv, "s:d:l:r:t:n:b:w:a:ch")) > 0) {
         switch (opt) {
             case 's':
                 parse_size_arg(optarg, argv[0], &blk_min, &blk_max);
                 break;
+            case 'd':
+                parse_dist_file(optarg, argv[0]);
+                break;
             case 'l':
                 loops = parse_int_arg(optarg, argv[0]);
                 break;
             case 'n':
                 num_blks = parse_int_arg(optarg, argv[0]);
                 break;
+            case 't':
+                num_threads = parse_int_arg(optarg, argv[0]);
+                break;
+            case 'w':
+                if (!strcmp(optarg, "random"))
+                    workload = WORKLOAD_RANDOM;
+                else if (!strcmp(optarg, "prodcons"))
+                    workload = WORKLOAD_PRODCONS;
+                else
+                    usage(argv[0]);
+                break;
+            case 'a':
+                if (!strcmp(optarg, "opic"))
+                    use_glibc = false;
+                else if (!strcmp(optarg, "glibc"))
+                    use_glibc = true;
+                else
+                    usage(argv[0]);
+                break;
             case 'c':
                 clear = true;
                 break;
@@ -190,51 +484,81 @@ int main(int argc, char **argv)
         }
     }
 
+    if (workload == WORKLOAD_PRODCONS) {
+        if (num_threads % 2)
+            usage(argv[0]);
+        rings = calloc(num_threads / 2, sizeof(struct ring));
+        assert(rings != NULL);
+    }
 
-    struct alloc_desc desc = {
-        .loops = loops,
-        .blk_min = blk_min,
-        .blk_max = blk_max,
-        .blk_array = malloc(num_blks * sizeof(unsigned char *)),
-        .num_blks = num_blks,
-        .clear = clear,
-    };
-    assert(desc.blk_array != NULL);
-    memset(desc.blk_array, 0, num_blks * sizeof(unsigned char *));
-
-    assert(OPHeapNew(&heap));
+    struct alloc_desc *descs = calloc(num_threads, sizeof(struct alloc_desc));
+    assert(descs != NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        /* Each loop is a malloc and at most one free. */
+        size_t ops = (size_t)loops * 2 + num_blks;
+
+        descs[i] = (struct alloc_desc) {
+            .seed = (time(NULL) ^ getpid()) + i,
+            .loops = loops,
+            .blk_min = blk_min,
+            .blk_max = blk_max,
+            .num_blks = num_blks,
+            .clear = clear,
+        };
+        if (workload == WORKLOAD_PRODCONS) {
+            descs[i].ring = &rings[i / 2];
+            descs[i].consumer = i % 2;
+        } else {
+            descs[i].blk_array = calloc(num_blks, sizeof(unsigned char *));
+            assert(descs[i].blk_array != NULL);
+        }
+        latency_init(&descs[i].malloc_lat, ops);
+        latency_init(&descs[i].free_lat, ops);
+    }
 
-    start_bench(&desc);
-    stop_bench(&desc);
+    if (!use_glibc && !OPHeapNew(&heap)) {
+        fprintf(stderr, "failed to create OPHeap\n");
+        return 1;
+    }
 
-    OPHeapDestroy(heap);
-    /*
-TODO: create a cross platform high resolution timer.
-    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_threads; i++) {
+        int err = pthread_create(&descs[i].thread, NULL,
+                                 start_bench, &descs[i]);
+        assert(err == 0);
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(descs[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    int err = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
-    assert(err == 0);
+    rss_kb = current_rss_kb();
+    getrusage(RUSAGE_SELF, &usage_info);
 
-    err = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
-    assert(err == 0);
+    for (int i = 0; i < num_threads; i++)
+        total_ops += descs[i].malloc_lat.ops + descs[i].free_lat.ops;
 
     double elapsed = (end.tv_sec - start.tv_sec) +
                      (end.tv_nsec - start.tv_nsec) * 1e-9;
-
-    struct rusage usage;
-    err = getrusage(RUSAGE_SELF, &usage);
-    assert(err == 0);
-    */
-
-
-    /* Dump both machine and human readable versions */
-    /*
-    printf("%u:%u:%u:%u:%u:%.6f: took %.6f s for %u malloc/free\n"
-           "benchmark loops of %u-%u bytes.  ~%.3f us per loop\n",
-           blk_min, blk_max, loops,
-           (int)clear, usage.ru_maxrss, elapsed, elapsed, loops, blk_min,
-           blk_max, (double)(elapsed / loops) * 1e6);
-           */
+    printf("%s %s: %d threads took %.6f s for %d loops each, "
+           "%zu malloc/free ops, %.3f Mops/s\n",
+           use_glibc ? "glibc" : "opic",
+           workload == WORKLOAD_PRODCONS ? "prodcons" : "random",
+           num_threads, elapsed, loops, total_ops,
+           (double)total_ops / elapsed * 1e-6);
+    report_latency("malloc", descs, num_threads, true);
+    report_latency("free", descs, num_threads, false);
+    printf("rss %ld kB, max rss %ld kB\n", rss_kb, usage_info.ru_maxrss);
+
+    for (int i = 0; i < num_threads; i++)
+        stop_bench(&descs[i]);
+    free(descs);
+    free(rings);
+    free(dist_sizes);
+    free(dist_weights);
+
+    if (!use_glibc)
+        OPHeapDestroy(heap);
 
     return 0;
 }
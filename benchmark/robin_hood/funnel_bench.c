@@ -130,6 +130,15 @@ uint64_t RHHFunnelInsertWrap(void* key, void* context, OPHash hash_impl)
   return 0;
 }
 
+uint64_t RHHParallelFunnelInsertWrap(void* key, void* context,
+                                     OPHash hash_impl)
+{
+  static uint64_t val = 0;
+  RHHParallelFunnelInsert(context, key, &val);
+  val++;
+  return 0;
+}
+
 uint64_t RHHFunnelGetWrap(void* key, void* context, OPHash hash_impl)
 {
   RHHFunnelGet(context, key, NULL, 0);
@@ -158,7 +167,7 @@ void help(char* program)
 {
   printf
     ("usage: %s [-n power_of_2] [-r repeat] [-k keytype] [-i impl]\n"
-     "       [-l load] [-p]\n"
+     "       [-l load] [-t threads] [-p]\n"
      "Options:\n"
      "  -n num     Number of elements measured in power of 2.\n"
      "             -n 20 => run 2^20 = 1 million elements.\n"
@@ -170,6 +179,7 @@ void help(char* program)
      "             For now only robin_hood hash supports long_int benchmark\n"
      "  -i impl    impl = rhh, funnel_rhh\n"
      "  -l load    load number for rhh range from 0.0 to 1.0.\n"
+     "  -t threads Insert with a parallel funnel of `threads` workers.\n"
      "  -p         print probing stats of RHH\n"
      "  -h         print help.\n"
      ,program);
@@ -192,6 +202,8 @@ int main(int argc, char* argv[])
   double load = 0.8;
   bool print_stat = false;
   RHHFunnel* funnel;
+  RHHParallelFunnel* parallel_funnel;
+  unsigned int funnel_workers = 0;
 
   RHHNew_t rhh_new = (RHHNew_t)RHHNew;
   RHHDestroy_t rhh_destroy = (RHHDestroy_t)RHHDestroy;
@@ -204,7 +216,7 @@ int main(int argc, char* argv[])
 
   num_power = 20;
 
-  while ((opt = getopt(argc, argv, "a:b:n:r:k:i:l:f:ph")) > -1)
+  while ((opt = getopt(argc, argv, "a:b:n:r:k:i:l:t:f:ph")) > -1)
     {
       switch (opt)
         {
@@ -264,6 +276,9 @@ int main(int argc, char* argv[])
         case 'l':
           load = atof(optarg);
           break;
+        case 't':
+          funnel_workers = atoi(optarg);
+          break;
         case 'f':
           if (!strcmp("murmur3", optarg))
             {
@@ -309,13 +324,29 @@ int main(int argc, char* argv[])
       op_assert(rhh_new(heap, &rhh, num,
                         load, k_len, 8), "Create RobinHoodHash\n");
 
-      funnel = RHHFunnelNewCustom(rhh, hasher, NULL,
-                                  funnel_slotsize, funnel_partition_size);
-      gettimeofday(&i_start, NULL);
-      key_func(num_power, rhh_put, funnel, hasher);
-      RHHFunnelInsertFlush(funnel);
-      gettimeofday(&i_end, NULL);
-      RHHFunnelDestroy(funnel);
+      if (funnel_workers)
+        {
+          parallel_funnel = RHHParallelFunnelNewCustom(rhh, hasher,
+                                                       funnel_workers,
+                                                       1 << 10);
+          gettimeofday(&i_start, NULL);
+          key_func(num_power, RHHParallelFunnelInsertWrap,
+                   parallel_funnel, hasher);
+          RHHParallelFunnelInsertFlush(parallel_funnel);
+          gettimeofday(&i_end, NULL);
+          RHHParallelFunnelDestroy(parallel_funnel);
+        }
+      else
+        {
+          funnel = RHHFunnelNewCustom(rhh, hasher, NULL,
+                                      funnel_slotsize,
+                                      funnel_partition_size);
+          gettimeofday(&i_start, NULL);
+          key_func(num_power, rhh_put, funnel, hasher);
+          RHHFunnelInsertFlush(funnel);
+          gettimeofday(&i_end, NULL);
+          RHHFunnelDestroy(funnel);
+        }
 
       printf("insert finished\n");
 
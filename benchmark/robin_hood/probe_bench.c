@@ -158,7 +158,7 @@ void help(char* program)
 {
   printf
     ("usage: %s [-n power_of_2] [-r repeat] [-k keytype] [-i impl]\n"
-     "       [-l load] [-p]\n"
+     "       [-f hasher] [-l load] [-p]\n"
      "Options:\n"
      "  -n num     Number of elements measured in power of 2.\n"
      "             -n 20 => run 2^20 = 1 million elements.\n"
@@ -169,6 +169,8 @@ void help(char* program)
      "             l_string: 256 bytes, l_int: 8 bytes\n"
      "             For now only robin_hood hash supports long_int benchmark\n"
      "  -i impl    impl = linear, quadratic, double_hashing, chain\n"
+     "  -f hasher  hasher = city, murmur3, spooky, farm, int, crc32c\n"
+     "             int and crc32c mix 8 byte keys, others use city.\n"
      "  -l load    load number range from 0.0 to 1.0.\n"
      "  -p         print probing stats of hash table\n"
      "  -h         print help.\n"
@@ -284,6 +286,16 @@ int main(int argc, char* argv[])
               printf("using farmhash\n");
               hasher = farm;
             }
+          else if (!strcmp("int", optarg))
+            {
+              printf("using OPIntHash\n");
+              hasher = OPIntHash;
+            }
+          else if (!strcmp("crc32c", optarg))
+            {
+              printf("using OPCRC32CHash\n");
+              hasher = OPCRC32CHash;
+            }
           else
             help(argv[0]);
           break;
@@ -57,6 +57,7 @@
 #include "opic/op_malloc.h"
 #include "opic/hash/op_hash.h"
 #include "opic/hash/robin_hood.h"
+#include "opic/hash/robin_hood_spec.h"
 
 #include "murmurhash3.h"
 #include "spookyhash-c/spookyhash.h"
@@ -127,6 +128,32 @@ uint64_t RHHGetWrap(void* key, void* context, OPHash hash_impl)
   return *(uint64_t*)RHHGetCustom(context, hash_impl, key);
 }
 
+// Specialized tables hash with OPDefaultHash regardless of -f.
+RHH_SPECIALIZE(K6V8, 6, 8, OPDefaultHash, OP_HASH_ID_DEFAULT)
+RHH_SPECIALIZE(K32V8, 32, 8, OPDefaultHash, OP_HASH_ID_DEFAULT)
+RHH_SPECIALIZE(K256V8, 256, 8, OPDefaultHash, OP_HASH_ID_DEFAULT)
+
+#define RHH_SPEC_WRAP(NAME)                                     \
+  uint64_t RHHSpecPutWrap##NAME(void* key, void* context,       \
+                                OPHash hash_impl)               \
+  {                                                             \
+    static uint64_t val = 0;                                    \
+    RHHInsert##NAME(context, key, &val);                        \
+    val++;                                                      \
+    return 0;                                                   \
+  }                                                             \
+                                                                \
+  uint64_t RHHSpecGetWrap##NAME(void* key, void* context,       \
+                                OPHash hash_impl)               \
+  {                                                             \
+    return *(uint64_t*)RHHGet##NAME(context, key);              \
+  }
+
+RHH_SPEC_WRAP(K6V8)
+RHH_SPEC_WRAP(K8V8)
+RHH_SPEC_WRAP(K32V8)
+RHH_SPEC_WRAP(K256V8)
+
 
 void CountObjects(void* key, void* val,
                   size_t keysize, size_t valsize, void* ctx)
@@ -154,7 +181,7 @@ void help(char* program)
 {
   printf
     ("usage: %s [-n power_of_2] [-r repeat] [-k keytype] [-i impl]\n"
-     "       [-l load] [-p]\n"
+     "       [-f hasher] [-l load] [-p]\n"
      "Options:\n"
      "  -n num     Number of elements measured in power of 2.\n"
      "             -n 20 => run 2^20 = 1 million elements.\n"
@@ -164,7 +191,11 @@ void help(char* program)
      "             s_string: 6 bytes, m_string: 32 bytes,\n"
      "             l_string: 256 bytes, l_int: 8 bytes\n"
      "             For now only robin_hood hash supports long_int benchmark\n"
-     "  -i impl    impl = rhh, rhh_b_k_v, rhh_b_kv\n"
+     "  -i impl    impl = rhh, rhh_spec, rhh_b_k_v, rhh_b_kv\n"
+     "             rhh_spec: rhh with key and value sizes fixed at\n"
+     "             compile time, always hashed with OPDefaultHash\n"
+     "  -f hasher  hasher = city, murmur3, spooky, farm, int, crc32c\n"
+     "             int and crc32c mix 8 byte keys, others use city.\n"
      "  -l load    load number for rhh range from 0.0 to 1.0.\n"
      "  -p         print probing stats of RHH\n"
      "  -h         print help.\n"
@@ -197,6 +228,7 @@ int main(int argc, char* argv[])
   HashFunc rhh_get = RHHGetWrap;
   RHHPrintStat_t rhh_printstat = (RHHPrintStat_t)RHHPrintStat;
   OPHash hasher = city;
+  bool spec = false;
 
   num_power = 20;
 
@@ -239,6 +271,11 @@ int main(int argc, char* argv[])
             {
               printf("Using official robin_hood\n");
             }
+          else if (!strcmp("rhh_spec", optarg))
+            {
+              printf("Using specialized robin_hood\n");
+              spec = true;
+            }
           else if (!strcmp("rhh_b_k_v", optarg))
             {
               printf("Using rhh_b_k_v\n");
@@ -311,6 +348,16 @@ int main(int argc, char* argv[])
               printf("using farmhash\n");
               hasher = farm;
             }
+          else if (!strcmp("int", optarg))
+            {
+              printf("using OPIntHash\n");
+              hasher = OPIntHash;
+            }
+          else if (!strcmp("crc32c", optarg))
+            {
+              printf("using OPCRC32CHash\n");
+              hasher = OPCRC32CHash;
+            }
           else
             help(argv[0]);
           break;
@@ -324,6 +371,30 @@ int main(int argc, char* argv[])
         }
     }
 
+  if (spec)
+    {
+      // Key length is only known once all options are parsed.
+      switch (k_len)
+        {
+        case 6:
+          rhh_put = RHHSpecPutWrapK6V8;
+          rhh_get = RHHSpecGetWrapK6V8;
+          break;
+        case 8:
+          rhh_put = RHHSpecPutWrapK8V8;
+          rhh_get = RHHSpecGetWrapK8V8;
+          break;
+        case 32:
+          rhh_put = RHHSpecPutWrapK32V8;
+          rhh_get = RHHSpecGetWrapK32V8;
+          break;
+        case 256:
+          rhh_put = RHHSpecPutWrapK256V8;
+          rhh_get = RHHSpecGetWrapK256V8;
+          break;
+        }
+    }
+
   num = 1UL << num_power;
   printf("running elements %" PRIu64 "\n", num);
 
@@ -114,9 +114,12 @@ static inline uint64_t hash_128_to_64(const uint128_t x) {
   return b;
 }
 
-// conditionally include declarations for versions of city that require SSE4.2
-// instructions to be available
-#if defined(__SSE4_2__) && defined(__x86_64)
+// versions of city built on CRC32C. They use the SSE4.2 crc32 instruction
+// when the CPU has it and a portable implementation with identical results
+// otherwise.
+
+// CRC32C of the 8 bytes of v, continuing from crc; same as _mm_crc32_u64
+uint32_t crc32c_u64(uint32_t crc, uint64_t v);
 
 // hash function for a byte array
 uint128_t cityhash128_crc(const uint8_t* s, size_t len);
@@ -129,8 +132,6 @@ uint128_t cityhash128_crc_with_seed(const uint8_t* s, size_t len,
 // hash function for a byte array
 uint256_t cityhash256_crc(const uint8_t* s, size_t len);
 
-#endif
-
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,214 @@
+/* cityhash_test.c ---
+ *
+ * Filename: cityhash_test.c
+ * Description:
+ * Author: Felix Chern
+ * Maintainer:
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ * The crc flavors of City pick their CRC32C implementation at run
+ * time. Hashes are persisted in heap files, hence every implementation
+ * must reproduce the same values; these are the values of the original
+ * SSE4.2 only build.
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <cmocka.h>
+#include "cityhash.h"
+#include "op_hash.h"
+
+#define TEST_BUF_SIZE 5000
+
+static uint8_t buf[TEST_BUF_SIZE];
+
+static void
+FillBuf(void)
+{
+  uint64_t state = 1;
+  for (int i = 0; i < TEST_BUF_SIZE; i++)
+    {
+      state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+      buf[i] = state >> 56;
+    }
+}
+
+static uint32_t
+BitwiseCRC32C(uint32_t crc, uint64_t v)
+{
+  for (int i = 0; i < 64; i++)
+    {
+      crc = ((crc ^ v) & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+      v >>= 1;
+    }
+  return crc;
+}
+
+static void
+test_CRC32C(void** context)
+{
+  uint64_t v = 1;
+  for (int i = 0; i < 10000; i++)
+    {
+      v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+      assert_int_equal(BitwiseCRC32C(v >> 17, v), crc32c_u64(v >> 17, v));
+    }
+  // "12345678", the first 8 bytes of the usual check string.
+  assert_int_equal(0x6087809a,
+                   crc32c_u64(0xffffffff, 0x3837363534333231ULL)
+                   ^ 0xffffffff);
+}
+
+static void
+test_CityHashCRC(void** context)
+{
+  static const struct
+  {
+    size_t len;
+    uint256_t h256;
+    uint128_t h128;
+  } expected[] =
+    {
+      {0,
+       {0x95162f24e6a5f930, 0x6808bdf4f1eb06e0,
+        0xb3b1f3a67b624d82, 0xc9a62f12bd4cd80b},
+       {0x3df09dfc64c09a2b, 0x3cb540c392e51e29}},
+      {100,
+       {0x3fcd686e0a842993, 0xcf0fc3c6ab450a38,
+        0xa535f01d97cdfa6e, 0x1e79dcd0438aec4b},
+       {0xa2f198411a2f0884, 0xdfb81e6c4b1e8d3d}},
+      {240,
+       {0x97d516e60241c116, 0x4c8bd5cf6f76c891,
+        0x7f9d55eca69d8784, 0xe8e0844c36d5326d},
+       {0x0a33722875300a05, 0x86e1bbac110d21e2}},
+      {241,
+       {0x14592eeb758e4bfc, 0x95c9eb41ee9785d1,
+        0x2f783a6fcb26dd05, 0x0aab6fb3eda2e3dd},
+       {0x6f83b6faef1da5df, 0x5b05bb639b15b655}},
+      {1000,
+       {0x8da5227423c1bad4, 0xb141817519a5a4fe,
+        0x349908c39fccfdf7, 0xf9074a445447b0d9},
+       {0x349908c39fccfdf7, 0xf9074a445447b0d9}},
+      {5000,
+       {0xaa4d6833a4d85fd7, 0x62e68450ffb5a178,
+        0xd38c3d9f33422c32, 0x0cfad56fd76df35b},
+       {0xd38c3d9f33422c32, 0x0cfad56fd76df35b}},
+    };
+  uint256_t h256;
+  uint128_t h128;
+
+  FillBuf();
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+      h256 = cityhash256_crc(buf, expected[i].len);
+      assert_int_equal(expected[i].h256.a, h256.a);
+      assert_int_equal(expected[i].h256.b, h256.b);
+      assert_int_equal(expected[i].h256.c, h256.c);
+      assert_int_equal(expected[i].h256.d, h256.d);
+      h128 = cityhash128_crc(buf, expected[i].len);
+      assert_int_equal(expected[i].h128.a, h128.a);
+      assert_int_equal(expected[i].h128.b, h128.b);
+    }
+}
+
+static void
+test_OPCRC32CHash(void** context)
+{
+  uint64_t k64;
+  uint32_t k32;
+
+  // Same value whether OP_CRC32C_U64 is the intrinsic or crc32c_u64.
+  for (uint64_t i = 0; i < 1000; i++)
+    {
+      uint64_t expected, mixed;
+      k64 = i << 40 | i;
+      mixed = k64 * 0x9e3779b97f4a7c15ULL;
+      expected = BitwiseCRC32C(0, k64) |
+        (uint64_t)BitwiseCRC32C(0, mixed) << 32;
+      expected ^= expected >> 29;
+      assert_int_equal(expected, OPCRC32CHash(&k64, 8));
+      k32 = i;
+      assert_int_equal(OPCRC32CHash(&(uint64_t){i}, 8),
+                       OPCRC32CHash(&k32, 4));
+    }
+}
+
+static void
+test_OPHashBatch(void** context)
+{
+  static const size_t keysizes[] = {4, 8, 6, 32};
+  uint64_t out[TEST_BUF_SIZE / 4];
+  size_t keysize;
+
+  FillBuf();
+  for (size_t k = 0; k < sizeof(keysizes) / sizeof(keysizes[0]); k++)
+    {
+      keysize = keysizes[k];
+      // Odd offsets and counts cover unaligned loads and the tail.
+      for (size_t n = 0; n < 40; n++)
+        {
+          OPHashBatch(&buf[1], n, keysize, out);
+          for (size_t i = 0; i < n; i++)
+            assert_int_equal(OPDefaultHash(&buf[1 + i * keysize], keysize),
+                             out[i]);
+        }
+      OPHashBatch(buf, TEST_BUF_SIZE / keysize, keysize, out);
+      for (size_t i = 0; i < TEST_BUF_SIZE / keysize; i++)
+        assert_int_equal(OPDefaultHash(&buf[i * keysize], keysize), out[i]);
+    }
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest cityhash_tests[] =
+    {
+      cmocka_unit_test(test_CRC32C),
+      cmocka_unit_test(test_CityHashCRC),
+      cmocka_unit_test(test_OPCRC32CHash),
+      cmocka_unit_test(test_OPHashBatch),
+    };
+
+  return cmocka_run_group_tests(cityhash_tests, NULL, NULL);
+}
+
+/* cityhash_test.c ends here */
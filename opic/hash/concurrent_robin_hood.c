@@ -0,0 +1,301 @@
+/* concurrent_robin_hood.c ---
+ *
+ * Filename: concurrent_robin_hood.c
+ * Description: Sharded RobinHoodHash with sequence locked segments
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opic/common/op_assert.h"
+#include "opic/common/op_atomic.h"
+#include "opic/common/op_log.h"
+#include "robin_hood_internal.h"
+#include "concurrent_robin_hood.h"
+
+#define CRHH_MAX_SEGMENT_BITS 12
+#define SPIN_BEFORE_YIELD 64
+
+OP_LOGGER_FACTORY(logger, "opic.hash.concurrent_robin_hood");
+
+/*
+ * The sequence number is even while the segment is stable and odd
+ * while a writer owns it. Writers take ownership by moving it from
+ * even to odd with a CAS, which makes the sequence lock a writer
+ * mutex at the same time. Each segment fills a cache line so that
+ * writers on neighbour segments do not bounce each other's lines.
+ */
+struct CRHHSegment
+{
+  a_uint64_t seq;
+  opref_t rhh_ref;
+  uint8_t padding[64 - sizeof(a_uint64_t) - sizeof(opref_t)];
+};
+
+struct ConcurrentRobinHoodHash
+{
+  size_t keysize;
+  size_t valsize;
+  uint32_t segment_bits;
+  struct CRHHSegment segments[];
+};
+
+static inline struct CRHHSegment*
+ObtainSegment(ConcurrentRobinHoodHash* crhh, uint64_t hashed_key)
+{
+  // RobinHoodHash indexes buckets with the low bits of the hash,
+  // hence segments take the high bits.
+  if (crhh->segment_bits == 0)
+    return &crhh->segments[0];
+  return &crhh->segments[hashed_key >> (64 - crhh->segment_bits)];
+}
+
+static inline void
+SpinWait(int* spin)
+{
+  if (++*spin < SPIN_BEFORE_YIELD)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+      return;
+    }
+  *spin = 0;
+  sched_yield();
+}
+
+static inline void
+SegmentLock(struct CRHHSegment* segment)
+{
+  uint64_t seq;
+  int spin = 0;
+
+  while (true)
+    {
+      seq = atomic_load_explicit(&segment->seq, memory_order_relaxed);
+      if (!(seq & 1) &&
+          atomic_compare_exchange_weak_explicit(&segment->seq, &seq, seq + 1,
+                                                memory_order_acquire,
+                                                memory_order_relaxed))
+        break;
+      SpinWait(&spin);
+    }
+  // Bucket writes must not become visible before the odd sequence.
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+SegmentUnlock(struct CRHHSegment* segment)
+{
+  atomic_fetch_add_explicit(&segment->seq, 1, memory_order_release);
+}
+
+bool
+CRHHNew(OPHeap* heap, ConcurrentRobinHoodHash** crhh_ref,
+        uint64_t num_objects, double load,
+        size_t keysize, size_t valsize, uint32_t segment_num)
+{
+  ConcurrentRobinHoodHash* crhh;
+  RobinHoodHash* rhh;
+  uint32_t segment_bits, seg;
+
+  op_assert(segment_num > 0 &&
+            segment_num <= (1U << CRHH_MAX_SEGMENT_BITS),
+            "segment_num %u must within 1 to %u\n",
+            segment_num, 1U << CRHH_MAX_SEGMENT_BITS);
+  segment_bits = segment_num == 1 ? 0 : 32 - __builtin_clz(segment_num - 1);
+  segment_num = 1U << segment_bits;
+
+  crhh = OPCalloc(heap, 1, sizeof(ConcurrentRobinHoodHash) +
+                  segment_num * sizeof(struct CRHHSegment));
+  if (!crhh)
+    return false;
+  crhh->keysize = keysize;
+  crhh->valsize = valsize;
+  crhh->segment_bits = segment_bits;
+
+  for (seg = 0; seg < segment_num; seg++)
+    {
+      if (!RHHNew(heap, &rhh, num_objects / segment_num + 1,
+                  load, keysize, valsize))
+        {
+          OP_LOG_ERROR(logger, "Cannot allocate segment %u", seg);
+          while (seg--)
+            RHHDestroy(OPRef2Ptr(crhh, crhh->segments[seg].rhh_ref));
+          OPDealloc(crhh);
+          return false;
+        }
+      crhh->segments[seg].rhh_ref = OPPtr2Ref(rhh);
+      atomic_init(&crhh->segments[seg].seq, 0);
+    }
+  *crhh_ref = crhh;
+  return true;
+}
+
+void
+CRHHDestroy(ConcurrentRobinHoodHash* crhh)
+{
+  uint32_t segment_num = 1U << crhh->segment_bits;
+
+  for (uint32_t seg = 0; seg < segment_num; seg++)
+    RHHDestroy(OPRef2Ptr(crhh, crhh->segments[seg].rhh_ref));
+  OPDealloc(crhh);
+}
+
+bool
+CRHHInsertCustom(ConcurrentRobinHoodHash* crhh, OPHash hasher,
+                 void* key, void* val)
+{
+  struct CRHHSegment* segment;
+  uint64_t hashed_key;
+  bool result;
+
+  hashed_key = hasher(key, crhh->keysize);
+  segment = ObtainSegment(crhh, hashed_key);
+  SegmentLock(segment);
+  result = RHHPreHashInsertCustom(OPRef2Ptr(crhh, segment->rhh_ref),
+                                  hasher, hashed_key, key, val);
+  SegmentUnlock(segment);
+  return result;
+}
+
+bool
+CRHHGetCustom(ConcurrentRobinHoodHash* crhh, OPHash hasher,
+              void* key, void* val)
+{
+  const size_t valsize = crhh->valsize;
+  struct CRHHSegment* segment;
+  RobinHoodHash* rhh;
+  uint64_t hashed_key, seq;
+  uint8_t val_cpy[valsize + 1];
+  bool found;
+  int spin = 0;
+
+  hashed_key = hasher(key, crhh->keysize);
+  segment = ObtainSegment(crhh, hashed_key);
+  rhh = OPRef2Ptr(crhh, segment->rhh_ref);
+
+  while (true)
+    {
+      seq = atomic_load_explicit(&segment->seq, memory_order_acquire);
+      if (seq & 1)
+        {
+          SpinWait(&spin);
+          continue;
+        }
+      // The copy may be torn by a concurrent writer, so it lands in a
+      // private buffer and reaches the caller only after validation.
+      found = RHHPreHashGetCopy(rhh, hashed_key, key, val_cpy);
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&segment->seq, memory_order_relaxed) == seq)
+        break;
+    }
+  if (found && val)
+    memcpy(val, val_cpy, valsize);
+  return found;
+}
+
+bool
+CRHHDeleteCustom(ConcurrentRobinHoodHash* crhh, OPHash hasher,
+                 void* key, void* val)
+{
+  struct CRHHSegment* segment;
+  uint64_t hashed_key;
+  void* deleted_val;
+
+  hashed_key = hasher(key, crhh->keysize);
+  segment = ObtainSegment(crhh, hashed_key);
+  SegmentLock(segment);
+  deleted_val = RHHPreHashDeleteCustom(OPRef2Ptr(crhh, segment->rhh_ref),
+                                       hasher, hashed_key, key);
+  if (deleted_val && val)
+    memcpy(val, deleted_val, crhh->valsize);
+  SegmentUnlock(segment);
+  return deleted_val != NULL;
+}
+
+uint64_t
+CRHHObjcnt(ConcurrentRobinHoodHash* crhh)
+{
+  uint32_t segment_num = 1U << crhh->segment_bits;
+  RobinHoodHash* rhh;
+  uint64_t objcnt = 0;
+
+  for (uint32_t seg = 0; seg < segment_num; seg++)
+    {
+      rhh = OPRef2Ptr(crhh, crhh->segments[seg].rhh_ref);
+      objcnt += __atomic_load_n(&rhh->objcnt, __ATOMIC_RELAXED);
+    }
+  return objcnt;
+}
+
+size_t
+CRHHKeysize(ConcurrentRobinHoodHash* crhh)
+{
+  return crhh->keysize;
+}
+
+size_t
+CRHHValsize(ConcurrentRobinHoodHash* crhh)
+{
+  return crhh->valsize;
+}
+
+void
+CRHHIterate(ConcurrentRobinHoodHash* crhh,
+            OPHashIterator iterator, void* context)
+{
+  uint32_t segment_num = 1U << crhh->segment_bits;
+  struct CRHHSegment* segment;
+
+  for (uint32_t seg = 0; seg < segment_num; seg++)
+    {
+      segment = &crhh->segments[seg];
+      SegmentLock(segment);
+      RHHIterate(OPRef2Ptr(crhh, segment->rhh_ref), iterator, context);
+      SegmentUnlock(segment);
+    }
+}
+
+/* concurrent_robin_hood.c ends here */
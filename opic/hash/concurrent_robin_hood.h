@@ -0,0 +1,211 @@
+/**
+ * @file concurrent_robin_hood.h
+ * @brief A thread safe variant of RobinHoodHash with lock free readers.
+ * @author Felix Chern
+ * @date Sun Oct 18 2026
+ * @copyright 2017 Felix Chern
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#ifndef OPIC_HASH_CONCURRENT_ROBIN_HOOD_H
+#define OPIC_HASH_CONCURRENT_ROBIN_HOOD_H 1
+
+#include <stdbool.h>
+#include "opic/common/op_macros.h"
+#include "op_hash.h"
+#include "opic/op_malloc.h"
+
+OP_BEGIN_DECLS
+
+/**
+ * @ingroup hash
+ * @struct ConcurrentRobinHoodHash　
+ * @brief ConcurrentRobinHoodHash is an opaque object that manages fixed
+ * length key-value pairs and can be shared between threads.
+ *
+ * The bucket array is split into segments by the most significant bits
+ * of the hashed key. Each segment is a RobinHoodHash　guarded by a
+ * sequence lock. Writers serialize on the segment they hash to, so
+ * writers on different segments never wait for each other. A segment
+ * resizes while its writer holds the lock, which leaves the other
+ * segments untouched.
+ *
+ * Readers never take a lock. They copy the value out of the segment
+ * and retry if a writer modified the segment meanwhile. For this reason
+ * there is no API returning a pointer into the table; the pointer could
+ * be invalidated by a concurrent push down or resize at any time.
+ *
+ * The segment count is fixed at construction time. Choose a number a few
+ * times larger than the number of writer threads to keep the chance of
+ * two writers meeting on one segment low.
+ */
+typedef struct ConcurrentRobinHoodHash ConcurrentRobinHoodHash;
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Constructor for ConcurrentRobinHoodHash.
+ *
+ * @param heap OPHeap instance.
+ * @param crhh_ref reference to the ConcurrentRobinHoodHash pointer for
+ * assigining ConcurrentRobinHoodHash instance.
+ * @param num_objects number of objects we decided to put in.
+ * @param load (0.0-1.0) how full the hash table could be
+ * before expansion.
+ * @param keysize length of key measured in bytes. Cannot be zero.
+ * @param valsize length of value measured in bytes. Can be zero.
+ * @param segment_num number of segments. Rounded up to power of two,
+ * must be within 1 to 4096.
+ * @return true when the allocation succeeded, false otherwise.
+ */
+bool CRHHNew(OPHeap* heap, ConcurrentRobinHoodHash** crhh_ref,
+             uint64_t num_objects, double load,
+             size_t keysize, size_t valsize, uint32_t segment_num);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Destructor for ConcurrentRobinHoodHash.
+ *
+ * No other thread may access the table during or after destruction.
+ *
+ * @param crhh the ConcurrentRobinHoodHash instance to destory.
+ */
+void CRHHDestroy(ConcurrentRobinHoodHash* crhh);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Associates the specified key with the specified value using
+ * custom hash function.
+ *
+ * @param crhh ConcurrentRobinHoodHash instance.
+ * @param hasher hash function.
+ * @param key pointer to the key.
+ * @param val pointer to the value.
+ * @return true if the operation succeeded, false otherwise.
+ *
+ * The content pointed by key and val will be copied into the hash table.
+ * When there's a key collision, the coresponding value get replaced.
+ */
+bool CRHHInsertCustom(ConcurrentRobinHoodHash* crhh, OPHash hasher,
+                      void* key, void* val);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Copies the value associated with the specified key using
+ * custom hash function.
+ *
+ * @param crhh ConcurrentRobinHoodHash instance.
+ * @param hasher hash function.
+ * @param key pointer to the key.
+ * @param val buffer of at least valsize bytes receiving the value.
+ * Can be NULL if valsize is 0.
+ * @return true if the key was found, false otherwise.
+ *
+ * This method never blocks writers.
+ */
+bool CRHHGetCustom(ConcurrentRobinHoodHash* crhh, OPHash hasher,
+                   void* key, void* val);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Deletes the key-value entry using custom hash function.
+ *
+ * @param crhh ConcurrentRobinHoodHash instance.
+ * @param hasher hash function.
+ * @param key pointer to the key.
+ * @param val buffer receiving the deleted value. Can be NULL.
+ * @return true if the key was found and deleted, false otherwise.
+ */
+bool CRHHDeleteCustom(ConcurrentRobinHoodHash* crhh, OPHash hasher,
+                      void* key, void* val);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Associates the specified key with the specified value using
+ * the default hash function.
+ *
+ * @see CRHHInsertCustom
+ */
+static inline bool
+CRHHInsert(ConcurrentRobinHoodHash* crhh, void* key, void* val)
+{
+  return CRHHInsertCustom(crhh, OPDefaultHash, key, val);
+}
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Copies the value associated with the specified key using
+ * the default hash function.
+ *
+ * @see CRHHGetCustom
+ */
+static inline bool
+CRHHGet(ConcurrentRobinHoodHash* crhh, void* key, void* val)
+{
+  return CRHHGetCustom(crhh, OPDefaultHash, key, val);
+}
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Deletes the key-value entry using the default hash function.
+ *
+ * @see CRHHDeleteCustom
+ */
+static inline bool
+CRHHDelete(ConcurrentRobinHoodHash* crhh, void* key, void* val)
+{
+  return CRHHDeleteCustom(crhh, OPDefaultHash, key, val);
+}
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Obtain the number of objects stored in this hash table.
+ *
+ * The count is only exact when no writer is running.
+ */
+uint64_t CRHHObjcnt(ConcurrentRobinHoodHash* crhh);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Obtain the size of the key configured for this hash table.
+ */
+size_t CRHHKeysize(ConcurrentRobinHoodHash* crhh);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Obtain the size of the value configured for this hash table.
+ */
+size_t CRHHValsize(ConcurrentRobinHoodHash* crhh);
+
+/**
+ * @relates ConcurrentRobinHoodHash　
+ * @brief Iterates over all key-value pairs in this hash table.
+ *
+ * Each segment is locked against writers while it is being iterated.
+ * The iterator must not modify this hash table.
+ *
+ * @param crhh ConcurrentRobinHoodHash instance.
+ * @param iterator function pointer to user defined iterator function.
+ * @param context user defined context.
+ */
+void CRHHIterate(ConcurrentRobinHoodHash* crhh,
+                 OPHashIterator iterator, void* context);
+
+OP_END_DECLS
+
+#endif
+/* concurrent_robin_hood.h ends here */
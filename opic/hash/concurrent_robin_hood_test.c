@@ -0,0 +1,211 @@
+/* concurrent_robin_hood_test.c ---
+ *
+ * Filename: concurrent_robin_hood_test.c
+ * Description:
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <cmocka.h>
+
+#include "opic/common/op_atomic.h"
+#include "opic/common/op_log.h"
+#include "concurrent_robin_hood.h"
+
+OP_LOGGER_FACTORY(logger, "opic.hash.concurrent_robin_hood_test");
+
+#define TEST_OBJECTS (1<<15)
+#define WRITER_NUM 4
+#define READER_NUM 4
+
+static ConcurrentRobinHoodHash* crhh;
+static a_int32_t writers_running;
+
+static void
+CountObjects(void* key, void* val,
+             size_t keysize, size_t valsize, void* ctx)
+{
+  (*(int*)ctx)++;
+}
+
+static void
+test_BasicOperations(void** context)
+{
+  OPHeap* heap;
+  int val, objcnt;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(CRHHNew(heap, &crhh, 20, 0.8, sizeof(int), sizeof(int), 3));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      val = i * 3;
+      assert_true(CRHHInsert(crhh, &i, &val));
+    }
+  assert_int_equal(TEST_OBJECTS, CRHHObjcnt(crhh));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_true(CRHHGet(crhh, &i, &val));
+      assert_int_equal(i * 3, val);
+    }
+  for (int i = TEST_OBJECTS; i < TEST_OBJECTS * 2; i++)
+    assert_false(CRHHGet(crhh, &i, &val));
+
+  objcnt = 0;
+  CRHHIterate(crhh, CountObjects, &objcnt);
+  assert_int_equal(TEST_OBJECTS, objcnt);
+
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_true(CRHHDelete(crhh, &i, &val));
+      assert_int_equal(i * 3, val);
+    }
+  assert_false(CRHHDelete(crhh, &val, NULL));
+  assert_int_equal(0, CRHHObjcnt(crhh));
+  CRHHDestroy(crhh);
+  OPHeapDestroy(heap);
+}
+
+/*
+ * Values are pairs of (x, ~x) so that a torn read is detectable no
+ * matter which version of the value the reader observes.
+ */
+static void*
+WriterWorker(void* arg)
+{
+  uint64_t base = (uintptr_t)arg * TEST_OBJECTS;
+  uint64_t key, val[2];
+  bool success = true;
+
+  for (int round = 0; success && round < 2; round++)
+    for (key = base; success && key < base + TEST_OBJECTS; key++)
+      {
+        val[0] = key + round;
+        val[1] = ~val[0];
+        success = CRHHInsert(crhh, &key, val);
+      }
+  for (key = base; success && key < base + TEST_OBJECTS; key += 2)
+    success = CRHHDelete(crhh, &key, NULL);
+  atomic_fetch_sub(&writers_running, 1);
+  return success ? arg : (void*)UINTPTR_MAX;
+}
+
+static void*
+ReaderWorker(void* arg)
+{
+  uint64_t key, val[2];
+  uintptr_t torn = 0;
+
+  key = (uintptr_t)arg;
+  while (atomic_load(&writers_running))
+    {
+      key = (key * 6364136223846793005ULL + 1442695040888963407ULL);
+      key %= WRITER_NUM * TEST_OBJECTS;
+      if (CRHHGet(crhh, &key, val) &&
+          (val[1] != ~val[0] || val[0] - key > 1))
+        torn++;
+    }
+  return (void*)torn;
+}
+
+static void
+test_ConcurrentReadWrite(void** context)
+{
+  OPHeap* heap;
+  pthread_t writers[WRITER_NUM], readers[READER_NUM];
+  void* result;
+  uint64_t key, val[2];
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(CRHHNew(heap, &crhh, 64, 0.8,
+                      sizeof(uint64_t), 2 * sizeof(uint64_t), 16));
+  atomic_store(&writers_running, WRITER_NUM);
+  for (uintptr_t i = 0; i < READER_NUM; i++)
+    assert_int_equal(0, pthread_create(&readers[i], NULL,
+                                       ReaderWorker, (void*)i));
+  for (uintptr_t i = 0; i < WRITER_NUM; i++)
+    assert_int_equal(0, pthread_create(&writers[i], NULL,
+                                       WriterWorker, (void*)i));
+  for (uintptr_t i = 0; i < WRITER_NUM; i++)
+    {
+      assert_int_equal(0, pthread_join(writers[i], &result));
+      assert_ptr_equal((void*)i, result);
+    }
+  for (int i = 0; i < READER_NUM; i++)
+    {
+      assert_int_equal(0, pthread_join(readers[i], &result));
+      assert_null(result);
+    }
+
+  assert_int_equal(WRITER_NUM * TEST_OBJECTS / 2, CRHHObjcnt(crhh));
+  for (key = 0; key < WRITER_NUM * TEST_OBJECTS; key++)
+    {
+      if (key % 2)
+        {
+          assert_true(CRHHGet(crhh, &key, val));
+          assert_int_equal(key + 1, val[0]);
+          assert_int_equal(~val[0], val[1]);
+        }
+      else
+        assert_false(CRHHGet(crhh, &key, val));
+    }
+  CRHHDestroy(crhh);
+  OPHeapDestroy(heap);
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest crhh_tests[] =
+    {
+      cmocka_unit_test(test_BasicOperations),
+      cmocka_unit_test(test_ConcurrentReadWrite),
+    };
+
+  return cmocka_run_group_tests(crhh_tests, NULL, NULL);
+}
+
+/* concurrent_robin_hood_test.c ends here */
@@ -20,10 +20,7 @@ static inline uint128_t make_uint128_t(uint64_t lo, uint64_t hi)
 }
 
 
-// conditionally include declarations for versions of city that require SSE4.2
-// instructions to be available
-#if defined(__SSE4_2__) && defined(__x86_64)
-
+// result of cityhash256_crc
 struct uint256_t {
   uint64_t a;
   uint64_t b;
@@ -34,5 +31,3 @@ struct uint256_t {
 typedef struct uint256_t uint256_t;
 
 #endif
-
-#endif
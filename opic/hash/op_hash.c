@@ -0,0 +1,252 @@
+/* op_hash.c ---
+ *
+ * Filename: op_hash.c
+ * Description: Batched hashing of fixed size keys
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ * OPHashBatch must agree with OPDefaultHash key by key, because tables
+ * filled through one are queried through the other. Integer keys are
+ * mixed four at a time with AVX2 when the CPU has it; AVX2 has no 64
+ * bit multiply, so each OPMix64 multiply is put together from three
+ * 32x32->64 ones.
+ *
+ * The OPHashStats writers live here as well since they are shared by
+ * every hash table flavor.
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "op_hash.h"
+
+OPHash OPHashFromId(OPHashId id)
+{
+  switch (id)
+    {
+    case OP_HASH_ID_CITY:
+      return OPCityHash;
+    case OP_HASH_ID_INT:
+      return OPDefaultHash;
+    default:
+      return NULL;
+    }
+}
+
+OPHashId OPHashToId(OPHash hasher, size_t keysize)
+{
+  uint8_t buf[64];
+  uint8_t* key;
+  bool is_default, is_city;
+
+  key = keysize <= sizeof(buf) ? buf : malloc(keysize);
+  if (!key)
+    return OP_HASH_ID_NONE;
+  is_default = is_city = true;
+  for (int round = 0; round < 2; round++)
+    {
+      for (size_t i = 0; i < keysize; i++)
+        key[i] = round ? (uint8_t)(i * 0x9d + 1) : (uint8_t)0x5a;
+      is_default &= hasher(key, keysize) == OPDefaultHash(key, keysize);
+      is_city &= hasher(key, keysize) == OPCityHash(key, keysize);
+    }
+  if (key != buf)
+    free(key);
+  // OPDefaultHash and OPCityHash agree on keys other than 4 and 8
+  // bytes; the default id keeps OPHashBatch usable for them.
+  if (is_default)
+    return OP_HASH_ID_DEFAULT;
+  return is_city ? OP_HASH_ID_CITY : OP_HASH_ID_NONE;
+}
+
+static void
+OPIntHashBatchScalar(const uint8_t* keys, size_t n, size_t keysize,
+                     uint64_t* out)
+{
+  for (size_t i = 0; i < n; i++)
+    out[i] = OPIntHash((void*)&keys[i * keysize], keysize);
+}
+
+#if defined(__x86_64) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline __m256i
+Mul64x4(__m256i a, uint64_t c)
+{
+  const __m256i c_lo = _mm256_set1_epi64x(c & 0xffffffffULL);
+  const __m256i c_hi = _mm256_set1_epi64x(c >> 32);
+  __m256i lo, cross;
+
+  lo = _mm256_mul_epu32(a, c_lo);
+  cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), c_lo),
+                           _mm256_mul_epu32(a, c_hi));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+Mix64x4(__m256i x)
+{
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 30));
+  x = Mul64x4(x, 0xbf58476d1ce4e5b9ULL);
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 27));
+  x = Mul64x4(x, 0x94d049bb133111ebULL);
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 31));
+  return x;
+}
+
+__attribute__((target("avx2")))
+static void
+OPIntHashBatchAVX2(const uint8_t* keys, size_t n, size_t keysize,
+                   uint64_t* out)
+{
+  size_t i = 0;
+  __m256i x;
+
+  // Two independent streams keep both multiply ports busy.
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256i y;
+      if (keysize == 8)
+        {
+          x = _mm256_loadu_si256((const __m256i*)&keys[i * 8]);
+          y = _mm256_loadu_si256((const __m256i*)&keys[i * 8 + 32]);
+        }
+      else
+        {
+          x = _mm256_cvtepu32_epi64
+            (_mm_loadu_si128((const __m128i*)&keys[i * 4]));
+          y = _mm256_cvtepu32_epi64
+            (_mm_loadu_si128((const __m128i*)&keys[i * 4 + 16]));
+        }
+      _mm256_storeu_si256((__m256i*)&out[i], Mix64x4(x));
+      _mm256_storeu_si256((__m256i*)&out[i + 4], Mix64x4(y));
+    }
+  OPIntHashBatchScalar(&keys[i * keysize], n - i, keysize, &out[i]);
+}
+
+static void (*OPIntHashBatch)(const uint8_t*, size_t, size_t, uint64_t*) =
+  OPIntHashBatchScalar;
+
+// Runs before any thread can hash, so OPIntHashBatch is never written
+// concurrently with a read.
+__attribute__((constructor))
+static void
+OPHashBatchDispatch(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    OPIntHashBatch = OPIntHashBatchAVX2;
+}
+#else
+#define OPIntHashBatch OPIntHashBatchScalar
+#endif
+
+void OPHashBatch(const void* keys, size_t n, size_t keysize, uint64_t* out)
+{
+  const uint8_t* key_bytes = keys;
+
+  if (keysize == 8 || keysize == 4)
+    {
+      OPIntHashBatch(key_bytes, n, keysize, out);
+      return;
+    }
+  for (size_t i = 0; i < n; i++)
+    out[i] = OPDefaultHash((void*)&key_bytes[i * keysize], keysize);
+}
+
+void OPHashStatsPrometheus(FILE* out, const char* name,
+                           const OPHashStats* stats)
+{
+  uint64_t count, sum;
+
+  fprintf(out, "# TYPE %s_objects gauge\n", name);
+  fprintf(out, "%s_objects %" PRIu64 "\n", name, stats->objcnt);
+  fprintf(out, "# TYPE %s_capacity gauge\n", name);
+  fprintf(out, "%s_capacity %" PRIu64 "\n", name, stats->capacity);
+  fprintf(out, "# TYPE %s_load_factor gauge\n", name);
+  fprintf(out, "%s_load_factor %g\n", name, stats->load);
+  fprintf(out, "# TYPE %s_probe_mean gauge\n", name);
+  fprintf(out, "%s_probe_mean %g\n", name, stats->mean_probe);
+  fprintf(out, "# TYPE %s_probe_max gauge\n", name);
+  fprintf(out, "%s_probe_max %u\n", name, stats->longest_probe);
+  fprintf(out, "# TYPE %s_bytes gauge\n", name);
+  fprintf(out, "%s_bytes %" PRIu64 "\n", name, stats->bytes);
+  fprintf(out, "# TYPE %s_resizes_total counter\n", name);
+  fprintf(out, "%s_resizes_total %" PRIu64 "\n", name, stats->resizes);
+
+  // Prometheus buckets are cumulative.
+  count = sum = 0;
+  fprintf(out, "# TYPE %s_probe_length histogram\n", name);
+  for (int i = 0; i < OP_HASH_PROBE_HIST_SIZE; i++)
+    {
+      count += stats->probe_hist[i];
+      sum += stats->probe_hist[i] * i;
+      fprintf(out, "%s_probe_length_bucket{le=\"%d\"} %" PRIu64 "\n",
+              name, i, count);
+    }
+  fprintf(out, "%s_probe_length_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+          name, count);
+  fprintf(out, "%s_probe_length_sum %" PRIu64 "\n", name, sum);
+  fprintf(out, "%s_probe_length_count %" PRIu64 "\n", name, count);
+}
+
+void OPHashStatsJSON(FILE* out, const OPHashStats* stats)
+{
+  int hist_end;
+
+  hist_end = stats->longest_probe < OP_HASH_PROBE_HIST_SIZE ?
+    stats->longest_probe + 1 : OP_HASH_PROBE_HIST_SIZE;
+  fprintf(out,
+          "{\"objects\":%" PRIu64 ",\"capacity\":%" PRIu64
+          ",\"load_factor\":%g,\"probe_mean\":%g,\"probe_max\":%u"
+          ",\"resizes\":%" PRIu64 ",\"bytes\":%" PRIu64
+          ",\"probe_hist\":[",
+          stats->objcnt, stats->capacity, stats->load, stats->mean_probe,
+          stats->longest_probe, stats->resizes, stats->bytes);
+  for (int i = 0; i < hist_end; i++)
+    fprintf(out, i ? ",%" PRIu64 : "%" PRIu64, stats->probe_hist[i]);
+  fprintf(out, "]}\n");
+}
+
+/* op_hash.c ends here */
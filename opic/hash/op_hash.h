@@ -25,9 +25,21 @@
 #ifndef OPIC_HASH_OP_HASH_H
 #define OPIC_HASH_OP_HASH_H 1
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include "opic/common/op_macros.h"
 #include "cityhash.h"
 
+#if defined(__SSE4_2__) && defined(__x86_64)
+#include <nmmintrin.h>
+#define OP_CRC32C_U64(crc, v) _mm_crc32_u64(crc, v)
+#else
+// Picks the crc32 instruction at run time when the CPU has it.
+#define OP_CRC32C_U64(crc, v) crc32c_u64(crc, v)
+#endif
+
 OP_BEGIN_DECLS
 
 /**
@@ -60,18 +72,276 @@ typedef void(*OPHashIterator)(void* key, void* value,
                               size_t keysize, size_t valsize,
                               void* context);
 
+/**
+ * @ingroup hash
+ * @brief HashTable predicate interface.
+ *
+ * Same arguments as OPHashIterator. Returns true to select the
+ * key-value pair.
+ *
+ * @see RHHDeleteIf for example usage.
+ */
+typedef bool(*OPHashPredicate)(void* key, void* value,
+                               size_t keysize, size_t valsize,
+                               void* context);
+
+/**
+ * @ingroup hash
+ * @brief Resumable position of a scan with RHHCursorNext or
+ * PRHHCursorNext.
+ *
+ * Zero initialize it to scan from the beginning. It is a plain value:
+ * a scan can be paused by keeping the cursor around, or even storing
+ * it in the heap next to the table.
+ */
+typedef struct OPHashCursor
+{
+  uint64_t pos;
+} OPHashCursor;
+
+/**
+ * @ingroup hash
+ * @brief Multiply-xorshift mixer for 64 bit integers.
+ *
+ * The splitmix64 finalizer. It is a bijection, and every input bit
+ * affects both the low bits used for the bucket index and the high
+ * bits used for tags and partitions.
+ */
+static inline
+uint64_t OPMix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * @ingroup hash
+ * @brief Hash function for 4 and 8 byte integer keys.
+ *
+ * This is an implementation of OPHash. Keys of other sizes go to
+ * cityhash64.
+ */
+static inline
+uint64_t OPIntHash(void* key, size_t size)
+{
+  uint64_t k64;
+  uint32_t k32;
+
+  switch (size)
+    {
+    case 8:
+      memcpy(&k64, key, 8);
+      return OPMix64(k64);
+    case 4:
+      memcpy(&k32, key, 4);
+      return OPMix64(k32);
+    default:
+      return cityhash64((const uint8_t*)key, size);
+    }
+}
+
+/**
+ * @ingroup hash
+ * @brief CRC32C hash function for 4 and 8 byte integer keys.
+ *
+ * This is an implementation of OPHash. Builds with SSE4.2 inline the
+ * crc32 instruction; other builds select it at run time and fall back
+ * to a table driven CRC32C, which gives the same results. CRC is
+ * linear, which lets regular keys such as sequential integers collide
+ * in the bucket index bits. The high half is therefore computed on the
+ * key multiplied by an odd constant and folded into the low half. Keys
+ * of other sizes go to cityhash64.
+ *
+ * OPDefaultHash does not pick it; tables built with it must be queried
+ * with it explicitly.
+ */
+static inline
+uint64_t OPCRC32CHash(void* key, size_t size)
+{
+  uint64_t k64;
+  uint32_t k32;
+
+  switch (size)
+    {
+    case 8:
+      memcpy(&k64, key, 8);
+      break;
+    case 4:
+      memcpy(&k32, key, 4);
+      k64 = k32;
+      break;
+    default:
+      return cityhash64((const uint8_t*)key, size);
+    }
+  k64 = OP_CRC32C_U64(0, k64) |
+    (uint64_t)OP_CRC32C_U64(0, k64 * 0x9e3779b97f4a7c15ULL) << 32;
+  return k64 ^ k64 >> 29;
+}
+
 /**
  * @ingroup hash
  * @brief Default hash function.
  *
- * This is the implementation of OPHash.
+ * This is the implementation of OPHash. 4 and 8 byte keys are hashed
+ * with OPIntHash, other sizes with cityhash64. When size is a compile
+ * time constant, e.g. in RHH_SPECIALIZE, the choice folds away.
+ *
+ * Tables record the hash they were created with, see OPHashId, so
+ * tables created before OPIntHash was introduced keep using
+ * OPCityHash.
+ *
+ * This changes the hash of 4 and 8 byte keys for code that passes
+ * OPDefaultHash to the Custom APIs or to PascalRobinHoodHash. Such
+ * code must pass OPCityHash for tables from older heaps; the Custom
+ * APIs abort if given OPDefaultHash for a table recorded with
+ * OP_HASH_ID_CITY.
  */
 static inline
 uint64_t OPDefaultHash(void* key, size_t size)
+{
+  if (size == 8 || size == 4)
+    return OPIntHash(key, size);
+  return cityhash64((const uint8_t*)key, size);
+}
+
+/**
+ * @ingroup hash
+ * @brief cityhash64 for keys of any size.
+ *
+ * This is an implementation of OPHash, and was OPDefaultHash before 4
+ * and 8 byte keys moved to OPIntHash.
+ */
+static inline
+uint64_t OPCityHash(void* key, size_t size)
 {
   return cityhash64((const uint8_t*)key, size);
 }
 
+/**
+ * @ingroup hash
+ * @brief Hash functions a table can record in its header.
+ *
+ * The non-Custom APIs of a table use the hash it recorded when it was
+ * created, so changing OPDefaultHash does not strand tables stored in
+ * existing heaps.
+ */
+typedef enum OPHashId
+  {
+    /** No known hash; the table must be used with the Custom APIs. */
+    OP_HASH_ID_NONE = 0,
+    /** OPCityHash. */
+    OP_HASH_ID_CITY = 1,
+    /** OPIntHash for 4 and 8 byte keys, cityhash64 otherwise. */
+    OP_HASH_ID_INT = 2,
+  } OPHashId;
+
+/**
+ * @ingroup hash
+ * @brief The OPHashId of OPDefaultHash.
+ */
+#define OP_HASH_ID_DEFAULT OP_HASH_ID_INT
+
+/**
+ * @ingroup hash
+ * @brief Maps an OPHashId to its hash function.
+ *
+ * @param id the hash id.
+ * @return the hash function, or NULL for OP_HASH_ID_NONE and unknown
+ * ids.
+ */
+OPHash OPHashFromId(OPHashId id);
+
+/**
+ * @ingroup hash
+ * @brief Finds the OPHashId of a hash function.
+ *
+ * The hash functions in this header are static inline, so their
+ * address differs between translation units. They are recognized by
+ * the values they give on a few keys of keysize instead.
+ *
+ * @param hasher the hash function.
+ * @param keysize the key size the hash function is used with.
+ * @return OP_HASH_ID_DEFAULT if hasher agrees with OPDefaultHash,
+ * OP_HASH_ID_CITY if it agrees with OPCityHash, OP_HASH_ID_NONE
+ * otherwise.
+ */
+OPHashId OPHashToId(OPHash hasher, size_t keysize);
+
+/**
+ * @ingroup hash
+ * @brief Hash an array of fixed size keys.
+ *
+ * @param keys n keys stored back to back.
+ * @param n number of keys.
+ * @param keysize size of each key in bytes.
+ * @param out array of n hashes to fill.
+ *
+ * out[i] is OPDefaultHash of the i-th key. 4 and 8 byte keys are mixed
+ * several at a time with AVX2 when the CPU has it. Useful to feed
+ * RHHFunnelPreHashInsert and the other pre-hashed APIs.
+ */
+void OPHashBatch(const void* keys, size_t n, size_t keysize, uint64_t* out);
+
+/**
+ * @ingroup hash
+ * @brief Number of probe lengths tracked by OPHashStats.
+ */
+#define OP_HASH_PROBE_HIST_SIZE 64
+
+/**
+ * @ingroup hash
+ * @brief Snapshot of a hash table's health, see RHHGetStats and
+ * PRHHGetStats.
+ *
+ * A hash function that does not fit the keys shows up here as a long
+ * tail in probe_hist and a rising mean_probe, well before it shows up
+ * as latency.
+ */
+typedef struct OPHashStats
+{
+  uint64_t objcnt;          ///< number of stored objects
+  uint64_t capacity;        ///< number of buckets
+  double load;              ///< objcnt / capacity
+  double mean_probe;        ///< mean probe length of probe_hist
+  uint16_t longest_probe;   ///< longest probe length seen
+  uint64_t resizes;         ///< resizes since the table was created
+  uint64_t bytes;           ///< bytes held by the table and buckets
+  /// Objects per probe length. Objects not yet migrated by an
+  /// incremental resize are not counted.
+  uint64_t probe_hist[OP_HASH_PROBE_HIST_SIZE];
+} OPHashStats;
+
+/**
+ * @ingroup hash
+ * @brief Writes stats in the Prometheus text exposition format.
+ *
+ * @param out stream to write to.
+ * @param name metric name prefix, e.g. "myapp_sessions".
+ * @param stats stats to write.
+ *
+ * Gauges are written as name_objects, name_capacity, name_load_factor,
+ * name_probe_mean, name_probe_max and name_bytes, the resize count as
+ * the counter name_resizes_total, and probe_hist as the histogram
+ * name_probe_length.
+ */
+void OPHashStatsPrometheus(FILE* out, const char* name,
+                           const OPHashStats* stats);
+
+/**
+ * @ingroup hash
+ * @brief Writes stats as a single JSON object.
+ *
+ * @param out stream to write to.
+ * @param stats stats to write.
+ *
+ * probe_hist is written up to longest_probe.
+ */
+void OPHashStatsJSON(FILE* out, const OPHashStats* stats);
+
 typedef void(*OPFunnelUpsertCB)(void* key,
                                 void* table_value,
                                 void* funnel_value,
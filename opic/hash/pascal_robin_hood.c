@@ -46,19 +46,28 @@
 /* Code: */
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "opic/common/op_assert.h"
+#include "opic/common/op_atomic.h"
 #include "opic/common/op_utils.h"
 #include "opic/common/op_log.h"
 #include "opic/op_malloc.h"
 #include "pascal_robin_hood.h"
 
-#define PROBE_STATS_SIZE 64
+#define PROBE_STATS_SIZE OP_HASH_PROBE_HIST_SIZE
 #define DEFAULT_LARGE_DATA_THRESHOLD (1UL << 30)
 #define PRHH_EMPTY_KEY 0
 #define PRHH_TOMBSTONE_KEY ~0ULL
+// "PRH" followed by a version byte, see RHH_FORMAT. Fields after
+// bucket_ref exist since version 1.
+#define PRHH_FORMAT 0x50524801
+
+#define PARALLEL_ITERATE_RANGE_BITS 14
+#define PARALLEL_ITERATE_MAX_THREADS 256
 #define VISIT_IDX_CACHE 8
 
 OP_LOGGER_FACTORY(logger, "opic.hash.pascal_robin_hood");
@@ -92,13 +101,88 @@ struct PascalRobinHoodHash
   uint8_t capacity_clz;    // leading zeros of capacity
   uint8_t capacity_ms4b;   // most significant 4 bits
   uint16_t longest_probes;
+  uint32_t format;
   size_t valsize;
   uint32_t stats[PROBE_STATS_SIZE];
   opref_t bucket_ref;
+  uint32_t resizes;
+  // Whether buckets keep the hash of their key. Fixed at creation.
+  bool inline_hash;
+  // OPHashId of the APIs without a hasher parameter.
+  uint8_t hash_id;
 };
 
-bool PRHHNew(OPHeap* heap, PascalRobinHoodHash** rhh,
-             uint64_t num_objects, double load, size_t valsize)
+_Static_assert(offsetof(PascalRobinHoodHash, bucket_ref) == 304,
+               "fields up to bucket_ref are shared with older heaps");
+
+static inline void
+PRHHCheckFormat(const PascalRobinHoodHash* rhh)
+{
+  op_assert(rhh->format == PRHH_FORMAT,
+            "PascalRobinHoodHash %p has format %#x, expected %#x; "
+            "tables from older heaps need PRHHUpgrade\n",
+            (void*)rhh, rhh->format, PRHH_FORMAT);
+}
+
+/*
+ * Buckets are laid out as [key oplenref_t][hash][value], where the hash
+ * is only present in tables created by PRHHNewInlineHash. The key
+ * length is part of the oplenref_t, so together with the hash most
+ * non-matching buckets are rejected without following the reference.
+ * The hash also gives the probe distance of a bucket without reading
+ * its key.
+ */
+static inline size_t
+PRHHValOffset(PascalRobinHoodHash* rhh)
+{
+  return sizeof(oplenref_t) + (rhh->inline_hash ? sizeof(uint64_t) : 0);
+}
+
+static inline uint64_t
+BucketHash(PascalRobinHoodHash* rhh, OPHash hasher, uint8_t* bucket)
+{
+  oplenref_t* recref = (oplenref_t*)bucket;
+  uint64_t hashed_key;
+
+  if (rhh->inline_hash)
+    {
+      memcpy(&hashed_key, &bucket[sizeof(oplenref_t)], sizeof(uint64_t));
+      return hashed_key;
+    }
+  return hasher(OPLenRef2Ptr(rhh, *recref), OPLenRef2Size(*recref));
+}
+
+static inline bool
+BucketMatch(PascalRobinHoodHash* rhh, uint8_t* bucket,
+            uint64_t hashed_key, void* key, size_t keysize)
+{
+  oplenref_t* recref = (oplenref_t*)bucket;
+  uint64_t rec_hash;
+
+  if (OPLenRef2Size(*recref) != keysize)
+    return false;
+  if (rhh->inline_hash)
+    {
+      memcpy(&rec_hash, &bucket[sizeof(oplenref_t)], sizeof(uint64_t));
+      if (rec_hash != hashed_key)
+        return false;
+    }
+  return !memcmp(key, OPLenRef2Ptr(rhh, *recref), keysize);
+}
+
+static inline void
+SetBucketKey(PascalRobinHoodHash* rhh, uint8_t* bucket,
+             oplenref_t keylref, uint64_t hashed_key)
+{
+  memcpy(bucket, &keylref, sizeof(oplenref_t));
+  if (rhh->inline_hash)
+    memcpy(&bucket[sizeof(oplenref_t)], &hashed_key, sizeof(uint64_t));
+}
+
+static bool
+PRHHNewInternal(OPHeap* heap, PascalRobinHoodHash** rhh,
+                uint64_t num_objects, double load, size_t valsize,
+                bool inline_hash)
 {
   uint64_t capacity;
   uint32_t capacity_clz, capacity_ms4b, capacity_msb;
@@ -115,7 +199,8 @@ bool PRHHNew(OPHeap* heap, PascalRobinHoodHash** rhh,
   capacity_ms4b = round_up_div(capacity, 1UL << (capacity_msb - 4));
   capacity = (uint64_t)capacity_ms4b << (capacity_msb - 4);
 
-  bucket_size = sizeof(oplenref_t) + valsize;
+  bucket_size = sizeof(oplenref_t) + valsize +
+    (inline_hash ? sizeof(uint64_t) : 0);
 
   *rhh = OPCalloc(heap, 1, sizeof(PascalRobinHoodHash));
   if (!*rhh)
@@ -133,17 +218,33 @@ bool PRHHNew(OPHeap* heap, PascalRobinHoodHash** rhh,
   (*rhh)->objcnt_high = (uint64_t)(capacity * load);
   (*rhh)->objcnt_low = capacity * 2 / 10;
   (*rhh)->valsize = valsize;
+  (*rhh)->inline_hash = inline_hash;
+  (*rhh)->format = PRHH_FORMAT;
+  (*rhh)->hash_id = OP_HASH_ID_DEFAULT;
   return true;
 }
 
+bool PRHHNew(OPHeap* heap, PascalRobinHoodHash** rhh,
+             uint64_t num_objects, double load, size_t valsize)
+{
+  return PRHHNewInternal(heap, rhh, num_objects, load, valsize, false);
+}
+
+bool PRHHNewInlineHash(OPHeap* heap, PascalRobinHoodHash** rhh,
+                       uint64_t num_objects, double load, size_t valsize)
+{
+  return PRHHNewInternal(heap, rhh, num_objects, load, valsize, true);
+}
+
 void PRHHDestroy(PascalRobinHoodHash* rhh)
 {
-  const size_t bucket_size = sizeof(oplenref_t) + rhh->valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + rhh->valsize;
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   oplenref_t* recref;
   void* recptr;
   uint64_t capacity = PRHHCapacity(rhh);
 
+  PRHHCheckFormat(rhh);
   for (uint64_t idx = 0; idx < capacity; idx++)
     {
       recref = (oplenref_t*)&buckets[idx * bucket_size];
@@ -158,6 +259,60 @@ void PRHHDestroy(PascalRobinHoodHash* rhh)
   OPDealloc(rhh);
 }
 
+bool PRHHUpgrade(PascalRobinHoodHash** rhh_ref)
+{
+  PascalRobinHoodHash* old = *rhh_ref;
+  PascalRobinHoodHash* rhh;
+
+  if (old->format == PRHH_FORMAT)
+    return true;
+  if (old->format || !old->bucket_ref ||
+      old->capacity_ms4b < 8 || old->capacity_ms4b > 15)
+    {
+      OP_LOG_ERROR(logger, "PascalRobinHoodHash %p has unknown format %#x\n",
+                   (void*)old, old->format);
+      return false;
+    }
+  rhh = OPCalloc(ObtainOPHeap(old), 1, sizeof(PascalRobinHoodHash));
+  if (!rhh)
+    return false;
+  // Older headers end at bucket_ref; the fields after it start zeroed.
+  memcpy(rhh, old,
+         offsetof(PascalRobinHoodHash, bucket_ref) + sizeof(opref_t));
+  rhh->format = PRHH_FORMAT;
+  rhh->hash_id = OP_HASH_ID_CITY;
+  OPDealloc(old);
+  *rhh_ref = rhh;
+  return true;
+}
+
+OPHash PRHHHasher(PascalRobinHoodHash* rhh)
+{
+  OPHash hasher;
+
+  PRHHCheckFormat(rhh);
+  hasher = OPHashFromId(rhh->hash_id);
+  op_assert(hasher, "PascalRobinHoodHash %p has no known hash, "
+            "use the Custom APIs\n", (void*)rhh);
+  return hasher;
+}
+
+// See RHHCheckHasher; keys of any size share a table here.
+static __thread OPHash prhh_checked_hasher;
+
+static inline void
+PRHHCheckHasher(PascalRobinHoodHash* rhh, OPHash hasher, size_t keysize)
+{
+  if (op_likely(rhh->hash_id != OP_HASH_ID_CITY ||
+                hasher == prhh_checked_hasher ||
+                (keysize != 4 && keysize != 8)))
+    return;
+  op_assert(OPHashToId(hasher, keysize) != OP_HASH_ID_DEFAULT,
+            "PascalRobinHoodHash %p hashes with OPCityHash, OPDefaultHash "
+            "would miss its %zu byte keys\n", (void*)rhh, keysize);
+  prhh_checked_hasher = hasher;
+}
+
 uint64_t PRHHObjcnt(PascalRobinHoodHash* rhh)
 {
   return rhh->objcnt;
@@ -211,17 +366,11 @@ static inline int
 findprobe(PascalRobinHoodHash* rhh, OPHash hasher, uintptr_t idx)
 {
   const size_t valsize = rhh->valsize;
-  const size_t bucket_size = sizeof(oplenref_t) + valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + valsize;
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   uint64_t hashed_key;
-  oplenref_t *keyref;
-  void* keyptr;
-  size_t keysize;
-
-  keyref = (oplenref_t*)&buckets[idx * bucket_size];
-  keyptr = OPLenRef2Ptr(rhh, *keyref);
-  keysize = OPLenRef2Size(*keyref);
-  hashed_key = hasher(keyptr, keysize);
+
+  hashed_key = BucketHash(rhh, hasher, &buckets[idx * bucket_size]);
   for (int i = 0; i <= rhh->longest_probes; i++)
     {
       if (hash_with_probe(rhh, hashed_key, i) == idx)
@@ -236,15 +385,13 @@ PRHHUpsertNewKey(PascalRobinHoodHash* rhh, OPHash hasher,
                  void* key, size_t keysize, uint64_t hashed_key,
                  uint8_t** matched_bucket, int* probe_state)
 {
-  const size_t refsize = sizeof(oplenref_t);
+  const size_t refsize = PRHHValOffset(rhh);
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = refsize + valsize;
   uint8_t* buckets;
   int probe, old_probe;
   uintptr_t idx, _idx;
   oplenref_t *recref, *_recref;
-  void *recptr, *_recptr;
-  size_t recsize, _recsize;
 
   buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   probe = 0;
@@ -275,10 +422,8 @@ PRHHUpsertNewKey(PascalRobinHoodHash* rhh, OPHash hasher,
               if (*_recref == PRHH_EMPTY_KEY ||
                   *_recref == PRHH_TOMBSTONE_KEY)
                 continue;
-              _recptr = OPLenRef2Ptr(rhh, *_recref);
-              _recsize = OPLenRef2Size(*_recref);
-              if (_recsize == keysize &&
-                  !memcmp(key, _recptr, keysize))
+              if (BucketMatch(rhh, &buckets[_idx * bucket_size],
+                              hashed_key, key, keysize))
                 {
                   *matched_bucket = &buckets[_idx * bucket_size];
                   return UPSERT_DUP;
@@ -288,10 +433,8 @@ PRHHUpsertNewKey(PascalRobinHoodHash* rhh, OPHash hasher,
           *matched_bucket = &buckets[idx * bucket_size];
           return UPSERT_EMPTY;
         }
-      recptr = OPLenRef2Ptr(rhh, *recref);
-      recsize = OPLenRef2Size(*recref);
-      if (keysize == recsize &&
-          !memcmp(key, recptr, keysize))
+      if (BucketMatch(rhh, &buckets[idx * bucket_size],
+                      hashed_key, key, keysize))
         {
           *matched_bucket = &buckets[idx * bucket_size];
           return UPSERT_DUP;
@@ -316,12 +459,10 @@ PRHHUpsertPushDown(PascalRobinHoodHash* rhh, OPHash hasher,
                    uint8_t* bucket_cpy, int probe, uint8_t* avoid_bucket,
                    bool* resized)
 {
-  const size_t refsize = sizeof(oplenref_t);
+  const size_t refsize = PRHHValOffset(rhh);
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = refsize + valsize;
-  oplenref_t *recref, *_recref;
-  void *recptr;
-  size_t recsize;
+  oplenref_t *_recref;
   uint8_t* buckets;
   int old_probe;
   uint8_t bucket_tmp[bucket_size];
@@ -333,10 +474,7 @@ PRHHUpsertPushDown(PascalRobinHoodHash* rhh, OPHash hasher,
   visit = 0;
   *resized = false;
   buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
-  recref = (oplenref_t*)&bucket_cpy[0];
-  recptr = OPLenRef2Ptr(rhh, *recref);
-  recsize = OPLenRef2Size(*recref);
-  hashed_key = hasher(recptr, recsize);
+  hashed_key = BucketHash(rhh, hasher, bucket_cpy);
   while (true)
     {
     next_iter:
@@ -404,10 +542,7 @@ PRHHUpsertPushDown(PascalRobinHoodHash* rhh, OPHash hasher,
           memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
           memcpy(bucket_cpy, bucket_tmp, bucket_size);
           probe = old_probe + 1;
-          recref = (oplenref_t*)&bucket_cpy[0];
-          recptr = OPLenRef2Ptr(rhh, *recref);
-          recsize = OPLenRef2Size(*recref);
-          hashed_key = hasher(recptr, recsize);
+          hashed_key = BucketHash(rhh, hasher, bucket_cpy);
           continue;
         }
       probe++;
@@ -417,9 +552,8 @@ PRHHUpsertPushDown(PascalRobinHoodHash* rhh, OPHash hasher,
 static bool
 PRHHSizeUp(PascalRobinHoodHash* rhh, OPHash hasher)
 {
-  const size_t keysize = sizeof(oplenref_t);
   const size_t valsize = rhh->valsize;
-  const size_t bucket_size = keysize + valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + valsize;
   const size_t large_data_threshold = rhh->large_data_threshold;
   uint8_t* old_buckets;
   uint8_t* new_buckets;
@@ -489,6 +623,7 @@ PRHHSizeUp(PascalRobinHoodHash* rhh, OPHash hasher)
   rhh->longest_probes = 0;
   memset(rhh->stats, 0x00, sizeof(uint32_t) * PROBE_STATS_SIZE);
   rhh->bucket_ref = OPPtr2Ref(new_buckets);
+  rhh->resizes++;
 
   for (uint64_t idx = 0; idx < old_capacity; idx++)
     {
@@ -508,7 +643,7 @@ static bool
 PRHHSizeDown(PascalRobinHoodHash* rhh, OPHash hasher)
 {
   const size_t valsize = rhh->valsize;
-  const size_t bucket_size = sizeof(oplenref_t) + valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + valsize;
   uint8_t* old_buckets;
   uint8_t* new_buckets;
   uint8_t new_capacity_ms4b, new_capacity_clz;
@@ -561,6 +696,7 @@ PRHHSizeDown(PascalRobinHoodHash* rhh, OPHash hasher)
   rhh->longest_probes = 0;
   memset(rhh->stats, 0x00, sizeof(uint32_t) * PROBE_STATS_SIZE);
   rhh->bucket_ref = OPPtr2Ref(new_buckets);
+  rhh->resizes++;
 
   for (uint64_t idx = 0; idx < old_capacity; idx++)
     {
@@ -579,7 +715,7 @@ PRHHSizeDown(PascalRobinHoodHash* rhh, OPHash hasher)
 bool PRHHInsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
                       void* key, size_t keysize, void* val)
 {
-  const size_t refsize = sizeof(oplenref_t);
+  const size_t refsize = PRHHValOffset(rhh);
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = refsize + valsize;
   enum upsert_result_t upsert_result;
@@ -590,6 +726,8 @@ bool PRHHInsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
   int probe;
   bool resized;
 
+  PRHHCheckFormat(rhh);
+  PRHHCheckHasher(rhh, hasher, keysize);
   if (rhh->objcnt > rhh->objcnt_high)
     {
       if(!PRHHSizeUp(rhh, hasher))
@@ -606,7 +744,7 @@ bool PRHHInsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
     case UPSERT_EMPTY:
       keylref = OPLenRefCreate(ObtainOPHeap(rhh), key, keysize);
       op_assert(keylref, "allocated pointer should not be NULL");
-      memcpy(matched_bucket, &keylref, sizeof(oplenref_t));
+      SetBucketKey(rhh, matched_bucket, keylref, hashed_key);
       memcpy(&matched_bucket[refsize], val, valsize);
       break;
     case UPSERT_DUP:
@@ -616,7 +754,7 @@ bool PRHHInsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
       memcpy(bucket_cpy, matched_bucket, bucket_size);
       keylref = OPLenRefCreate(ObtainOPHeap(rhh), key, keysize);
       op_assert(keylref, "allocated pointer should not be NULL");
-      memcpy(matched_bucket, &keylref, sizeof(oplenref_t));
+      SetBucketKey(rhh, matched_bucket, keylref, hashed_key);
       memcpy(&matched_bucket[refsize], val, valsize);
       PRHHUpsertPushDown(rhh, hasher, bucket_cpy, probe,
                          matched_bucket, &resized);
@@ -628,7 +766,7 @@ bool PRHHUpsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
                       void* key, size_t keysize, void** val_ref,
                       bool* is_duplicate)
 {
-  const size_t refsize = sizeof(oplenref_t);
+  const size_t refsize = PRHHValOffset(rhh);
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = refsize + valsize;
   enum upsert_result_t upsert_result;
@@ -639,6 +777,8 @@ bool PRHHUpsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
   uint8_t bucket_cpy[bucket_size];
   bool resized;
 
+  PRHHCheckFormat(rhh);
+  PRHHCheckHasher(rhh, hasher, keysize);
   if (rhh->objcnt > rhh->objcnt_high)
     {
       if(!PRHHSizeUp(rhh, hasher))
@@ -649,7 +789,7 @@ bool PRHHUpsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
   upsert_result = PRHHUpsertNewKey(rhh, hasher,
                                    key, keysize, hashed_key,
                                    &matched_bucket, &probe);
-  *val_ref = &matched_bucket[sizeof(oplenref_t)];
+  *val_ref = &matched_bucket[refsize];
 
   switch (upsert_result)
     {
@@ -660,14 +800,14 @@ bool PRHHUpsertCustom(PascalRobinHoodHash* rhh, OPHash hasher,
       *is_duplicate = false;
       keylref = OPLenRefCreate(ObtainOPHeap(rhh), key, keysize);
       op_assert(keylref, "allocated pointer should not be NULL");
-      memcpy(matched_bucket, &keylref, sizeof(oplenref_t));
+      SetBucketKey(rhh, matched_bucket, keylref, hashed_key);
       break;
     case UPSERT_PUSHDOWN:
       *is_duplicate = false;
       memcpy(bucket_cpy, matched_bucket, bucket_size);
       keylref = OPLenRefCreate(ObtainOPHeap(rhh), key, keysize);
       op_assert(keylref, "allocated pointer should not be NULL");
-      memcpy(matched_bucket, &keylref, sizeof(oplenref_t));
+      SetBucketKey(rhh, matched_bucket, keylref, hashed_key);
       PRHHUpsertPushDown(rhh, hasher, bucket_cpy, probe,
                          matched_bucket, &resized);
       if (resized)
@@ -683,12 +823,10 @@ PRHHSearchIdx(PascalRobinHoodHash* rhh, OPHash hasher,
               void* key, size_t keysize, uintptr_t* idx)
 {
   const size_t valsize = rhh->valsize;
-  const size_t bucket_size = sizeof(oplenref_t) + valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + valsize;
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   uint64_t hashed_key;
   oplenref_t *recref;
-  void* recptr;
-  size_t recsize;
 
   hashed_key = hasher(key, keysize);
 
@@ -702,10 +840,8 @@ PRHHSearchIdx(PascalRobinHoodHash* rhh, OPHash hasher,
         case ~0ULL: continue;
         default: break;
         }
-      recptr = OPLenRef2Ptr(rhh, *recref);
-      recsize = OPLenRef2Size(*recref);
-      if (keysize == recsize &&
-          !memcmp(key, recptr, keysize))
+      if (BucketMatch(rhh, &buckets[*idx * bucket_size],
+                      hashed_key, key, keysize))
         return true;
     }
   return false;
@@ -714,12 +850,15 @@ PRHHSearchIdx(PascalRobinHoodHash* rhh, OPHash hasher,
 void* PRHHGetCustom(PascalRobinHoodHash* rhh, OPHash hasher,
                     void* key, size_t keysize)
 {
-  const size_t bucket_size = sizeof(oplenref_t) + rhh->valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + rhh->valsize;
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   uintptr_t idx;
+
+  PRHHCheckFormat(rhh);
+  PRHHCheckHasher(rhh, hasher, keysize);
   if (PRHHSearchIdx(rhh, hasher, key, keysize, &idx))
     {
-      return &buckets[idx * bucket_size + sizeof(oplenref_t)];
+      return &buckets[idx * bucket_size + PRHHValOffset(rhh)];
     }
   return NULL;
 }
@@ -733,7 +872,7 @@ void* PRHHDeleteCustom(PascalRobinHoodHash* rhh, OPHash hasher,
    * slows down, not bounding it.
    */
   const size_t valsize = rhh->valsize;
-  const size_t bucket_size = sizeof(oplenref_t) + valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + valsize;
   uint8_t* buckets;
   uintptr_t idx, premod_idx, candidate_idx;
   uintptr_t mask;
@@ -741,10 +880,11 @@ void* PRHHDeleteCustom(PascalRobinHoodHash* rhh, OPHash hasher,
   int record_probe;
   oplenref_t* recref;
   void* recptr;
-  size_t recsize;
   uint64_t hashed_rec;
   uint8_t bucket_tmp[bucket_size];
 
+  PRHHCheckFormat(rhh);
+  PRHHCheckHasher(rhh, hasher, keysize);
   if (rhh->objcnt < rhh->objcnt_low &&
       rhh->objcnt > 16)
     {
@@ -802,9 +942,8 @@ void* PRHHDeleteCustom(PascalRobinHoodHash* rhh, OPHash hasher,
               recref = (oplenref_t*)&buckets[candidate_idx * bucket_size];
               if (*recref == 0 || *recref == ~0ULL)
                 continue;
-              recptr = OPLenRef2Ptr(rhh, *recref);
-              recsize = OPLenRef2Size(*recref);
-              hashed_rec = hasher(recptr, recsize);
+              hashed_rec = BucketHash(rhh, hasher,
+                                      &buckets[candidate_idx * bucket_size]);
               if (hash_with_probe(rhh, hashed_rec, probe + 1)
                   == candidate_idx &&
                   hash_with_probe(rhh, hashed_rec, probe)
@@ -838,25 +977,24 @@ void* PRHHDeleteCustom(PascalRobinHoodHash* rhh, OPHash hasher,
 
  end_iter:
   recref = (oplenref_t*)&buckets[idx * bucket_size];
-  recsize = OPLenRef2Size(*recref);
   recptr = OPLenRef2Ptr(rhh, *recref);
   OPDealloc(recptr);
   *recref = PRHH_TOMBSTONE_KEY;
-  return &buckets[idx * bucket_size + sizeof(oplenref_t)];
+  return &buckets[idx * bucket_size + PRHHValOffset(rhh)];
 }
 
-void PRHHIterate(PascalRobinHoodHash* rhh,
-                 OPHashIterator iterator, void* context)
+static void
+PRHHScanRange(PascalRobinHoodHash* rhh, uint64_t begin, uint64_t end,
+              OPHashIterator iterator, void* context)
 {
   const size_t valsize = rhh->valsize;
-  const size_t bucket_size = sizeof(oplenref_t) + valsize;
+  const size_t bucket_size = PRHHValOffset(rhh) + valsize;
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
-  uint64_t capacity = PRHHCapacity(rhh);
   oplenref_t* recref;
   void* recptr;
   size_t recsize;
 
-  for (uint64_t idx = 0; idx < capacity; idx++)
+  for (uint64_t idx = begin; idx < end; idx++)
     {
       recref = (oplenref_t*)&buckets[idx * bucket_size];
       if (*recref != PRHH_EMPTY_KEY &&
@@ -864,12 +1002,137 @@ void PRHHIterate(PascalRobinHoodHash* rhh,
         {
           recptr = OPLenRef2Ptr(rhh, *recref);
           recsize = OPLenRef2Size(*recref);
-          iterator(recptr, &buckets[idx * bucket_size + sizeof(oplenref_t)],
+          iterator(recptr, &buckets[idx * bucket_size + PRHHValOffset(rhh)],
                    recsize, valsize, context);
         }
     }
 }
 
+void PRHHIterate(PascalRobinHoodHash* rhh,
+                 OPHashIterator iterator, void* context)
+{
+  PRHHCheckFormat(rhh);
+  PRHHScanRange(rhh, 0, PRHHCapacity(rhh), iterator, context);
+}
+
+size_t PRHHCursorNext(PascalRobinHoodHash* rhh, OPHashCursor* cursor,
+                      size_t max, void** keys, size_t* keysizes,
+                      void** vals)
+{
+  const size_t bucket_size = PRHHValOffset(rhh) + rhh->valsize;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  const uint64_t capacity = PRHHCapacity(rhh);
+  oplenref_t* recref;
+  uint64_t pos;
+  size_t n;
+
+  PRHHCheckFormat(rhh);
+  n = 0;
+  for (pos = cursor->pos; n < max && pos < capacity; pos++)
+    {
+      recref = (oplenref_t*)&buckets[pos * bucket_size];
+      if (*recref == PRHH_EMPTY_KEY ||
+          *recref == PRHH_TOMBSTONE_KEY)
+        continue;
+      keys[n] = OPLenRef2Ptr(rhh, *recref);
+      if (keysizes)
+        keysizes[n] = OPLenRef2Size(*recref);
+      if (vals)
+        vals[n] = &buckets[pos * bucket_size + PRHHValOffset(rhh)];
+      n++;
+    }
+  cursor->pos = pos;
+  return n;
+}
+
+struct PRHHIterateTask
+{
+  PascalRobinHoodHash* rhh;
+  OPHashIterator iterator;
+  void* context;
+  uint64_t end;
+  a_uint64_t next_range;
+};
+
+static void*
+PRHHIterateWorker(void* arg)
+{
+  struct PRHHIterateTask* task = arg;
+  uint64_t begin, end;
+
+  while ((begin = atomic_fetch_add_explicit(&task->next_range, 1,
+                                            memory_order_relaxed)
+          << PARALLEL_ITERATE_RANGE_BITS) < task->end)
+    {
+      end = begin + (1ULL << PARALLEL_ITERATE_RANGE_BITS);
+      if (end > task->end)
+        end = task->end;
+      PRHHScanRange(task->rhh, begin, end, task->iterator, task->context);
+    }
+  return NULL;
+}
+
+void PRHHParallelIterate(PascalRobinHoodHash* rhh, unsigned int nthreads,
+                         OPHashIterator iterator, void* context)
+{
+  struct PRHHIterateTask task;
+  uint64_t ranges;
+
+  PRHHCheckFormat(rhh);
+  task.rhh = rhh;
+  task.iterator = iterator;
+  task.context = context;
+  task.end = PRHHCapacity(rhh);
+  atomic_init(&task.next_range, 0);
+  ranges = (task.end >> PARALLEL_ITERATE_RANGE_BITS) + 1;
+  if (nthreads > ranges)
+    nthreads = ranges;
+  if (nthreads > PARALLEL_ITERATE_MAX_THREADS)
+    nthreads = PARALLEL_ITERATE_MAX_THREADS;
+  if (nthreads <= 1)
+    {
+      PRHHScanRange(rhh, 0, task.end, iterator, context);
+      return;
+    }
+
+  pthread_t threads[nthreads];
+  bool started[nthreads];
+
+  // The calling thread takes part and covers for threads that could
+  // not be started.
+  for (unsigned int i = 1; i < nthreads; i++)
+    started[i] = !pthread_create(&threads[i], NULL,
+                                 PRHHIterateWorker, &task);
+  PRHHIterateWorker(&task);
+  for (unsigned int i = 1; i < nthreads; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+}
+
+void PRHHGetStats(PascalRobinHoodHash* rhh, OPHashStats* stats)
+{
+  const size_t bucket_size = PRHHValOffset(rhh) + rhh->valsize;
+  uint64_t probes, counted;
+
+  PRHHCheckFormat(rhh);
+  memset(stats, 0x00, sizeof(OPHashStats));
+  stats->objcnt = rhh->objcnt;
+  stats->capacity = PRHHCapacity(rhh);
+  stats->load = (double)stats->objcnt / stats->capacity;
+  stats->longest_probe = rhh->longest_probes;
+  stats->resizes = rhh->resizes;
+  stats->bytes = sizeof(PascalRobinHoodHash) + bucket_size * stats->capacity;
+
+  probes = counted = 0;
+  for (int i = 0; i < PROBE_STATS_SIZE; i++)
+    {
+      stats->probe_hist[i] = rhh->stats[i];
+      probes += (uint64_t)rhh->stats[i] * i;
+      counted += rhh->stats[i];
+    }
+  stats->mean_probe = counted ? (double)probes / counted : 0.0;
+}
+
 void PRHHPrintStat(PascalRobinHoodHash* rhh)
 {
   for (int i = 0; i < PROBE_STATS_SIZE; i++)
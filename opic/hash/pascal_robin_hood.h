@@ -65,6 +65,23 @@ typedef struct PascalRobinHoodHash PascalRobinHoodHash;
 bool PRHHNew(OPHeap* heap, PascalRobinHoodHash** rhh_ref,
              uint64_t num_objects, double load, size_t valsize);
 
+/**
+ * @relates PascalRobinHoodHash　
+ * @brief Constructor for PascalRobinHoodHash keeping key hashes in
+ * the buckets.
+ *
+ * Same parameters as PRHHNew. Each bucket additionally keeps the 64
+ * bit hash of its key next to the key reference. Probes compare the
+ * key length and the hash before following the reference, so buckets
+ * holding other keys rarely cost a cache miss, and inserts and deletes
+ * find how far an entry was displaced without re-hashing its key. This
+ * costs 8 bytes per bucket.
+ *
+ * @return true when the allocation succeeded, false otherwise.
+ */
+bool PRHHNewInlineHash(OPHeap* heap, PascalRobinHoodHash** rhh_ref,
+                       uint64_t num_objects, double load, size_t valsize);
+
 /**
  * @relates PascalRobinHoodHash　
  * @brief Destructor for PascalRobinHoodHash
@@ -76,6 +93,34 @@ bool PRHHNew(OPHeap* heap, PascalRobinHoodHash** rhh_ref,
  */
 void PRHHDestroy(PascalRobinHoodHash* rhh);
 
+/**
+ * @relates PascalRobinHoodHash　
+ * @brief Hash function used by the APIs without a hasher parameter.
+ *
+ * @param rhh PascalRobinHoodHash instance.
+ * @return the hash function recorded in the table header.
+ *
+ * PRHHNew records OPDefaultHash. Tables upgraded from older heaps keep
+ * OPCityHash, which they were built with, see OPHashId.
+ */
+OPHash PRHHHasher(PascalRobinHoodHash* rhh);
+
+/**
+ * @relates PascalRobinHoodHash　
+ * @brief Converts a PascalRobinHoodHash stored by an older version of
+ * the library to the current format.
+ *
+ * @param rhh_ref reference to the PascalRobinHoodHash pointer restored
+ * from the heap. Points to the converted table on success.
+ * @return true if the table is in the current format, false if it is
+ * not a known format or the allocation failed.
+ *
+ * Older tables lack the header fields the other APIs check. The header
+ * is reallocated, so store the new pointer with OPHeapStorePtr again.
+ * Tables in the current format are returned as they are.
+ */
+bool PRHHUpgrade(PascalRobinHoodHash** rhh_ref);
+
 /**
  * @relates PascalRobinHoodHash　
  * @brief Associates the specified key and value with custom
@@ -180,7 +225,7 @@ void* PRHHDeleteCustom(PascalRobinHoodHash* rhh, OPHash hasher,
 static inline bool
 PRHHInsert(PascalRobinHoodHash* rhh, void* key, size_t keysize, void* val)
 {
-  return PRHHInsertCustom(rhh, OPDefaultHash, key, keysize, val);
+  return PRHHInsertCustom(rhh, PRHHHasher(rhh), key, keysize, val);
 }
 
 /**
@@ -206,7 +251,7 @@ static inline bool
 PRHHUpsert(PascalRobinHoodHash* rhh, void* key, size_t keysize,
            void** val_ref, bool* is_duplicate)
 {
-  return PRHHUpsertCustom(rhh, OPDefaultHash, key, keysize,
+  return PRHHUpsertCustom(rhh, PRHHHasher(rhh), key, keysize,
                           val_ref, is_duplicate);
 }
 
@@ -227,7 +272,7 @@ PRHHUpsert(PascalRobinHoodHash* rhh, void* key, size_t keysize,
 static inline void*
 PRHHGet(PascalRobinHoodHash* rhh, void* key, size_t keysize)
 {
-  return PRHHGetCustom(rhh, OPDefaultHash, key, keysize);
+  return PRHHGetCustom(rhh, PRHHHasher(rhh), key, keysize);
 }
 
 /**
@@ -245,7 +290,7 @@ PRHHGet(PascalRobinHoodHash* rhh, void* key, size_t keysize)
 static inline void*
 PRHHDelete(PascalRobinHoodHash* rhh, void* key, size_t keysize)
 {
-  return PRHHDeleteCustom(rhh, OPDefaultHash, key, keysize);
+  return PRHHDeleteCustom(rhh, PRHHHasher(rhh), key, keysize);
 }
 
 /**
@@ -299,6 +344,54 @@ size_t RHHValsize(PascalRobinHoodHash* rhh);
 void PRHHIterate(PascalRobinHoodHash* rhh,
                  OPHashIterator iterator, void* context);
 
+/**
+ * @relates PascalRobinHoodHash　
+ * @brief Returns the next batch of key-value pairs of a scan.
+ *
+ * @param rhh PascalRobinHoodHash instance.
+ * @param cursor scan position, zero initialized for a new scan and
+ * advanced by each call.
+ * @param max maximum number of pairs to return.
+ * @param keys array of max key pointers to fill.
+ * @param keysizes array of max key sizes to fill, or NULL.
+ * @param vals array of max value pointers to fill, or NULL.
+ * @return number of pairs filled in. 0 once the scan is complete.
+ *
+ * Same as RHHCursorNext, with the key sizes reported alongside. Pairs
+ * moved by modifications during a scan may be skipped or returned
+ * twice.
+ */
+size_t PRHHCursorNext(PascalRobinHoodHash* rhh, OPHashCursor* cursor,
+                      size_t max, void** keys, size_t* keysizes,
+                      void** vals);
+
+/**
+ * @relates PascalRobinHoodHash　
+ * @brief Iterates over all key-value pairs with several threads.
+ *
+ * @param rhh PascalRobinHoodHash instance.
+ * @param nthreads number of threads including the calling one.
+ * @param iterator function pointer to user defined iterator function.
+ * @param context user defined context, shared by all threads.
+ *
+ * See RHHParallelIterate. The iterator must synchronize its access to
+ * context and the table must not be modified meanwhile.
+ */
+void PRHHParallelIterate(PascalRobinHoodHash* rhh, unsigned int nthreads,
+                         OPHashIterator iterator, void* context);
+
+/**
+ * @relates PascalRobinHoodHash　
+ * @brief Fills in load, probe and memory statistics of the table.
+ *
+ * @param rhh PascalRobinHoodHash instance.
+ * @param stats stats to fill.
+ *
+ * Same as RHHGetStats. bytes does not include the separately
+ * allocated keys.
+ */
+void PRHHGetStats(PascalRobinHoodHash* rhh, OPHashStats* stats);
+
 /**
  * @relates PascalRobinHoodHash　
  * @brief Prints the accumulated count for each probing number.
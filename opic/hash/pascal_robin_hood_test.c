@@ -54,6 +54,7 @@
 #include <string.h>
 #include <cmocka.h>
 
+#include "opic/common/op_atomic.h"
 #include "opic/common/op_log.h"
 #include "pascal_robin_hood.h"
 
@@ -115,6 +116,7 @@ test_BasicInsert(void** context)
 {
   OPHeap* heap;
   PascalRobinHoodHash* rhh;
+  OPHashStats stats;
   size_t keylen;
 
   OP_LOG_INFO(logger, "Starting basic insert");
@@ -130,6 +132,10 @@ test_BasicInsert(void** context)
     }
   PRHHPrintStat(rhh);
   assert_int_equal(TEST_OBJECTS, PRHHObjcnt(rhh));
+  PRHHGetStats(rhh, &stats);
+  assert_int_equal(TEST_OBJECTS, stats.objcnt);
+  assert_int_equal(PRHHCapacity(rhh), stats.capacity);
+  assert_true(stats.resizes > 0);
   ResetObjcnt();
   PRHHIterate(rhh, CountObjects, NULL);
   assert_int_equal(TEST_OBJECTS, objcnt);
@@ -240,6 +246,166 @@ test_Upsert(void** context)
   OPHeapDestroy(heap);
 }
 
+static void
+CountObjectsAtomic(void* key, void* val,
+                   size_t keysize, size_t valsize, void* ctx)
+{
+  atomic_fetch_add_explicit((a_int32_t*)ctx, 1, memory_order_relaxed);
+}
+
+static void
+test_Cursor(void** context)
+{
+  OPHeap* heap;
+  PascalRobinHoodHash* rhh;
+  OPHashCursor cursor = {0};
+  void* keys[64];
+  size_t keysizes[64];
+  void* vals[64];
+  size_t n, total, keylen;
+  a_int32_t count;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(PRHHNew(heap, &rhh, 20, 0.80, sizeof(int)));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      keylen = MutateUUID(i);
+      PRHHInsert(rhh, uuid, keylen, &i);
+    }
+
+  total = 0;
+  while ((n = PRHHCursorNext(rhh, &cursor, 64, keys, keysizes, vals)))
+    {
+      for (size_t i = 0; i < n; i++)
+        {
+          keylen = MutateUUID(*(int*)vals[i]);
+          assert_int_equal(keylen, keysizes[i]);
+          assert_memory_equal(uuid, keys[i], keylen);
+        }
+      total += n;
+    }
+  assert_int_equal(TEST_OBJECTS, total);
+
+  for (unsigned int nthreads = 0; nthreads <= 4; nthreads++)
+    {
+      atomic_init(&count, 0);
+      PRHHParallelIterate(rhh, nthreads, CountObjectsAtomic, &count);
+      assert_int_equal(TEST_OBJECTS, atomic_load(&count));
+    }
+  PRHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_InlineHash(void** context)
+{
+  OPHeap* heap;
+  PascalRobinHoodHash* rhh;
+  OPHashCursor cursor = {0};
+  void* keys[64];
+  void* vals[64];
+  size_t n, total, keylen;
+  int* val;
+  bool is_duplicate;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(PRHHNewInlineHash(heap, &rhh, 20, 0.80, sizeof(int)));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      keylen = MutateUUID(i);
+      assert_true(PRHHInsert(rhh, uuid, keylen, &i));
+    }
+  assert_int_equal(TEST_OBJECTS, PRHHObjcnt(rhh));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      keylen = MutateUUID(i);
+      assert_true(PRHHUpsert(rhh, uuid, keylen, (void**)&val, &is_duplicate));
+      assert_true(is_duplicate);
+      assert_int_equal(i, *val);
+    }
+
+  total = 0;
+  while ((n = PRHHCursorNext(rhh, &cursor, 64, keys, NULL, vals)))
+    {
+      for (size_t i = 0; i < n; i++)
+        {
+          keylen = MutateUUID(*(int*)vals[i]);
+          assert_memory_equal(uuid, keys[i], keylen);
+        }
+      total += n;
+    }
+  assert_int_equal(TEST_OBJECTS, total);
+
+  // Deletes move displaced entries back using the stored hashes.
+  for (int i = 0; i < TEST_OBJECTS; i += 2)
+    {
+      keylen = MutateUUID(i);
+      val = PRHHDelete(rhh, uuid, keylen);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      keylen = MutateUUID(i);
+      val = PRHHGet(rhh, uuid, keylen);
+      if (i % 2)
+        {
+          assert_non_null(val);
+          assert_int_equal(i, *val);
+        }
+      else
+        assert_null(val);
+    }
+  PRHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_Upgrade(void** context)
+{
+  OPHeap* heap;
+  PascalRobinHoodHash *rhh, *current;
+  uint64_t key;
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(PRHHNew(heap, &rhh, 20, 0.80, sizeof(int)));
+  current = rhh;
+  assert_true(PRHHUpgrade(&rhh));
+  assert_ptr_equal(current, rhh);
+  // 8 byte keys as an older version stored them, hashed with
+  // cityhash64 and without the format after longest_probes.
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      key = i;
+      assert_true(PRHHInsertCustom(rhh, OPCityHash, &key, sizeof(key), &i));
+    }
+  memset((uint8_t*)rhh + 36, 0, sizeof(uint32_t));
+  assert_true(PRHHUpgrade(&rhh));
+  assert_ptr_not_equal(current, rhh);
+
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      key = i;
+      val = PRHHGet(rhh, &key, sizeof(key));
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+  for (int i = TEST_OBJECTS; i < TEST_OBJECTS * 2; i++)
+    {
+      key = i;
+      assert_true(PRHHInsert(rhh, &key, sizeof(key), &i));
+    }
+  for (int i = 0; i < TEST_OBJECTS * 2; i++)
+    {
+      key = i;
+      assert_non_null(PRHHDelete(rhh, &key, sizeof(key)));
+    }
+  assert_int_equal(0, PRHHObjcnt(rhh));
+  PRHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
 int
 main (void)
 {
@@ -250,6 +416,9 @@ main (void)
       cmocka_unit_test(test_BasicDelete),
       cmocka_unit_test(test_DistributionForUpdate),
       cmocka_unit_test(test_Upsert),
+      cmocka_unit_test(test_Cursor),
+      cmocka_unit_test(test_InlineHash),
+      cmocka_unit_test(test_Upgrade),
     };
 
   return cmocka_run_group_tests(prhh_tests, NULL, NULL);
@@ -51,15 +51,43 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "opic/common/op_assert.h"
+#include "opic/common/op_atomic.h"
 #include "opic/common/op_utils.h"
 #include "opic/common/op_log.h"
 #include "opic/op_malloc.h"
 #include "robin_hood.h"
+#include "robin_hood_internal.h"
 
-#define PROBE_STATS_SIZE 64
 #define DEFAULT_LARGE_DATA_THRESHOLD (1UL << 30)
 #define VISIT_IDX_CACHE 8
+// Minimum old buckets moved by each modification during an incremental
+// resize, see RHHMigrateStep.
+#define MIGRATE_STEP 16
+// Blocking resizes below this many old buckets are not worth the
+// thread start up cost.
+#define PARALLEL_REHASH_THRESHOLD (1UL << 14)
+// Upper bound of hash prefixes handed out to rehash workers; each
+// prefix owns at least 1 << PARALLEL_REHASH_MIN_BITS hash values.
+#define PARALLEL_REHASH_PART_BITS 8
+#define PARALLEL_REHASH_MIN_BITS 10
+#define PARALLEL_REHASH_MAX_THREADS 256
+// Buckets handed out at a time by RHHParallelIterate.
+#define PARALLEL_ITERATE_RANGE_BITS 14
+#define PARALLEL_ITERATE_MAX_THREADS 256
+
+// Optional tag array (see RHHNewTagged). One byte per bucket stored
+// right after the buckets: the top 7 bits of the hash with the high
+// bit set, or one of the two values below. TAG_GROUP bytes of padding
+// let a lookup load a whole group starting at any bucket.
+#define TAG_EMPTY 0x00
+#define TAG_TOMBSTONE 0x01
+#define TAG_GROUP 16
+#define hash_tag(hashed_key) ((uint8_t)(0x80 | ((hashed_key) >> 57)))
 
 OP_LOGGER_FACTORY(logger, "opic.hash.robin_hood");
 
@@ -82,22 +110,13 @@ RHHUpsertPushDown(RobinHoodHash* rhh, OPHash hasher,
                   uint8_t* bucket_cpy, int probe,
                   uint8_t* avoid_bucket, bool* resize);
 
-static bool RHHSizeUp(RobinHoodHash* rhh, OPHash hasher);
+static bool RHHSizeUp(RobinHoodHash* rhh, OPHash hasher, bool incremental);
 
-struct RobinHoodHash
-{
-  uint64_t objcnt;
-  uint64_t objcnt_high;
-  uint64_t objcnt_low;
-  uint64_t large_data_threshold;
-  uint8_t capacity_clz;    // leading zeros of capacity
-  uint8_t capacity_ms4b;   // most significant 4 bits
-  uint16_t longest_probes;
-  size_t keysize;
-  size_t valsize;
-  uint32_t stats[PROBE_STATS_SIZE];
-  opref_t bucket_ref;
-};
+static void
+RHHMigrateBuckets(RobinHoodHash* rhh, OPHash hasher, uint64_t nbuckets);
+
+static inline uint8_t*
+RHHPreHashSearchOldBucket(RobinHoodHash* rhh, uint64_t hashed_key, void* key);
 
 struct RHHFunnel
 {
@@ -109,11 +128,36 @@ struct RHHFunnel
   uint8_t partition_clz;
   uint8_t* tubes;
   ptrdiff_t* flowheads;
+  // Interleaved mode, see RHHFunnelNewInterleavedCustom.
+  unsigned int window;
+  unsigned int inflight;
+  unsigned int next_lookup;
+  struct RHHLookup* lookups;
+  uint8_t* lookup_data;
+  // Created by RHHReadOnlyFunnelNewCustom; the table may be mapped
+  // read only.
+  bool read_only;
 };
 
-bool
-RHHNew(OPHeap* heap, RobinHoodHash** rhh,
-       uint64_t num_objects, double load, size_t keysize, size_t valsize)
+// In-flight lookup of an interleaved funnel. Its key and context are
+// kept at lookup_data[i * slotsize].
+struct RHHLookup
+{
+  uint64_t hashed_key;
+  int probe;
+  uint32_t ctxsize;
+  bool active;
+};
+
+static inline size_t
+BucketArraySize(size_t bucket_size, uint64_t capacity, bool tagged)
+{
+  return bucket_size * capacity + (tagged ? capacity + TAG_GROUP : 0);
+}
+
+static bool
+RHHNewInternal(OPHeap* heap, RobinHoodHash** rhh, uint64_t num_objects,
+               double load, size_t keysize, size_t valsize, bool tagged)
 {
   uint64_t capacity;
   uint32_t capacity_clz, capacity_ms4b, capacity_msb;
@@ -135,10 +179,11 @@ RHHNew(OPHeap* heap, RobinHoodHash** rhh,
   *rhh = OPCalloc(heap, 1, sizeof(RobinHoodHash));
   if (!*rhh)
     return false;
-  bucket_ptr = OPCalloc(heap, 1, bucket_size * capacity);
+  bucket_ptr = OPCalloc(heap, 1,
+                        BucketArraySize(bucket_size, capacity, tagged));
   if (!bucket_ptr)
     {
-      OPDealloc(rhh);
+      OPDealloc(*rhh);
       return false;
     }
   (*rhh)->bucket_ref = OPPtr2Ref(bucket_ptr);
@@ -149,16 +194,67 @@ RHHNew(OPHeap* heap, RobinHoodHash** rhh,
   (*rhh)->objcnt_low = capacity * 2 / 10;
   (*rhh)->keysize = keysize;
   (*rhh)->valsize = valsize;
+  (*rhh)->tagged = tagged;
+  (*rhh)->format = RHH_FORMAT;
+  (*rhh)->hash_id = OP_HASH_ID_DEFAULT;
   return true;
 }
 
+bool
+RHHNew(OPHeap* heap, RobinHoodHash** rhh,
+       uint64_t num_objects, double load, size_t keysize, size_t valsize)
+{
+  return RHHNewInternal(heap, rhh, num_objects, load, keysize, valsize,
+                        false);
+}
+
+bool
+RHHNewTagged(OPHeap* heap, RobinHoodHash** rhh,
+             uint64_t num_objects, double load, size_t keysize, size_t valsize)
+{
+  return RHHNewInternal(heap, rhh, num_objects, load, keysize, valsize,
+                        true);
+}
+
 void
 RHHDestroy(RobinHoodHash* rhh)
 {
+  RHHCheckFormat(rhh);
+  if (rhh->old_bucket_ref)
+    OPDealloc(OPRef2Ptr(rhh, rhh->old_bucket_ref));
   OPDealloc(OPRef2Ptr(rhh, rhh->bucket_ref));
   OPDealloc(rhh);
 }
 
+OPHash RHHHasher(RobinHoodHash* rhh)
+{
+  OPHash hasher;
+
+  RHHCheckFormat(rhh);
+  hasher = OPHashFromId(rhh->hash_id);
+  op_assert(hasher, "RobinHoodHash %p has no known hash, "
+            "use the Custom APIs\n", (void*)rhh);
+  return hasher;
+}
+
+// OPDefaultHash hashes 4 and 8 byte keys with OPIntHash, so it misses
+// every key of a table RHHUpgrade tagged OP_HASH_ID_CITY. The last
+// hasher that passed is cached to keep the check off the hot path.
+static __thread OPHash rhh_checked_hasher;
+
+static inline void
+RHHCheckHasher(const RobinHoodHash* rhh, OPHash hasher)
+{
+  if (op_likely(rhh->hash_id != OP_HASH_ID_CITY ||
+                hasher == rhh_checked_hasher ||
+                (rhh->keysize != 4 && rhh->keysize != 8)))
+    return;
+  op_assert(OPHashToId(hasher, rhh->keysize) != OP_HASH_ID_DEFAULT,
+            "RobinHoodHash %p hashes with OPCityHash, OPDefaultHash "
+            "would miss its %zu byte keys\n", (void*)rhh, rhh->keysize);
+  rhh_checked_hasher = hasher;
+}
+
 uint64_t RHHObjcnt(RobinHoodHash* rhh)
 {
   return rhh->objcnt;
@@ -220,6 +316,27 @@ hash_with_probe(RobinHoodHash* rhh, uint64_t key, int probe)
   return (probed_hash & mask) * rhh->capacity_ms4b >> 4;
 }
 
+static inline uint8_t*
+bucket_tags(RobinHoodHash* rhh, uint8_t* buckets)
+{
+  return &buckets[RHHCapacity(rhh) * (rhh->keysize + rhh->valsize + 1)];
+}
+
+static inline void
+SetTag(RobinHoodHash* rhh, uintptr_t idx, uint8_t tag)
+{
+  if (rhh->tagged)
+    bucket_tags(rhh, OPRef2Ptr(rhh, rhh->bucket_ref))[idx] = tag;
+}
+
+static inline uintptr_t
+old_hash_with_probe(RobinHoodHash* rhh, uint64_t key, int probe)
+{
+  uint64_t mask = (1ULL << (64 - rhh->old_capacity_clz)) - 1;
+  uint64_t probed_hash = key + probe * probe * 2;
+  return (probed_hash & mask) * rhh->old_capacity_ms4b >> 4;
+}
+
 static inline int
 findprobe(RobinHoodHash* rhh, OPHash hasher, uintptr_t idx)
 {
@@ -229,6 +346,9 @@ findprobe(RobinHoodHash* rhh, OPHash hasher, uintptr_t idx)
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   uint64_t hashed_key;
 
+  if ((buckets[idx*bucket_size] & PROBE_UNKNOWN) != PROBE_UNKNOWN)
+    return buckets[idx*bucket_size] & PROBE_UNKNOWN;
+
   hashed_key = hasher(&buckets[idx*bucket_size + 1], keysize);
   for (int i = 0; i <= rhh->longest_probes; i++)
     {
@@ -239,6 +359,71 @@ findprobe(RobinHoodHash* rhh, OPHash hasher, uintptr_t idx)
   return -1;
 }
 
+static bool
+RHHUpgradeInternal(RobinHoodHash** rhh_ref, OPHash hasher, OPHashId hash_id)
+{
+  RobinHoodHash* old = *rhh_ref;
+  RobinHoodHash* rhh;
+  uint8_t* buckets;
+  size_t bucket_size;
+  uint64_t capacity, hashed_key;
+  int probe;
+
+  if (old->format == RHH_FORMAT)
+    return true;
+  if (old->format || !old->keysize || !old->bucket_ref ||
+      old->capacity_ms4b < 8 || old->capacity_ms4b > 15)
+    {
+      OP_LOG_ERROR(logger, "RobinHoodHash %p has unknown format %#x\n",
+                   (void*)old, old->format);
+      return false;
+    }
+  rhh = OPCalloc(ObtainOPHeap(old), 1, sizeof(RobinHoodHash));
+  if (!rhh)
+    return false;
+  // Older headers end at bucket_ref; the fields after it start zeroed.
+  memcpy(rhh, old, offsetof(RobinHoodHash, bucket_ref) + sizeof(opref_t));
+  rhh->format = RHH_FORMAT;
+  rhh->hash_id = hash_id;
+
+  bucket_size = rhh->keysize + rhh->valsize + 1;
+  buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  capacity = RHHCapacity(rhh);
+  for (uint64_t idx = 0; idx < capacity; idx++)
+    {
+      if (buckets[idx*bucket_size] != LEGACY_OCCUPIED)
+        continue;
+      hashed_key = hasher(&buckets[idx*bucket_size + 1], rhh->keysize);
+      for (probe = 0; probe <= rhh->longest_probes; probe++)
+        if (hash_with_probe(rhh, hashed_key, probe) == idx)
+          break;
+      if (probe > rhh->longest_probes)
+        {
+          OP_LOG_ERROR(logger, "RobinHoodHash %p was not built with the "
+                       "given hash function\n", (void*)old);
+          for (uint64_t i = 0; i < idx; i++)
+            if (bucket_occupied(buckets[i*bucket_size]))
+              buckets[i*bucket_size] = LEGACY_OCCUPIED;
+          OPDealloc(rhh);
+          return false;
+        }
+      buckets[idx*bucket_size] = bucket_flag(probe);
+    }
+  OPDealloc(old);
+  *rhh_ref = rhh;
+  return true;
+}
+
+bool RHHUpgrade(RobinHoodHash** rhh_ref)
+{
+  return RHHUpgradeInternal(rhh_ref, OPCityHash, OP_HASH_ID_CITY);
+}
+
+bool RHHUpgradeCustom(RobinHoodHash** rhh_ref, OPHash hasher)
+{
+  return RHHUpgradeInternal(rhh_ref, hasher, OP_HASH_ID_NONE);
+}
+
 static inline void
 IncreaseProbeStat(RobinHoodHash* rhh, int probe)
 {
@@ -248,6 +433,61 @@ IncreaseProbeStat(RobinHoodHash* rhh, int probe)
   rhh->stats[probe]++;
 }
 
+/*
+ * Old buckets to move in this modification. The rest of the old array
+ * is spread over the modifications left before objcnt reaches either
+ * resize threshold, so the migration is done before the next resize
+ * would need to drain it. Resizes are deferred while it runs.
+ */
+static inline uint64_t
+RHHMigrateStep(RobinHoodHash* rhh)
+{
+  uint64_t remaining, headroom;
+
+  remaining = RHHCapacityInternal(rhh->old_capacity_clz,
+                                  rhh->old_capacity_ms4b) - rhh->migrate_idx;
+  headroom = 0;
+  if (rhh->objcnt > rhh->objcnt_low && rhh->objcnt < rhh->objcnt_high)
+    {
+      headroom = rhh->objcnt_high - rhh->objcnt;
+      if (rhh->objcnt - rhh->objcnt_low < headroom)
+        headroom = rhh->objcnt - rhh->objcnt_low;
+    }
+  return MIGRATE_STEP + remaining / (headroom + 1);
+}
+
+/*
+ * Looks for key on its probe sequence after probe. Upserts stopping at
+ * a tombstone or at a poorer bucket must call it: deletes leave both
+ * ahead of keys they did not touch. Only keysize bytes are compared,
+ * the caller's key is not followed by a value.
+ */
+static inline bool
+RHHFindKeyAfter(RobinHoodHash* rhh, uint64_t hashed_key, void* key,
+                int probe, uint8_t** matched_bucket)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t bucket_size = keysize + rhh->valsize + 1;
+  uint8_t* buckets;
+  uintptr_t idx;
+
+  buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  for (int p = probe + 1; p <= rhh->longest_probes; p++)
+    {
+      idx = hash_with_probe(rhh, hashed_key, p);
+      if (buckets[idx * bucket_size] == 0)
+        return false;
+      if (!bucket_occupied(buckets[idx * bucket_size]))
+        continue;
+      if (!memcmp(key, &buckets[idx * bucket_size + 1], keysize))
+        {
+          *matched_bucket = &buckets[idx * bucket_size];
+          return true;
+        }
+    }
+  return false;
+}
+
 static inline enum upsert_result_t
 RHHUpsertNewKey(RobinHoodHash* rhh, OPHash hasher,
                 uint64_t hashed_key,
@@ -259,7 +499,15 @@ RHHUpsertNewKey(RobinHoodHash* rhh, OPHash hasher,
   const size_t bucket_size = keysize + valsize + 1;
   uint8_t* buckets;
   int probe, old_probe;
-  uintptr_t idx, _idx;
+  uintptr_t idx;
+
+  if (rhh->old_bucket_ref)
+    {
+      RHHMigrateBuckets(rhh, hasher, RHHMigrateStep(rhh));
+      *matched_bucket = RHHPreHashSearchOldBucket(rhh, hashed_key, key);
+      if (*matched_bucket)
+        return UPSERT_DUP;
+    }
 
   buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   probe = 0;
@@ -269,7 +517,7 @@ RHHUpsertNewKey(RobinHoodHash* rhh, OPHash hasher,
       idx = hash_with_probe(rhh, hashed_key, probe);
       if (probe > PROBE_STATS_SIZE)
         {
-          RHHSizeUp(rhh, hasher);
+          RHHSizeUp(rhh, hasher, false);
           probe = 0;
           buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
           continue;
@@ -277,23 +525,18 @@ RHHUpsertNewKey(RobinHoodHash* rhh, OPHash hasher,
       if (buckets[idx * bucket_size] == 0)
         {
           IncreaseProbeStat(rhh, probe);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
           *matched_bucket = &buckets[idx * bucket_size];
           return UPSERT_EMPTY;
         }
       else if (buckets[idx * bucket_size] == 2)
         {
-          for (int p = probe+1; p <= rhh->longest_probes; p++)
-            {
-              _idx = hash_with_probe(rhh, hashed_key, p);
-              if (buckets[_idx * bucket_size] != 1)
-                continue;
-              if (!memcmp(key, &buckets[_idx * bucket_size + 1], bucket_size))
-                {
-                  *matched_bucket = &buckets[_idx * bucket_size];
-                  return UPSERT_DUP;
-                }
-            }
+          if (RHHFindKeyAfter(rhh, hashed_key, key, probe, matched_bucket))
+            return UPSERT_DUP;
           IncreaseProbeStat(rhh, probe);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
           *matched_bucket = &buckets[idx * bucket_size];
           return UPSERT_EMPTY;
         }
@@ -305,10 +548,16 @@ RHHUpsertNewKey(RobinHoodHash* rhh, OPHash hasher,
       old_probe = findprobe(rhh, hasher, idx);
       if (probe > old_probe)
         {
+          if (RHHFindKeyAfter(rhh, hashed_key, key, probe, matched_bucket))
+            return UPSERT_DUP;
           rhh->longest_probes = probe > rhh->longest_probes ?
             probe : rhh->longest_probes;
           rhh->stats[old_probe]--;
           rhh->stats[probe]++;
+          // Callers copy the displaced entry out before overwriting the
+          // key; RHHUpsertPushDown assigns its new probe when placing it.
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
           *matched_bucket = &buckets[idx * bucket_size];
           *probe_state = old_probe+1;
           return UPSERT_PUSHDOWN;
@@ -348,7 +597,7 @@ RHHUpsertPushDown(RobinHoodHash* rhh, OPHash hasher,
 
       if (iter > capacity)
         {
-          RHHSizeUp(rhh, hasher);
+          RHHSizeUp(rhh, hasher, false);
           capacity = RHHCapacity(rhh);
           iter = 0;
           probe = 0;
@@ -390,10 +639,12 @@ RHHUpsertPushDown(RobinHoodHash* rhh, OPHash hasher,
       visit++;
 
       // empty bucket or tombstone bucket
-      if (buckets[idx * bucket_size] != 1)
+      if (!bucket_occupied(buckets[idx * bucket_size]))
         {
           IncreaseProbeStat(rhh, probe);
           memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
           return;
         }
 
@@ -406,6 +657,8 @@ RHHUpsertPushDown(RobinHoodHash* rhh, OPHash hasher,
           rhh->stats[probe]++;
           memcpy(bucket_tmp, &buckets[idx * bucket_size], bucket_size);
           memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
           memcpy(bucket_cpy, bucket_tmp, bucket_size);
           probe = old_probe + 1;
           hashed_key = hasher(&bucket_cpy[1], keysize);
@@ -415,165 +668,560 @@ RHHUpsertPushDown(RobinHoodHash* rhh, OPHash hasher,
     }
 }
 
-static bool
-RHHSizeUp(RobinHoodHash* rhh, OPHash hasher)
+static void
+RHHMigrateBuckets(RobinHoodHash* rhh, OPHash hasher, uint64_t nbuckets)
 {
   const size_t keysize = rhh->keysize;
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = keysize + valsize + 1;
-  const size_t large_data_threshold = rhh->large_data_threshold;
   uint8_t* old_buckets;
-  uint8_t* new_buckets;
-  uint8_t new_capacity_ms4b, new_capacity_clz;
-  uint64_t old_capacity, new_capacity;
+  uint8_t bucket_cpy[bucket_size];
+  uint64_t idx;
   bool resized;
 
-  old_capacity = RHHCapacity(rhh);
-  old_buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
-
-  if (old_capacity * bucket_size >= large_data_threshold)
+  while (rhh->old_bucket_ref && nbuckets--)
     {
-      // increase size by 20% ~ 33%
-      switch(rhh->capacity_ms4b)
+      old_buckets = OPRef2Ptr(rhh, rhh->old_bucket_ref);
+      idx = rhh->migrate_idx++;
+      if (bucket_occupied(old_buckets[idx * bucket_size]))
         {
-        case 8:
-          new_capacity_ms4b = 10;
-          new_capacity_clz = rhh->capacity_clz;
-          break;
-        case 9:
-        case 10:
-          new_capacity_ms4b = 12;
-          new_capacity_clz = rhh->capacity_clz;
-          break;
-        case 11:
-        case 12:
-          new_capacity_ms4b = 14;
-          new_capacity_clz = rhh->capacity_clz;
-          break;
-        case 13:
-        case 14:
-          new_capacity_ms4b = 8;
-          new_capacity_clz = rhh->capacity_clz - 1;
-          break;
-        case 15:
-          new_capacity_ms4b = 10;
-          new_capacity_clz = rhh->capacity_clz - 1;
-          break;
-        default: op_assert(false, "Unknown capacity_ms4b %d\n",
-                           rhh->capacity_ms4b);
+          // Retire the old bucket before pushing it down. A resize
+          // nested in RHHUpsertPushDown drains the rest of the old
+          // array and must not see this entry twice.
+          memcpy(bucket_cpy, &old_buckets[idx * bucket_size], bucket_size);
+          old_buckets[idx * bucket_size] = 2;
+          rhh->objcnt--;
+          RHHUpsertPushDown(rhh, hasher, bucket_cpy, 0, NULL, &resized);
         }
-    }
-  else
-    {
-      new_capacity_ms4b = 8;
-      new_capacity_clz = rhh->capacity_ms4b == 8 ?
-        rhh->capacity_clz - 1 : rhh->capacity_clz - 2;
-    }
-  new_capacity = RHHCapacityInternal(new_capacity_clz, new_capacity_ms4b);
-  OP_LOG_INFO(logger, "Resize from %" PRIu64 " to %" PRIu64,
-              old_capacity, new_capacity);
-
-  new_buckets = OPCalloc(ObtainOPHeap(rhh), 1, bucket_size * new_capacity);
-  if (!new_buckets)
-    {
-      OP_LOG_ERROR(logger, "Cannot obtain new bucket for size %" PRIu64,
-                   new_capacity);
-      return false;
-    }
-
-  rhh->objcnt = 0;
-  rhh->objcnt_high = new_capacity * 8 / 10;
-  rhh->objcnt_low = new_capacity * 2 / 10;
-  rhh->capacity_clz = new_capacity_clz;
-  rhh->capacity_ms4b = new_capacity_ms4b;
-  rhh->longest_probes = 0;
-  memset(rhh->stats, 0x00, sizeof(uint32_t) * PROBE_STATS_SIZE);
-  rhh->bucket_ref = OPPtr2Ref(new_buckets);
-
-  for (uint64_t idx = 0; idx < old_capacity; idx++)
-    {
-      if (old_buckets[idx*bucket_size] == 1)
+      if (rhh->old_bucket_ref &&
+          rhh->migrate_idx == RHHCapacityInternal(rhh->old_capacity_clz,
+                                                  rhh->old_capacity_ms4b))
         {
-          RHHUpsertPushDown(rhh, hasher, &old_buckets[idx * bucket_size],
-                            0, NULL, &resized);
+          OPDealloc(OPRef2Ptr(rhh, rhh->old_bucket_ref));
+          rhh->old_bucket_ref = 0;
+          rhh->migrate_idx = 0;
         }
     }
-  OPDealloc(old_buckets);
-  return true;
 }
 
-static bool
-RHHSizeDown(RobinHoodHash* rhh, OPHash hasher)
+/*
+ * Parallel rehash.
+ *
+ * Both bucket arrays are indexed by a hash masked to their own number
+ * of bits and scaled by capacity_ms4b/16. Let lowbits be the smaller
+ * of the two mask widths. Every hash value whose bits
+ * [lowbits - part_bits, lowbits) equal K forms a handful of contiguous
+ * ranges in both arrays, and the ranges of different K are disjoint.
+ * Each worker claims a prefix K, scans the old buckets of K and
+ * inserts their entries into the new buckets of K. Entries that were
+ * displaced across a boundary in the old array, or whose probe
+ * sequence leaves the new buckets of K, are set aside and inserted by
+ * the calling thread once all workers are done.
+ */
+struct RHHRehashTask
 {
-  const size_t keysize = rhh->keysize;
-  const size_t valsize = rhh->valsize;
-  const size_t bucket_size = keysize + valsize + 1;
+  RobinHoodHash* rhh;
+  OPHash hasher;
   uint8_t* old_buckets;
   uint8_t* new_buckets;
-  uint8_t new_capacity_ms4b, new_capacity_clz;
-  uint64_t old_capacity, new_capacity;
-  bool resized;
+  int old_bits;
+  uint8_t old_capacity_ms4b;
+  int low_bits;
+  int part_bits;
+  a_uint32_t next_part;
+  // RHHBuild stages its entries in old_buckets grouped by part; the
+  // entries of part K are at [part_start[K], part_start[K + 1]).
+  uint64_t* part_start;
+};
 
-  old_capacity = RHHCapacity(rhh);
-  old_buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
-  op_assert(old_capacity > 16,
-            "Can not resize smaller than 16, but got old_capacity %"
-            PRIu64 "\n", old_capacity);
+struct RHHRehashWorker
+{
+  struct RHHRehashTask* task;
+  uint64_t objcnt;
+  int longest_probes;
+  uint32_t stats[PROBE_STATS_SIZE];
+  uint8_t* deferred;
+  size_t deferred_cnt;
+  size_t deferred_cap;
+};
 
-  switch(rhh->capacity_ms4b)
-    {
-    case 8:  // new load 0.45
-    case 9:  // new load 0.50
-    case 10: // new load 0.55
-    case 11: // new load 0.60
-      new_capacity_ms4b = 8;
-      new_capacity_clz = rhh->capacity_clz + 1;
-      break;
-    case 12: // new load 0.40
-    case 13: // new load 0.43
-    case 14: // new load 0.46
-    case 15: // new load 0.50
-      new_capacity_ms4b = 12;
-      new_capacity_clz = rhh->capacity_clz + 1;
-      break;
-    default: op_assert(false, "Unknown capacity_ms4b %d\n",
-                       rhh->capacity_ms4b);
-    }
+static inline uint32_t
+RehashPart(struct RHHRehashTask* task, uint64_t masked_hash)
+{
+  return (masked_hash >> (task->low_bits - task->part_bits)) &
+    ((1U << task->part_bits) - 1);
+}
 
-  new_capacity = RHHCapacityInternal(new_capacity_clz, new_capacity_ms4b);
-  OP_LOG_INFO(logger, "Resize from %" PRIu64 " to %" PRIu64,
-              old_capacity, new_capacity);
-  new_buckets = OPCalloc(ObtainOPHeap(rhh), 1, bucket_size * new_capacity);
-  if (!new_buckets)
-    {
-      OP_LOG_ERROR(logger, "Cannot obtain new bucket for size %" PRIu64,
-                   new_capacity);
-      return false;
-    }
+static inline bool
+RehashOwnsNewIdx(struct RHHRehashTask* task, uint32_t part, uintptr_t idx)
+{
+  // The smallest masked hash mapping to idx decides the owner.
+  return RehashPart(task, round_up_div(16 * idx,
+                                       task->rhh->capacity_ms4b)) == part;
+}
 
-  rhh->objcnt = 0;
-  rhh->objcnt_high = new_capacity * 8 / 10;
-  rhh->objcnt_low = new_capacity * 2 / 10;
-  rhh->capacity_clz = new_capacity_clz;
-  rhh->capacity_ms4b = new_capacity_ms4b;
-  rhh->longest_probes = 0;
-  memset(rhh->stats, 0x00, sizeof(uint32_t) * PROBE_STATS_SIZE);
-  rhh->bucket_ref = OPPtr2Ref(new_buckets);
+static void
+RehashDefer(struct RHHRehashWorker* worker, uint8_t* bucket)
+{
+  const size_t bucket_size =
+    worker->task->rhh->keysize + worker->task->rhh->valsize + 1;
 
-  for (uint64_t idx = 0; idx < old_capacity; idx++)
+  if (worker->deferred_cnt == worker->deferred_cap)
     {
-      if (old_buckets[idx*bucket_size] == 1)
-        {
-          RHHUpsertPushDown(rhh, hasher, &old_buckets[idx * bucket_size],
-                            0, NULL, &resized);
-        }
+      worker->deferred_cap = worker->deferred_cap ?
+        worker->deferred_cap * 2 : 64;
+      worker->deferred = realloc(worker->deferred,
+                                 worker->deferred_cap * bucket_size);
+      op_assert(worker->deferred,
+                "Cannot allocate %zu deferred buckets\n",
+                worker->deferred_cap);
     }
-  OPDealloc(old_buckets);
-  return true;
+  memcpy(&worker->deferred[worker->deferred_cnt * bucket_size],
+         bucket, bucket_size);
+  worker->deferred_cnt++;
 }
 
-static inline
-bool RHHPreHashInsertCustom(RobinHoodHash* rhh, OPHash hasher,
+static inline int
+RehashFindProbe(struct RHHRehashWorker* worker, uintptr_t idx)
+{
+  RobinHoodHash* rhh = worker->task->rhh;
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  uint8_t* const buckets = worker->task->new_buckets;
+  uint64_t hashed_key;
+
+  if ((buckets[idx*bucket_size] & PROBE_UNKNOWN) != PROBE_UNKNOWN)
+    return buckets[idx*bucket_size] & PROBE_UNKNOWN;
+
+  hashed_key = worker->task->hasher(&buckets[idx*bucket_size + 1],
+                                    rhh->keysize);
+  for (int i = 0; i <= worker->longest_probes; i++)
+    {
+      if (hash_with_probe(rhh, hashed_key, i) == idx)
+        return i;
+    }
+  return -1;
+}
+
+static void
+RehashBucket(struct RHHRehashWorker* worker, uint32_t part, uint8_t* bucket)
+{
+  RobinHoodHash* rhh = worker->task->rhh;
+  const size_t keysize = rhh->keysize;
+  const size_t bucket_size = keysize + rhh->valsize + 1;
+  uint8_t* const buckets = worker->task->new_buckets;
+  uint8_t bucket_cpy[bucket_size], bucket_tmp[bucket_size];
+  uint64_t hashed_key;
+  uintptr_t idx;
+  int probe, old_probe;
+
+  memcpy(bucket_cpy, bucket, bucket_size);
+  hashed_key = worker->task->hasher(&bucket_cpy[1], keysize);
+  // Entry displaced from another prefix in the old array.
+  if (RehashPart(worker->task, hashed_key) != part)
+    {
+      RehashDefer(worker, bucket_cpy);
+      return;
+    }
+
+  probe = 0;
+  // Bound the swaps as well; the scaled probe sequence may revisit a
+  // bucket and RHHUpsertPushDown is better equipped to break cycles.
+  for (int iter = 0; iter < PROBE_STATS_SIZE * 4; iter++)
+    {
+      if (probe >= PROBE_STATS_SIZE)
+        break;
+      idx = hash_with_probe(rhh, hashed_key, probe);
+      if (!RehashOwnsNewIdx(worker->task, part, idx))
+        break;
+      if (buckets[idx * bucket_size] == 0)
+        {
+          memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
+          worker->objcnt++;
+          worker->stats[probe]++;
+          if (probe > worker->longest_probes)
+            worker->longest_probes = probe;
+          return;
+        }
+      old_probe = RehashFindProbe(worker, idx);
+      if (probe > old_probe)
+        {
+          worker->stats[old_probe]--;
+          worker->stats[probe]++;
+          if (probe > worker->longest_probes)
+            worker->longest_probes = probe;
+          memcpy(bucket_tmp, &buckets[idx * bucket_size], bucket_size);
+          memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
+          memcpy(bucket_cpy, bucket_tmp, bucket_size);
+          probe = old_probe + 1;
+          hashed_key = worker->task->hasher(&bucket_cpy[1], keysize);
+          continue;
+        }
+      probe++;
+    }
+  RehashDefer(worker, bucket_cpy);
+}
+
+static void*
+RehashWorker(void* arg)
+{
+  struct RHHRehashWorker* worker = arg;
+  struct RHHRehashTask* task = worker->task;
+  const size_t bucket_size =
+    task->rhh->keysize + task->rhh->valsize + 1;
+  const uint32_t parts = 1U << task->part_bits;
+  const uint64_t part_span = 1UL << (task->low_bits - task->part_bits);
+  const uint64_t repeats = 1UL << (task->old_bits - task->low_bits);
+  uint64_t hash_lo, hash_hi, idx_lo, idx_hi;
+  uint32_t part;
+
+  while ((part = atomic_fetch_add_explicit(&task->next_part, 1,
+                                           memory_order_relaxed)) < parts)
+    {
+      for (uint64_t rep = 0; rep < repeats; rep++)
+        {
+          hash_lo = (rep << task->low_bits) | (part * part_span);
+          hash_hi = hash_lo + part_span;
+          // Old buckets whose smallest masked hash lies in the range.
+          idx_lo = hash_lo ?
+            ((hash_lo - 1) * task->old_capacity_ms4b >> 4) + 1 : 0;
+          idx_hi = ((hash_hi - 1) * task->old_capacity_ms4b >> 4) + 1;
+          for (uint64_t idx = idx_lo; idx < idx_hi; idx++)
+            {
+              if (bucket_occupied(task->old_buckets[idx * bucket_size]))
+                RehashBucket(worker, part,
+                             &task->old_buckets[idx * bucket_size]);
+            }
+        }
+    }
+  return NULL;
+}
+
+static void*
+BuildWorker(void* arg)
+{
+  struct RHHRehashWorker* worker = arg;
+  struct RHHRehashTask* task = worker->task;
+  const size_t bucket_size =
+    task->rhh->keysize + task->rhh->valsize + 1;
+  const uint32_t parts = 1U << task->part_bits;
+  uint32_t part;
+
+  while ((part = atomic_fetch_add_explicit(&task->next_part, 1,
+                                           memory_order_relaxed)) < parts)
+    {
+      for (uint64_t i = task->part_start[part];
+           i < task->part_start[part + 1]; i++)
+        RehashBucket(worker, part, &task->old_buckets[i * bucket_size]);
+    }
+  return NULL;
+}
+
+/*
+ * Runs work on nthreads workers, the calling thread being one of them,
+ * then folds their statistics into the table and inserts the entries
+ * they set aside.
+ */
+static void
+RehashRun(struct RHHRehashTask* task, int nthreads, void* (*work)(void*))
+{
+  RobinHoodHash* rhh = task->rhh;
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  struct RHHRehashWorker workers[nthreads];
+  pthread_t threads[nthreads];
+  bool started[nthreads];
+  bool resized;
+
+  atomic_init(&task->next_part, 0);
+  memset(workers, 0x00, sizeof(workers));
+  for (int i = 0; i < nthreads; i++)
+    workers[i].task = task;
+  // The calling thread works as worker 0. If a thread cannot be
+  // started the remaining workers pick up its share.
+  for (int i = 1; i < nthreads; i++)
+    started[i] = !pthread_create(&threads[i], NULL, work, &workers[i]);
+  work(&workers[0]);
+  for (int i = 1; i < nthreads; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < nthreads; i++)
+    {
+      rhh->objcnt += workers[i].objcnt;
+      for (int p = 0; p < PROBE_STATS_SIZE; p++)
+        rhh->stats[p] += workers[i].stats[p];
+      if (workers[i].longest_probes > rhh->longest_probes)
+        rhh->longest_probes = workers[i].longest_probes;
+    }
+  for (int i = 0; i < nthreads; i++)
+    {
+      for (size_t j = 0; j < workers[i].deferred_cnt; j++)
+        RHHUpsertPushDown(rhh, task->hasher,
+                          &workers[i].deferred[j * bucket_size],
+                          0, NULL, &resized);
+      free(workers[i].deferred);
+    }
+}
+
+static void
+RHHParallelRehash(RobinHoodHash* rhh, OPHash hasher, uint8_t* old_buckets,
+                  uint8_t old_capacity_clz, uint8_t old_capacity_ms4b)
+{
+  struct RHHRehashTask task;
+  int new_bits;
+
+  task.rhh = rhh;
+  task.hasher = hasher;
+  task.old_buckets = old_buckets;
+  task.new_buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  task.old_bits = 64 - old_capacity_clz;
+  task.old_capacity_ms4b = old_capacity_ms4b;
+  new_bits = 64 - rhh->capacity_clz;
+  task.low_bits = new_bits < task.old_bits ? new_bits : task.old_bits;
+  task.part_bits = task.low_bits - PARALLEL_REHASH_MIN_BITS;
+  if (task.part_bits > PARALLEL_REHASH_PART_BITS)
+    task.part_bits = PARALLEL_REHASH_PART_BITS;
+  task.part_start = NULL;
+  RehashRun(&task, rhh->resize_threads, RehashWorker);
+}
+
+bool
+RHHBuildCustom(OPHeap* heap, RobinHoodHash** rhh, OPHash hasher,
+               void* keys, void* vals, uint64_t num_objects, double load,
+               size_t keysize, size_t valsize, unsigned int nthreads)
+{
+  const size_t bucket_size = keysize + valsize + 1;
+  struct RHHRehashTask task;
+  uint32_t parts;
+  uint64_t next[1 << PARALLEL_REHASH_PART_BITS];
+  uint8_t* key_parts;
+  uint8_t* staged;
+  uint8_t* bucket;
+
+  if (!RHHNew(heap, rhh, num_objects, load, keysize, valsize))
+    return false;
+  // The non-Custom APIs must probe with the hash the table is built
+  // with, or refuse when it is not one they know.
+  (*rhh)->hash_id = OPHashToId(hasher, keysize);
+  if (!num_objects)
+    return true;
+
+  task.rhh = *rhh;
+  task.hasher = hasher;
+  task.new_buckets = OPRef2Ptr(*rhh, (*rhh)->bucket_ref);
+  task.old_bits = 64 - (*rhh)->capacity_clz;
+  task.old_capacity_ms4b = (*rhh)->capacity_ms4b;
+  task.low_bits = task.old_bits;
+  task.part_bits = task.low_bits - PARALLEL_REHASH_MIN_BITS;
+  if (task.part_bits > PARALLEL_REHASH_PART_BITS)
+    task.part_bits = PARALLEL_REHASH_PART_BITS;
+  if (task.part_bits < 0)
+    task.part_bits = 0;
+  parts = 1U << task.part_bits;
+
+  key_parts = malloc(num_objects);
+  staged = malloc(num_objects * bucket_size);
+  task.part_start = calloc(parts + 1, sizeof(uint64_t));
+  op_assert(key_parts && staged && task.part_start,
+            "Cannot allocate %" PRIu64 " staged buckets\n", num_objects);
+
+  // Counting sort by hash prefix, so that each part fills its own
+  // region of the bucket array from a contiguous run of entries.
+  for (uint64_t i = 0; i < num_objects; i++)
+    {
+      key_parts[i] = RehashPart(&task, hasher((uint8_t*)keys + i * keysize,
+                                              keysize));
+      task.part_start[key_parts[i] + 1]++;
+    }
+  for (uint32_t part = 0; part < parts; part++)
+    task.part_start[part + 1] += task.part_start[part];
+  memcpy(next, task.part_start, parts * sizeof(uint64_t));
+  for (uint64_t i = 0; i < num_objects; i++)
+    {
+      bucket = &staged[next[key_parts[i]]++ * bucket_size];
+      bucket[0] = 0;
+      memcpy(&bucket[1], (uint8_t*)keys + i * keysize, keysize);
+      if (valsize)
+        memcpy(&bucket[1 + keysize], (uint8_t*)vals + i * valsize,
+               valsize);
+    }
+  free(key_parts);
+
+  task.old_buckets = staged;
+  if (nthreads > parts)
+    nthreads = parts;
+  if (nthreads > PARALLEL_REHASH_MAX_THREADS)
+    nthreads = PARALLEL_REHASH_MAX_THREADS;
+  RehashRun(&task, nthreads ? nthreads : 1, BuildWorker);
+  free(staged);
+  free(task.part_start);
+  return true;
+}
+
+static bool
+RHHRebucket(RobinHoodHash* rhh, OPHash hasher,
+            uint8_t new_capacity_clz, uint8_t new_capacity_ms4b,
+            bool incremental)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  const size_t bucket_size = keysize + valsize + 1;
+  uint8_t* old_buckets;
+  uint8_t* new_buckets;
+  uint8_t old_capacity_clz, old_capacity_ms4b;
+  uint64_t old_capacity, new_capacity;
+  bool resized;
+
+  // Only one incremental resize can be in flight. Modifications defer
+  // resizes until the migration is done; only a probe sequence that
+  // overflows PROBE_STATS_SIZE still gets here with one in flight.
+  RHHMigrateBuckets(rhh, hasher, UINT64_MAX);
+
+  old_capacity = RHHCapacity(rhh);
+  old_capacity_clz = rhh->capacity_clz;
+  old_capacity_ms4b = rhh->capacity_ms4b;
+  old_buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  new_capacity = RHHCapacityInternal(new_capacity_clz, new_capacity_ms4b);
+  OP_LOG_INFO(logger, "Resize from %" PRIu64 " to %" PRIu64,
+              old_capacity, new_capacity);
+
+  new_buckets = OPCalloc(ObtainOPHeap(rhh), 1,
+                         BucketArraySize(bucket_size, new_capacity,
+                                         rhh->tagged));
+  if (!new_buckets)
+    {
+      OP_LOG_ERROR(logger, "Cannot obtain new bucket for size %" PRIu64,
+                   new_capacity);
+      return false;
+    }
+
+  if (incremental)
+    {
+      rhh->old_capacity_clz = rhh->capacity_clz;
+      rhh->old_capacity_ms4b = rhh->capacity_ms4b;
+      rhh->old_longest_probes = rhh->longest_probes;
+      rhh->migrate_idx = 0;
+      rhh->old_bucket_ref = rhh->bucket_ref;
+    }
+  else
+    rhh->objcnt = 0;
+  rhh->objcnt_high = new_capacity * 8 / 10;
+  rhh->objcnt_low = new_capacity * 2 / 10;
+  rhh->capacity_clz = new_capacity_clz;
+  rhh->capacity_ms4b = new_capacity_ms4b;
+  rhh->longest_probes = 0;
+  memset(rhh->stats, 0x00, sizeof(uint32_t) * PROBE_STATS_SIZE);
+  rhh->bucket_ref = OPPtr2Ref(new_buckets);
+  rhh->resizes++;
+
+  if (incremental)
+    return true;
+
+  if (rhh->resize_threads > 1 && old_capacity >= PARALLEL_REHASH_THRESHOLD)
+    {
+      RHHParallelRehash(rhh, hasher, old_buckets,
+                        old_capacity_clz, old_capacity_ms4b);
+      OPDealloc(old_buckets);
+      return true;
+    }
+
+  for (uint64_t idx = 0; idx < old_capacity; idx++)
+    {
+      if (bucket_occupied(old_buckets[idx*bucket_size]))
+        {
+          RHHUpsertPushDown(rhh, hasher, &old_buckets[idx * bucket_size],
+                            0, NULL, &resized);
+        }
+    }
+  OPDealloc(old_buckets);
+  return true;
+}
+
+static bool
+RHHSizeUp(RobinHoodHash* rhh, OPHash hasher, bool incremental)
+{
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  const size_t large_data_threshold = rhh->large_data_threshold;
+  uint8_t new_capacity_ms4b, new_capacity_clz;
+
+  if (RHHCapacity(rhh) * bucket_size >= large_data_threshold)
+    {
+      // increase size by 20% ~ 33%
+      switch(rhh->capacity_ms4b)
+        {
+        case 8:
+          new_capacity_ms4b = 10;
+          new_capacity_clz = rhh->capacity_clz;
+          break;
+        case 9:
+        case 10:
+          new_capacity_ms4b = 12;
+          new_capacity_clz = rhh->capacity_clz;
+          break;
+        case 11:
+        case 12:
+          new_capacity_ms4b = 14;
+          new_capacity_clz = rhh->capacity_clz;
+          break;
+        case 13:
+        case 14:
+          new_capacity_ms4b = 8;
+          new_capacity_clz = rhh->capacity_clz - 1;
+          break;
+        case 15:
+          new_capacity_ms4b = 10;
+          new_capacity_clz = rhh->capacity_clz - 1;
+          break;
+        default: op_assert(false, "Unknown capacity_ms4b %d\n",
+                           rhh->capacity_ms4b);
+        }
+    }
+  else
+    {
+      new_capacity_ms4b = 8;
+      new_capacity_clz = rhh->capacity_ms4b == 8 ?
+        rhh->capacity_clz - 1 : rhh->capacity_clz - 2;
+    }
+  return RHHRebucket(rhh, hasher, new_capacity_clz, new_capacity_ms4b,
+                     incremental);
+}
+
+static bool
+RHHSizeDown(RobinHoodHash* rhh, OPHash hasher, bool incremental)
+{
+  uint8_t new_capacity_ms4b, new_capacity_clz;
+
+  op_assert(RHHCapacity(rhh) > 16,
+            "Can not resize smaller than 16, but got old_capacity %"
+            PRIu64 "\n", RHHCapacity(rhh));
+
+  switch(rhh->capacity_ms4b)
+    {
+    case 8:  // new load 0.45
+    case 9:  // new load 0.50
+    case 10: // new load 0.55
+    case 11: // new load 0.60
+      new_capacity_ms4b = 8;
+      new_capacity_clz = rhh->capacity_clz + 1;
+      break;
+    case 12: // new load 0.40
+    case 13: // new load 0.43
+    case 14: // new load 0.46
+    case 15: // new load 0.50
+      new_capacity_ms4b = 12;
+      new_capacity_clz = rhh->capacity_clz + 1;
+      break;
+    default: op_assert(false, "Unknown capacity_ms4b %d\n",
+                       rhh->capacity_ms4b);
+    }
+  return RHHRebucket(rhh, hasher, new_capacity_clz, new_capacity_ms4b,
+                     incremental);
+}
+
+bool RHHPreHashInsertCustom(RobinHoodHash* rhh, OPHash hasher,
                             uint64_t hashed_key, void* key, void* val)
 {
   const size_t keysize = rhh->keysize;
@@ -585,9 +1233,9 @@ bool RHHPreHashInsertCustom(RobinHoodHash* rhh, OPHash hasher,
   uint8_t bucket_cpy[bucket_size];
   bool resized;
 
-  if (rhh->objcnt > rhh->objcnt_high)
+  if (rhh->objcnt > rhh->objcnt_high && !rhh->old_bucket_ref)
     {
-      if(!RHHSizeUp(rhh, hasher))
+      if(!RHHSizeUp(rhh, hasher, rhh->incremental_resize))
         return false;
     }
 
@@ -597,7 +1245,6 @@ bool RHHPreHashInsertCustom(RobinHoodHash* rhh, OPHash hasher,
   switch (upsert_result)
     {
     case UPSERT_EMPTY:
-      *matched_bucket = 1;
       memcpy(&matched_bucket[1], key, keysize);
     case UPSERT_DUP:
       memcpy(&matched_bucket[1 + keysize], val, valsize);
@@ -615,30 +1262,31 @@ bool RHHPreHashInsertCustom(RobinHoodHash* rhh, OPHash hasher,
 bool RHHInsertCustom(RobinHoodHash* rhh, OPHash hasher, void* key, void* val)
 {
   uint64_t hashed_key;
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
   hashed_key = hasher(key, rhh->keysize);
   return RHHPreHashInsertCustom(rhh, hasher, hashed_key, key, val);
 }
 
-bool RHHUpsertCustom(RobinHoodHash* rhh, OPHash hasher,
-                     void* key, void** val_ref, bool* is_duplicate)
+static bool
+RHHPreHashUpsertCustom(RobinHoodHash* rhh, OPHash hasher, uint64_t hashed_key,
+                       void* key, void** val_ref, bool* is_duplicate)
 {
   const size_t keysize = rhh->keysize;
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = keysize + valsize + 1;
   enum upsert_result_t upsert_result;
-  uint64_t hashed_key;
   uint8_t* matched_bucket;
   int probe;
   uint8_t bucket_cpy[bucket_size];
   bool resized;
 
-  if (rhh->objcnt > rhh->objcnt_high)
+  if (rhh->objcnt > rhh->objcnt_high && !rhh->old_bucket_ref)
     {
-      if (!RHHSizeUp(rhh, hasher))
+      if (!RHHSizeUp(rhh, hasher, rhh->incremental_resize))
         return false;
     }
 
-  hashed_key = hasher(key, keysize);
   upsert_result = RHHUpsertNewKey(rhh, hasher, hashed_key, key,
                                   &matched_bucket, &probe);
   *val_ref = &matched_bucket[keysize + 1];
@@ -646,7 +1294,6 @@ bool RHHUpsertCustom(RobinHoodHash* rhh, OPHash hasher,
     {
     case UPSERT_EMPTY:
       *is_duplicate = false;
-      *matched_bucket = 1;
       memcpy(&matched_bucket[1], key, keysize);
       break;
     case UPSERT_DUP:
@@ -666,6 +1313,72 @@ bool RHHUpsertCustom(RobinHoodHash* rhh, OPHash hasher,
   return true;
 }
 
+bool RHHUpsertCustom(RobinHoodHash* rhh, OPHash hasher,
+                     void* key, void** val_ref, bool* is_duplicate)
+{
+  uint64_t hashed_key;
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  hashed_key = hasher(key, rhh->keysize);
+  return RHHPreHashUpsertCustom(rhh, hasher, hashed_key,
+                                key, val_ref, is_duplicate);
+}
+
+/*
+ * Tag driven search. The first few quadratic probes land within
+ * TAG_GROUP buckets of the home bucket, so a single group load answers
+ * them with two compares. Later probes fall back to one tag byte each.
+ * Either way the bucket itself is only touched on a tag match.
+ */
+static inline bool
+TaggedSearchIdx(const uint8_t* buckets, const uint8_t* tags, size_t keysize,
+                size_t bucket_size, uint8_t capacity_clz,
+                uint8_t capacity_ms4b, int longest_probes,
+                uint64_t hashed_key, const void* key, uintptr_t* idx)
+{
+  const uint64_t mask = (1ULL << (64 - capacity_clz)) - 1;
+  const uint8_t tag = hash_tag(hashed_key);
+  uintptr_t home, offset;
+  uint32_t match, empty;
+
+  home = (hashed_key & mask) * capacity_ms4b >> 4;
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i*)&tags[home]);
+  match = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+  empty = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_setzero_si128()));
+#else
+  match = empty = 0;
+  for (int i = 0; i < TAG_GROUP; i++)
+    {
+      match |= (uint32_t)(tags[home + i] == tag) << i;
+      empty |= (uint32_t)(tags[home + i] == TAG_EMPTY) << i;
+    }
+#endif
+
+  for (int probe = 0; probe <= longest_probes; probe++)
+    {
+      *idx = ((hashed_key + probe * probe * 2) & mask) * capacity_ms4b >> 4;
+      offset = *idx - home;
+      if (offset < TAG_GROUP)
+        {
+          if (empty & (1U << offset))
+            return false;
+          if (!(match & (1U << offset)))
+            continue;
+        }
+      else
+        {
+          if (tags[*idx] == TAG_EMPTY)
+            return false;
+          if (tags[*idx] != tag)
+            continue;
+        }
+      if (!memcmp(key, &buckets[*idx*bucket_size + 1], keysize))
+        return true;
+    }
+  return false;
+}
+
 static inline bool
 RHHPreHashSearchIdx(RobinHoodHash* rhh, uint64_t hashed_key,
                     void* key, uintptr_t* idx)
@@ -675,6 +1388,11 @@ RHHPreHashSearchIdx(RobinHoodHash* rhh, uint64_t hashed_key,
   const size_t bucket_size = keysize + valsize + 1;
   uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
 
+  if (rhh->tagged)
+    return TaggedSearchIdx(buckets, bucket_tags(rhh, buckets), keysize,
+                           bucket_size, rhh->capacity_clz,
+                           rhh->capacity_ms4b, rhh->longest_probes,
+                           hashed_key, key, idx);
   for (int probe = 0; probe <= rhh->longest_probes; probe++)
     {
       *idx = hash_with_probe(rhh, hashed_key, probe);
@@ -690,57 +1408,190 @@ RHHPreHashSearchIdx(RobinHoodHash* rhh, uint64_t hashed_key,
   return false;
 }
 
-static inline bool
-RHHSearchIdx(RobinHoodHash* rhh, OPHash hasher, void* key, uintptr_t* idx)
-{
-  const size_t keysize = rhh->keysize;
-  uint64_t hashed_key;
-  hashed_key = hasher(key, keysize);
-  return RHHPreHashSearchIdx(rhh, hashed_key, key, idx);
-}
-
-void* RHHGetCustom(RobinHoodHash* rhh, OPHash hasher, void* key)
+static inline uint8_t*
+RHHPreHashSearchOldBucket(RobinHoodHash* rhh, uint64_t hashed_key, void* key)
 {
   const size_t keysize = rhh->keysize;
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = keysize + valsize + 1;
-  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uint8_t* buckets;
   uintptr_t idx;
-  if (RHHSearchIdx(rhh, hasher, key, &idx))
+
+  if (!rhh->old_bucket_ref)
+    return NULL;
+  buckets = OPRef2Ptr(rhh, rhh->old_bucket_ref);
+  for (int probe = 0; probe <= rhh->old_longest_probes; probe++)
     {
-      return &buckets[idx*bucket_size + keysize + 1];
+      idx = old_hash_with_probe(rhh, hashed_key, probe);
+      switch(buckets[idx*bucket_size])
+        {
+        case 0: return NULL;
+        case 2: continue;
+        default: (void)0;
+        }
+      if (!memcmp(key, &buckets[idx*bucket_size + 1], keysize))
+        return &buckets[idx*bucket_size];
     }
   return NULL;
 }
 
-static inline void*
-RHHPreHashDeleteCustom(RobinHoodHash* rhh, OPHash hasher,
-                       uint64_t hashed_key, void* key)
+/*
+ * Searches the current bucket array and, during an incremental resize,
+ * the old one. Returns the matched bucket or NULL.
+ */
+static inline uint8_t*
+RHHPreHashSearchBucket(RobinHoodHash* rhh, uint64_t hashed_key, void* key)
 {
-  /*
-   * This works for load that is not super high, i.e. < 0.9.
-   * It slows down the growth for both E[psl] and Var[psl], but only
-   * slows down, not bounding it.
-   */
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  const size_t bucket_size = keysize + valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uintptr_t idx;
+
+  if (RHHPreHashSearchIdx(rhh, hashed_key, key, &idx))
+    return &buckets[idx*bucket_size];
+  return RHHPreHashSearchOldBucket(rhh, hashed_key, key);
+}
+
+void* RHHGetCustom(RobinHoodHash* rhh, OPHash hasher, void* key)
+{
+  const size_t keysize = rhh->keysize;
+  uint8_t* bucket;
+
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  bucket = RHHPreHashSearchBucket(rhh, hasher(key, keysize), key);
+  if (bucket)
+    return &bucket[keysize + 1];
+  return NULL;
+}
+
+static inline bool
+RHHPreHashGetCopyFrom(RobinHoodHash* rhh, uint8_t capacity_clz,
+                      uint8_t capacity_ms4b, int longest_probes,
+                      opref_t bucket_ref, bool tagged, uint64_t hashed_key,
+                      void* key, void* val)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  const size_t bucket_size = keysize + valsize + 1;
+  uint64_t mask, capacity;
+  uint8_t* buckets;
+  uintptr_t idx;
+
+  // The geometry and the bucket array may still come from different
+  // resizes. Make sure the array it describes stays inside the heap.
+  capacity = RHHCapacityInternal(capacity_clz, capacity_ms4b);
+  if (capacity > OPHEAP_SIZE / (bucket_size + 1) ||
+      bucket_ref > OPHEAP_SIZE - BucketArraySize(bucket_size, capacity,
+                                                 tagged))
+    return false;
+  if (longest_probes > PROBE_STATS_SIZE)
+    longest_probes = PROBE_STATS_SIZE;
+
+  buckets = OPRef2Ptr(rhh, bucket_ref);
+  if (tagged)
+    {
+      if (!TaggedSearchIdx(buckets, &buckets[capacity * bucket_size],
+                           keysize, bucket_size, capacity_clz,
+                           capacity_ms4b, longest_probes,
+                           hashed_key, key, &idx))
+        return false;
+      memcpy(val, &buckets[idx*bucket_size + 1 + keysize], valsize);
+      return true;
+    }
+  mask = (1ULL << (64 - capacity_clz)) - 1;
+  for (int probe = 0; probe <= longest_probes; probe++)
+    {
+      // same probing sequence as hash_with_probe
+      idx = ((hashed_key + probe * probe * 2) & mask) * capacity_ms4b >> 4;
+      switch(buckets[idx*bucket_size])
+        {
+        case 0: return false;
+        case 2: continue;
+        default: (void)0;
+        }
+      if (!memcmp(key, &buckets[idx*bucket_size + 1], keysize))
+        {
+          memcpy(val, &buckets[idx*bucket_size + 1 + keysize], valsize);
+          return true;
+        }
+    }
+  return false;
+}
+
+bool
+RHHPreHashGetCopy(RobinHoodHash* rhh, uint64_t hashed_key,
+                  void* key, void* val)
+{
+  opref_t bucket_ref;
+
+  // A writer may be swapping these fields under our feet. Read each
+  // of them exactly once so that every index we compute belongs to a
+  // table geometry that actually existed.
+  if (RHHPreHashGetCopyFrom
+      (rhh,
+       __atomic_load_n(&rhh->capacity_clz, __ATOMIC_RELAXED),
+       __atomic_load_n(&rhh->capacity_ms4b, __ATOMIC_RELAXED),
+       __atomic_load_n(&rhh->longest_probes, __ATOMIC_RELAXED),
+       __atomic_load_n(&rhh->bucket_ref, __ATOMIC_RELAXED),
+       rhh->tagged, hashed_key, key, val))
+    return true;
+
+  bucket_ref = __atomic_load_n(&rhh->old_bucket_ref, __ATOMIC_RELAXED);
+  if (!bucket_ref)
+    return false;
+  return RHHPreHashGetCopyFrom
+    (rhh,
+     __atomic_load_n(&rhh->old_capacity_clz, __ATOMIC_RELAXED),
+     __atomic_load_n(&rhh->old_capacity_ms4b, __ATOMIC_RELAXED),
+     __atomic_load_n(&rhh->old_longest_probes, __ATOMIC_RELAXED),
+     bucket_ref, false, hashed_key, key, val);
+}
+
+void*
+RHHPreHashDeleteCustom(RobinHoodHash* rhh, OPHash hasher,
+                       uint64_t hashed_key, void* key)
+{
+  /*
+   * This works for load that is not super high, i.e. < 0.9.
+   * It slows down the growth for both E[psl] and Var[psl], but only
+   * slows down, not bounding it.
+   */
   const size_t keysize = rhh->keysize;
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = keysize + valsize + 1;
   uint8_t* buckets;
+  uint8_t* old_bucket;
+  uint8_t flag;
   uintptr_t idx, premod_idx, candidate_idx;
+  uint64_t candidate_hash;
   uintptr_t mask;
   int candidates;
   int record_probe;
   uint8_t bucket_tmp[bucket_size];
 
   if (rhh->objcnt < rhh->objcnt_low &&
-      rhh->objcnt > 16)
+      rhh->objcnt > 16 && !rhh->old_bucket_ref)
     {
-      if (!RHHSizeDown(rhh, hasher))
+      if (!RHHSizeDown(rhh, hasher, rhh->incremental_resize))
         return NULL;
     }
 
+  if (rhh->old_bucket_ref)
+    RHHMigrateBuckets(rhh, hasher, RHHMigrateStep(rhh));
+
   if (!RHHPreHashSearchIdx(rhh, hashed_key, key, &idx))
-    return NULL;
+    {
+      // Entries still waiting in the old array are simply retired;
+      // the old array does not keep probe statistics.
+      old_bucket = RHHPreHashSearchOldBucket(rhh, hashed_key, key);
+      if (!old_bucket)
+        return NULL;
+      *old_bucket = 2;
+      rhh->objcnt--;
+      return &old_bucket[1 + keysize];
+    }
 
   buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   mask = (1ULL << (64 - rhh->capacity_clz)) - 1;
@@ -786,15 +1637,17 @@ RHHPreHashDeleteCustom(RobinHoodHash* rhh, OPHash hasher,
               candidate_idx =
                 ((premod_idx + candidate + (probe + 1)*(probe + 1)*2
                   - probe*probe*2) & mask) * rhh->capacity_ms4b >> 4;
-              if (buckets[candidate_idx * bucket_size] == 1 &&
-                  hash_with_probe(rhh,
-                                  hasher(&buckets[candidate_idx*bucket_size+1],
-                                         keysize),
-                                  probe + 1) == candidate_idx &&
-                  hash_with_probe(rhh,
-                                  hasher(&buckets[candidate_idx*bucket_size+1],
-                                         keysize),
-                                  probe) == idx)
+              flag = buckets[candidate_idx * bucket_size];
+              // Only re-hash candidates whose recorded probe matches.
+              if (!bucket_occupied(flag) ||
+                  ((flag & PROBE_UNKNOWN) != PROBE_UNKNOWN &&
+                   (flag & PROBE_UNKNOWN) != probe + 1))
+                continue;
+              candidate_hash =
+                hasher(&buckets[candidate_idx*bucket_size+1], keysize);
+              if (hash_with_probe(rhh, candidate_hash, probe + 1) ==
+                  candidate_idx &&
+                  hash_with_probe(rhh, candidate_hash, probe) == idx)
                 {
                   if (probe + 1 < PROBE_STATS_SIZE)
                     rhh->stats[probe + 1]--;
@@ -811,6 +1664,8 @@ RHHPreHashDeleteCustom(RobinHoodHash* rhh, OPHash hasher,
                   memcpy(&buckets[idx*bucket_size],
                          &buckets[candidate_idx*bucket_size],
                          bucket_size);
+                  buckets[idx*bucket_size] = bucket_flag(probe);
+                  SetTag(rhh, idx, hash_tag(candidate_hash));
                   memcpy(&buckets[candidate_idx * bucket_size],
                          bucket_tmp, bucket_size);
                   idx = candidate_idx;
@@ -824,27 +1679,355 @@ RHHPreHashDeleteCustom(RobinHoodHash* rhh, OPHash hasher,
 
  end_iter:
   buckets[idx*bucket_size] = 2;
+  SetTag(rhh, idx, TAG_TOMBSTONE);
   return &buckets[idx*bucket_size + 1 + keysize];
 }
 
 void* RHHDeleteCustom(RobinHoodHash* rhh, OPHash hasher, void* key)
 {
   uint64_t hashed_key;
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
   hashed_key = hasher(key, rhh->keysize);
   return RHHPreHashDeleteCustom(rhh, hasher, hashed_key, key);
 }
 
-void RHHIterate(RobinHoodHash* rhh, OPHashIterator iterator, void* context)
+/*
+ * Moves an entry of the current bucket array to the first tombstone
+ * on its probe sequence, if any comes before the bucket it is in.
+ * Lookups skip tombstones, so the entry stays reachable.
+ */
+static void
+RHHCompactBucket(RobinHoodHash* rhh, OPHash hasher, uintptr_t idx)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t bucket_size = keysize + rhh->valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uint64_t hashed_key;
+  uintptr_t target_idx;
+  int record_probe;
+
+  record_probe = findprobe(rhh, hasher, idx);
+  if (record_probe <= 0)
+    return;
+  hashed_key = hasher(&buckets[idx*bucket_size + 1], keysize);
+  for (int probe = 0; probe < record_probe; probe++)
+    {
+      target_idx = hash_with_probe(rhh, hashed_key, probe);
+      if (buckets[target_idx*bucket_size] != 2)
+        continue;
+      if (record_probe < PROBE_STATS_SIZE)
+        rhh->stats[record_probe]--;
+      rhh->stats[probe]++;
+      memcpy(&buckets[target_idx*bucket_size],
+             &buckets[idx*bucket_size], bucket_size);
+      buckets[target_idx*bucket_size] = bucket_flag(probe);
+      SetTag(rhh, target_idx, hash_tag(hashed_key));
+      buckets[idx*bucket_size] = 2;
+      SetTag(rhh, idx, TAG_TOMBSTONE);
+      return;
+    }
+}
+
+uint64_t RHHDeleteIfCustom(RobinHoodHash* rhh, OPHash hasher,
+                           OPHashPredicate predicate, void* context)
 {
   const size_t keysize = rhh->keysize;
   const size_t valsize = rhh->valsize;
   const size_t bucket_size = keysize + valsize + 1;
-  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
-  uint64_t capacity = RHHCapacity(rhh);
+  const uint64_t capacity = RHHCapacity(rhh);
+  uint8_t* buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uint64_t old_capacity, deleted;
+  int record_probe;
+
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  deleted = 0;
+  for (uint64_t idx = 0; idx < capacity; idx++)
+    {
+      if (!bucket_occupied(buckets[idx*bucket_size]) ||
+          !predicate(&buckets[idx*bucket_size + 1],
+                     &buckets[idx*bucket_size + 1 + keysize],
+                     keysize, valsize, context))
+        continue;
+      record_probe = findprobe(rhh, hasher, idx);
+      if (record_probe >= 0 && record_probe < PROBE_STATS_SIZE)
+        rhh->stats[record_probe]--;
+      buckets[idx*bucket_size] = 2;
+      SetTag(rhh, idx, TAG_TOMBSTONE);
+      deleted++;
+    }
+
+  // As in RHHPreHashDeleteCustom, entries waiting in the old array of
+  // an incremental resize are simply retired.
+  if (rhh->old_bucket_ref)
+    {
+      buckets = OPRef2Ptr(rhh, rhh->old_bucket_ref);
+      old_capacity = RHHCapacityInternal(rhh->old_capacity_clz,
+                                         rhh->old_capacity_ms4b);
+      for (uint64_t idx = rhh->migrate_idx; idx < old_capacity; idx++)
+        {
+          if (bucket_occupied(buckets[idx*bucket_size]) &&
+              predicate(&buckets[idx*bucket_size + 1],
+                        &buckets[idx*bucket_size + 1 + keysize],
+                        keysize, valsize, context))
+            {
+              buckets[idx*bucket_size] = 2;
+              deleted++;
+            }
+        }
+    }
+  rhh->objcnt -= deleted;
+  if (!deleted)
+    return 0;
 
+  // Shrinking rehashes every entry, which leaves nothing to compact.
+  if (rhh->objcnt < rhh->objcnt_low && rhh->objcnt > 16 &&
+      !rhh->old_bucket_ref &&
+      RHHSizeDown(rhh, hasher, rhh->incremental_resize))
+    return deleted;
+
+  buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   for (uint64_t idx = 0; idx < capacity; idx++)
+    if (bucket_occupied(buckets[idx*bucket_size]))
+      RHHCompactBucket(rhh, hasher, idx);
+  while (rhh->longest_probes > 0 &&
+         rhh->longest_probes < PROBE_STATS_SIZE &&
+         rhh->stats[rhh->longest_probes] == 0)
+    rhh->longest_probes--;
+  return deleted;
+}
+
+/*
+ * Batched operations. Keys are hashed a chunk at a time, then the home
+ * bucket of each key is prefetched BATCH_PREFETCH_DISTANCE keys ahead
+ * of the one being resolved, so the cache misses of neighbouring keys
+ * overlap instead of being paid one after another.
+ */
+#define BATCH_CHUNK 64
+#define BATCH_PREFETCH_DISTANCE 8
+
+// __builtin_prefetch needs rw as a constant even when not inlined.
+#define RHH_PREFETCH(addr, rw)                          \
+  ((rw) ? __builtin_prefetch(addr, 1) : __builtin_prefetch(addr, 0))
+
+static inline void
+RHHPrefetchHome(RobinHoodHash* rhh, uint64_t hashed_key, int rw)
+{
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uintptr_t idx;
+
+  idx = hash_with_probe(rhh, hashed_key, 0);
+  if (rhh->tagged)
+    {
+      RHH_PREFETCH(&bucket_tags(rhh, buckets)[idx], rw);
+      // Writers touch the bucket no matter what the tag says.
+      if (!rw)
+        return;
+    }
+  RHH_PREFETCH(&buckets[idx * bucket_size], rw);
+}
+
+/*
+ * The non-custom batch APIs pass batch_hash when the table uses
+ * OPDefaultHash, which hashes the chunk with OPHashBatch; it gives the
+ * same values as OPDefaultHash.
+ */
+static inline void
+RHHHashChunk(RobinHoodHash* rhh, OPHash hasher, bool batch_hash,
+             uint8_t* keys, size_t n, uint64_t* hashes, int rw)
+{
+  const size_t keysize = rhh->keysize;
+
+  if (batch_hash)
+    OPHashBatch(keys, n, keysize, hashes);
+  else
+    for (size_t i = 0; i < n; i++)
+      hashes[i] = hasher(&keys[i * keysize], keysize);
+  for (size_t i = 0; i < n && i < BATCH_PREFETCH_DISTANCE; i++)
+    RHHPrefetchHome(rhh, hashes[i], rw);
+}
+
+static void
+RHHGetBatchInternal(RobinHoodHash* rhh, OPHash hasher, bool batch_hash,
+                    void* keys, size_t n, void** vals)
+{
+  const size_t keysize = rhh->keysize;
+  uint8_t* const key_bytes = keys;
+  uint64_t hashes[BATCH_CHUNK];
+  uint8_t* bucket;
+  size_t chunk;
+
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  for (size_t base = 0; base < n; base += chunk)
+    {
+      chunk = n - base < BATCH_CHUNK ? n - base : BATCH_CHUNK;
+      RHHHashChunk(rhh, hasher, batch_hash, &key_bytes[base * keysize],
+                   chunk, hashes, 0);
+      for (size_t i = 0; i < chunk; i++)
+        {
+          if (i + BATCH_PREFETCH_DISTANCE < chunk)
+            RHHPrefetchHome(rhh, hashes[i + BATCH_PREFETCH_DISTANCE], 0);
+          bucket = RHHPreHashSearchBucket(rhh, hashes[i],
+                                          &key_bytes[(base + i) * keysize]);
+          vals[base + i] = bucket ? &bucket[keysize + 1] : NULL;
+        }
+    }
+}
+
+void RHHGetBatchCustom(RobinHoodHash* rhh, OPHash hasher,
+                       void* keys, size_t n, void** vals)
+{
+  RHHGetBatchInternal(rhh, hasher, false, keys, n, vals);
+}
+
+void RHHGetBatch(RobinHoodHash* rhh, void* keys, size_t n, void** vals)
+{
+  RHHGetBatchInternal(rhh, RHHHasher(rhh),
+                      rhh->hash_id == OP_HASH_ID_DEFAULT, keys, n, vals);
+}
+
+static bool
+RHHInsertBatchInternal(RobinHoodHash* rhh, OPHash hasher, bool batch_hash,
+                       void* keys, void* vals, size_t n)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  uint8_t* const key_bytes = keys;
+  uint8_t* const val_bytes = vals;
+  uint64_t hashes[BATCH_CHUNK];
+  size_t chunk;
+
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  for (size_t base = 0; base < n; base += chunk)
+    {
+      chunk = n - base < BATCH_CHUNK ? n - base : BATCH_CHUNK;
+      RHHHashChunk(rhh, hasher, batch_hash, &key_bytes[base * keysize],
+                   chunk, hashes, 1);
+      for (size_t i = 0; i < chunk; i++)
+        {
+          if (i + BATCH_PREFETCH_DISTANCE < chunk)
+            RHHPrefetchHome(rhh, hashes[i + BATCH_PREFETCH_DISTANCE], 1);
+          if (!RHHPreHashInsertCustom(rhh, hasher, hashes[i],
+                                      &key_bytes[(base + i) * keysize],
+                                      &val_bytes[(base + i) * valsize]))
+            return false;
+        }
+    }
+  return true;
+}
+
+bool RHHInsertBatchCustom(RobinHoodHash* rhh, OPHash hasher,
+                          void* keys, void* vals, size_t n)
+{
+  return RHHInsertBatchInternal(rhh, hasher, false, keys, vals, n);
+}
+
+bool RHHInsertBatch(RobinHoodHash* rhh, void* keys, void* vals, size_t n)
+{
+  return RHHInsertBatchInternal(rhh, RHHHasher(rhh),
+                                rhh->hash_id == OP_HASH_ID_DEFAULT,
+                                keys, vals, n);
+}
+
+static bool
+RHHUpsertBatchInternal(RobinHoodHash* rhh, OPHash hasher, bool batch_hash,
+                       void* keys, size_t n,
+                       void** val_refs, bool* is_duplicate)
+{
+  const size_t keysize = rhh->keysize;
+  uint8_t* const key_bytes = keys;
+  uint64_t hashes[BATCH_CHUNK];
+  void* val_ref;
+  size_t chunk;
+
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  for (size_t base = 0; base < n; base += chunk)
+    {
+      chunk = n - base < BATCH_CHUNK ? n - base : BATCH_CHUNK;
+      RHHHashChunk(rhh, hasher, batch_hash, &key_bytes[base * keysize],
+                   chunk, hashes, 1);
+      for (size_t i = 0; i < chunk; i++)
+        {
+          if (i + BATCH_PREFETCH_DISTANCE < chunk)
+            RHHPrefetchHome(rhh, hashes[i + BATCH_PREFETCH_DISTANCE], 1);
+          if (!RHHPreHashUpsertCustom(rhh, hasher, hashes[i],
+                                      &key_bytes[(base + i) * keysize],
+                                      &val_ref, &is_duplicate[base + i]))
+            return false;
+        }
+    }
+  // Later keys may push down or rehash the buckets of earlier ones,
+  // so value locations are only stable once every key is in place.
+  RHHGetBatchInternal(rhh, hasher, batch_hash, keys, n, val_refs);
+  return true;
+}
+
+bool RHHUpsertBatchCustom(RobinHoodHash* rhh, OPHash hasher,
+                          void* keys, size_t n,
+                          void** val_refs, bool* is_duplicate)
+{
+  return RHHUpsertBatchInternal(rhh, hasher, false, keys, n,
+                                val_refs, is_duplicate);
+}
+
+bool RHHUpsertBatch(RobinHoodHash* rhh, void* keys, size_t n,
+                    void** val_refs, bool* is_duplicate)
+{
+  return RHHUpsertBatchInternal(rhh, RHHHasher(rhh),
+                                rhh->hash_id == OP_HASH_ID_DEFAULT, keys, n,
+                                val_refs, is_duplicate);
+}
+
+/*
+ * Scans share one position space: the bucket array first, then during
+ * an incremental resize the old bucket array, of which the buckets
+ * below migrate_idx have already moved.
+ */
+static inline uint64_t
+RHHScanEnd(RobinHoodHash* rhh)
+{
+  uint64_t end = RHHCapacity(rhh);
+
+  if (rhh->old_bucket_ref)
+    end += RHHCapacityInternal(rhh->old_capacity_clz,
+                               rhh->old_capacity_ms4b);
+  return end;
+}
+
+static void
+RHHScanRange(RobinHoodHash* rhh, uint64_t begin, uint64_t end,
+             OPHashIterator iterator, void* context)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  const size_t bucket_size = keysize + valsize + 1;
+  const uint64_t capacity = RHHCapacity(rhh);
+  uint8_t* buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+
+  for (uint64_t idx = begin; idx < end && idx < capacity; idx++)
+    {
+      if (bucket_occupied(buckets[idx*bucket_size]))
+        {
+          iterator(&buckets[idx*bucket_size + 1],
+                   &buckets[idx*bucket_size + 1 + keysize],
+                   keysize, valsize, context);
+        }
+    }
+
+  if (!rhh->old_bucket_ref || end <= capacity)
+    return;
+  buckets = OPRef2Ptr(rhh, rhh->old_bucket_ref);
+  begin = begin > capacity ? begin - capacity : 0;
+  if (begin < rhh->migrate_idx)
+    begin = rhh->migrate_idx;
+  for (uint64_t idx = begin; idx < end - capacity; idx++)
     {
-      if (buckets[idx*bucket_size] == 1)
+      if (bucket_occupied(buckets[idx*bucket_size]))
         {
           iterator(&buckets[idx*bucket_size + 1],
                    &buckets[idx*bucket_size + 1 + keysize],
@@ -853,8 +2036,173 @@ void RHHIterate(RobinHoodHash* rhh, OPHashIterator iterator, void* context)
     }
 }
 
+void RHHIterate(RobinHoodHash* rhh, OPHashIterator iterator, void* context)
+{
+  RHHCheckFormat(rhh);
+  RHHScanRange(rhh, 0, RHHScanEnd(rhh), iterator, context);
+}
+
+size_t RHHCursorNext(RobinHoodHash* rhh, OPHashCursor* cursor, size_t max,
+                     void** keys, void** vals)
+{
+  const size_t keysize = rhh->keysize;
+  const size_t bucket_size = keysize + rhh->valsize + 1;
+  const uint64_t capacity = RHHCapacity(rhh);
+  const uint64_t end = RHHScanEnd(rhh);
+  uint8_t* buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uint8_t* bucket;
+  uint64_t pos;
+  size_t n;
+
+  RHHCheckFormat(rhh);
+  n = 0;
+  pos = cursor->pos;
+  while (n < max && pos < end)
+    {
+      if (pos < capacity)
+        bucket = &buckets[pos * bucket_size];
+      else if (pos - capacity >= rhh->migrate_idx)
+        bucket = &((uint8_t*)OPRef2Ptr(rhh, rhh->old_bucket_ref))
+          [(pos - capacity) * bucket_size];
+      else
+        {
+          pos = capacity + rhh->migrate_idx;
+          continue;
+        }
+      pos++;
+      if (!bucket_occupied(bucket[0]))
+        continue;
+      keys[n] = &bucket[1];
+      if (vals)
+        vals[n] = &bucket[1 + keysize];
+      n++;
+    }
+  cursor->pos = pos;
+  return n;
+}
+
+struct RHHIterateTask
+{
+  RobinHoodHash* rhh;
+  OPHashIterator iterator;
+  void* context;
+  uint64_t end;
+  a_uint64_t next_range;
+};
+
+static void*
+IterateWorker(void* arg)
+{
+  struct RHHIterateTask* task = arg;
+  uint64_t begin, end;
+
+  while ((begin = atomic_fetch_add_explicit(&task->next_range, 1,
+                                            memory_order_relaxed)
+          << PARALLEL_ITERATE_RANGE_BITS) < task->end)
+    {
+      end = begin + (1ULL << PARALLEL_ITERATE_RANGE_BITS);
+      if (end > task->end)
+        end = task->end;
+      RHHScanRange(task->rhh, begin, end, task->iterator, task->context);
+    }
+  return NULL;
+}
+
+void RHHParallelIterate(RobinHoodHash* rhh, unsigned int nthreads,
+                        OPHashIterator iterator, void* context)
+{
+  struct RHHIterateTask task;
+  uint64_t ranges;
+
+  RHHCheckFormat(rhh);
+  task.rhh = rhh;
+  task.iterator = iterator;
+  task.context = context;
+  task.end = RHHScanEnd(rhh);
+  atomic_init(&task.next_range, 0);
+  ranges = (task.end >> PARALLEL_ITERATE_RANGE_BITS) + 1;
+  if (nthreads > ranges)
+    nthreads = ranges;
+  if (nthreads > PARALLEL_ITERATE_MAX_THREADS)
+    nthreads = PARALLEL_ITERATE_MAX_THREADS;
+  if (nthreads <= 1)
+    {
+      RHHScanRange(rhh, 0, task.end, iterator, context);
+      return;
+    }
+
+  pthread_t threads[nthreads];
+  bool started[nthreads];
+
+  // As in RehashRun, the calling thread takes part and covers for
+  // threads that could not be started.
+  for (unsigned int i = 1; i < nthreads; i++)
+    started[i] = !pthread_create(&threads[i], NULL, IterateWorker, &task);
+  IterateWorker(&task);
+  for (unsigned int i = 1; i < nthreads; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+}
+
+void RHHSetIncrementalResize(RobinHoodHash* rhh, bool incremental)
+{
+  RHHCheckFormat(rhh);
+  rhh->incremental_resize = incremental;
+}
+
+void RHHSetResizeThreads(RobinHoodHash* rhh, unsigned int nthreads)
+{
+  RHHCheckFormat(rhh);
+  rhh->resize_threads = nthreads > PARALLEL_REHASH_MAX_THREADS ?
+    PARALLEL_REHASH_MAX_THREADS : nthreads;
+}
+
+bool RHHResizeStepCustom(RobinHoodHash* rhh, OPHash hasher, uint64_t nbuckets)
+{
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  RHHMigrateBuckets(rhh, hasher, nbuckets);
+  return rhh->old_bucket_ref != 0;
+}
+
+void RHHGetStats(RobinHoodHash* rhh, OPHashStats* stats)
+{
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  uint64_t probes, counted;
+
+  RHHCheckFormat(rhh);
+  memset(stats, 0x00, sizeof(OPHashStats));
+  stats->objcnt = rhh->objcnt;
+  stats->capacity = RHHCapacity(rhh);
+  stats->load = (double)stats->objcnt / stats->capacity;
+  stats->longest_probe = rhh->longest_probes;
+  stats->resizes = rhh->resizes;
+  stats->bytes = sizeof(RobinHoodHash) +
+    BucketArraySize(bucket_size, stats->capacity, rhh->tagged);
+  if (rhh->old_bucket_ref)
+    {
+      stats->bytes +=
+        BucketArraySize(bucket_size,
+                        RHHCapacityInternal(rhh->old_capacity_clz,
+                                            rhh->old_capacity_ms4b),
+                        rhh->tagged);
+      if (rhh->old_longest_probes > stats->longest_probe)
+        stats->longest_probe = rhh->old_longest_probes;
+    }
+
+  probes = counted = 0;
+  for (int i = 0; i < PROBE_STATS_SIZE; i++)
+    {
+      stats->probe_hist[i] = rhh->stats[i];
+      probes += (uint64_t)rhh->stats[i] * i;
+      counted += rhh->stats[i];
+    }
+  stats->mean_probe = counted ? (double)probes / counted : 0.0;
+}
+
 void RHHPrintStat(RobinHoodHash* rhh)
 {
+  RHHCheckFormat(rhh);
   for (int i = 0; i < PROBE_STATS_SIZE; i++)
     if (rhh->stats[i])
       printf("probe %02d: %d\n", i, rhh->stats[i]);
@@ -868,6 +2216,8 @@ RHHFunnel* RHHFunnelNewCustom(RobinHoodHash* rhh, OPHash hasher,
   size_t bucketsize;
   int tube_num;
 
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
   funnel = malloc(sizeof(RHHFunnel));
   bucketsize = rhh->keysize + rhh->valsize + 1;
   funnel->rhh = rhh;
@@ -878,6 +2228,12 @@ RHHFunnel* RHHFunnelNewCustom(RobinHoodHash* rhh, OPHash hasher,
   funnel->capacity_clz = 0;
   funnel->tubes = NULL;
   funnel->flowheads = NULL;
+  funnel->window = 0;
+  funnel->inflight = 0;
+  funnel->next_lookup = 0;
+  funnel->lookups = NULL;
+  funnel->lookup_data = NULL;
+  funnel->read_only = false;
   if (funnel->partition_clz > rhh->capacity_clz)
     {
       funnel->capacity_clz = rhh->capacity_clz;
@@ -899,9 +2255,41 @@ void RHHFunnelDestroy(RHHFunnel* funnel)
     free(funnel->tubes);
   if (funnel->flowheads)
     free(funnel->flowheads);
+  if (funnel->lookups)
+    free(funnel->lookups);
+  if (funnel->lookup_data)
+    free(funnel->lookup_data);
   free(funnel);
 }
 
+RHHFunnel* RHHFunnelNewInterleavedCustom(RobinHoodHash* rhh, OPHash hasher,
+                                         FunnelCB callback,
+                                         size_t max_ctxsize,
+                                         unsigned int window)
+{
+  RHHFunnel* funnel;
+
+  op_assert(window > 0, "Interleaved funnel needs a positive window\n");
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  funnel = malloc(sizeof(RHHFunnel));
+  funnel->rhh = rhh;
+  funnel->hasher = hasher;
+  funnel->callback = callback;
+  funnel->slotsize = rhh->keysize + max_ctxsize;
+  funnel->partition_clz = 0;
+  funnel->capacity_clz = 0;
+  funnel->tubes = NULL;
+  funnel->flowheads = NULL;
+  funnel->window = window;
+  funnel->inflight = 0;
+  funnel->next_lookup = 0;
+  funnel->read_only = false;
+  funnel->lookups = calloc(window, sizeof(struct RHHLookup));
+  funnel->lookup_data = malloc(window * funnel->slotsize);
+  return funnel;
+}
+
 void RHHFunnelPreHashInsert(RHHFunnel* funnel,
                             uint64_t hashed_key,
                             void* key, void* value)
@@ -922,6 +2310,8 @@ void RHHFunnelPreHashInsert(RHHFunnel* funnel,
   enum upsert_result_t upsert_result;
   uint8_t bucket_cpy[bucket_size];
 
+  op_assert(!funnel->window, "Interleaved funnels only serve lookups\n");
+  op_assert(!funnel->read_only, "Read only funnels only serve lookups\n");
   rhh = funnel->rhh;
 
   if (funnel->capacity_clz != rhh->capacity_clz)
@@ -1008,7 +2398,6 @@ void RHHFunnelPreHashInsert(RHHFunnel* funnel,
           switch (upsert_result)
             {
             case UPSERT_EMPTY:
-              *matched_bucket = 1;
               memcpy(&matched_bucket[1], tube_key, keysize);
             case UPSERT_DUP:
               memcpy(&matched_bucket[1 + keysize], tube_val, valsize);
@@ -1085,7 +2474,6 @@ void RHHFunnelInsertFlush(RHHFunnel* funnel)
           switch (upsert_result)
             {
             case UPSERT_EMPTY:
-              *matched_bucket = 1;
               memcpy(&matched_bucket[1], tube_key, keysize);
             case UPSERT_DUP:
               memcpy(&matched_bucket[1 + keysize], tube_val, valsize);
@@ -1126,6 +2514,8 @@ void RHHFunnelPreHashUpsert(RHHFunnel* funnel,
   enum upsert_result_t upsert_result;
   uint8_t bucket_cpy[bucket_size];
 
+  op_assert(!funnel->window, "Interleaved funnels only serve lookups\n");
+  op_assert(!funnel->read_only, "Read only funnels only serve lookups\n");
   rhh = funnel->rhh;
   upsertcb = funnel->callback.upsertcb;
   ctxsize = (uint32_t)ctxsize_st;
@@ -1157,7 +2547,6 @@ void RHHFunnelPreHashUpsert(RHHFunnel* funnel,
               switch (upsert_result)
                 {
                 case UPSERT_EMPTY:
-                  *matched_bucket = 1;
                   memcpy(&matched_bucket[1], key, keysize);
                   if (upsertcb)
                     upsertcb(&matched_bucket[1],           // key
@@ -1239,7 +2628,6 @@ void RHHFunnelPreHashUpsert(RHHFunnel* funnel,
                   switch (upsert_result)
                     {
                     case UPSERT_EMPTY:
-                      *matched_bucket = 1;
                       memcpy(&matched_bucket[1], tube_key, keysize);
                       if (upsertcb)
                         upsertcb(&matched_bucket[1],           // key
@@ -1318,7 +2706,6 @@ void RHHFunnelPreHashUpsert(RHHFunnel* funnel,
           switch (upsert_result)
             {
             case UPSERT_EMPTY:
-              *matched_bucket = 1;
               memcpy(&matched_bucket[1], tube_key, keysize);
               if (upsertcb)
                 upsertcb(&matched_bucket[1],           // key
@@ -1435,7 +2822,6 @@ void RHHFunnelUpsertFlush(RHHFunnel* funnel)
           switch (upsert_result)
             {
             case UPSERT_EMPTY:
-              *matched_bucket = 1;
               memcpy(&matched_bucket[1], tube_key, keysize);
               if (upsertcb)
                 upsertcb(&matched_bucket[1],           // key
@@ -1481,19 +2867,134 @@ void RHHFunnelUpsertFlush(RHHFunnel* funnel)
     }
 }
 
-void RHHFunnelGet(RHHFunnel* funnel, void* key, void* context, size_t ctxsize)
+/*
+ * Interleaved lookups (AMAC style). Each in-flight lookup is a small
+ * state machine: it inspects the LOOKUP_PROBES buckets it prefetched
+ * when it last ran, and either finishes or prefetches the following
+ * probes and yields to the other lookups. Most keys sit within the
+ * first two probes, so a lookup usually finishes in one step. While a
+ * lookup waits on memory the others make progress, and every lookup
+ * finishes within window * (longest_probes + 1) steps.
+ */
+#define LOOKUP_PROBES 2
+
+static inline void
+RHHLookupPrefetch(RobinHoodHash* rhh, struct RHHLookup* lookup)
 {
-  uint64_t hashed_key;
-  hashed_key = funnel->hasher(key, funnel->rhh->keysize);
-  RHHFunnelPreHashGet(funnel, hashed_key, key, context, ctxsize);
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uintptr_t idx;
+
+  for (int probe = lookup->probe;
+       probe < lookup->probe + LOOKUP_PROBES; probe++)
+    {
+      idx = hash_with_probe(rhh, lookup->hashed_key, probe);
+      __builtin_prefetch(&buckets[idx * bucket_size], 0);
+    }
 }
 
-void RHHFunnelPreHashGet(RHHFunnel* funnel, uint64_t hashed_key,
+static void
+RHHFunnelInterleavedStep(RHHFunnel* funnel)
+{
+  RobinHoodHash* const rhh = funnel->rhh;
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  const size_t bucket_size = keysize + valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  OPFunnelGetCB getcb;
+  struct RHHLookup* lookup;
+  uint8_t *key, *bucket;
+  uintptr_t idx;
+  int last_probe;
+
+  do
+    {
+      lookup = &funnel->lookups[funnel->next_lookup];
+      key = &funnel->lookup_data[funnel->next_lookup * funnel->slotsize];
+      if (++funnel->next_lookup == funnel->window)
+        funnel->next_lookup = 0;
+    }
+  while (!lookup->active);
+
+  last_probe = lookup->probe + LOOKUP_PROBES;
+  do
+    {
+      idx = hash_with_probe(rhh, lookup->hashed_key, lookup->probe);
+      bucket = &buckets[idx * bucket_size];
+      if (bucket[0] == 0)
+        break;
+      if (bucket[0] != 2 && !memcmp(key, &bucket[1], keysize))
+        goto found;
+      if (++lookup->probe > rhh->longest_probes)
+        break;
+      if (lookup->probe == last_probe)
+        {
+          RHHLookupPrefetch(rhh, lookup);
+          return;
+        }
+    }
+  while (true);
+  bucket = RHHPreHashSearchOldBucket(rhh, lookup->hashed_key, key);
+
+ found:
+  lookup->active = false;
+  funnel->inflight--;
+  getcb = funnel->callback.getcb;
+  if (!getcb)
+    return;
+  if (bucket)
+    getcb(&bucket[1], &bucket[1 + keysize],
+          &key[keysize], keysize, valsize, lookup->ctxsize);
+  else
+    getcb(key, NULL, &key[keysize], keysize, valsize, lookup->ctxsize);
+}
+
+static void
+RHHFunnelInterleavedGet(RHHFunnel* funnel, uint64_t hashed_key,
+                        void* key, void* context, size_t ctxsize)
+{
+  const size_t keysize = funnel->rhh->keysize;
+  struct RHHLookup* lookup;
+  unsigned int slot;
+
+  op_assert(keysize + ctxsize <= funnel->slotsize,
+            "Context size %zu exceeds the funnel limit %zu\n",
+            ctxsize, funnel->slotsize - keysize);
+
+  while (funnel->inflight == funnel->window)
+    RHHFunnelInterleavedStep(funnel);
+
+  // Take the slot right behind the scheduler so the new lookup runs
+  // last, after every older one got another step.
+  slot = funnel->next_lookup;
+  do
+    slot = (slot ? slot : funnel->window) - 1;
+  while (funnel->lookups[slot].active);
+
+  lookup = &funnel->lookups[slot];
+  lookup->hashed_key = hashed_key;
+  lookup->probe = 0;
+  lookup->ctxsize = (uint32_t)ctxsize;
+  lookup->active = true;
+  memcpy(&funnel->lookup_data[slot * funnel->slotsize], key, keysize);
+  memcpy(&funnel->lookup_data[slot * funnel->slotsize + keysize],
+         context, ctxsize);
+  funnel->inflight++;
+  RHHLookupPrefetch(funnel->rhh, lookup);
+}
+
+void RHHFunnelGet(RHHFunnel* funnel, void* key, void* context, size_t ctxsize)
+{
+  uint64_t hashed_key;
+  hashed_key = funnel->hasher(key, funnel->rhh->keysize);
+  RHHFunnelPreHashGet(funnel, hashed_key, key, context, ctxsize);
+}
+
+void RHHFunnelPreHashGet(RHHFunnel* funnel, uint64_t hashed_key,
                          void* key, void* context, size_t ctxsize_st)
 {
   const size_t keysize = funnel->rhh->keysize;
   const size_t valsize = funnel->rhh->valsize;
-  const size_t bucket_size = keysize + valsize + 1;
 
   RobinHoodHash* rhh;
   OPFunnelGetCB getcb;
@@ -1501,28 +3002,29 @@ void RHHFunnelPreHashGet(RHHFunnel* funnel, uint64_t hashed_key,
   uint64_t mask;
   size_t trip_bundle_size;
   ptrdiff_t flowhead, flowbase, tubeidx;
-  uintptr_t bucket_idx;
   uint8_t *tube_key, *tube_ctx;
   uint32_t* tube_ctxsize;
   uint32_t ctxsize;
   uint64_t* tube_hashed_key;
-  uint8_t* buckets;
+  uint8_t* bucket;
 
   rhh = funnel->rhh;
-  buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   getcb = funnel->callback.getcb;
 
+  if (funnel->window)
+    {
+      RHHFunnelInterleavedGet(funnel, hashed_key, key, context, ctxsize_st);
+      return;
+    }
+
   // hash table is too small for using funnel
   if (!funnel->tubes)
     {
-      if (RHHPreHashSearchIdx(rhh,
-                              hashed_key,
-                              key,
-                              &bucket_idx))
+      bucket = RHHPreHashSearchBucket(rhh, hashed_key, key);
+      if (bucket)
         {
           if (getcb)
-            getcb(&buckets[bucket_idx * bucket_size + 1],
-                  &buckets[bucket_idx * bucket_size + 1 + keysize],
+            getcb(&bucket[1], &bucket[1 + keysize],
                   context, keysize, valsize, ctxsize_st);
         }
       else
@@ -1554,14 +3056,11 @@ void RHHFunnelPreHashGet(RHHFunnel* funnel, uint64_t hashed_key,
           tubeidx += keysize;
           tube_ctx = &funnel->tubes[tubeidx];
           tubeidx += *tube_ctxsize;
-          if (RHHPreHashSearchIdx(rhh,
-                                  *tube_hashed_key,
-                                  tube_key,
-                                  &bucket_idx))
+          bucket = RHHPreHashSearchBucket(rhh, *tube_hashed_key, tube_key);
+          if (bucket)
             {
               if (getcb)
-                getcb(&buckets[bucket_idx * bucket_size + 1],
-                      &buckets[bucket_idx * bucket_size + 1 + keysize],
+                getcb(&bucket[1], &bucket[1 + keysize],
                       tube_ctx, keysize, valsize, *tube_ctxsize);
             }
           else
@@ -1591,23 +3090,27 @@ void RHHFunnelGetFlush(RHHFunnel* funnel)
 {
   const size_t keysize = funnel->rhh->keysize;
   const size_t valsize = funnel->rhh->valsize;
-  const size_t bucket_size = keysize + valsize + 1;
 
   RobinHoodHash* rhh;
   OPFunnelGetCB getcb;
   int tube_num, row_idx;
   ptrdiff_t flowhead, tubeidx;
-  uintptr_t bucket_idx;
   uint8_t *tube_key, *tube_ctx;
   uint32_t* tube_ctxsize;
   uint64_t* tube_hashed_key;
-  uint8_t* buckets;
+  uint8_t* bucket;
+
+  if (funnel->window)
+    {
+      while (funnel->inflight)
+        RHHFunnelInterleavedStep(funnel);
+      return;
+    }
 
   if (!funnel->tubes || !funnel->rhh)
     return;
 
   rhh = funnel->rhh;
-  buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
   getcb = funnel->callback.getcb;
   tube_num = 1 << (funnel->partition_clz - funnel->capacity_clz);
 
@@ -1625,14 +3128,11 @@ void RHHFunnelGetFlush(RHHFunnel* funnel)
           tubeidx += keysize;
           tube_ctx = &funnel->tubes[tubeidx];
           tubeidx += *tube_ctxsize;
-          if (RHHPreHashSearchIdx(rhh,
-                                  *tube_hashed_key,
-                                  tube_key,
-                                  &bucket_idx))
+          bucket = RHHPreHashSearchBucket(rhh, *tube_hashed_key, tube_key);
+          if (bucket)
             {
               if (getcb)
-                getcb(&buckets[bucket_idx * bucket_size + 1],
-                      &buckets[bucket_idx * bucket_size + 1 + keysize],
+                getcb(&bucket[1], &bucket[1 + keysize],
                       tube_ctx, keysize, valsize, *tube_ctxsize);
             }
           else
@@ -1671,6 +3171,8 @@ void RHHFunnelPreHashDelete(RHHFunnel* funnel, uint64_t hashed_key,
   uint32_t ctxsize;
   uint64_t* tube_hashed_key;
 
+  op_assert(!funnel->window, "Interleaved funnels only serve lookups\n");
+  op_assert(!funnel->read_only, "Read only funnels only serve lookups\n");
   rhh = funnel->rhh;
   deletecb = funnel->callback.deletecb;
 
@@ -1804,4 +3306,870 @@ void RHHFunnelDeleteFlush(RHHFunnel* funnel)
     }
 }
 
+/*
+ * Parallel funnel.
+ *
+ * Entries are routed to workers by the same hash prefix the parallel
+ * rehash partitions on, so every worker owns a disjoint set of buckets
+ * and inserts into them without locks. Producers append entries to the
+ * chunked queue of the owning worker. An insertion whose probe
+ * sequence, or whose chain of displaced entries, leaves the buckets of
+ * its worker is set aside and applied by whoever holds the funnel
+ * exclusively next: a worker growing the table, or the flush.
+ *
+ * An entry sees the same probe sequence whenever it is retried, and no
+ * bucket it skipped can become available to it while workers run, so
+ * once a key is set aside every later copy of it is set aside too. The
+ * displaced entries are applied before the new ones, and each list in
+ * order, hence the last value inserted for a key wins as it would with
+ * RHHInsert.
+ */
+#define PF_QUEUE_DEPTH 4
+// A worker fills its part of the table a chunk at a time while the
+// table only grows by its overall load, so every part must be large
+// enough to take a chunk without piling up.
+#define PF_PART_CHUNKS 16
+#define PF_DEFER_NEW 1
+#define PF_DEFER_DISPLACED 0
+
+struct PFChunk
+{
+  struct PFChunk* next;
+  size_t cnt;
+  uint8_t entries[];
+};
+
+struct PFQueue
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t not_full;
+  struct PFChunk* head;
+  struct PFChunk* tail;
+  struct PFChunk* open;
+  size_t nchunks;
+};
+
+struct PFWorker
+{
+  RHHParallelFunnel* pf;
+  unsigned int id;
+  pthread_t thread;
+  bool started;
+  uint64_t objcnt;
+  int longest_probes;
+  uint32_t stats[PROBE_STATS_SIZE];
+  uint8_t* deferred;
+  size_t deferred_cnt;
+  size_t deferred_cap;
+};
+
+struct RHHParallelFunnel
+{
+  RobinHoodHash* rhh;
+  OPHash hasher;
+  unsigned int nworkers;
+  size_t chunk_size;
+  size_t entry_size;
+  // Routing geometry. Only changes while every queue lock is held;
+  // producers recheck epoch under the queue lock they route to.
+  uint64_t epoch;
+  int bits;
+  int part_bits;
+  uint8_t capacity_ms4b;
+  pthread_mutex_t phase_lock;
+  pthread_cond_t phase_cond;
+  unsigned int active;
+  bool exclusive;
+  bool stop;
+  bool failed;
+  a_uint64_t reserved;
+  struct PFQueue* queues;
+  struct PFWorker* workers;
+};
+
+static inline unsigned int
+PFWorkerOf(RHHParallelFunnel* pf, uint64_t masked_hash)
+{
+  uint64_t part;
+
+  if (pf->part_bits <= 0)
+    return 0;
+  part = (masked_hash >> (pf->bits - pf->part_bits)) &
+    ((1UL << pf->part_bits) - 1);
+  return part * pf->nworkers >> pf->part_bits;
+}
+
+static inline bool
+PFOwnsIdx(struct PFWorker* worker, uintptr_t idx)
+{
+  RHHParallelFunnel* pf = worker->pf;
+  // The smallest masked hash mapping to idx decides the owner.
+  return PFWorkerOf(pf, round_up_div(16 * idx, pf->capacity_ms4b)) ==
+    worker->id;
+}
+
+static void
+PFSetGeometry(RHHParallelFunnel* pf)
+{
+  pf->bits = 64 - pf->rhh->capacity_clz;
+  pf->capacity_ms4b = pf->rhh->capacity_ms4b;
+  pf->part_bits = pf->bits - PARALLEL_REHASH_MIN_BITS;
+  if (pf->part_bits > PARALLEL_REHASH_PART_BITS)
+    pf->part_bits = PARALLEL_REHASH_PART_BITS;
+  while (pf->part_bits > 0 &&
+         RHHCapacity(pf->rhh) >> pf->part_bits <
+         PF_PART_CHUNKS * pf->chunk_size)
+    pf->part_bits--;
+  __atomic_store_n(&pf->epoch, pf->epoch + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+PFEnqueueChunk(struct PFQueue* queue)
+{
+  if (queue->tail)
+    queue->tail->next = queue->open;
+  else
+    queue->head = queue->open;
+  queue->tail = queue->open;
+  queue->open = NULL;
+  queue->nchunks++;
+  pthread_cond_signal(&queue->ready);
+}
+
+static inline void
+PFAppend(RHHParallelFunnel* pf, struct PFQueue* queue, uint8_t* entry)
+{
+  if (!queue->open)
+    {
+      queue->open = malloc(sizeof(struct PFChunk) +
+                           pf->chunk_size * pf->entry_size);
+      op_assert(queue->open, "Cannot allocate parallel funnel chunk\n");
+      queue->open->next = NULL;
+      queue->open->cnt = 0;
+    }
+  memcpy(&queue->open->entries[queue->open->cnt * pf->entry_size],
+         entry, pf->entry_size);
+  if (++queue->open->cnt == pf->chunk_size)
+    PFEnqueueChunk(queue);
+}
+
+/*
+ * Called with every queue lock held after the table changed its
+ * geometry. Queued entries move to their new owners in order.
+ */
+static void
+PFReroute(RHHParallelFunnel* pf)
+{
+  struct PFChunk* chunks[pf->nworkers];
+  struct PFChunk *chunk, *next;
+  struct PFQueue* queue;
+  uint64_t hashed_key;
+  uint8_t* entry;
+
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      queue = &pf->queues[i];
+      if (queue->open)
+        {
+          if (queue->tail)
+            queue->tail->next = queue->open;
+          else
+            queue->head = queue->open;
+        }
+      chunks[i] = queue->head;
+      queue->head = queue->tail = queue->open = NULL;
+      queue->nchunks = 0;
+    }
+  PFSetGeometry(pf);
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      for (chunk = chunks[i]; chunk; chunk = next)
+        {
+          next = chunk->next;
+          for (size_t j = 0; j < chunk->cnt; j++)
+            {
+              entry = &chunk->entries[j * pf->entry_size];
+              memcpy(&hashed_key, entry, sizeof(uint64_t));
+              PFAppend(pf, &pf->queues[PFWorkerOf(pf, hashed_key)], entry);
+            }
+          free(chunk);
+        }
+    }
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      pthread_cond_broadcast(&pf->queues[i].ready);
+      pthread_cond_broadcast(&pf->queues[i].not_full);
+    }
+}
+
+static void
+PFDefer(struct PFWorker* worker, uint8_t* bucket, uint8_t kind)
+{
+  RobinHoodHash* rhh = worker->pf->rhh;
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+
+  if (worker->deferred_cnt == worker->deferred_cap)
+    {
+      worker->deferred_cap = worker->deferred_cap ?
+        worker->deferred_cap * 2 : 64;
+      worker->deferred = realloc(worker->deferred,
+                                 worker->deferred_cap * bucket_size);
+      op_assert(worker->deferred,
+                "Cannot allocate %zu deferred buckets\n",
+                worker->deferred_cap);
+    }
+  memcpy(&worker->deferred[worker->deferred_cnt * bucket_size],
+         bucket, bucket_size);
+  worker->deferred[worker->deferred_cnt * bucket_size] = kind;
+  worker->deferred_cnt++;
+}
+
+static inline int
+PFFindProbe(struct PFWorker* worker, uintptr_t idx)
+{
+  RobinHoodHash* rhh = worker->pf->rhh;
+  const size_t bucket_size = rhh->keysize + rhh->valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uint64_t hashed_key;
+
+  if ((buckets[idx*bucket_size] & PROBE_UNKNOWN) != PROBE_UNKNOWN)
+    return buckets[idx*bucket_size] & PROBE_UNKNOWN;
+
+  hashed_key = worker->pf->hasher(&buckets[idx*bucket_size + 1],
+                                  rhh->keysize);
+  for (int i = 0; i < PROBE_STATS_SIZE; i++)
+    {
+      if (hash_with_probe(rhh, hashed_key, i) == idx)
+        return i;
+    }
+  return -1;
+}
+
+enum pf_find_result_t
+  {
+    PF_NOT_FOUND,
+    PF_FOUND,
+    PF_UNKNOWN,
+  };
+
+// RHHFindKeyAfter that gives up on buckets owned by other workers.
+static inline enum pf_find_result_t
+PFFindKeyAfter(struct PFWorker* worker, uint64_t hashed_key, void* key,
+               int probe, uint8_t** matched_bucket)
+{
+  RobinHoodHash* rhh = worker->pf->rhh;
+  const size_t keysize = rhh->keysize;
+  const size_t bucket_size = keysize + rhh->valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uintptr_t idx;
+
+  for (int p = probe + 1; p < PROBE_STATS_SIZE; p++)
+    {
+      idx = hash_with_probe(rhh, hashed_key, p);
+      if (!PFOwnsIdx(worker, idx))
+        return PF_UNKNOWN;
+      if (buckets[idx * bucket_size] == 0)
+        return PF_NOT_FOUND;
+      if (!bucket_occupied(buckets[idx * bucket_size]))
+        continue;
+      if (!memcmp(key, &buckets[idx * bucket_size + 1], keysize))
+        {
+          *matched_bucket = &buckets[idx * bucket_size];
+          return PF_FOUND;
+        }
+    }
+  return PF_NOT_FOUND;
+}
+
+static void
+PFInsert(struct PFWorker* worker, uint8_t* entry)
+{
+  RobinHoodHash* rhh = worker->pf->rhh;
+  const size_t keysize = rhh->keysize;
+  const size_t valsize = rhh->valsize;
+  const size_t bucket_size = keysize + valsize + 1;
+  uint8_t* const buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  uint8_t bucket_cpy[bucket_size], bucket_tmp[bucket_size];
+  uint8_t* matched_bucket;
+  uint64_t hashed_key;
+  uintptr_t idx;
+  int probe, old_probe;
+  bool newcomer;
+
+  memcpy(&hashed_key, entry, sizeof(uint64_t));
+  bucket_cpy[0] = 0;
+  memcpy(&bucket_cpy[1], &entry[sizeof(uint64_t)], keysize + valsize);
+  newcomer = true;
+  probe = 0;
+
+  for (int iter = 0; iter < PROBE_STATS_SIZE * 4; iter++)
+    {
+      if (probe >= PROBE_STATS_SIZE)
+        break;
+      idx = hash_with_probe(rhh, hashed_key, probe);
+      if (!PFOwnsIdx(worker, idx))
+        break;
+      if (buckets[idx * bucket_size] == 2 && newcomer)
+        {
+          switch (PFFindKeyAfter(worker, hashed_key, &bucket_cpy[1],
+                                 probe, &matched_bucket))
+            {
+            case PF_FOUND:
+              memcpy(&matched_bucket[1 + keysize],
+                     &bucket_cpy[1 + keysize], valsize);
+              return;
+            case PF_UNKNOWN:
+              PFDefer(worker, bucket_cpy, PF_DEFER_NEW);
+              return;
+            case PF_NOT_FOUND:
+              break;
+            }
+        }
+      if (!bucket_occupied(buckets[idx * bucket_size]))
+        {
+          memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
+          worker->objcnt++;
+          worker->stats[probe]++;
+          if (probe > worker->longest_probes)
+            worker->longest_probes = probe;
+          return;
+        }
+      if (newcomer &&
+          !memcmp(&bucket_cpy[1], &buckets[idx * bucket_size + 1], keysize))
+        {
+          memcpy(&buckets[idx * bucket_size + 1 + keysize],
+                 &bucket_cpy[1 + keysize], valsize);
+          return;
+        }
+      old_probe = PFFindProbe(worker, idx);
+      if (old_probe < 0)
+        break;
+      if (probe > old_probe)
+        {
+          if (newcomer)
+            {
+              switch (PFFindKeyAfter(worker, hashed_key, &bucket_cpy[1],
+                                     probe, &matched_bucket))
+                {
+                case PF_FOUND:
+                  memcpy(&matched_bucket[1 + keysize],
+                         &bucket_cpy[1 + keysize], valsize);
+                  return;
+                case PF_UNKNOWN:
+                  PFDefer(worker, bucket_cpy, PF_DEFER_NEW);
+                  return;
+                case PF_NOT_FOUND:
+                  break;
+                }
+            }
+          worker->stats[old_probe]--;
+          worker->stats[probe]++;
+          if (probe > worker->longest_probes)
+            worker->longest_probes = probe;
+          memcpy(bucket_tmp, &buckets[idx * bucket_size], bucket_size);
+          memcpy(&buckets[idx * bucket_size], bucket_cpy, bucket_size);
+          buckets[idx * bucket_size] = bucket_flag(probe);
+          SetTag(rhh, idx, hash_tag(hashed_key));
+          memcpy(bucket_cpy, bucket_tmp, bucket_size);
+          probe = old_probe + 1;
+          hashed_key = worker->pf->hasher(&bucket_cpy[1], keysize);
+          newcomer = false;
+          continue;
+        }
+      probe++;
+    }
+  PFDefer(worker, bucket_cpy,
+          newcomer ? PF_DEFER_NEW : PF_DEFER_DISPLACED);
+}
+
+/*
+ * Waits until no worker processes a chunk and keeps the others out.
+ * Called with phase_lock held, which it keeps.
+ */
+static void
+PFBeginExclusive(RHHParallelFunnel* pf)
+{
+  while (pf->exclusive)
+    pthread_cond_wait(&pf->phase_cond, &pf->phase_lock);
+  pf->exclusive = true;
+  while (pf->active)
+    pthread_cond_wait(&pf->phase_cond, &pf->phase_lock);
+}
+
+/*
+ * Folds the work of every worker back into the table: statistics
+ * first, then the entries they set aside, in order. Regrows the table
+ * by min_free entries if asked to, and reroutes the queues when the
+ * geometry changed.
+ */
+static void
+PFEndExclusive(RHHParallelFunnel* pf, uint64_t min_free)
+{
+  RobinHoodHash* rhh = pf->rhh;
+  const size_t keysize = rhh->keysize;
+  const size_t bucket_size = keysize + rhh->valsize + 1;
+  struct PFWorker* worker;
+  uint8_t* bucket;
+  bool resized;
+
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      worker = &pf->workers[i];
+      rhh->objcnt += worker->objcnt;
+      for (int p = 0; p < PROBE_STATS_SIZE; p++)
+        rhh->stats[p] += worker->stats[p];
+      if (worker->longest_probes > rhh->longest_probes)
+        rhh->longest_probes = worker->longest_probes;
+      worker->objcnt = 0;
+      worker->longest_probes = 0;
+      memset(worker->stats, 0x00, sizeof(worker->stats));
+    }
+  // A displaced entry may hold a key routed to another worker, and is
+  // always older than the copies of its key deferred as new. Put the
+  // displaced entries back first so the newer values win.
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      worker = &pf->workers[i];
+      for (size_t j = 0; j < worker->deferred_cnt; j++)
+        {
+          bucket = &worker->deferred[j * bucket_size];
+          if (bucket[0] == PF_DEFER_DISPLACED)
+            RHHUpsertPushDown(rhh, pf->hasher, bucket, 0, NULL, &resized);
+        }
+    }
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      worker = &pf->workers[i];
+      for (size_t j = 0; j < worker->deferred_cnt; j++)
+        {
+          bucket = &worker->deferred[j * bucket_size];
+          if (bucket[0] == PF_DEFER_NEW &&
+              !RHHInsertCustom(rhh, pf->hasher, &bucket[1],
+                               &bucket[1 + keysize]))
+            pf->failed = true;
+        }
+      worker->deferred_cnt = 0;
+    }
+  atomic_store_explicit(&pf->reserved, 0, memory_order_relaxed);
+
+  if (!pf->failed && rhh->objcnt + min_free > rhh->objcnt_high)
+    pf->failed = !RHHSizeUp(rhh, pf->hasher, false);
+  // Workers only know the current bucket array.
+  RHHMigrateBuckets(rhh, pf->hasher, UINT64_MAX);
+
+  if (pf->bits != 64 - rhh->capacity_clz ||
+      pf->capacity_ms4b != rhh->capacity_ms4b)
+    {
+      for (unsigned int i = 0; i < pf->nworkers; i++)
+        pthread_mutex_lock(&pf->queues[i].lock);
+      PFReroute(pf);
+      for (unsigned int i = 0; i < pf->nworkers; i++)
+        pthread_mutex_unlock(&pf->queues[i].lock);
+    }
+
+  pf->exclusive = false;
+  pthread_cond_broadcast(&pf->phase_cond);
+}
+
+static void*
+PFWorkerMain(void* arg)
+{
+  struct PFWorker* worker = arg;
+  RHHParallelFunnel* pf = worker->pf;
+  RobinHoodHash* rhh = pf->rhh;
+  struct PFQueue* queue = &pf->queues[worker->id];
+  struct PFChunk* chunk;
+  uint64_t reserved;
+  bool grow;
+
+  while (true)
+    {
+      pthread_mutex_lock(&queue->lock);
+      while (!queue->head && !pf->stop)
+        pthread_cond_wait(&queue->ready, &queue->lock);
+      if (!queue->head)
+        {
+          pthread_mutex_unlock(&queue->lock);
+          return NULL;
+        }
+      pthread_mutex_unlock(&queue->lock);
+
+      pthread_mutex_lock(&pf->phase_lock);
+      while (pf->exclusive)
+        pthread_cond_wait(&pf->phase_cond, &pf->phase_lock);
+      pf->active++;
+      pthread_mutex_unlock(&pf->phase_lock);
+
+      // The chunk may have been rerouted while we were waiting.
+      pthread_mutex_lock(&queue->lock);
+      chunk = queue->head;
+      if (chunk)
+        {
+          queue->head = chunk->next;
+          if (!queue->head)
+            queue->tail = NULL;
+          queue->nchunks--;
+          pthread_cond_broadcast(&queue->not_full);
+        }
+      pthread_mutex_unlock(&queue->lock);
+
+      grow = false;
+      if (chunk)
+        {
+          reserved = atomic_fetch_add_explicit(&pf->reserved, chunk->cnt,
+                                               memory_order_relaxed);
+          if (!pf->failed &&
+              rhh->objcnt + reserved + chunk->cnt > rhh->objcnt_high)
+            {
+              // Hand the chunk back and grow the table first.
+              grow = true;
+              pthread_mutex_lock(&queue->lock);
+              chunk->next = queue->head;
+              queue->head = chunk;
+              if (!queue->tail)
+                queue->tail = chunk;
+              queue->nchunks++;
+              pthread_mutex_unlock(&queue->lock);
+            }
+          else
+            {
+              for (size_t i = 0; i < chunk->cnt; i++)
+                PFInsert(worker, &chunk->entries[i * pf->entry_size]);
+              free(chunk);
+            }
+        }
+
+      pthread_mutex_lock(&pf->phase_lock);
+      if (--pf->active == 0)
+        pthread_cond_broadcast(&pf->phase_cond);
+      if (grow)
+        {
+          PFBeginExclusive(pf);
+          PFEndExclusive(pf, pf->chunk_size);
+        }
+      pthread_mutex_unlock(&pf->phase_lock);
+    }
+}
+
+RHHParallelFunnel*
+RHHParallelFunnelNewCustom(RobinHoodHash* rhh, OPHash hasher,
+                           unsigned int nworkers, size_t chunk_size)
+{
+  RHHParallelFunnel* pf;
+
+  op_assert(nworkers > 0 && chunk_size > 0,
+            "Parallel funnel needs workers and a positive chunk size\n");
+  RHHCheckFormat(rhh);
+  RHHCheckHasher(rhh, hasher);
+  pf = malloc(sizeof(RHHParallelFunnel));
+  op_assert(pf, "Cannot allocate parallel funnel\n");
+  // Workers only know the current bucket array.
+  RHHMigrateBuckets(rhh, hasher, UINT64_MAX);
+
+  pf->rhh = rhh;
+  pf->hasher = hasher;
+  pf->nworkers = nworkers;
+  pf->chunk_size = chunk_size;
+  pf->entry_size = sizeof(uint64_t) + rhh->keysize + rhh->valsize;
+  pf->epoch = 0;
+  PFSetGeometry(pf);
+  pthread_mutex_init(&pf->phase_lock, NULL);
+  pthread_cond_init(&pf->phase_cond, NULL);
+  pf->active = 0;
+  pf->exclusive = false;
+  pf->stop = false;
+  pf->failed = false;
+  atomic_init(&pf->reserved, 0);
+  pf->queues = calloc(nworkers, sizeof(struct PFQueue));
+  pf->workers = calloc(nworkers, sizeof(struct PFWorker));
+  op_assert(pf->queues && pf->workers,
+            "Cannot allocate %u parallel funnel workers\n", nworkers);
+
+  for (unsigned int i = 0; i < nworkers; i++)
+    {
+      pthread_mutex_init(&pf->queues[i].lock, NULL);
+      pthread_cond_init(&pf->queues[i].ready, NULL);
+      pthread_cond_init(&pf->queues[i].not_full, NULL);
+      pf->workers[i].pf = pf;
+      pf->workers[i].id = i;
+    }
+  for (unsigned int i = 0; i < nworkers; i++)
+    {
+      pf->workers[i].started =
+        !pthread_create(&pf->workers[i].thread, NULL,
+                        PFWorkerMain, &pf->workers[i]);
+      op_assert(pf->workers[i].started,
+                "Cannot start parallel funnel worker %u\n", i);
+    }
+  return pf;
+}
+
+void RHHParallelFunnelPreHashInsert(RHHParallelFunnel* pf,
+                                    uint64_t hashed_key,
+                                    void* key, void* value)
+{
+  const size_t keysize = pf->rhh->keysize;
+  const size_t valsize = pf->rhh->valsize;
+  uint8_t entry[pf->entry_size];
+  struct PFQueue* queue;
+  uint64_t epoch;
+
+  memcpy(entry, &hashed_key, sizeof(uint64_t));
+  memcpy(&entry[sizeof(uint64_t)], key, keysize);
+  memcpy(&entry[sizeof(uint64_t) + keysize], value, valsize);
+
+ retry:
+  epoch = __atomic_load_n(&pf->epoch, __ATOMIC_ACQUIRE);
+  queue = &pf->queues[PFWorkerOf(pf, hashed_key)];
+  pthread_mutex_lock(&queue->lock);
+  while (pf->epoch == epoch && queue->nchunks >= PF_QUEUE_DEPTH)
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  if (pf->epoch != epoch)
+    {
+      pthread_mutex_unlock(&queue->lock);
+      goto retry;
+    }
+  PFAppend(pf, queue, entry);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void RHHParallelFunnelInsert(RHHParallelFunnel* pf, void* key, void* value)
+{
+  uint64_t hashed_key;
+  hashed_key = pf->hasher(key, pf->rhh->keysize);
+  RHHParallelFunnelPreHashInsert(pf, hashed_key, key, value);
+}
+
+bool RHHParallelFunnelInsertFlush(RHHParallelFunnel* pf)
+{
+  struct PFQueue* queue;
+  bool pending;
+
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      queue = &pf->queues[i];
+      pthread_mutex_lock(&queue->lock);
+      if (queue->open)
+        PFEnqueueChunk(queue);
+      pthread_mutex_unlock(&queue->lock);
+    }
+
+  pthread_mutex_lock(&pf->phase_lock);
+  while (true)
+    {
+      pending = pf->exclusive || pf->active;
+      for (unsigned int i = 0; i < pf->nworkers && !pending; i++)
+        {
+          queue = &pf->queues[i];
+          pthread_mutex_lock(&queue->lock);
+          pending = queue->head || queue->open;
+          pthread_mutex_unlock(&queue->lock);
+        }
+      if (!pending)
+        break;
+      pthread_cond_wait(&pf->phase_cond, &pf->phase_lock);
+    }
+  PFBeginExclusive(pf);
+  PFEndExclusive(pf, 0);
+  pthread_mutex_unlock(&pf->phase_lock);
+  return !pf->failed;
+}
+
+void RHHParallelFunnelDestroy(RHHParallelFunnel* pf)
+{
+  if (!pf)
+    return;
+
+  RHHParallelFunnelInsertFlush(pf);
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      pthread_mutex_lock(&pf->queues[i].lock);
+      pf->stop = true;
+      pthread_cond_broadcast(&pf->queues[i].ready);
+      pthread_mutex_unlock(&pf->queues[i].lock);
+    }
+  for (unsigned int i = 0; i < pf->nworkers; i++)
+    {
+      if (pf->workers[i].started)
+        pthread_join(pf->workers[i].thread, NULL);
+      free(pf->workers[i].deferred);
+      pthread_mutex_destroy(&pf->queues[i].lock);
+      pthread_cond_destroy(&pf->queues[i].ready);
+      pthread_cond_destroy(&pf->queues[i].not_full);
+    }
+  pthread_mutex_destroy(&pf->phase_lock);
+  pthread_cond_destroy(&pf->phase_cond);
+  free(pf->queues);
+  free(pf->workers);
+  free(pf);
+}
+
+/*
+ * Read only access.
+ *
+ * Heaps loaded by OPHeapRead are mapped PROT_READ and may be shared by
+ * many processes. The handle lives outside of the heap and caches the
+ * geometry of the table, so lookups only read the bucket array.
+ */
+struct RHHReadOnly
+{
+  const RobinHoodHash* rhh;
+  const uint8_t* buckets;
+  const uint8_t* tags;
+  uint64_t mask;
+  uint64_t capacity;
+  size_t keysize;
+  size_t valsize;
+  size_t bucket_size;
+  int longest_probes;
+  uint8_t capacity_clz;
+  uint8_t capacity_ms4b;
+};
+
+RHHReadOnly* RHHOpenReadOnly(OPHeap* heap, int pos)
+{
+  const RobinHoodHash* rhh;
+  RHHReadOnly* ro;
+  uint64_t capacity;
+  size_t bucket_size;
+
+  // An empty root restores to the heap itself.
+  rhh = OPHeapRestorePtr(heap, pos);
+  if ((void*)rhh == (void*)heap || ObtainOPHeap((void*)rhh) != heap)
+    {
+      OP_LOG_ERROR(logger, "No RobinHoodHash stored at root %d\n", pos);
+      return NULL;
+    }
+  if (rhh->format != RHH_FORMAT)
+    {
+      OP_LOG_ERROR(logger, "RobinHoodHash at root %d has format %#x, "
+                   "expected %#x\n", pos, rhh->format, RHH_FORMAT);
+      return NULL;
+    }
+  if (rhh->old_bucket_ref)
+    {
+      OP_LOG_ERROR(logger, "RobinHoodHash at root %d was stored during "
+                   "an incremental resize\n", pos);
+      return NULL;
+    }
+  if (!rhh->keysize || !rhh->bucket_ref ||
+      rhh->capacity_ms4b < 8 || rhh->capacity_ms4b > 15)
+    {
+      OP_LOG_ERROR(logger, "Corrupted RobinHoodHash at root %d\n", pos);
+      return NULL;
+    }
+  // Lookups trust the header from here on, so the bucket array it
+  // describes must stay inside the heap.
+  bucket_size = rhh->keysize + rhh->valsize + 1;
+  capacity = RHHCapacityInternal(rhh->capacity_clz, rhh->capacity_ms4b);
+  if (capacity > OPHEAP_SIZE / (bucket_size + 1) ||
+      rhh->bucket_ref > OPHEAP_SIZE - BucketArraySize(bucket_size, capacity,
+                                                      rhh->tagged) ||
+      rhh->longest_probes >= PROBE_STATS_SIZE)
+    {
+      OP_LOG_ERROR(logger, "Corrupted RobinHoodHash at root %d\n", pos);
+      return NULL;
+    }
+
+  ro = malloc(sizeof(RHHReadOnly));
+  if (!ro)
+    return NULL;
+  ro->rhh = rhh;
+  ro->buckets = OPRef2Ptr((void*)rhh, rhh->bucket_ref);
+  ro->capacity = capacity;
+  ro->keysize = rhh->keysize;
+  ro->valsize = rhh->valsize;
+  ro->bucket_size = bucket_size;
+  ro->tags = rhh->tagged ? &ro->buckets[ro->bucket_size * ro->capacity] :
+    NULL;
+  ro->mask = (1ULL << (64 - rhh->capacity_clz)) - 1;
+  ro->longest_probes = rhh->longest_probes;
+  ro->capacity_clz = rhh->capacity_clz;
+  ro->capacity_ms4b = rhh->capacity_ms4b;
+  return ro;
+}
+
+void RHHCloseReadOnly(RHHReadOnly* ro)
+{
+  free(ro);
+}
+
+OPHash RHHReadOnlyHasher(const RHHReadOnly* ro)
+{
+  return RHHHasher((RobinHoodHash*)ro->rhh);
+}
+
+uint64_t RHHReadOnlyObjcnt(const RHHReadOnly* ro)
+{
+  return ro->rhh->objcnt;
+}
+
+const void* RHHReadOnlyGetCustom(const RHHReadOnly* ro, OPHash hasher,
+                                 const void* key)
+{
+  const size_t keysize = ro->keysize;
+  const size_t bucket_size = ro->bucket_size;
+  const uint8_t* const buckets = ro->buckets;
+  uint64_t hashed_key;
+  uintptr_t idx;
+
+  RHHCheckHasher(ro->rhh, hasher);
+  hashed_key = hasher((void*)key, keysize);
+  if (ro->tags)
+    {
+      if (!TaggedSearchIdx(buckets, ro->tags, keysize, bucket_size,
+                           ro->capacity_clz, ro->capacity_ms4b,
+                           ro->longest_probes, hashed_key, key, &idx))
+        return NULL;
+      return &buckets[idx*bucket_size + 1 + keysize];
+    }
+  for (int probe = 0; probe <= ro->longest_probes; probe++)
+    {
+      idx = ((hashed_key + probe * probe * 2) & ro->mask) *
+        ro->capacity_ms4b >> 4;
+      switch(buckets[idx*bucket_size])
+        {
+        case 0: return NULL;
+        case 2: continue;
+        default: (void)0;
+        }
+      if (!memcmp(key, &buckets[idx*bucket_size + 1], keysize))
+        return &buckets[idx*bucket_size + 1 + keysize];
+    }
+  return NULL;
+}
+
+void RHHReadOnlyIterate(const RHHReadOnly* ro, OPHashIterator iterator,
+                        void* context)
+{
+  const size_t keysize = ro->keysize;
+  const size_t bucket_size = ro->bucket_size;
+
+  for (uint64_t idx = 0; idx < ro->capacity; idx++)
+    {
+      if (bucket_occupied(ro->buckets[idx*bucket_size]))
+        {
+          iterator((void*)&ro->buckets[idx*bucket_size + 1],
+                   (void*)&ro->buckets[idx*bucket_size + 1 + keysize],
+                   keysize, ro->valsize, context);
+        }
+    }
+}
+
+RHHFunnel* RHHReadOnlyFunnelNewCustom(const RHHReadOnly* ro, OPHash hasher,
+                                      OPFunnelGetCB callback,
+                                      size_t slotsize, size_t partition_size)
+{
+  RHHFunnel* funnel;
+
+  // Lookups through a funnel never write to the table.
+  funnel = RHHFunnelNewCustom((RobinHoodHash*)ro->rhh, hasher, callback,
+                              slotsize, partition_size);
+  funnel->read_only = true;
+  return funnel;
+}
+
 /* robin_hood.c ends here */
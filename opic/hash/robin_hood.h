@@ -62,6 +62,10 @@ typedef struct RobinHoodHash RobinHoodHash;
 
 typedef struct RHHFunnel RHHFunnel;
 
+typedef struct RHHParallelFunnel RHHParallelFunnel;
+
+typedef struct RHHReadOnly RHHReadOnly;
+
 /**
  * @relates RobinHoodHash　
  * @brief Constructor for RobinHoodHash.
@@ -80,6 +84,70 @@ typedef struct RHHFunnel RHHFunnel;
 bool RHHNew(OPHeap* heap, RobinHoodHash** rhh_ref, uint64_t num_objects,
             double load, size_t keysize, size_t valsize);
 
+/**
+ * @relates RobinHoodHash　
+ * @brief Constructor for RobinHoodHash with a tag array for lookups.
+ *
+ * Same parameters as RHHNew. The table additionally keeps one tag
+ * byte per bucket, derived from the top bits of the hash. Lookups
+ * compare a whole group of tags at once and only read the buckets
+ * whose tag matches, which pays off for large keys or miss heavy
+ * workloads at the cost of one extra byte per bucket.
+ *
+ * @return true when the allocation succeeded, false otherwise.
+ */
+bool RHHNewTagged(OPHeap* heap, RobinHoodHash** rhh_ref,
+                  uint64_t num_objects, double load,
+                  size_t keysize, size_t valsize);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Constructs a RobinHoodHash holding the given key value pairs
+ * with specified hash function.
+ *
+ * @param heap OPHeap instance.
+ * @param rhh_ref reference to the RobinHoodHash pointer for assigining
+ * RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param keys num_objects keys of keysize bytes, packed.
+ * @param vals num_objects values of valsize bytes, packed. Can be NULL
+ * when valsize is zero.
+ * @param num_objects number of key value pairs.
+ * @param load (0.0-1.0) how full the hash table could be
+ * before expansion.
+ * @param keysize length of key measured in bytes. Cannot be zero.
+ * @param valsize length of value measured in bytes.
+ * @param nthreads number of threads including the calling thread.
+ * @return true when the allocation succeeded, false otherwise.
+ *
+ * The table is sized once. The pairs are grouped by hash prefix and
+ * each group fills its own region of the bucket array, which replaces
+ * the random writes of num_objects insertions by mostly sequential
+ * ones. Keys must be distinct.
+ *
+ * The table records the OPHashId of hasher, see OPHashToId. The
+ * non-Custom APIs then use hasher, or refuse the table when hasher is
+ * neither OPDefaultHash nor OPCityHash.
+ */
+bool RHHBuildCustom(OPHeap* heap, RobinHoodHash** rhh_ref, OPHash hasher,
+                    void* keys, void* vals, uint64_t num_objects,
+                    double load, size_t keysize, size_t valsize,
+                    unsigned int nthreads);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Constructs a RobinHoodHash holding the given key value pairs
+ * on the calling thread. See RHHBuildCustom.
+ */
+static inline
+bool RHHBuild(OPHeap* heap, RobinHoodHash** rhh_ref,
+              void* keys, void* vals, uint64_t num_objects, double load,
+              size_t keysize, size_t valsize)
+{
+  return RHHBuildCustom(heap, rhh_ref, OPDefaultHash, keys, vals,
+                        num_objects, load, keysize, valsize, 1);
+}
+
 /**
  * @relates RobinHoodHash　
  * @brief Destructor for RobinHoodHash.
@@ -88,6 +156,48 @@ bool RHHNew(OPHeap* heap, RobinHoodHash** rhh_ref, uint64_t num_objects,
  */
 void RHHDestroy(RobinHoodHash* rhh);
 
+/**
+ * @relates RobinHoodHash　
+ * @brief Hash function used by the APIs without a hasher parameter.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @return the hash function recorded in the table header.
+ *
+ * RHHNew records OPDefaultHash. Tables upgraded from older heaps keep
+ * the hash they were built with, see OPHashId.
+ */
+OPHash RHHHasher(RobinHoodHash* rhh);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Converts a RobinHoodHash stored by an older version of the
+ * library to the current format.
+ *
+ * @param rhh_ref reference to the RobinHoodHash pointer restored from
+ * the heap. Points to the converted table on success.
+ * @return true if the table is in the current format, false if it is
+ * not a known format, was not hashed with OPCityHash, or the
+ * allocation failed. The table is left untouched on failure.
+ *
+ * Older tables lack the header fields the other APIs check, and only
+ * mark occupied buckets instead of recording their probe distance.
+ * They were hashed with OPCityHash, which RHHHasher keeps returning
+ * after the conversion. The header is reallocated, so store the new
+ * pointer with OPHeapStorePtr again. Tables in the current format are
+ * returned as they are.
+ */
+bool RHHUpgrade(RobinHoodHash** rhh_ref);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Converts a RobinHoodHash stored by an older version of the
+ * library and built with the specified hash function, see RHHUpgrade.
+ *
+ * The converted table has no recorded hash and must be used with the
+ * Custom APIs.
+ */
+bool RHHUpgradeCustom(RobinHoodHash** rhh_ref, OPHash hasher);
+
 /**
  * @relates RobinHoodHash　
  * @brief Associates the specified key with the specified value in
@@ -198,7 +308,7 @@ void* RHHDeleteCustom(RobinHoodHash* rhh, OPHash hasher, void* key);
 static inline bool
 RHHInsert(RobinHoodHash* rhh, void* key, void* val)
 {
-  return RHHInsertCustom(rhh, OPDefaultHash, key, val);
+  return RHHInsertCustom(rhh, RHHHasher(rhh), key, val);
 }
 
 /**
@@ -239,7 +349,7 @@ RHHInsert(RobinHoodHash* rhh, void* key, void* val)
 static inline bool
 RHHUpsert(RobinHoodHash* rhh, void* key, void** val_ref, bool* is_duplicate)
 {
-  return RHHUpsertCustom(rhh, OPDefaultHash, key, val_ref, is_duplicate);
+  return RHHUpsertCustom(rhh, RHHHasher(rhh), key, val_ref, is_duplicate);
 }
 
 /**
@@ -258,7 +368,7 @@ RHHUpsert(RobinHoodHash* rhh, void* key, void** val_ref, bool* is_duplicate)
 static inline void*
 RHHGet(RobinHoodHash* rhh, void* key)
 {
-  return RHHGetCustom(rhh, OPDefaultHash, key);
+  return RHHGetCustom(rhh, RHHHasher(rhh), key);
 }
 
 /**
@@ -275,9 +385,145 @@ RHHGet(RobinHoodHash* rhh, void* key)
 static inline void*
 RHHDelete(RobinHoodHash* rhh, void* key)
 {
-  return RHHDeleteCustom(rhh, OPDefaultHash, key);
+  return RHHDeleteCustom(rhh, RHHHasher(rhh), key);
+}
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Deletes every key-value pair matching a predicate using
+ * custom hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param predicate returns true for the pairs to delete.
+ * @param context user defined context passed to predicate.
+ * @return number of deleted pairs.
+ *
+ * Deletes in a single pass over the buckets instead of looking up each
+ * key. Pairs that were displaced past a freed bucket are then moved
+ * back along their own probe sequence, so probe lengths shrink as they
+ * would with RHHDeleteCustom. The hash table shrinks at most once, at
+ * the end, if too many entries were deleted. The predicate must not
+ * modify the table.
+ */
+uint64_t RHHDeleteIfCustom(RobinHoodHash* rhh, OPHash hasher,
+                           OPHashPredicate predicate, void* context);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Deletes every key-value pair matching a predicate using
+ * the default hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param predicate returns true for the pairs to delete.
+ * @param context user defined context passed to predicate.
+ * @return number of deleted pairs.
+ *
+ * @code
+ * bool expired(void* key, void* value,
+ *              size_t keysize, size_t valsize, void* context)
+ * {
+ *   struct Session* session = value;
+ *   return session->deadline < *(time_t*)context;
+ * }
+ *
+ * time_t now = time(NULL);
+ * RHHDeleteIf(rhh, expired, &now);
+ * @endcode
+ */
+static inline uint64_t
+RHHDeleteIf(RobinHoodHash* rhh, OPHashPredicate predicate, void* context)
+{
+  return RHHDeleteIfCustom(rhh, RHHHasher(rhh), predicate, context);
 }
 
+/**
+ * @relates RobinHoodHash　
+ * @brief Obtain the values associated with an array of keys using
+ * custom hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param keys n keys stored back to back, each of the hash table's
+ * key size.
+ * @param n number of keys.
+ * @param vals array of n value pointers to fill. Keys that were not
+ * found get NULL.
+ *
+ * Equivalent to calling RHHGetCustom on each key, but the keys are
+ * hashed ahead and their buckets prefetched a few keys in advance, so
+ * the memory latency of random lookups on large tables overlaps.
+ */
+void RHHGetBatchCustom(RobinHoodHash* rhh, OPHash hasher,
+                       void* keys, size_t n, void** vals);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Associates an array of keys with an array of values using
+ * custom hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param keys n keys stored back to back.
+ * @param vals n values stored back to back.
+ * @param n number of key-value pairs.
+ * @return true if all pairs were inserted, false if a resize failed.
+ * Pairs before the failing one remain inserted.
+ *
+ * Same as calling RHHInsertCustom on each pair, with prefetching as in
+ * RHHGetBatchCustom.
+ */
+bool RHHInsertBatchCustom(RobinHoodHash* rhh, OPHash hasher,
+                          void* keys, void* vals, size_t n);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Update or insert an array of keys using custom hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param keys n keys stored back to back.
+ * @param n number of keys.
+ * @param val_refs array of n value pointers to fill.
+ * @param is_duplicate array of n booleans to fill.
+ * @return true if the operation succeeded, false if a resize failed.
+ * val_refs is left untouched on failure.
+ *
+ * Works like RHHUpsertCustom on each key. The value pointers are
+ * resolved after all keys were placed, hence all of them remain valid
+ * until the next modification of the hash table. A key repeated in the
+ * batch gets is_duplicate set on its later occurrences and shares the
+ * same value pointer.
+ */
+bool RHHUpsertBatchCustom(RobinHoodHash* rhh, OPHash hasher,
+                          void* keys, size_t n,
+                          void** val_refs, bool* is_duplicate);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Batched RHHGet. See RHHGetBatchCustom.
+ *
+ * Keys are hashed a chunk at a time with OPHashBatch.
+ */
+void RHHGetBatch(RobinHoodHash* rhh, void* keys, size_t n, void** vals);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Batched RHHInsert. See RHHInsertBatchCustom.
+ *
+ * Keys are hashed a chunk at a time with OPHashBatch.
+ */
+bool RHHInsertBatch(RobinHoodHash* rhh, void* keys, void* vals, size_t n);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Batched RHHUpsert. See RHHUpsertBatchCustom.
+ *
+ * Keys are hashed a chunk at a time with OPHashBatch.
+ */
+bool RHHUpsertBatch(RobinHoodHash* rhh, void* keys, size_t n,
+                    void** val_refs, bool* is_duplicate);
+
 /**
  * @relates RobinHoodHash　
  * @brief Obtain the number of objects stored in this hash table.
@@ -334,10 +580,141 @@ size_t RHHValsize(RobinHoodHash* rhh);
  */
 void RHHIterate(RobinHoodHash* rhh, OPHashIterator iterator, void* context);
 
+/**
+ * @relates RobinHoodHash　
+ * @brief Returns the next batch of key-value pairs of a scan.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param cursor scan position, zero initialized for a new scan and
+ * advanced by each call.
+ * @param max maximum number of pairs to return.
+ * @param keys array of max key pointers to fill.
+ * @param vals array of max value pointers to fill, or NULL.
+ * @return number of pairs filled in. 0 once the scan is complete.
+ *
+ * Visits the same pairs as RHHIterate, in the same order, but hands
+ * them out in batches so that a scan can be paused and resumed. The
+ * pointers stay valid until the table is modified. Modifying the table
+ * during a scan is safe, but pairs moved by it may be skipped or
+ * returned twice.
+ *
+ * @code
+ * OPHashCursor cursor = {0};
+ * void *keys[256], *vals[256];
+ * size_t n;
+ *
+ * while ((n = RHHCursorNext(rhh, &cursor, 256, keys, vals)))
+ *   export(keys, vals, n);
+ * @endcode
+ */
+size_t RHHCursorNext(RobinHoodHash* rhh, OPHashCursor* cursor, size_t max,
+                     void** keys, void** vals);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Iterates over all key-value pairs with several threads.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param nthreads number of threads including the calling one. 0 and 1
+ * iterate on the calling thread.
+ * @param iterator function pointer to user defined iterator function.
+ * @param context user defined context, shared by all threads.
+ *
+ * The bucket array is cut into ranges which the threads claim one at a
+ * time, so uneven ranges do not hold up the scan. The iterator runs
+ * concurrently on different pairs and must synchronize its access to
+ * context. Returns once every pair has been visited. The table must
+ * not be modified meanwhile.
+ */
+void RHHParallelIterate(RobinHoodHash* rhh, unsigned int nthreads,
+                        OPHashIterator iterator, void* context);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Spreads resizing over subsequent modifications instead of
+ * rehashing the whole table at once.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param incremental true to enable incremental resize, false to
+ * restore the default stop-the-world resize.
+ *
+ * When enabled, a resize only allocates the new bucket array. The old
+ * array is kept until every entry has moved over: each insert, upsert
+ * or delete migrates a small, bounded number of old buckets, and
+ * lookups search both arrays. Lookups never migrate entries, hence
+ * pointers returned by RHHGetCustom stay valid until the next
+ * modification, same as before.
+ */
+void RHHSetIncrementalResize(RobinHoodHash* rhh, bool incremental);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Sets the number of threads used by blocking resizes.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param nthreads number of threads including the calling thread,
+ * capped at 256. 0 or 1 rehashes on the calling thread only.
+ *
+ * A blocking resize splits the table by hash prefix so that every
+ * thread fills its own region of the new bucket array; the few entries
+ * crossing region boundaries are inserted by the calling thread
+ * afterwards. Small tables are always rehashed on the calling thread.
+ * This does not apply to incremental resizes, see
+ * RHHSetIncrementalResize.
+ */
+void RHHSetResizeThreads(RobinHoodHash* rhh, unsigned int nthreads);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Migrates up to nbuckets buckets of an in-flight incremental
+ * resize using the specified hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param nbuckets number of old buckets to migrate. Use UINT64_MAX to
+ * finish the resize.
+ * @return true if the resize is still in progress, false otherwise.
+ *
+ * Useful for draining a resize from an idle loop, so that the hash
+ * table does not carry two bucket arrays for long under a read mostly
+ * workload.
+ */
+bool RHHResizeStepCustom(RobinHoodHash* rhh, OPHash hasher,
+                         uint64_t nbuckets);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Migrates up to nbuckets buckets of an in-flight incremental
+ * resize using the default hash function.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param nbuckets number of old buckets to migrate. Use UINT64_MAX to
+ * finish the resize.
+ * @return true if the resize is still in progress, false otherwise.
+ */
+static inline bool
+RHHResizeStep(RobinHoodHash* rhh, uint64_t nbuckets)
+{
+  return RHHResizeStepCustom(rhh, RHHHasher(rhh), nbuckets);
+}
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Fills in load, probe and memory statistics of the table.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param stats stats to fill.
+ *
+ * Cheap enough to call from a metrics endpoint; it does not scan the
+ * buckets. Pass the result to OPHashStatsPrometheus or OPHashStatsJSON
+ * to export it.
+ */
+void RHHGetStats(RobinHoodHash* rhh, OPHashStats* stats);
+
 /**
  * @relates RobinHoodHash　
  * @brief Prints the accumulated count for each probing number.
- * @todo make this API easier to process by cilent, not just printing.
+ * @see RHHGetStats for a structured version.
  */
 void RHHPrintStat(RobinHoodHash* rhh);
 
@@ -353,10 +730,46 @@ RHHFunnel* RHHFunnelNew(RobinHoodHash* rhh,
                         size_t slotsize,
                         size_t partition_size)
 {
-  return RHHFunnelNewCustom(rhh, OPDefaultHash, callback,
+  return RHHFunnelNewCustom(rhh, RHHHasher(rhh), callback,
                             slotsize, partition_size);
 }
 
+/**
+ * @relates RobinHoodHash　
+ * @brief Creates a funnel that interleaves lookups instead of
+ * partitioning them.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param callback OPFunnelGetCB called for each lookup.
+ * @param max_ctxsize largest context size passed to RHHFunnelGet.
+ * @param window number of lookups kept in flight.
+ * @return the funnel.
+ *
+ * Up to window lookups are kept in flight. Each of them prefetches its
+ * next probe and yields to the others, so memory latency overlaps
+ * without buffering whole partitions. Callbacks are still called out
+ * of order, but every lookup completes within a bounded number of
+ * later RHHFunnelGet calls. RHHFunnelGetFlush completes the remaining
+ * lookups; the hash table must not be modified while any are pending.
+ * The funnel only serves RHHFunnelGet and RHHFunnelPreHashGet.
+ */
+RHHFunnel* RHHFunnelNewInterleavedCustom(RobinHoodHash* rhh,
+                                         OPHash hasher,
+                                         FunnelCB callback,
+                                         size_t max_ctxsize,
+                                         unsigned int window);
+
+static inline
+RHHFunnel* RHHFunnelNewInterleaved(RobinHoodHash* rhh,
+                                   FunnelCB callback,
+                                   size_t max_ctxsize,
+                                   unsigned int window)
+{
+  return RHHFunnelNewInterleavedCustom(rhh, RHHHasher(rhh), callback,
+                                       max_ctxsize, window);
+}
+
 void RHHFunnelDestroy(RHHFunnel* funnel);
 
 void RHHFunnelPreHashInsert(RHHFunnel* funnel,
@@ -393,6 +806,159 @@ void RHHFunnelDelete(RHHFunnel* funnel, void* key,
 
 void RHHFunnelDeleteFlush(RHHFunnel* funnel);
 
+/**
+ * @relates RobinHoodHash　
+ * @brief Creates a funnel that inserts with several worker threads.
+ *
+ * @param rhh RobinHoodHash instance.
+ * @param hasher hash function.
+ * @param nworkers number of worker threads to start.
+ * @param chunk_size number of entries handed to a worker at once.
+ * @return the parallel funnel.
+ *
+ * Each worker owns the buckets of a disjoint range of hash prefixes and
+ * inserts into them without locking. RHHParallelFunnelInsert may be
+ * called from any number of producer threads; entries are queued for
+ * the worker owning their prefix. The few insertions that would cross
+ * into buckets of another worker are applied when the table grows or
+ * on RHHParallelFunnelInsertFlush. Entries of the same producer and
+ * key are applied in order, so the last value wins.
+ *
+ * While the table is too small to give every worker many chunks worth
+ * of buckets, fewer workers share the work, down to a single one.
+ *
+ * The hash table must not be accessed by other means until
+ * RHHParallelFunnelInsertFlush returns.
+ */
+RHHParallelFunnel* RHHParallelFunnelNewCustom(RobinHoodHash* rhh,
+                                              OPHash hasher,
+                                              unsigned int nworkers,
+                                              size_t chunk_size);
+
+static inline
+RHHParallelFunnel* RHHParallelFunnelNew(RobinHoodHash* rhh,
+                                        unsigned int nworkers,
+                                        size_t chunk_size)
+{
+  return RHHParallelFunnelNewCustom(rhh, RHHHasher(rhh),
+                                    nworkers, chunk_size);
+}
+
+void RHHParallelFunnelPreHashInsert(RHHParallelFunnel* funnel,
+                                    uint64_t hashed_key,
+                                    void* key, void* value);
+
+void RHHParallelFunnelInsert(RHHParallelFunnel* funnel,
+                             void* key, void* value);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Waits until every queued entry is in the hash table.
+ *
+ * @param funnel RHHParallelFunnel instance.
+ * @return false if growing the hash table failed at some point.
+ *
+ * Producers must have stopped calling RHHParallelFunnelInsert.
+ */
+bool RHHParallelFunnelInsertFlush(RHHParallelFunnel* funnel);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Flushes the funnel and stops its worker threads.
+ */
+void RHHParallelFunnelDestroy(RHHParallelFunnel* funnel);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Opens a RobinHoodHash stored in a heap for lookups only.
+ *
+ * @param heap OPHeap instance, typically loaded by OPHeapRead.
+ * @param pos root position the RobinHoodHash was stored at with
+ * OPHeapStorePtr.
+ * @return the read only handle, or NULL if no usable RobinHoodHash is
+ * stored at pos.
+ *
+ * Lookups, iteration and funnel lookups through the handle never
+ * write to the heap, so a heap mapped read only can be shared by any
+ * number of threads or processes. The handle caches the geometry of
+ * the table and lives outside of the heap. A table stored while an
+ * incremental resize was in flight is refused; finish the resize with
+ * RHHResizeStep before writing the heap. So is a table written by an
+ * older version of the library; convert it with RHHUpgrade on a
+ * writable heap first.
+ */
+RHHReadOnly* RHHOpenReadOnly(OPHeap* heap, int pos);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Releases a handle obtained from RHHOpenReadOnly.
+ */
+void RHHCloseReadOnly(RHHReadOnly* ro);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Obtains the number of objects in the hash table opened by a
+ * read only handle.
+ *
+ * @param ro RHHReadOnly instance.
+ * @return number of objects stored.
+ */
+uint64_t RHHReadOnlyObjcnt(const RHHReadOnly* ro);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Obtains the value associated with the key through a read
+ * only handle with specified hash function.
+ *
+ * @param ro RHHReadOnly handle.
+ * @param hasher hash function the table was built with.
+ * @param key pointer to the key.
+ * @return pointer to the value in the heap, or NULL if not found.
+ */
+const void* RHHReadOnlyGetCustom(const RHHReadOnly* ro, OPHash hasher,
+                                 const void* key);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Hash function recorded in the table of a read only handle,
+ * see RHHHasher.
+ */
+OPHash RHHReadOnlyHasher(const RHHReadOnly* ro);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Obtains the value associated with the key through a read
+ * only handle.
+ */
+static inline
+const void* RHHReadOnlyGet(const RHHReadOnly* ro, const void* key)
+{
+  return RHHReadOnlyGetCustom(ro, RHHReadOnlyHasher(ro), key);
+}
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Iterates over the entries of a read only handle.
+ *
+ * The iterator receives pointers into the heap and must not write
+ * through them.
+ */
+void RHHReadOnlyIterate(const RHHReadOnly* ro, OPHashIterator iterator,
+                        void* context);
+
+/**
+ * @relates RobinHoodHash　
+ * @brief Creates a funnel serving RHHFunnelGet on a read only handle.
+ *
+ * Same parameters as RHHFunnelNewCustom. The funnel supports
+ * RHHFunnelGet and RHHFunnelGetFlush only. Destroy it with
+ * RHHFunnelDestroy before closing the handle.
+ */
+RHHFunnel* RHHReadOnlyFunnelNewCustom(const RHHReadOnly* ro, OPHash hasher,
+                                      OPFunnelGetCB callback,
+                                      size_t slotsize,
+                                      size_t partition_size);
+
 OP_END_DECLS
 
 #endif
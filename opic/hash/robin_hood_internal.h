@@ -0,0 +1,145 @@
+/* robin_hood_internal.h ---
+ *
+ * Filename: robin_hood_internal.h
+ * Description: Definitions shared by the robin hood hash variants
+ *              and robin_hood_spec.h
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#ifndef OPIC_HASH_ROBIN_HOOD_INTERNAL_H
+#define OPIC_HASH_ROBIN_HOOD_INTERNAL_H 1
+
+#include <stddef.h>
+#include "opic/common/op_assert.h"
+#include "opic/common/op_macros.h"
+#include "robin_hood.h"
+
+OP_BEGIN_DECLS
+
+// Persisted in the table header, keep in sync with OPHashStats.
+#define PROBE_STATS_SIZE OP_HASH_PROBE_HIST_SIZE
+
+// Bucket control byte. 0 is empty and 2 is tombstone. Occupied buckets
+// set BUCKET_OCCUPIED and keep their probe distance in the low 7 bits,
+// so that displacement is known without re-hashing the key. Probes
+// from PROBE_UNKNOWN on saturate and fall back to re-hashing.
+#define BUCKET_OCCUPIED 0x80
+#define PROBE_UNKNOWN 0x7F
+#define bucket_occupied(flag) ((flag) & BUCKET_OCCUPIED)
+#define bucket_flag(probe) \
+  (BUCKET_OCCUPIED | ((probe) < PROBE_UNKNOWN ? (probe) : PROBE_UNKNOWN))
+
+// Header format, "RHH" followed by a version byte. Tables created
+// before the header carried a format read 0: the field occupies what
+// used to be padding, and headers always come from OPCalloc. Fields
+// after bucket_ref, and the control byte above, exist since version 1.
+// Format 0 marked every occupied bucket with LEGACY_OCCUPIED.
+#define LEGACY_OCCUPIED 1
+#define RHH_FORMAT 0x52484801
+
+struct RobinHoodHash
+{
+  uint64_t objcnt;
+  uint64_t objcnt_high;
+  uint64_t objcnt_low;
+  uint64_t large_data_threshold;
+  uint8_t capacity_clz;    // leading zeros of capacity
+  uint8_t capacity_ms4b;   // most significant 4 bits
+  uint16_t longest_probes;
+  uint32_t format;
+  size_t keysize;
+  size_t valsize;
+  uint32_t stats[PROBE_STATS_SIZE];
+  opref_t bucket_ref;
+  // Whether a tag array follows the buckets. Fixed at creation.
+  bool tagged;
+  // Incremental resize. While old_bucket_ref is set, entries not yet
+  // migrated live in the old bucket array from migrate_idx onwards.
+  bool incremental_resize;
+  uint16_t resize_threads;
+  uint8_t old_capacity_clz;
+  uint8_t old_capacity_ms4b;
+  uint16_t old_longest_probes;
+  uint64_t migrate_idx;
+  opref_t old_bucket_ref;
+  uint32_t resizes;
+  // OPHashId of the APIs without a hasher parameter.
+  uint8_t hash_id;
+};
+
+_Static_assert(offsetof(RobinHoodHash, bucket_ref) == 312,
+               "fields up to bucket_ref are shared with older heaps");
+
+static inline void
+RHHCheckFormat(const RobinHoodHash* rhh)
+{
+  op_assert(rhh->format == RHH_FORMAT,
+            "RobinHoodHash %p has format %#x, expected %#x; "
+            "tables from older heaps need RHHUpgrade\n",
+            (void*)rhh, rhh->format, RHH_FORMAT);
+}
+
+bool RHHPreHashInsertCustom(RobinHoodHash* rhh, OPHash hasher,
+                            uint64_t hashed_key, void* key, void* val)
+  __attribute__ ((visibility ("internal")));
+
+void* RHHPreHashDeleteCustom(RobinHoodHash* rhh, OPHash hasher,
+                             uint64_t hashed_key, void* key)
+  __attribute__ ((visibility ("internal")));
+
+/*
+ * Optimistic lookup that copies the value out instead of returning a
+ * pointer into the bucket array.  It may run while another thread
+ * modifies or resizes rhh; the result is only meaningful if the caller
+ * can prove afterwards that no writer touched rhh in the meantime
+ * (e.g. with a sequence lock).  It never reads outside the heap and
+ * never loops for more than PROBE_STATS_SIZE probes.
+ */
+bool RHHPreHashGetCopy(RobinHoodHash* rhh, uint64_t hashed_key,
+                       void* key, void* val)
+  __attribute__ ((visibility ("internal")));
+
+OP_END_DECLS
+
+#endif
+/* robin_hood_internal.h ends here */
@@ -0,0 +1,236 @@
+/**
+ * @file robin_hood_spec.h
+ * @brief RobinHoodHash operations specialized for fixed key and value
+ * sizes.
+ * @author Felix Chern
+ * @date Sun Oct 18 2026
+ * @copyright 2017 Felix Chern
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#ifndef OPIC_HASH_ROBIN_HOOD_SPEC_H
+#define OPIC_HASH_ROBIN_HOOD_SPEC_H 1
+
+#include <string.h>
+#include "opic/common/op_assert.h"
+#include "robin_hood.h"
+#include "robin_hood_internal.h"
+
+OP_BEGIN_DECLS
+
+// Bound on displacement steps taken by a specialized insert before it
+// hands the entry it carries over to RHHInsertCustom.
+#define RHH_SPEC_MAX_STEPS (PROBE_STATS_SIZE * 4)
+
+#define RHH_SPEC_IDX(hashed_key, probe, mask, ms4b)                     \
+  ((((hashed_key) + (uint64_t)(probe) * (probe) * 2) & (mask)) * (ms4b) >> 4)
+
+/**
+ * @ingroup hash
+ * @brief Generates RobinHoodHash functions for a fixed key and value size.
+ *
+ * @param NAME suffix of the generated functions.
+ * @param KEYSIZE key size in bytes, a compile time constant.
+ * @param VALSIZE value size in bytes, a compile time constant.
+ * @param HASHER function of type OPHash. Prefer a static inline one so
+ * that the compiler can inline it.
+ * @param HASH_ID OPHashId of HASHER, OP_HASH_ID_NONE if it has none.
+ *
+ * The macro defines `RHHNew##NAME`, `RHHInsert##NAME`, `RHHGet##NAME`
+ * and `RHHDelete##NAME`. They work on an ordinary RobinHoodHash whose
+ * key and value sizes are KEYSIZE and VALSIZE and whose recorded hash
+ * is HASH_ID, so the same table can also be passed to the generic API
+ * with HASHER as the hash function. `RHHNew##NAME` records HASH_ID;
+ * the other functions abort on tables recorded with another hash, e.g.
+ * tables upgraded from older heaps when HASHER is OPDefaultHash.
+ * With the sizes known, bucket offsets fold into constants and key
+ * compares become one or two word compares.
+ *
+ * Lookups and inserts run the specialized code on the common path and
+ * fall back to RHHGetCustom or RHHInsertCustom when the table is
+ * tagged, an incremental resize is in flight, the table needs to grow,
+ * or a displacement chain runs unusually long. Deletes always use the
+ * generic path.
+ *
+ * Example usage:
+ * @code
+ * RHH_SPECIALIZE(U64, 8, 8, MyInlineHash, OP_HASH_ID_NONE)
+ *
+ * RobinHoodHash* rhh;
+ * uint64_t key = 1, val = 2;
+ * RHHNewU64(heap, &rhh, 1000, 0.8);
+ * RHHInsertU64(rhh, &key, &val);
+ * uint64_t* val_ptr = RHHGetU64(rhh, &key);
+ * @endcode
+ */
+#define RHH_SPECIALIZE(NAME, KEYSIZE, VALSIZE, HASHER, HASH_ID)         \
+  static inline bool                                                    \
+  RHHNew##NAME(OPHeap* heap, RobinHoodHash** rhh_ref,                   \
+               uint64_t num_objects, double load)                       \
+  {                                                                     \
+    if (!RHHNew(heap, rhh_ref, num_objects, load, KEYSIZE, VALSIZE))    \
+      return false;                                                     \
+    (*rhh_ref)->hash_id = (HASH_ID);                                    \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  RHHCheckSpec##NAME(const RobinHoodHash* rhh)                          \
+  {                                                                     \
+    RHHCheckFormat(rhh);                                                \
+    op_assert(rhh->keysize == (KEYSIZE) && rhh->valsize == (VALSIZE),   \
+              "RobinHoodHash sizes %zu/%zu do not match %d/%d\n",       \
+              rhh->keysize, rhh->valsize, (int)(KEYSIZE), (int)(VALSIZE)); \
+    op_assert(rhh->hash_id == (HASH_ID),                                \
+              "RobinHoodHash %p records hash %d, " #NAME " uses %d\n",  \
+              (void*)rhh, (int)rhh->hash_id, (int)(HASH_ID));           \
+  }                                                                     \
+                                                                        \
+  static inline void*                                                   \
+  RHHGet##NAME(RobinHoodHash* rhh, void* key)                           \
+  {                                                                     \
+    const size_t bucket_size = 1 + (KEYSIZE) + (VALSIZE);               \
+    uint64_t hashed_key, mask;                                          \
+    uint8_t* buckets;                                                   \
+    uint8_t* bucket;                                                    \
+                                                                        \
+    RHHCheckSpec##NAME(rhh);                                            \
+    if (op_unlikely(rhh->tagged || rhh->old_bucket_ref))                \
+      return RHHGetCustom(rhh, HASHER, key);                            \
+                                                                        \
+    hashed_key = HASHER(key, KEYSIZE);                                  \
+    mask = (1ULL << (64 - rhh->capacity_clz)) - 1;                      \
+    buckets = OPRef2Ptr(rhh, rhh->bucket_ref);                          \
+    for (int probe = 0; probe <= rhh->longest_probes; probe++)          \
+      {                                                                 \
+        bucket = &buckets[RHH_SPEC_IDX(hashed_key, probe, mask,         \
+                                       rhh->capacity_ms4b) * bucket_size]; \
+        if (bucket[0] == 0)                                             \
+          return NULL;                                                  \
+        if (bucket[0] == 2)                                             \
+          continue;                                                     \
+        if (!memcmp(key, &bucket[1], KEYSIZE))                          \
+          return &bucket[1 + (KEYSIZE)];                                \
+      }                                                                 \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool                                                    \
+  RHHInsert##NAME(RobinHoodHash* rhh, void* key, void* val)             \
+  {                                                                     \
+    const size_t bucket_size = 1 + (KEYSIZE) + (VALSIZE);               \
+    uint8_t bucket_cpy[1 + (KEYSIZE) + (VALSIZE)];                      \
+    uint8_t bucket_tmp[1 + (KEYSIZE) + (VALSIZE)];                      \
+    uint64_t hashed_key, mask;                                          \
+    uint8_t* buckets;                                                   \
+    uint8_t* bucket;                                                    \
+    int probe, old_probe;                                               \
+                                                                        \
+    RHHCheckSpec##NAME(rhh);                                            \
+    if (op_unlikely(rhh->tagged || rhh->old_bucket_ref ||               \
+                    rhh->objcnt > rhh->objcnt_high))                    \
+      return RHHInsertCustom(rhh, HASHER, key, val);                    \
+                                                                        \
+    hashed_key = HASHER(key, KEYSIZE);                                  \
+    mask = (1ULL << (64 - rhh->capacity_clz)) - 1;                      \
+    buckets = OPRef2Ptr(rhh, rhh->bucket_ref);                          \
+    for (probe = 0; probe <= rhh->longest_probes; probe++)              \
+      {                                                                 \
+        bucket = &buckets[RHH_SPEC_IDX(hashed_key, probe, mask,         \
+                                       rhh->capacity_ms4b) * bucket_size]; \
+        if (bucket[0] == 0)                                             \
+          break;                                                        \
+        if (bucket[0] == 2)                                             \
+          continue;                                                     \
+        if (!memcmp(key, &bucket[1], KEYSIZE))                          \
+          {                                                             \
+            memcpy(&bucket[1 + (KEYSIZE)], val, VALSIZE);               \
+            return true;                                                \
+          }                                                             \
+      }                                                                 \
+                                                                        \
+    /* The key is absent; place it the robin hood way. */               \
+    memcpy(&bucket_cpy[1], key, KEYSIZE);                               \
+    memcpy(&bucket_cpy[1 + (KEYSIZE)], val, VALSIZE);                   \
+    probe = 0;                                                          \
+    for (int step = 0; step < RHH_SPEC_MAX_STEPS; step++)               \
+      {                                                                 \
+        if (probe >= PROBE_STATS_SIZE)                                  \
+          break;                                                        \
+        bucket = &buckets[RHH_SPEC_IDX(hashed_key, probe, mask,         \
+                                       rhh->capacity_ms4b) * bucket_size]; \
+        if (!bucket_occupied(bucket[0]))                                \
+          {                                                             \
+            rhh->objcnt++;                                              \
+            rhh->longest_probes = probe > rhh->longest_probes ?         \
+              probe : rhh->longest_probes;                              \
+            rhh->stats[probe]++;                                        \
+            memcpy(bucket, bucket_cpy, bucket_size);                    \
+            bucket[0] = bucket_flag(probe);                             \
+            return true;                                                \
+          }                                                             \
+        old_probe = bucket[0] & PROBE_UNKNOWN;                          \
+        if (old_probe == PROBE_UNKNOWN)                                 \
+          break;                                                        \
+        if (probe > old_probe)                                          \
+          {                                                             \
+            rhh->longest_probes = probe > rhh->longest_probes ?         \
+              probe : rhh->longest_probes;                              \
+            rhh->stats[old_probe]--;                                    \
+            rhh->stats[probe]++;                                        \
+            memcpy(bucket_tmp, bucket, bucket_size);                    \
+            memcpy(bucket, bucket_cpy, bucket_size);                    \
+            bucket[0] = bucket_flag(probe);                             \
+            memcpy(bucket_cpy, bucket_tmp, bucket_size);                \
+            probe = old_probe + 1;                                      \
+            hashed_key = HASHER(&bucket_cpy[1], KEYSIZE);               \
+            continue;                                                   \
+          }                                                             \
+        probe++;                                                        \
+      }                                                                 \
+    /* The carried entry is not in the table, the generic insert */     \
+    /* counts it and finishes the push down. */                         \
+    return RHHInsertCustom(rhh, HASHER, &bucket_cpy[1],                 \
+                           &bucket_cpy[1 + (KEYSIZE)]);                 \
+  }                                                                     \
+                                                                        \
+  static inline void*                                                   \
+  RHHDelete##NAME(RobinHoodHash* rhh, void* key)                        \
+  {                                                                     \
+    RHHCheckSpec##NAME(rhh);                                            \
+    return RHHDeleteCustom(rhh, HASHER, key);                           \
+  }
+
+/**
+ * @ingroup hash
+ * @brief Common specializations using OPDefaultHash.
+ *
+ * RHHGetK8V8, RHHInsertK8V8 etc. for 8 byte keys with 8 byte values,
+ * K16V8 for 16 byte keys with 8 byte values and K32V16 for 32 byte
+ * keys with 16 byte values. They abort on tables whose RHHHasher is
+ * not OPDefaultHash, e.g. tables upgraded from older heaps.
+ */
+RHH_SPECIALIZE(K8V8, 8, 8, OPDefaultHash, OP_HASH_ID_DEFAULT)
+RHH_SPECIALIZE(K16V8, 16, 8, OPDefaultHash, OP_HASH_ID_DEFAULT)
+RHH_SPECIALIZE(K32V16, 32, 16, OPDefaultHash, OP_HASH_ID_DEFAULT)
+
+OP_END_DECLS
+
+#endif
+
+/* robin_hood_spec.h ends here */
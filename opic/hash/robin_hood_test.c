@@ -49,18 +49,25 @@
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <string.h>
 #include <cmocka.h>
 
+#include "opic/common/op_atomic.h"
 #include "opic/common/op_log.h"
 #include "robin_hood.h"
+#include "robin_hood_spec.h"
 
 OP_LOGGER_FACTORY(logger, "opic.hash.robin_hood_test");
 
 #define TEST_OBJECTS (1<<15)
 #define SMALL_TEST_OBJECTS 20
 
+RHH_SPECIALIZE(K8V8City, 8, 8, OPCityHash, OP_HASH_ID_CITY)
+
 static int objcnt = 0;
 static uint8_t objmap[TEST_OBJECTS];
 
@@ -544,6 +551,50 @@ test_FunnelGet(void** context)
   OPHeapDestroy(heap);
 }
 
+static void
+test_FunnelInterleavedGet(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  RHHFunnel* funnel;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, TEST_OBJECTS,
+                     0.8, sizeof(int), sizeof(int)));
+
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      RHHInsert(rhh, &i, &i);
+    }
+
+  ResetObjcnt();
+  funnel = RHHFunnelNewInterleaved(rhh, funnel_count_objects,
+                                   sizeof(int), 16);
+  for (int i = 0; i < TEST_OBJECTS * 2; i++)
+    {
+      RHHFunnelGet(funnel, &i, &i, sizeof(int));
+    }
+  RHHFunnelGetFlush(funnel);
+  RHHFunnelDestroy(funnel);
+  assert_int_equal(TEST_OBJECTS, objcnt);
+
+  ResetObjmap();
+  funnel = RHHFunnelNewInterleaved(rhh, funnel_check_objects, 0, 1);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      RHHFunnelGet(funnel, &i, NULL, 0);
+    }
+  RHHFunnelGetFlush(funnel);
+  RHHFunnelDestroy(funnel);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_int_equal(1, objmap[i]);
+    }
+
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
 static void
 test_FunnelDelete(void** context)
 {
@@ -581,6 +632,979 @@ test_FunnelDelete(void** context)
   OPHeapDestroy(heap);
 }
 
+static void
+test_IncrementalResize(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  int* val;
+  bool is_duplicate, resizing;
+  int resizes;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+  RHHSetIncrementalResize(rhh, true);
+
+  resizes = 0;
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_true(RHHInsert(rhh, &i, &i));
+      resizing = RHHResizeStep(rhh, 0);
+      // Every key must stay reachable while entries are split
+      // between the old and the new bucket array.
+      if (resizing && i % 1024 == 0)
+        {
+          resizes++;
+          for (int j = 0; j <= i; j++)
+            {
+              val = RHHGet(rhh, &j);
+              assert_non_null(val);
+              assert_int_equal(j, *val);
+            }
+        }
+    }
+  assert_true(resizes > 0);
+  assert_int_equal(TEST_OBJECTS, RHHObjcnt(rhh));
+
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_true(RHHUpsert(rhh, &i, (void**)&val, &is_duplicate));
+      assert_true(is_duplicate);
+      assert_int_equal(i, *val);
+    }
+
+  for (int i = 0; i < TEST_OBJECTS; i += 2)
+    {
+      val = RHHDelete(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+  assert_int_equal(TEST_OBJECTS / 2, RHHObjcnt(rhh));
+  ResetObjcnt();
+  RHHIterate(rhh, CountObjects, NULL);
+  assert_int_equal(TEST_OBJECTS / 2, objcnt);
+
+  assert_false(RHHResizeStep(rhh, UINT64_MAX));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      if (i % 2)
+        assert_non_null(RHHGet(rhh, &i));
+      else
+        assert_null(RHHGet(rhh, &i));
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_ParallelResize(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+  RHHSetResizeThreads(rhh, 4);
+
+  for (int i = 0; i < TEST_OBJECTS * 4; i++)
+    assert_true(RHHInsert(rhh, &i, &i));
+  assert_int_equal(TEST_OBJECTS * 4, RHHObjcnt(rhh));
+  ResetObjcnt();
+  RHHIterate(rhh, CountObjects, NULL);
+  assert_int_equal(TEST_OBJECTS * 4, objcnt);
+  for (int i = 0; i < TEST_OBJECTS * 4; i++)
+    {
+      val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+
+  // Shrinks the table with the parallel rehash as well.
+  for (int i = TEST_OBJECTS; i < TEST_OBJECTS * 4; i++)
+    assert_non_null(RHHDelete(rhh, &i));
+  assert_int_equal(TEST_OBJECTS, RHHObjcnt(rhh));
+  ResetObjmap();
+  RHHIterate(rhh, CheckObjects, NULL);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_int_equal(1, objmap[i]);
+      val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_TaggedLookup(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  int* val;
+  bool is_duplicate;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNewTagged(heap, &rhh, 20,
+                           0.9, sizeof(int), sizeof(int)));
+
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    assert_true(RHHInsert(rhh, &i, &i));
+  for (int i = 0; i < TEST_OBJECTS * 2; i++)
+    {
+      val = RHHGet(rhh, &i);
+      if (i < TEST_OBJECTS)
+        {
+          assert_non_null(val);
+          assert_int_equal(i, *val);
+        }
+      else
+        assert_null(val);
+    }
+
+  // Deletes leave tombstones and shift entries back; both must be
+  // reflected in the tags.
+  for (int i = 0; i < TEST_OBJECTS; i += 3)
+    assert_non_null(RHHDelete(rhh, &i));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_true(RHHUpsert(rhh, &i, (void**)&val, &is_duplicate));
+      assert_int_equal(i % 3 != 0, is_duplicate);
+      *val = i;
+    }
+  assert_int_equal(TEST_OBJECTS, RHHObjcnt(rhh));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_Batch(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  int keys[TEST_OBJECTS], vals[TEST_OBJECTS];
+  int* val_refs[TEST_OBJECTS];
+  bool is_duplicate[TEST_OBJECTS];
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      keys[i] = i * 2;
+      vals[i] = i;
+    }
+  assert_true(RHHInsertBatch(rhh, keys, vals, TEST_OBJECTS));
+  assert_int_equal(TEST_OBJECTS, RHHObjcnt(rhh));
+
+  // Half of the keys hit, half of them miss.
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    keys[i] = i;
+  RHHGetBatch(rhh, keys, TEST_OBJECTS, (void**)val_refs);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      if (i % 2)
+        assert_null(val_refs[i]);
+      else
+        {
+          assert_non_null(val_refs[i]);
+          assert_int_equal(i / 2, *val_refs[i]);
+        }
+    }
+
+  // Upserting the odd keys grows the table while the batch runs.
+  assert_true(RHHUpsertBatch(rhh, keys, TEST_OBJECTS,
+                             (void**)val_refs, is_duplicate));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_int_equal(i % 2 == 0, is_duplicate[i]);
+      if (!is_duplicate[i])
+        *val_refs[i] = -i;
+    }
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      int* val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i % 2 ? -i : i / 2, *val);
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+struct ParallelFunnelProducer
+{
+  RHHParallelFunnel* funnel;
+  int first;
+  int step;
+  int offset;
+};
+
+static void*
+ParallelFunnelProduce(void* arg)
+{
+  struct ParallelFunnelProducer* producer = arg;
+  int val;
+
+  for (int i = producer->first; i < TEST_OBJECTS * 4; i += producer->step)
+    {
+      val = i + producer->offset;
+      RHHParallelFunnelInsert(producer->funnel, &i, &val);
+    }
+  return NULL;
+}
+
+static void
+test_ParallelFunnel(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  RHHParallelFunnel* funnel;
+  struct ParallelFunnelProducer producers[2];
+  pthread_t threads[2];
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+  funnel = RHHParallelFunnelNew(rhh, 4, 256);
+
+  // Two producers, starting from a tiny table so that workers keep
+  // growing it under each other.
+  for (int i = 0; i < 2; i++)
+    {
+      producers[i].funnel = funnel;
+      producers[i].first = i;
+      producers[i].step = 2;
+      producers[i].offset = 0;
+      assert_int_equal(0, pthread_create(&threads[i], NULL,
+                                         ParallelFunnelProduce,
+                                         &producers[i]));
+    }
+  for (int i = 0; i < 2; i++)
+    pthread_join(threads[i], NULL);
+  assert_true(RHHParallelFunnelInsertFlush(funnel));
+  assert_int_equal(TEST_OBJECTS * 4, RHHObjcnt(rhh));
+
+  // Overwrite every key twice from a single producer; the last value
+  // must win.
+  for (int offset = 1; offset <= 2; offset++)
+    {
+      producers[0].step = 1;
+      producers[0].offset = offset;
+      ParallelFunnelProduce(&producers[0]);
+    }
+  RHHParallelFunnelDestroy(funnel);
+  assert_int_equal(TEST_OBJECTS * 4, RHHObjcnt(rhh));
+  ResetObjcnt();
+  RHHIterate(rhh, CountObjects, NULL);
+  assert_int_equal(TEST_OBJECTS * 4, objcnt);
+  for (int i = 0; i < TEST_OBJECTS * 4; i++)
+    {
+      val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i + 2, *val);
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_Build(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  int* keys;
+  int* vals;
+  int* val;
+
+  keys = malloc(sizeof(int) * TEST_OBJECTS * 4);
+  vals = malloc(sizeof(int) * TEST_OBJECTS * 4);
+  for (int i = 0; i < TEST_OBJECTS * 4; i++)
+    {
+      keys[i] = i;
+      vals[i] = i * 2;
+    }
+  assert_true(OPHeapNew(&heap));
+
+  for (unsigned int nthreads = 1; nthreads <= 4; nthreads += 3)
+    {
+      assert_true(RHHBuildCustom(heap, &rhh, OPDefaultHash, keys, vals,
+                                 TEST_OBJECTS * 4, 0.8,
+                                 sizeof(int), sizeof(int), nthreads));
+      assert_int_equal(TEST_OBJECTS * 4, RHHObjcnt(rhh));
+      ResetObjcnt();
+      RHHIterate(rhh, CountObjects, NULL);
+      assert_int_equal(TEST_OBJECTS * 4, objcnt);
+      for (int i = 0; i < TEST_OBJECTS * 4; i++)
+        {
+          val = RHHGet(rhh, &i);
+          assert_non_null(val);
+          assert_int_equal(i * 2, *val);
+        }
+      // The built table takes further updates as usual.
+      for (int i = 0; i < TEST_OBJECTS; i++)
+        assert_non_null(RHHDelete(rhh, &i));
+      for (int i = TEST_OBJECTS * 4; i < TEST_OBJECTS * 5; i++)
+        assert_true(RHHInsert(rhh, &i, &i));
+      assert_int_equal(TEST_OBJECTS * 4, RHHObjcnt(rhh));
+      for (int i = 0; i < TEST_OBJECTS * 5; i++)
+        {
+          val = RHHGet(rhh, &i);
+          if (i < TEST_OBJECTS)
+            assert_null(val);
+          else
+            assert_non_null(val);
+        }
+      RHHDestroy(rhh);
+    }
+
+  // A table built with another hash keeps using it in the non-Custom
+  // APIs, or refuses them when the hash is unknown.
+  assert_true(RHHBuildCustom(heap, &rhh, OPCityHash, keys, vals,
+                             TEST_OBJECTS, 0.8, sizeof(int), sizeof(int), 1));
+  assert_int_equal(OP_HASH_ID_CITY, rhh->hash_id);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i * 2, *val);
+    }
+  RHHDestroy(rhh);
+  assert_true(RHHBuildCustom(heap, &rhh, OPCRC32CHash, keys, vals,
+                             TEST_OBJECTS, 0.8, sizeof(int), sizeof(int), 1));
+  assert_int_equal(OP_HASH_ID_NONE, rhh->hash_id);
+  RHHDestroy(rhh);
+
+  assert_true(RHHBuild(heap, &rhh, keys, NULL, 0, 0.8, sizeof(int), 0));
+  assert_int_equal(0, RHHObjcnt(rhh));
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+  free(keys);
+  free(vals);
+}
+
+static void
+test_ReadOnly(void** context)
+{
+  OPHeap *heap, *heap_read;
+  RobinHoodHash* rhh;
+  RHHReadOnly* ro;
+  RHHFunnel* funnel;
+  const int* val;
+  FILE* fd;
+
+  for (int tagged = 0; tagged < 2; tagged++)
+    {
+      assert_true(OPHeapNew(&heap));
+      if (tagged)
+        assert_true(RHHNewTagged(heap, &rhh, TEST_OBJECTS,
+                                 0.8, sizeof(int), sizeof(int)));
+      else
+        assert_true(RHHNew(heap, &rhh, TEST_OBJECTS,
+                           0.8, sizeof(int), sizeof(int)));
+      for (int i = 0; i < TEST_OBJECTS; i++)
+        assert_true(RHHInsert(rhh, &i, &i));
+      OPHeapStorePtr(heap, rhh, 0);
+      fd = tmpfile();
+      OPHeapWrite(heap, fd);
+      fseek(fd, 0, SEEK_SET);
+      OPHeapDestroy(heap);
+      // The heap read back is mapped read only.
+      assert_true(OPHeapRead(&heap_read, fd));
+      fclose(fd);
+
+      assert_null(RHHOpenReadOnly(heap_read, 1));
+      ro = RHHOpenReadOnly(heap_read, 0);
+      assert_non_null(ro);
+      assert_int_equal(TEST_OBJECTS, RHHReadOnlyObjcnt(ro));
+      for (int i = 0; i < TEST_OBJECTS * 2; i++)
+        {
+          val = RHHReadOnlyGet(ro, &i);
+          if (i < TEST_OBJECTS)
+            {
+              assert_non_null(val);
+              assert_int_equal(i, *val);
+            }
+          else
+            assert_null(val);
+        }
+      ResetObjcnt();
+      RHHReadOnlyIterate(ro, CountObjects, NULL);
+      assert_int_equal(TEST_OBJECTS, objcnt);
+
+      ResetObjcnt();
+      funnel = RHHReadOnlyFunnelNewCustom(ro, OPDefaultHash,
+                                          funnel_count_objects,
+                                          2048, 2048);
+      for (int i = 0; i < TEST_OBJECTS * 2; i++)
+        RHHFunnelGet(funnel, &i, &i, sizeof(int));
+      RHHFunnelGetFlush(funnel);
+      RHHFunnelDestroy(funnel);
+      assert_int_equal(TEST_OBJECTS, objcnt);
+
+      RHHCloseReadOnly(ro);
+      OPHeapDestroy(heap_read);
+    }
+}
+
+static void
+test_ReadOnlyCorrupted(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  RHHReadOnly* ro;
+  opref_t bucket_ref;
+  uint16_t longest_probes;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 64, 0.8, sizeof(int), sizeof(int)));
+  OPHeapStorePtr(heap, rhh, 0);
+  ro = RHHOpenReadOnly(heap, 0);
+  assert_non_null(ro);
+  RHHCloseReadOnly(ro);
+
+  // A bucket array running past the end of the heap is refused.
+  bucket_ref = rhh->bucket_ref;
+  rhh->bucket_ref = OPHEAP_SIZE - 64;
+  assert_null(RHHOpenReadOnly(heap, 0));
+  rhh->bucket_ref = bucket_ref;
+
+  // So is a probe length the stats histogram cannot hold.
+  longest_probes = rhh->longest_probes;
+  rhh->longest_probes = PROBE_STATS_SIZE;
+  assert_null(RHHOpenReadOnly(heap, 0));
+  rhh->longest_probes = longest_probes;
+
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_OldFormat(void** context)
+{
+  OPHeap *heap, *heap_read;
+  RobinHoodHash* rhh;
+  FILE* fd;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, TEST_OBJECTS, 0.8, sizeof(int), sizeof(int)));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    assert_true(RHHInsert(rhh, &i, &i));
+  // Headers written before the format field have zeros there.
+  rhh->format = 0;
+  OPHeapStorePtr(heap, rhh, 0);
+  fd = tmpfile();
+  OPHeapWrite(heap, fd);
+  fseek(fd, 0, SEEK_SET);
+  OPHeapDestroy(heap);
+  assert_true(OPHeapRead(&heap_read, fd));
+  fclose(fd);
+
+  assert_null(RHHOpenReadOnly(heap_read, 0));
+  OPHeapDestroy(heap_read);
+}
+
+static void
+test_Upgrade(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash *rhh, *old;
+  uint8_t* buckets;
+  size_t bucket_size;
+  uint64_t key;
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, TEST_OBJECTS, 0.8,
+                     sizeof(uint64_t), sizeof(int)));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      key = i;
+      assert_true(RHHInsertCustom(rhh, OPCityHash, &key, &i));
+    }
+  for (int i = 0; i < TEST_OBJECTS; i += 3)
+    {
+      key = i;
+      assert_non_null(RHHDeleteCustom(rhh, OPCityHash, &key));
+    }
+  // Rewrite the table as an older heap stored it: no format, no fields
+  // after bucket_ref, and occupied buckets marked with 1.
+  bucket_size = rhh->keysize + rhh->valsize + 1;
+  buckets = OPRef2Ptr(rhh, rhh->bucket_ref);
+  for (uint64_t idx = 0; idx < RHHCapacity(rhh); idx++)
+    if (bucket_occupied(buckets[idx*bucket_size]))
+      buckets[idx*bucket_size] = 1;
+  rhh->format = 0;
+  memset(&rhh->tagged, 0xff,
+         sizeof(RobinHoodHash) - offsetof(RobinHoodHash, tagged));
+
+  old = rhh;
+  assert_false(RHHUpgradeCustom(&rhh, OPDefaultHash));
+  assert_ptr_equal(old, rhh);
+  assert_true(RHHUpgrade(&rhh));
+  assert_int_equal(0, rhh->old_bucket_ref);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      key = i;
+      val = RHHGet(rhh, &key);
+      if (i % 3)
+        {
+          assert_non_null(val);
+          assert_int_equal(i, *val);
+        }
+      else
+        assert_null(val);
+    }
+  for (int i = TEST_OBJECTS; i < TEST_OBJECTS * 2; i++)
+    {
+      key = i;
+      assert_true(RHHInsert(rhh, &key, &i));
+    }
+  for (int i = 0; i < TEST_OBJECTS * 2; i++)
+    {
+      key = i;
+      if (i % 3 || i >= TEST_OBJECTS)
+        assert_non_null(RHHDelete(rhh, &key));
+    }
+  assert_int_equal(0, RHHObjcnt(rhh));
+  assert_true(RHHUpgrade(&rhh));
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_HashId(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  uint64_t keys[TEST_OBJECTS];
+  void* vals[TEST_OBJECTS];
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, TEST_OBJECTS, 0.8,
+                     sizeof(uint64_t), sizeof(int)));
+  // As recorded by tables upgraded from older heaps.
+  rhh->hash_id = OP_HASH_ID_CITY;
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      keys[i] = i;
+      assert_true(RHHInsert(rhh, &keys[i], &i));
+    }
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      val = RHHGetCustom(rhh, OPCityHash, &keys[i]);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+    }
+  RHHGetBatch(rhh, keys, TEST_OBJECTS, vals);
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    {
+      assert_non_null(vals[i]);
+      assert_int_equal(i, *(int*)vals[i]);
+    }
+  OPHeapDestroy(heap);
+}
+
+static void
+test_Specialized(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  uint64_t* val;
+
+  assert_true(OPHeapNew(&heap));
+  for (int tagged = 0; tagged < 2; tagged++)
+    {
+      // Start small so that inserts also go through the resize fallback.
+      if (tagged)
+        assert_true(RHHNewTagged(heap, &rhh, 20, 0.8, 8, 8));
+      else
+        assert_true(RHHNewK8V8(heap, &rhh, 20, 0.8));
+      for (uint64_t i = 0; i < TEST_OBJECTS * 2; i++)
+        {
+          if (i % 3)
+            assert_true(RHHInsertK8V8(rhh, &i, &i));
+          else
+            assert_true(RHHInsert(rhh, &i, &i));
+        }
+      assert_int_equal(TEST_OBJECTS * 2, RHHObjcnt(rhh));
+      for (uint64_t i = 0; i < TEST_OBJECTS * 2; i++)
+        {
+          val = RHHGetK8V8(rhh, &i);
+          assert_non_null(val);
+          assert_int_equal(i, *val);
+          assert_ptr_equal(val, RHHGet(rhh, &i));
+        }
+
+      // Duplicates update in place; deleted slots are reused.
+      for (uint64_t i = 0; i < TEST_OBJECTS; i++)
+        {
+          uint64_t newval = i + 1;
+          assert_true(RHHInsertK8V8(rhh, &i, &newval));
+          assert_non_null(RHHDeleteK8V8(rhh, &i));
+        }
+      assert_int_equal(TEST_OBJECTS, RHHObjcnt(rhh));
+      for (uint64_t i = 0; i < TEST_OBJECTS; i++)
+        assert_null(RHHGetK8V8(rhh, &i));
+      for (uint64_t i = TEST_OBJECTS * 2; i < TEST_OBJECTS * 3; i++)
+        assert_true(RHHInsertK8V8(rhh, &i, &i));
+      assert_int_equal(TEST_OBJECTS * 2, RHHObjcnt(rhh));
+      ResetObjcnt();
+      RHHIterate(rhh, CountObjects, NULL);
+      assert_int_equal(TEST_OBJECTS * 2, objcnt);
+      for (uint64_t i = TEST_OBJECTS; i < TEST_OBJECTS * 3; i++)
+        {
+          val = RHHGet(rhh, &i);
+          assert_non_null(val);
+          assert_int_equal(i, *val);
+        }
+      RHHDestroy(rhh);
+    }
+
+  // The generic API follows the hash a specialization records.
+  assert_true(RHHNewK8V8City(heap, &rhh, 20, 0.8));
+  assert_int_equal(OP_HASH_ID_CITY, rhh->hash_id);
+  for (uint64_t i = 0; i < TEST_OBJECTS; i++)
+    assert_true(RHHInsertK8V8City(rhh, &i, &i));
+  for (uint64_t i = 0; i < TEST_OBJECTS; i++)
+    {
+      val = RHHGet(rhh, &i);
+      assert_non_null(val);
+      assert_int_equal(i, *val);
+      assert_ptr_equal(val, RHHGetK8V8City(rhh, &i));
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_Cursor(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  OPHashCursor cursor = {0};
+  void* keys[100];
+  void* vals[100];
+  size_t n, total;
+  int num;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+  RHHSetIncrementalResize(rhh, true);
+  // Stop while a resize is in flight so that the scan has to cover
+  // both bucket arrays.
+  num = 0;
+  do
+    {
+      assert_true(RHHInsert(rhh, &num, &num));
+      num++;
+    }
+  while (num < TEST_OBJECTS / 2 || !RHHResizeStep(rhh, 0));
+
+  memset(objmap, 0x00, sizeof(objmap));
+  total = 0;
+  while ((n = RHHCursorNext(rhh, &cursor, 100, keys, vals)))
+    {
+      assert_true(n <= 100);
+      for (size_t i = 0; i < n; i++)
+        {
+          assert_int_equal(*(int*)keys[i], *(int*)vals[i]);
+          objmap[*(int*)keys[i]]++;
+        }
+      total += n;
+    }
+  assert_int_equal(num, total);
+  for (int i = 0; i < num; i++)
+    assert_int_equal(1, objmap[i]);
+  assert_int_equal(0, RHHCursorNext(rhh, &cursor, 100, keys, NULL));
+
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+CountObjectsAtomic(void* key, void* val,
+                   size_t keysize, size_t valsize, void* ctx)
+{
+  atomic_fetch_add_explicit((a_int32_t*)ctx, 1, memory_order_relaxed);
+}
+
+static void
+test_ParallelIterate(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  a_int32_t count;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, TEST_OBJECTS * 4,
+                     0.8, sizeof(int), sizeof(int)));
+  for (int i = 0; i < TEST_OBJECTS * 4; i++)
+    assert_true(RHHInsert(rhh, &i, &i));
+
+  for (unsigned int nthreads = 0; nthreads <= 4; nthreads++)
+    {
+      atomic_init(&count, 0);
+      RHHParallelIterate(rhh, nthreads, CountObjectsAtomic, &count);
+      assert_int_equal(TEST_OBJECTS * 4, atomic_load(&count));
+    }
+
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_Stats(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  OPHashStats stats;
+  uint64_t counted;
+  char* buf;
+  size_t buf_size;
+  FILE* out;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+  for (int i = 0; i < TEST_OBJECTS; i++)
+    assert_true(RHHInsert(rhh, &i, &i));
+
+  RHHGetStats(rhh, &stats);
+  assert_int_equal(TEST_OBJECTS, stats.objcnt);
+  assert_int_equal(RHHCapacity(rhh), stats.capacity);
+  assert_true(stats.load > 0.0 && stats.load <= 0.8);
+  assert_true(stats.resizes > 0);
+  assert_true(stats.bytes >= stats.capacity * (1 + 2 * sizeof(int)));
+  counted = 0;
+  for (int i = 0; i < OP_HASH_PROBE_HIST_SIZE; i++)
+    {
+      counted += stats.probe_hist[i];
+      if (i > stats.longest_probe)
+        assert_int_equal(0, stats.probe_hist[i]);
+    }
+  assert_int_equal(TEST_OBJECTS, counted);
+  assert_true(stats.mean_probe <= stats.longest_probe);
+
+  out = open_memstream(&buf, &buf_size);
+  OPHashStatsPrometheus(out, "rhh", &stats);
+  fclose(out);
+  assert_non_null(strstr(buf, "rhh_objects 32768\n"));
+  assert_non_null(strstr(buf, "rhh_probe_length_bucket{le=\"+Inf\"} 32768\n"));
+  assert_non_null(strstr(buf, "rhh_probe_length_count 32768\n"));
+  free(buf);
+
+  out = open_memstream(&buf, &buf_size);
+  OPHashStatsJSON(out, &stats);
+  fclose(out);
+  assert_memory_equal("{\"objects\":32768,", buf, 17);
+  assert_non_null(strstr(buf, "]}\n"));
+  free(buf);
+
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static bool
+IsMultipleOf(void* key, void* val,
+             size_t keysize, size_t valsize, void* ctx)
+{
+  return *(int*)key % *(int*)ctx == 0;
+}
+
+static bool
+IsBelow(void* key, void* val,
+        size_t keysize, size_t valsize, void* ctx)
+{
+  return *(int*)key < *(int*)ctx;
+}
+
+static void
+test_DeleteIf(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  uint64_t capacity;
+  int divisor, threshold;
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  for (int variant = 0; variant < 3; variant++)
+    {
+      if (variant == 1)
+        assert_true(RHHNewTagged(heap, &rhh, TEST_OBJECTS,
+                                 0.8, sizeof(int), sizeof(int)));
+      else
+        assert_true(RHHNew(heap, &rhh, variant ? 20 : TEST_OBJECTS,
+                           0.8, sizeof(int), sizeof(int)));
+      // The third variant sweeps while an incremental resize is in
+      // flight.
+      if (variant == 2)
+        RHHSetIncrementalResize(rhh, true);
+      for (int i = 0; i < TEST_OBJECTS; i++)
+        assert_true(RHHInsert(rhh, &i, &i));
+      capacity = RHHCapacity(rhh);
+
+      divisor = 3;
+      assert_int_equal((TEST_OBJECTS + 2) / 3,
+                       RHHDeleteIf(rhh, IsMultipleOf, &divisor));
+      assert_int_equal(TEST_OBJECTS - (TEST_OBJECTS + 2) / 3,
+                       RHHObjcnt(rhh));
+      assert_int_equal(capacity, RHHCapacity(rhh));
+      ResetObjcnt();
+      RHHIterate(rhh, CountObjects, NULL);
+      assert_int_equal(RHHObjcnt(rhh), objcnt);
+      for (int i = 0; i < TEST_OBJECTS; i++)
+        {
+          val = RHHGet(rhh, &i);
+          if (i % 3 == 0)
+            assert_null(val);
+          else
+            {
+              assert_non_null(val);
+              assert_int_equal(i, *val);
+            }
+        }
+      assert_int_equal(0, RHHDeleteIf(rhh, IsMultipleOf, &divisor));
+
+      // Deleting most of the table shrinks it once.
+      threshold = TEST_OBJECTS - 1000;
+      RHHDeleteIf(rhh, IsBelow, &threshold);
+      assert_true(RHHCapacity(rhh) < capacity);
+      for (int i = 0; i < TEST_OBJECTS; i++)
+        {
+          val = RHHGet(rhh, &i);
+          if (i % 3 == 0 || i < threshold)
+            assert_null(val);
+          else
+            {
+              assert_non_null(val);
+              assert_int_equal(i, *val);
+            }
+        }
+      for (int i = 0; i < TEST_OBJECTS; i++)
+        assert_true(RHHInsert(rhh, &i, &i));
+      assert_int_equal(TEST_OBJECTS, RHHObjcnt(rhh));
+      RHHDestroy(rhh);
+    }
+  OPHeapDestroy(heap);
+}
+
+static void
+test_ResizeDeferredDuringMigration(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  int threshold, resizes, n;
+  int* val;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20,
+                     0.8, sizeof(int), sizeof(int)));
+  RHHSetIncrementalResize(rhh, true);
+  n = 0;
+  while (n < 1000 || !rhh->old_bucket_ref)
+    {
+      assert_true(RHHInsert(rhh, &n, &n));
+      n++;
+    }
+  resizes = rhh->resizes;
+
+  // Dropping below objcnt_low mid migration must not start another
+  // resize, which would drain the old array in one go.
+  threshold = n - 40;
+  assert_int_equal(threshold, RHHDeleteIf(rhh, IsBelow, &threshold));
+  assert_int_equal(resizes, rhh->resizes);
+  assert_true(rhh->old_bucket_ref != 0);
+  assert_true(RHHObjcnt(rhh) < rhh->objcnt_low);
+
+  // Once the migration is done the next modification shrinks.
+  assert_false(RHHResizeStep(rhh, UINT64_MAX));
+  val = RHHDelete(rhh, &threshold);
+  assert_non_null(val);
+  assert_int_equal(resizes + 1, rhh->resizes);
+  assert_false(RHHResizeStep(rhh, UINT64_MAX));
+  for (int i = 0; i < n; i++)
+    {
+      val = RHHGet(rhh, &i);
+      if (i <= threshold)
+        assert_null(val);
+      else
+        {
+          assert_non_null(val);
+          assert_int_equal(i, *val);
+        }
+    }
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_UpsertAfterDelete(void** context)
+{
+  OPHeap* heap;
+  RobinHoodHash* rhh;
+  uint64_t* val;
+  bool is_duplicate;
+  uint64_t objcnt;
+
+  // Tombstones and the holes deletes leave behind sit between a key's
+  // home bucket and the key; upserts must still find the key.
+  assert_true(OPHeapNew(&heap));
+  assert_true(RHHNew(heap, &rhh, 20, 0.8,
+                     sizeof(uint64_t), 2 * sizeof(uint64_t)));
+  objcnt = 0;
+  for (uint64_t base = 0; base < 4 * TEST_OBJECTS; base += TEST_OBJECTS)
+    {
+      for (uint64_t key = base; key < base + TEST_OBJECTS; key++)
+        {
+          assert_true(RHHUpsert(rhh, &key, (void**)&val, &is_duplicate));
+          assert_false(is_duplicate);
+          val[0] = key;
+          val[1] = ~key;
+        }
+      for (uint64_t key = base; key < base + TEST_OBJECTS; key += 2)
+        assert_non_null(RHHDelete(rhh, &key));
+      objcnt += TEST_OBJECTS / 2;
+      for (uint64_t key = 0; key < base + TEST_OBJECTS; key++)
+        {
+          assert_true(RHHUpsert(rhh, &key, (void**)&val, &is_duplicate));
+          if (key % 2)
+            {
+              assert_true(is_duplicate);
+              assert_int_equal(key, val[0]);
+              assert_int_equal(~key, val[1]);
+            }
+          else
+            {
+              assert_false(is_duplicate);
+              assert_non_null(RHHDelete(rhh, &key));
+            }
+        }
+      assert_int_equal(objcnt, RHHObjcnt(rhh));
+    }
+  for (uint64_t key = 1; key < 4 * TEST_OBJECTS; key += 2)
+    {
+      assert_non_null(RHHDelete(rhh, &key));
+      assert_null(RHHGet(rhh, &key));
+    }
+  assert_int_equal(0, RHHObjcnt(rhh));
+  RHHDestroy(rhh);
+  OPHeapDestroy(heap);
+}
+
 int
 main (void)
 {
@@ -595,10 +1619,29 @@ main (void)
       cmocka_unit_test(test_BasicDeleteSmall),
       cmocka_unit_test(test_DistributionForUpdateSmall),
       cmocka_unit_test(test_UpsertSmall),
+      cmocka_unit_test(test_UpsertAfterDelete),
       cmocka_unit_test(test_FunnelInsert),
       cmocka_unit_test(test_FunnelUpsert),
       cmocka_unit_test(test_FunnelGet),
+      cmocka_unit_test(test_FunnelInterleavedGet),
       cmocka_unit_test(test_FunnelDelete),
+      cmocka_unit_test(test_IncrementalResize),
+      cmocka_unit_test(test_ParallelResize),
+      cmocka_unit_test(test_TaggedLookup),
+      cmocka_unit_test(test_Batch),
+      cmocka_unit_test(test_ParallelFunnel),
+      cmocka_unit_test(test_Build),
+      cmocka_unit_test(test_ReadOnly),
+      cmocka_unit_test(test_ReadOnlyCorrupted),
+      cmocka_unit_test(test_OldFormat),
+      cmocka_unit_test(test_HashId),
+      cmocka_unit_test(test_Upgrade),
+      cmocka_unit_test(test_Specialized),
+      cmocka_unit_test(test_Cursor),
+      cmocka_unit_test(test_ParallelIterate),
+      cmocka_unit_test(test_Stats),
+      cmocka_unit_test(test_DeleteIf),
+      cmocka_unit_test(test_ResizeDeferredDuringMigration),
     };
 
   return cmocka_run_group_tests(rhh_tests, NULL, NULL);
@@ -54,6 +54,7 @@
 #include "allocator.h"
 #include "init_helper.h"
 #include "lookup_helper.h"
+#include "profiler.h"
 
 #define DISPATCH_ATTEMPT 128
 
@@ -62,6 +63,23 @@ OP_LOGGER_FACTORY(logger, "opic.malloc.allocator");
 static __thread int thread_id = -1;
 static a_uint32_t round_robin = 0;
 
+static inline Magic
+USpanHPageMagic(Magic uspan_magic)
+{
+  Magic hpage_magic = {};
+
+  switch (uspan_magic.generic.pattern)
+    {
+    case RAW_USPAN_PATTERN:
+    case LARGE_USPAN_PATTERN:
+      hpage_magic.raw_hpage.pattern = RAW_HPAGE_PATTERN;
+      break;
+    default:
+      op_assert(false, "Unknown uspan pattern %d", uspan_magic.generic.pattern);
+    }
+  return hpage_magic;
+}
+
 void*
 OPMalloc(OPHeap* heap, size_t size)
 {
@@ -82,24 +100,23 @@ OPCalloc(OPHeap* heap, size_t num, size_t size)
   return OPCallocAdviced(heap, num, size, thread_id);
 }
 
-void*
-OPMallocAdviced(OPHeap* heap, size_t size, int advice)
+static inline void*
+DispatchMalloc(OPHeap* heap, size_t size, int advice)
 {
   OPHeapCtx ctx;
   void* addr;
   Magic magic;
   unsigned int size_class, page_cnt;
 
-  op_assert(size > 0, "malloc size must greater than 0");
-
   advice %= 16;
 
   ctx.hqueue = &heap->raw_type.hpage_queue;
   if (size <= 256)
     {
-      size_class = round_up_div(size, 16);
+      // Same index as ObtainUSpanQueue, which frees go through.
+      size_class = round_up_div(size, 16) - 1;
       magic.raw_uspan.pattern = RAW_USPAN_PATTERN;
-      magic.raw_uspan.obj_size = size_class * 16;
+      magic.raw_uspan.obj_size = (size_class + 1) * 16;
       magic.raw_uspan.thread_id = advice;
       ctx.uqueue = &heap->raw_type.uspan_queue[size_class][advice];
       if (DispatchUSpanForAddr(&ctx, magic, &addr))
@@ -155,6 +172,19 @@ OPMallocAdviced(OPHeap* heap, size_t size, int advice)
     }
 }
 
+void*
+OPMallocAdviced(OPHeap* heap, size_t size, int advice)
+{
+  void* addr;
+
+  op_assert(size > 0, "malloc size must greater than 0");
+
+  addr = DispatchMalloc(heap, size, advice);
+  if (ProfileSampleTick(size))
+    ProfileRecordAlloc(heap, addr, size);
+  return addr;
+}
+
 void*
 OPCallocAdviced(OPHeap* heap, size_t num, size_t size, int advice)
 {
@@ -162,7 +192,7 @@ OPCallocAdviced(OPHeap* heap, size_t num, size_t size, int advice)
   size_t _size;
 
   _size = num * size;
-  addr = OPMallocAdviced(heap, _size, thread_id);
+  addr = OPMallocAdviced(heap, _size, advice);
 
   if (addr)
     memset(addr, 0x00, _size);
@@ -170,11 +200,98 @@ OPCallocAdviced(OPHeap* heap, size_t num, size_t size, int advice)
   return addr;
 }
 
+#ifdef OPIC_LOCKFREE_QUEUE
+
+bool
+DispatchUSpanForAddr(OPHeapCtx* ctx, Magic uspan_magic, void** addr)
+{
+  UnarySpan* it;
+  int attempt;
+  attempt = 0;
+
+ retry:
+  if (attempt++ > DISPATCH_ATTEMPT)
+    return false;
+  while (!atomic_check_in(&ctx->uqueue->pcard))
+    ;
+
+  it = USpanQueueTop(ctx->uqueue);
+  while (it)
+    {
+      ctx->sspan.uspan = it;
+      switch(USpanObtainAddr(ctx, addr))
+        {
+        case QOP_SUCCESS:
+          atomic_check_out(&ctx->uqueue->pcard);
+          return true;
+        case QOP_RESTART:
+          atomic_check_out(&ctx->uqueue->pcard);
+          goto retry;
+        case QOP_CONTINUE:
+          it = it->next;
+        }
+    }
+  atomic_check_out(&ctx->uqueue->pcard);
+
+  // Other threads may race to create spans for the same queue.  The
+  // extra spans are pushed as well and get used by later allocations.
+  if (!DispatchHPageForSSpan(ctx, USpanHPageMagic(uspan_magic),
+                             USpanPageCount(uspan_magic), false))
+    return false;
+  USpanInit(ctx->sspan.uspan, uspan_magic, USpanPageCount(uspan_magic));
+  atomic_store_explicit(&ctx->sspan.uspan->state, SPAN_DEQUEUED,
+                        memory_order_relaxed);
+  PushUSpan(ctx->uqueue, ctx->sspan.uspan);
+  goto retry;
+}
+
+bool
+DispatchHPageForSSpan(OPHeapCtx* ctx, Magic magic, unsigned int spage_cnt,
+                      bool use_full_span)
+{
+  HugePage* it;
+  int attempt;
+  attempt = 0;
+ retry:
+  if (attempt++ > DISPATCH_ATTEMPT)
+    return false;
+  while (!atomic_check_in(&ctx->hqueue->pcard))
+    ;
+
+  it = HPageQueueTop(ctx->hqueue);
+  while (it)
+    {
+      ctx->hspan.hpage = it;
+      switch(HPageObtainSSpan(ctx, spage_cnt, use_full_span))
+        {
+        case QOP_SUCCESS:
+          atomic_check_out(&ctx->hqueue->pcard);
+          return true;
+        case QOP_RESTART:
+          atomic_check_out(&ctx->hqueue->pcard);
+          goto retry;
+        case QOP_CONTINUE:
+          it = it->next;
+        }
+    }
+  atomic_check_out(&ctx->hqueue->pcard);
+
+  if (!OPHeapObtainHPage(ObtainOPHeap(ctx->hqueue), ctx))
+    return false;
+  HPageInit(ctx->hspan.hpage, magic);
+  atomic_store_explicit(&ctx->hspan.hpage->state, SPAN_DEQUEUED,
+                        memory_order_relaxed);
+  PushHPage(ctx->hqueue, ctx->hspan.hpage);
+  goto retry;
+}
+
+#else
+
 bool
 DispatchUSpanForAddr(OPHeapCtx* ctx, Magic uspan_magic, void** addr)
 {
   unsigned int spage_cnt;
-  Magic hpage_magic = {};
+  Magic hpage_magic;
   int attempt;
   attempt = 0;
 
@@ -197,7 +314,9 @@ DispatchUSpanForAddr(OPHeapCtx* ctx, Magic uspan_magic, void** addr)
           atomic_check_out(&ctx->uqueue->pcard);
           goto retry;
         case QOP_CONTINUE:
-          *it = (*it)->next;
+          // Only step over the span. Unlinking it needs the queue's
+          // critical section, and a shared check-in is all we hold.
+          it = &(*it)->next;
         }
     }
   if (!atomic_book_critical(&ctx->uqueue->pcard))
@@ -207,25 +326,8 @@ DispatchUSpanForAddr(OPHeapCtx* ctx, Magic uspan_magic, void** addr)
     }
   atomic_enter_critical(&ctx->uqueue->pcard);
 
-  switch (uspan_magic.generic.pattern)
-    {
-    case RAW_USPAN_PATTERN:
-    case LARGE_USPAN_PATTERN:
-      hpage_magic.raw_hpage.pattern = RAW_HPAGE_PATTERN;
-      break;
-    default:
-      op_assert(false, "Unknown uspan pattern %d", uspan_magic.generic.pattern);
-    }
-  if (uspan_magic.uspan_generic.obj_size <= 32)
-    spage_cnt = 1;
-  else if (uspan_magic.uspan_generic.obj_size <= 64)
-    spage_cnt = 4;
-  else if (uspan_magic.uspan_generic.obj_size <= 256)
-    spage_cnt = 8;
-  else if (uspan_magic.uspan_generic.obj_size < 1024)
-    spage_cnt = 16;
-  else
-    spage_cnt = 32;
+  hpage_magic = USpanHPageMagic(uspan_magic);
+  spage_cnt = USpanPageCount(uspan_magic);
   if (!DispatchHPageForSSpan(ctx, hpage_magic, spage_cnt, false))
     {
       atomic_exit_check_out(&ctx->uqueue->pcard);
@@ -262,7 +364,9 @@ DispatchHPageForSSpan(OPHeapCtx* ctx, Magic magic, unsigned int spage_cnt,
           atomic_check_out(&ctx->hqueue->pcard);
           goto retry;
         case QOP_CONTINUE:
-          *it = (*it)->next;
+          // Only step over the span. Unlinking it needs the queue's
+          // critical section, and a shared check-in is all we hold.
+          it = &(*it)->next;
         }
     }
   if (!atomic_book_critical(&ctx->hqueue->pcard))
@@ -282,6 +386,8 @@ DispatchHPageForSSpan(OPHeapCtx* ctx, Magic magic, unsigned int spage_cnt,
   goto retry;
 }
 
+#endif
+
 QueueOperation
 USpanObtainAddr(OPHeapCtx* ctx, void** addr)
 {
@@ -342,6 +448,11 @@ USpanObtainAddr(OPHeapCtx* ctx, void** addr)
     }
 
  uspan_full:
+#ifdef OPIC_LOCKFREE_QUEUE
+  PopUSpan(ctx->uqueue, uspan);
+  atomic_check_out(&uspan->pcard);
+  return QOP_CONTINUE;
+#else
   if (atomic_load_explicit(&uspan->state,
                            memory_order_acquire) == SPAN_DEQUEUED)
     {
@@ -358,6 +469,7 @@ USpanObtainAddr(OPHeapCtx* ctx, void** addr)
   atomic_exit_critical(&ctx->uqueue->pcard);
   atomic_check_out(&uspan->pcard);
   return QOP_RESTART;
+#endif
 }
 
 QueueOperation
@@ -406,7 +518,9 @@ HPageObtainSSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
         {
           if (bmidx >= 8)
             goto check_full;
-          if (_spage_cnt > 64)
+          // Whole words the span runs through must be free, including
+          // the last one when the span ends on a word boundary.
+          if (_spage_cnt >= 64)
             {
               if (occupy_bmap[bmidx] != 0UL)
                 {
@@ -415,12 +529,8 @@ HPageObtainSSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
                 }
               bmidx++;
               _spage_cnt -= 64;
-              continue;
-            }
-          else if (_spage_cnt == 64)
-            {
-              bmidx++;
-              _spage_cnt -= 64;
+              if (_spage_cnt)
+                continue;
               goto found;
             }
           else if (_spage_cnt < (occupy_bmap[bmidx] == 0 ?
@@ -443,7 +553,7 @@ HPageObtainSSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
                            memory_order_release);
   if (bmidx == sspan_bmidx)
     {
-      occupy_bmap[sspan_bmidx] |= ((1UL << _spage_cnt) - 1) << sspan_bmbit;
+      occupy_bmap[sspan_bmidx] |= SPageBits(_spage_cnt, sspan_bmbit);
     }
   else
     {
@@ -467,6 +577,11 @@ HPageObtainSSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
           return QOP_CONTINUE;
         }
     }
+#ifdef OPIC_LOCKFREE_QUEUE
+  PopHPage(ctx->hqueue, hpage);
+  atomic_exit_check_out(&hpage->pcard);
+  return QOP_CONTINUE;
+#else
   while (1)
     {
       if (atomic_load_explicit(&hpage->state, memory_order_acquire)
@@ -490,6 +605,7 @@ HPageObtainSSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
   atomic_exit_critical(&ctx->hqueue->pcard);
   atomic_exit_check_out(&hpage->pcard);
   return QOP_RESTART;
+#endif
 }
 
 QueueOperation
@@ -551,6 +667,11 @@ HPageObtainUSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
           return QOP_CONTINUE;
         }
     }
+#ifdef OPIC_LOCKFREE_QUEUE
+  PopHPage(ctx->hqueue, hpage);
+  atomic_exit_check_out(&hpage->pcard);
+  return QOP_CONTINUE;
+#else
   if (!atomic_book_critical(&ctx->hqueue->pcard))
     {
       atomic_exit_check_out(&hpage->pcard);
@@ -561,6 +682,7 @@ HPageObtainUSpan(OPHeapCtx* ctx, unsigned int spage_cnt, bool use_full_span)
   atomic_exit_critical(&ctx->hqueue->pcard);
   atomic_exit_check_out(&hpage->pcard);
   return QOP_RESTART;
+#endif
 }
 
 
@@ -731,6 +731,120 @@ test_DispatchHPageForSSpan(void** context)
   OPHeapDestroy(heap);
 }
 
+static void
+test_OPMallocSizeClass(void** context)
+{
+  OPHeap* heap;
+  UnarySpanQueue* uqueue;
+  void* addr;
+
+  assert_true(OPHeapNew(&heap));
+  // Sizes up to 256 go to uspan_queue[(size + 15) / 16 - 1],
+  // the queue ObtainUSpanQueue hands the span back to on free. The
+  // largest class must not spill into large_uspan_queue.
+  for (size_t size = 1; size <= 256; size += 15)
+    for (int advice = 0; advice < 16; advice++)
+      {
+        addr = OPMallocAdviced(heap, size, advice);
+        assert_non_null(addr);
+        uqueue = &heap->raw_type.uspan_queue[(size + 15) / 16 - 1][advice];
+        assert_non_null(uqueue->uspan);
+        assert_int_equal((size + 15) / 16 * 16,
+                         uqueue->uspan->magic.raw_uspan.obj_size);
+        assert_int_equal(advice, uqueue->uspan->magic.raw_uspan.thread_id);
+        assert_ptr_equal(uqueue, ObtainUSpanQueue(uqueue->uspan));
+      }
+  addr = OPMallocAdviced(heap, 256, 15);
+  assert_non_null(addr);
+  for (int i = 0; i < 3; i++)
+    assert_null(heap->raw_type.large_uspan_queue[i].uspan);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_DispatchSkipsBusySpans(void** context)
+{
+  OPHeap* heap;
+  UnarySpanQueue* uqueue;
+  HugePageQueue* hqueue;
+  UnarySpan *uspan, *it;
+  HugePage *hpage, *hit;
+  int found, cnt;
+
+  assert_true(OPHeapNew(&heap));
+  uqueue = &heap->raw_type.uspan_queue[0][0];
+  hqueue = &heap->raw_type.hpage_queue;
+  assert_non_null(OPMallocAdviced(heap, 16, 0));
+  uspan = uqueue->uspan;
+  hpage = hqueue->hpage;
+  assert_non_null(uspan);
+  assert_non_null(hpage);
+
+  // Spans another thread holds are skipped, but stay in their queues.
+  uspan->pcard = -1;
+  hpage->pcard = -1;
+  assert_non_null(OPMallocAdviced(heap, 16, 0));
+  uspan->pcard = 0;
+  hpage->pcard = 0;
+
+  found = cnt = 0;
+  for (it = uqueue->uspan; it; it = it->next, cnt++)
+    found += it == uspan;
+  assert_int_equal(1, found);
+  assert_int_equal(2, cnt);
+  found = cnt = 0;
+  for (hit = hqueue->hpage; hit; hit = hit->next, cnt++)
+    found += hit == hpage;
+  assert_int_equal(1, found);
+  assert_int_equal(2, cnt);
+  assert_int_equal(0, uqueue->pcard);
+  assert_int_equal(0, hqueue->pcard);
+
+  OPHeapDestroy(heap);
+}
+
+static void
+test_HPageObtainSSpan_OccupiedWord(void** context)
+{
+  OPHeap* heap;
+  OPHeapCtx ctx;
+  HugePage* hpage;
+  uintptr_t heap_base;
+  Magic magic = {};
+  uint64_t occupy_bmap[8] = {0};
+  uint64_t header_bmap[8] = {0};
+
+  assert_true(OPHeapNew(&heap));
+  heap_base = (uintptr_t)heap;
+  assert_true(OPHeapObtainHPage(heap, &ctx));
+  ctx.hqueue = &heap->raw_type.hpage_queue;
+  magic.raw_hpage.pattern = RAW_HPAGE_PATTERN;
+  hpage = ctx.hspan.hpage;
+  HPageInit(hpage, magic);
+  EnqueueHPage(ctx.hqueue, hpage);
+
+  // 96 pages after the first 32 would end exactly at the end of the
+  // second word, which is in use at bit 40.
+  atomic_store(&hpage->occupy_bmap[0], 0x00000000FFFFFFFFUL);
+  atomic_store(&hpage->occupy_bmap[1], 0x0000010000000000UL);
+  atomic_store(&hpage->header_bmap[0], 0x0000000000000001UL);
+  atomic_store(&hpage->header_bmap[1], 0x0000010000000000UL);
+
+  //                 7654321076543210
+  occupy_bmap[0] = 0x00000000FFFFFFFFUL;
+  occupy_bmap[1] = 0xFFFFFF0000000000UL;
+  occupy_bmap[2] = 0xFFFFFFFFFFFFFFFFUL;
+  occupy_bmap[3] = 0x00000000000001FFUL;
+  header_bmap[0] = 0x0000000000000001UL;
+  header_bmap[1] = 0x0000030000000000UL;
+  assert_int_equal(QOP_SUCCESS, HPageObtainSSpan(&ctx, 96, false));
+  assert_int_equal(heap_base + 105 * SPAGE_SIZE, ctx.sspan.uintptr);
+  assert_memory_equal(occupy_bmap, hpage->occupy_bmap, sizeof(occupy_bmap));
+  assert_memory_equal(header_bmap, hpage->header_bmap, sizeof(header_bmap));
+
+  OPHeapDestroy(heap);
+}
+
 int
 main (void)
 {
@@ -742,9 +856,12 @@ main (void)
       cmocka_unit_test(test_OPHeapObtainHBlob_Large),
       cmocka_unit_test(test_HPageObtainUSpan),
       cmocka_unit_test(test_HPageObtainSSpan),
+      cmocka_unit_test(test_HPageObtainSSpan_OccupiedWord),
       cmocka_unit_test(test_USpanObtainAddr),
       cmocka_unit_test(test_USpanObtainAddr_Large),
       cmocka_unit_test(test_DispatchHPageForSSpan),
+      cmocka_unit_test(test_DispatchSkipsBusySpans),
+      cmocka_unit_test(test_OPMallocSizeClass),
     };
 
   return cmocka_run_group_tests(allocator_tests, NULL, NULL);
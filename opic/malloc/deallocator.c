@@ -55,15 +55,37 @@
 #include "inline_aux.h"
 #include "init_helper.h"
 #include "lookup_helper.h"
+#include "profiler.h"
 
 OP_LOGGER_FACTORY(logger, "opic.malloc.deallocator");
 
+#ifdef OPIC_LOCKFREE_QUEUE
+// Called with hpage->pcard in critical section once the hugepage is
+// emptied.  See the comment on the emptied UnarySpan case.
+static inline void
+HPageRecycle(HugePage* hpage, HugePageQueue* hqueue)
+{
+  if (atomic_load_explicit(&hpage->state, memory_order_acquire)
+      == SPAN_DEQUEUED && QueueQuiescent(&hqueue->pcard))
+    {
+      atomic_exit_check_out(&hpage->pcard);
+      OPHeapReleaseHSpan(hpage);
+      return;
+    }
+  PushHPage(hqueue, hpage);
+  atomic_exit_check_out(&hpage->pcard);
+}
+#endif
+
 void
 OPDealloc(void* addr)
 {
   HugeSpanPtr hspan;
   SmallSpanPtr sspan;
 
+  if (ProfileHasLiveSamples())
+    ProfileRecordDealloc(addr);
+
   hspan = ObtainHugeSpanPtr(addr);
   if (hspan.magic->generic.pattern == HUGE_BLOB_PATTERN)
     {
@@ -129,6 +151,21 @@ USpanReleaseAddr(UnarySpan* uspan, void* addr)
           atomic_exit_check_out(&uspan->pcard);
           return;
         }
+#ifdef OPIC_LOCKFREE_QUEUE
+      // An enqueued span cannot be unlinked without blocking the
+      // allocators, so it stays in the queue for reuse.  Same for a
+      // dequeued span whose queue has readers that may still see it.
+      if (atomic_load_explicit(&uspan->state, memory_order_acquire)
+          == SPAN_DEQUEUED && QueueQuiescent(&uqueue->pcard))
+        {
+          atomic_exit_check_out(&uspan->pcard);
+          HPageReleaseSSpan(hpage, uspan);
+          return;
+        }
+      PushUSpan(uqueue, uspan);
+      atomic_exit_check_out(&uspan->pcard);
+      return;
+#else
       while (1)
         {
           if (atomic_load_explicit(&uspan->state, memory_order_acquire)
@@ -154,6 +191,7 @@ USpanReleaseAddr(UnarySpan* uspan, void* addr)
       atomic_exit_check_out(&uqueue->pcard);
       HPageReleaseSSpan(hpage, uspan);
       return;
+#endif
     }
 
   while (1)
@@ -171,6 +209,11 @@ USpanReleaseAddr(UnarySpan* uspan, void* addr)
           atomic_check_out(&uspan->pcard);
           return;
         }
+#ifdef OPIC_LOCKFREE_QUEUE
+      PushUSpan(uqueue, uspan);
+      atomic_check_out(&uspan->pcard);
+      return;
+#else
       if (!atomic_check_in_book(&uqueue->pcard))
         continue;
       atomic_enter_critical(&uqueue->pcard);
@@ -185,6 +228,7 @@ USpanReleaseAddr(UnarySpan* uspan, void* addr)
       atomic_exit_check_out(&uqueue->pcard);
       atomic_check_out(&uspan->pcard);
       return;
+#endif
     }
 }
 
@@ -235,7 +279,7 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
                                            memory_order_release);
       op_assert((old_bmap & (1UL << _addr_bmbit)) != 0,
                 "header bit didn't match");
-      mask = ~(((1UL << spages) - 1) << _addr_bmbit);
+      mask = ~SPageBits(spages, _addr_bmbit);
       atomic_fetch_and_explicit(&hpage->occupy_bmap[_addr_bmidx],
                                 mask, memory_order_release);
 
@@ -252,6 +296,10 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
               atomic_exit_check_out(&hpage->pcard);
               return;
             }
+#ifdef OPIC_LOCKFREE_QUEUE
+          HPageRecycle(hpage, hqueue);
+          return;
+#else
           while (1)
             {
               if (atomic_load_explicit(&hpage->state, memory_order_acquire)
@@ -277,9 +325,17 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
           atomic_exit_check_out(&hqueue->pcard);
           OPHeapReleaseHSpan(hpage);
           return;
+#endif
         }
       else
         {
+#ifdef OPIC_LOCKFREE_QUEUE
+          if (!atomic_is_booked(&hpage->pcard) &&
+              atomic_load_explicit(&hpage->state, memory_order_acquire)
+              != SPAN_ENQUEUED)
+            PushHPage(hqueue, hpage);
+          atomic_check_out(&hpage->pcard);
+#else
           while (1)
             {
               if (atomic_is_booked(&hpage->pcard))
@@ -307,6 +363,7 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
           EnqueueHPage(hqueue, hpage);
           atomic_exit_check_out(&hqueue->pcard);
           atomic_check_out(&hpage->pcard);
+#endif
         }
     }
   else
@@ -337,6 +394,10 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
 
       if (memcmp(occupy_bmap, hpage->occupy_bmap, sizeof(occupy_bmap)) == 0)
         {
+#ifdef OPIC_LOCKFREE_QUEUE
+          HPageRecycle(hpage, hqueue);
+          return;
+#else
           while (1)
             {
               if (atomic_load_explicit(&hpage->state, memory_order_acquire)
@@ -362,9 +423,16 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
           atomic_exit_check_out(&hqueue->pcard);
           OPHeapReleaseHSpan(hpage);
           return;
+#endif
         }
       else
         {
+#ifdef OPIC_LOCKFREE_QUEUE
+          if (atomic_load_explicit(&hpage->state, memory_order_acquire)
+              != SPAN_ENQUEUED)
+            PushHPage(hqueue, hpage);
+          atomic_exit_check_out(&hpage->pcard);
+#else
           while (1)
             {
               if (atomic_load_explicit(&hpage->state, memory_order_acquire)
@@ -387,6 +455,7 @@ HPageReleaseSSpan(HugePage* hpage, SmallSpanPtr sspan)
           EnqueueHPage(hqueue, hpage);
           atomic_exit_check_out(&hqueue->pcard);
           atomic_exit_check_out(&hpage->pcard);
+#endif
         }
     }
 }
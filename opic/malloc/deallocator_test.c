@@ -510,6 +510,47 @@ test_USpanReleaseAddr(void** context)
   OPHeapDestroy(heap);
 }
 
+static void
+test_HPageReleaseSSpan_FullWord(void** context)
+{
+  OPHeap* heap;
+  HugePage* hpage;
+  uintptr_t heap_base;
+  OPHeapCtx ctx;
+  Magic hmagic = {};
+
+  assert_true(OPHeapNew(&heap));
+  heap_base = (uintptr_t)heap;
+  hmagic.raw_hpage.pattern = RAW_HPAGE_PATTERN;
+  ctx.hqueue = &heap->raw_type.hpage_queue;
+  ctx.hspan.uintptr = heap_base + HPAGE_SIZE;
+  hpage = ctx.hspan.hpage;
+  HPageInit(hpage, hmagic);
+  EnqueueHPage(ctx.hqueue, hpage);
+
+  // Spans in the first word keep the hpage in use and push the next
+  // span to the start of the second word.
+  atomic_store(&hpage->occupy_bmap[0], 0x8000000000000001UL);
+  atomic_store(&hpage->header_bmap[0], 0x8000000000000001UL);
+
+  // A 64 page small blob covers the second word exactly.
+  assert_int_equal(QOP_SUCCESS, HPageObtainSSpan(&ctx, 64, false));
+  assert_int_equal(heap_base + HPAGE_SIZE + 64 * SPAGE_SIZE,
+                   ctx.sspan.uintptr);
+  assert_int_equal(~0UL, hpage->occupy_bmap[1]);
+  assert_int_equal(0x01UL, hpage->header_bmap[1]);
+  ctx.sspan.magic->small_blob.pattern = SMALL_BLOB_PATTERN;
+  ctx.sspan.magic->small_blob.pages = 64;
+  HPageReleaseSSpan(hpage, ctx.sspan);
+  assert_int_equal(0x8000000000000001UL, hpage->occupy_bmap[0]);
+  assert_int_equal(0x00UL, hpage->occupy_bmap[1]);
+  assert_int_equal(0x00UL, hpage->header_bmap[1]);
+  assert_int_equal(0, hpage->pcard);
+  assert_ptr_equal(hpage, ctx.hqueue->hpage);
+
+  OPHeapDestroy(heap);
+}
+
 int
 main (void)
 {
@@ -519,6 +560,7 @@ main (void)
       cmocka_unit_test(test_OPHeapReleaseHSpan_smallHBlob),
       cmocka_unit_test(test_OPHeapReleaseHSpan_lageHBlob),
       cmocka_unit_test(test_HPageReleaseSSpan),
+      cmocka_unit_test(test_HPageReleaseSSpan_FullWord),
       cmocka_unit_test(test_USpanReleaseAddr),
     };
 
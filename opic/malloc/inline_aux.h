@@ -58,6 +58,157 @@
 
 OP_BEGIN_DECLS
 
+#ifdef OPIC_LOCKFREE_QUEUE
+
+// Number of polls on a queue pcard before giving up waiting for the
+// readers of the queue to drain.
+#define QUEUE_QUIESCENT_ATTEMPT 1024
+
+static inline UnarySpan*
+USpanQueueTop(UnarySpanQueue* uspan_queue)
+{
+  uint64_t top;
+
+  top = atomic_load_explicit(&uspan_queue->tagged_uspan,
+                             memory_order_seq_cst);
+  return (UnarySpan*)(top & QUEUE_PTR_MASK);
+}
+
+static inline HugePage*
+HPageQueueTop(HugePageQueue* hpage_queue)
+{
+  uint64_t top;
+
+  top = atomic_load_explicit(&hpage_queue->tagged_hpage,
+                             memory_order_seq_cst);
+  return (HugePage*)(top & QUEUE_PTR_MASK);
+}
+
+// Push uspan on top of the queue.  The caller must own the transition
+// from SPAN_DEQUEUED to SPAN_ENQUEUED; if the span is already enqueued
+// nothing is done and false is returned.
+static inline bool
+PushUSpan(UnarySpanQueue* uspan_queue, UnarySpan* uspan)
+{
+  uint8_t state;
+  uint64_t old_top, new_top;
+
+  state = SPAN_DEQUEUED;
+  if (!atomic_compare_exchange_strong_explicit
+      (&uspan->state, &state, SPAN_ENQUEUED,
+       memory_order_acq_rel,
+       memory_order_relaxed))
+    return false;
+
+  old_top = atomic_load_explicit(&uspan_queue->tagged_uspan,
+                                 memory_order_relaxed);
+  do
+    {
+      uspan->next = (UnarySpan*)(old_top & QUEUE_PTR_MASK);
+      new_top = (((old_top >> QUEUE_TAG_SHIFT) + 1) << QUEUE_TAG_SHIFT) |
+        (uintptr_t)uspan;
+    }
+  while (!atomic_compare_exchange_weak_explicit
+         (&uspan_queue->tagged_uspan, &old_top, new_top,
+          memory_order_release,
+          memory_order_relaxed));
+  return true;
+}
+
+// Pop uspan if it is still on top of the queue.  Spans in the middle
+// of the queue cannot be unlinked without locking; they are skipped by
+// the allocator until they surface, and the ones that empty out there
+// are never released.  This is why --enable-lockfree-queue is
+// experimental.  uspan->next is left intact so
+// concurrent readers standing on uspan can keep walking the queue.
+static inline bool
+PopUSpan(UnarySpanQueue* uspan_queue, UnarySpan* uspan)
+{
+  uint64_t old_top, new_top;
+
+  old_top = atomic_load_explicit(&uspan_queue->tagged_uspan,
+                                 memory_order_acquire);
+  if ((UnarySpan*)(old_top & QUEUE_PTR_MASK) != uspan)
+    return false;
+  new_top = (((old_top >> QUEUE_TAG_SHIFT) + 1) << QUEUE_TAG_SHIFT) |
+    (uintptr_t)uspan->next;
+  if (!atomic_compare_exchange_strong_explicit
+      (&uspan_queue->tagged_uspan, &old_top, new_top,
+       memory_order_acq_rel,
+       memory_order_relaxed))
+    return false;
+
+  atomic_store_explicit(&uspan->state, SPAN_DEQUEUED, memory_order_release);
+  return true;
+}
+
+static inline bool
+PushHPage(HugePageQueue* hpage_queue, HugePage* hpage)
+{
+  uint8_t state;
+  uint64_t old_top, new_top;
+
+  state = SPAN_DEQUEUED;
+  if (!atomic_compare_exchange_strong_explicit
+      (&hpage->state, &state, SPAN_ENQUEUED,
+       memory_order_acq_rel,
+       memory_order_relaxed))
+    return false;
+
+  old_top = atomic_load_explicit(&hpage_queue->tagged_hpage,
+                                 memory_order_relaxed);
+  do
+    {
+      hpage->next = (HugePage*)(old_top & QUEUE_PTR_MASK);
+      new_top = (((old_top >> QUEUE_TAG_SHIFT) + 1) << QUEUE_TAG_SHIFT) |
+        (uintptr_t)hpage;
+    }
+  while (!atomic_compare_exchange_weak_explicit
+         (&hpage_queue->tagged_hpage, &old_top, new_top,
+          memory_order_release,
+          memory_order_relaxed));
+  return true;
+}
+
+static inline bool
+PopHPage(HugePageQueue* hpage_queue, HugePage* hpage)
+{
+  uint64_t old_top, new_top;
+
+  old_top = atomic_load_explicit(&hpage_queue->tagged_hpage,
+                                 memory_order_acquire);
+  if ((HugePage*)(old_top & QUEUE_PTR_MASK) != hpage)
+    return false;
+  new_top = (((old_top >> QUEUE_TAG_SHIFT) + 1) << QUEUE_TAG_SHIFT) |
+    (uintptr_t)hpage->next;
+  if (!atomic_compare_exchange_strong_explicit
+      (&hpage_queue->tagged_hpage, &old_top, new_top,
+       memory_order_acq_rel,
+       memory_order_relaxed))
+    return false;
+
+  atomic_store_explicit(&hpage->state, SPAN_DEQUEUED, memory_order_release);
+  return true;
+}
+
+// A popped span may still be referenced by allocators that walked the
+// queue before the pop.  Those allocators are checked in on the queue
+// pcard, so once the pcard is observed empty no stale reference is
+// left and the span can be handed back to its container.
+static inline bool
+QueueQuiescent(a_int16_t* pcard)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  for (int i = 0; i < QUEUE_QUIESCENT_ATTEMPT; i++)
+    {
+      if (atomic_load_explicit(pcard, memory_order_acquire) == 0)
+        return true;
+    }
+  return false;
+}
+
+#else
+
 static inline void
 EnqueueUSpan(UnarySpanQueue* uspan_queue, UnarySpan* uspan)
 {
@@ -129,6 +280,8 @@ DequeueHPage(HugePageQueue* hpage_queue, HugePage* hpage)
   atomic_store_explicit(&hpage->state, SPAN_DEQUEUED, memory_order_release);
 }
 
+#endif
+
 OP_END_DECLS
 
 #endif
@@ -0,0 +1,235 @@
+/* lockfree_queue_test.c ---
+ *
+ * Filename: lockfree_queue_test.c
+ * Description: Tests for the allocator built with OPIC_LOCKFREE_QUEUE
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ * This test is compiled with -DOPIC_LOCKFREE_QUEUE regardless of the
+ * configure option so the lock free queues are always exercised.
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <cmocka.h>
+
+#include "magic.h"
+#include "inline_aux.h"
+#include "lookup_helper.h"
+#include "init_helper.h"
+#include "allocator.h"
+#include "deallocator.h"
+
+#ifndef OPIC_LOCKFREE_QUEUE
+#error "lockfree_queue_test must be compiled with OPIC_LOCKFREE_QUEUE"
+#endif
+
+#define THREAD_NUM 8
+#define THREAD_OBJECTS 4096
+#define THREAD_LOOPS (1 << 17)
+
+static void
+test_PushPopUSpan(void** context)
+{
+  UnarySpanQueue uqueue = {};
+  UnarySpan uspan[3] = {};
+
+  for (int i = 0; i < 3; i++)
+    uspan[i].state = SPAN_DEQUEUED;
+
+  assert_true(PushUSpan(&uqueue, &uspan[0]));
+  assert_true(PushUSpan(&uqueue, &uspan[1]));
+  assert_false(PushUSpan(&uqueue, &uspan[1]));
+  assert_ptr_equal(&uspan[1], USpanQueueTop(&uqueue));
+  assert_ptr_equal(&uspan[0], uspan[1].next);
+  assert_int_equal(SPAN_ENQUEUED, uspan[1].state);
+
+  // Only the top of the queue can be popped.
+  assert_false(PopUSpan(&uqueue, &uspan[0]));
+  assert_false(PopUSpan(&uqueue, &uspan[2]));
+  assert_true(PopUSpan(&uqueue, &uspan[1]));
+  assert_int_equal(SPAN_DEQUEUED, uspan[1].state);
+  assert_ptr_equal(&uspan[0], USpanQueueTop(&uqueue));
+
+  assert_true(PushUSpan(&uqueue, &uspan[2]));
+  assert_true(PushUSpan(&uqueue, &uspan[1]));
+  assert_ptr_equal(&uspan[1], USpanQueueTop(&uqueue));
+  assert_ptr_equal(&uspan[2], uspan[1].next);
+  assert_ptr_equal(&uspan[0], uspan[2].next);
+
+  // Each push and pop bumps the tag.
+  assert_int_equal(5, uqueue.tagged_uspan >> QUEUE_TAG_SHIFT);
+  assert_int_equal(0, uqueue.pcard);
+}
+
+static void
+test_PushPopHPage(void** context)
+{
+  HugePageQueue hqueue = {};
+  HugePage hpage[2] = {};
+
+  hpage[0].state = hpage[1].state = SPAN_DEQUEUED;
+
+  assert_true(PushHPage(&hqueue, &hpage[0]));
+  assert_true(PushHPage(&hqueue, &hpage[1]));
+  assert_false(PopHPage(&hqueue, &hpage[0]));
+  assert_true(PopHPage(&hqueue, &hpage[1]));
+  assert_true(PopHPage(&hqueue, &hpage[0]));
+  assert_null(HPageQueueTop(&hqueue));
+  assert_int_equal(SPAN_DEQUEUED, hpage[0].state);
+  assert_int_equal(4, hqueue.tagged_hpage >> QUEUE_TAG_SHIFT);
+}
+
+struct ThreadArgs
+{
+  OPHeap* heap;
+  int seed;
+  uint64_t** objects;
+};
+
+static void*
+MallocWorker(void* arg)
+{
+  struct ThreadArgs* args = arg;
+  uint64_t** objects = args->objects;
+  uint32_t rand_state = args->seed * 2654435761U + 1;
+  size_t size;
+  int idx;
+
+  for (int i = 0; i < THREAD_LOOPS; i++)
+    {
+      rand_state ^= rand_state << 13;
+      rand_state ^= rand_state >> 17;
+      rand_state ^= rand_state << 5;
+      idx = rand_state % THREAD_OBJECTS;
+      if (objects[idx])
+        {
+          if (objects[idx][0] != (uintptr_t)objects[idx])
+            return objects[idx];
+          OPDealloc(objects[idx]);
+        }
+      size = 8 + (rand_state >> 16) % 2048;
+      objects[idx] = OPMalloc(args->heap, size);
+      if (!objects[idx])
+        return (void*)args;
+      objects[idx][0] = (uintptr_t)objects[idx];
+    }
+  return NULL;
+}
+
+static void*
+FreeWorker(void* arg)
+{
+  struct ThreadArgs* args = arg;
+
+  for (int i = 0; i < THREAD_OBJECTS; i++)
+    {
+      if (!args->objects[i])
+        continue;
+      if (args->objects[i][0] != (uintptr_t)args->objects[i])
+        return args->objects[i];
+      OPDealloc(args->objects[i]);
+      args->objects[i] = NULL;
+    }
+  return NULL;
+}
+
+static void
+test_ConcurrentMallocFree(void** context)
+{
+  OPHeap* heap;
+  pthread_t threads[THREAD_NUM];
+  struct ThreadArgs args[THREAD_NUM];
+  void* result;
+
+  assert_true(OPHeapNew(&heap));
+
+  for (int i = 0; i < THREAD_NUM; i++)
+    {
+      args[i].heap = heap;
+      args[i].seed = i + 1;
+      args[i].objects = calloc(THREAD_OBJECTS, sizeof(uint64_t*));
+      assert_int_equal(0, pthread_create(&threads[i], NULL,
+                                         MallocWorker, &args[i]));
+    }
+  for (int i = 0; i < THREAD_NUM; i++)
+    {
+      assert_int_equal(0, pthread_join(threads[i], &result));
+      assert_null(result);
+    }
+
+  // Free objects from threads other than the ones allocated them.
+  for (int i = 0; i < THREAD_NUM; i++)
+    assert_int_equal(0, pthread_create(&threads[i], NULL, FreeWorker,
+                                       &args[(i + 1) % THREAD_NUM]));
+  for (int i = 0; i < THREAD_NUM; i++)
+    {
+      assert_int_equal(0, pthread_join(threads[i], &result));
+      assert_null(result);
+    }
+
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++)
+      assert_int_equal(0, heap->raw_type.uspan_queue[i][j].pcard);
+  assert_int_equal(0, heap->raw_type.hpage_queue.pcard);
+
+  for (int i = 0; i < THREAD_NUM; i++)
+    free(args[i].objects);
+  OPHeapDestroy(heap);
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest lockfree_queue_tests[] =
+    {
+      cmocka_unit_test(test_PushPopUSpan),
+      cmocka_unit_test(test_PushPopHPage),
+      cmocka_unit_test(test_ConcurrentMallocFree),
+    };
+
+  return cmocka_run_group_tests(lockfree_queue_tests, NULL, NULL);
+}
+
+/* lockfree_queue_test.c ends here */
@@ -80,6 +80,32 @@ ObtainSSpanBase(SmallSpanPtr header)
   return header.uintptr & ~(SPAGE_SIZE - 1);
 }
 
+// Number of small pages a UnarySpan of given magic spans.
+static inline unsigned int
+USpanPageCount(Magic uspan_magic)
+{
+  if (uspan_magic.uspan_generic.obj_size <= 32)
+    return 1;
+  else if (uspan_magic.uspan_generic.obj_size <= 64)
+    return 4;
+  else if (uspan_magic.uspan_generic.obj_size <= 256)
+    return 8;
+  else if (uspan_magic.uspan_generic.obj_size < 1024)
+    return 16;
+  else
+    return 32;
+}
+
+// Bits of spages small pages from bmbit within one occupy_bmap word.
+// spages can be 64, where 1UL << spages would be undefined.
+static inline uint64_t
+SPageBits(unsigned int spages, unsigned int bmbit)
+{
+  if (spages >= 64)
+    return ~0UL;
+  return ((1UL << spages) - 1) << bmbit;
+}
+
 HugeSpanPtr ObtainHugeSpanPtr(void* addr)
   __attribute__ ((visibility ("internal")));
 
@@ -0,0 +1,464 @@
+/* mark.c ---
+ *
+ * Filename: mark.c
+ * Description: Mark and rollback allocations in bulk
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdlib.h>
+#include <string.h>
+#include "opic/common/op_assert.h"
+#include "opic/common/op_atomic.h"
+#include "opic/common/op_log.h"
+#include "opic/common/op_utils.h"
+#include "init_helper.h"
+#include "inline_aux.h"
+#include "lookup_helper.h"
+#include "profiler.h"
+
+OP_LOGGER_FACTORY(logger, "opic.malloc.mark");
+
+typedef struct MarkHSpan MarkHSpan;
+typedef struct MarkSSpan MarkSSpan;
+
+// A huge span alive at the time of the mark.  For huge pages, the
+// small spans contained are sspans[sspan_begin, sspan_end) of the
+// marker.
+struct MarkHSpan
+{
+  int hpage_idx;
+  Magic magic;
+  size_t sspan_begin;
+  size_t sspan_end;
+};
+
+// A small span alive at the time of the mark.  The bitmap of unary
+// spans is copied to bmaps[bmap_begin, bmap_begin + bitmap_cnt).
+struct MarkSSpan
+{
+  int spage_idx;
+  Magic magic;
+  size_t bmap_begin;
+};
+
+struct OPHeapMarker
+{
+  OPHeap* heap;
+  MarkHSpan* hspans;
+  size_t hspan_cnt, hspan_cap;
+  MarkSSpan* sspans;
+  size_t sspan_cnt, sspan_cap;
+  uint64_t* bmaps;
+  size_t bmap_cnt, bmap_cap;
+};
+
+static bool
+MarkerReserve(void** arr, size_t* cap, size_t cnt, size_t elem_size)
+{
+  void* new_arr;
+  size_t new_cap;
+
+  if (cnt < *cap)
+    return true;
+  new_cap = *cap ? *cap * 2 : 64;
+  new_arr = realloc(*arr, new_cap * elem_size);
+  if (!new_arr)
+    return false;
+  *arr = new_arr;
+  *cap = new_cap;
+  return true;
+}
+
+static inline void
+BmapSetRange(uint64_t* bmap, int start, int cnt)
+{
+  for (int i = start; i < start + cnt; i++)
+    bmap[i / 64] |= 1UL << (i % 64);
+}
+
+static inline bool
+BmapTest(a_uint64_t* bmap, int idx)
+{
+  return atomic_load_explicit(&bmap[idx / 64], memory_order_relaxed) &
+    (1UL << (idx % 64));
+}
+
+static inline HugeSpanPtr
+HSpanAt(OPHeap* heap, int hpage_idx)
+{
+  HugeSpanPtr hspan;
+
+  if (hpage_idx == 0)
+    hspan.hpage = &heap->hpage;
+  else
+    hspan.uintptr = (uintptr_t)heap + hpage_idx * HPAGE_SIZE;
+  return hspan;
+}
+
+static inline SmallSpanPtr
+SSpanAt(HugePage* hpage, int spage_idx)
+{
+  SmallSpanPtr sspan;
+
+  sspan.uintptr = ObtainHSpanBase(hpage) + spage_idx * SPAGE_SIZE;
+  if (spage_idx == 0)
+    sspan.uintptr += sizeof(HugePage);
+  return sspan;
+}
+
+static inline uint64_t*
+USpanBmap(UnarySpan* uspan)
+{
+  return (uint64_t*)((uintptr_t)uspan + sizeof(UnarySpan));
+}
+
+static bool
+MarkHPage(OPHeapMarker* marker, HugePage* hpage)
+{
+  SmallSpanPtr sspan;
+  MarkSSpan* mark_sspan;
+
+  for (int spage_idx = 0; spage_idx < 512; spage_idx++)
+    {
+      if (!BmapTest(hpage->header_bmap, spage_idx))
+        continue;
+      if (!MarkerReserve((void**)&marker->sspans, &marker->sspan_cap,
+                         marker->sspan_cnt, sizeof(MarkSSpan)))
+        return false;
+      sspan = SSpanAt(hpage, spage_idx);
+      mark_sspan = &marker->sspans[marker->sspan_cnt++];
+      mark_sspan->spage_idx = spage_idx;
+      mark_sspan->magic = *sspan.magic;
+      mark_sspan->bmap_begin = marker->bmap_cnt;
+
+      if (sspan.magic->generic.pattern != RAW_USPAN_PATTERN &&
+          sspan.magic->generic.pattern != LARGE_USPAN_PATTERN)
+        continue;
+      while (marker->bmap_cnt + sspan.uspan->bitmap_cnt > marker->bmap_cap)
+        {
+          if (!MarkerReserve((void**)&marker->bmaps, &marker->bmap_cap,
+                             marker->bmap_cap, sizeof(uint64_t)))
+            return false;
+        }
+      memcpy(&marker->bmaps[marker->bmap_cnt], USpanBmap(sspan.uspan),
+             sspan.uspan->bitmap_cnt * sizeof(uint64_t));
+      marker->bmap_cnt += sspan.uspan->bitmap_cnt;
+    }
+  return true;
+}
+
+OPHeapMarker*
+OPHeapMark(OPHeap* heap)
+{
+  OPHeapMarker* marker;
+  HugeSpanPtr hspan;
+  MarkHSpan* mark_hspan;
+
+  marker = calloc(1, sizeof(OPHeapMarker));
+  if (!marker)
+    return NULL;
+  marker->heap = heap;
+
+  for (int hpage_idx = 0; hpage_idx < heap->hpage_num; hpage_idx++)
+    {
+      if (!BmapTest(heap->header_bmap, hpage_idx))
+        continue;
+      if (!MarkerReserve((void**)&marker->hspans, &marker->hspan_cap,
+                         marker->hspan_cnt, sizeof(MarkHSpan)))
+        goto fail;
+      hspan = HSpanAt(heap, hpage_idx);
+      mark_hspan = &marker->hspans[marker->hspan_cnt++];
+      mark_hspan->hpage_idx = hpage_idx;
+      mark_hspan->magic = *hspan.magic;
+      mark_hspan->sspan_begin = marker->sspan_cnt;
+      if (hspan.magic->generic.pattern == RAW_HPAGE_PATTERN &&
+          !MarkHPage(marker, hspan.hpage))
+        goto fail;
+      mark_hspan->sspan_end = marker->sspan_cnt;
+    }
+  return marker;
+
+ fail:
+  OP_LOG_ERROR(logger, "Failed to allocate marker for OPHeap %p", heap);
+  OPHeapMarkerDestroy(marker);
+  return NULL;
+}
+
+void
+OPHeapMarkerDestroy(OPHeapMarker* marker)
+{
+  if (!marker)
+    return;
+  free(marker->hspans);
+  free(marker->sspans);
+  free(marker->bmaps);
+  free(marker);
+}
+
+static void
+ResetQueues(OPHeap* heap)
+{
+  RawType* raw_type;
+
+  raw_type = &heap->raw_type;
+#ifdef OPIC_LOCKFREE_QUEUE
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++)
+      {
+        atomic_store(&raw_type->uspan_queue[i][j].tagged_uspan, 0);
+        atomic_store(&raw_type->uspan_queue[i][j].pcard, 0);
+      }
+  for (int i = 0; i < 3; i++)
+    {
+      atomic_store(&raw_type->large_uspan_queue[i].tagged_uspan, 0);
+      atomic_store(&raw_type->large_uspan_queue[i].pcard, 0);
+    }
+  atomic_store(&raw_type->hpage_queue.tagged_hpage, 0);
+  atomic_store(&raw_type->hpage_queue.pcard, 0);
+#else
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++)
+      {
+        raw_type->uspan_queue[i][j].uspan = NULL;
+        atomic_store(&raw_type->uspan_queue[i][j].pcard, 0);
+      }
+  for (int i = 0; i < 3; i++)
+    {
+      raw_type->large_uspan_queue[i].uspan = NULL;
+      atomic_store(&raw_type->large_uspan_queue[i].pcard, 0);
+    }
+  raw_type->hpage_queue.hpage = NULL;
+  atomic_store(&raw_type->hpage_queue.pcard, 0);
+#endif
+}
+
+static void
+RequeueUSpan(UnarySpan* uspan, bool full)
+{
+  uspan->next = NULL;
+  atomic_store(&uspan->pcard, 0);
+  atomic_store(&uspan->state, SPAN_DEQUEUED);
+  if (full)
+    return;
+#ifdef OPIC_LOCKFREE_QUEUE
+  PushUSpan(ObtainUSpanQueue(uspan), uspan);
+#else
+  EnqueueUSpan(ObtainUSpanQueue(uspan), uspan);
+#endif
+}
+
+static void
+RequeueHPage(HugePage* hpage, bool full)
+{
+  hpage->next = NULL;
+  atomic_store(&hpage->pcard, 0);
+  atomic_store(&hpage->state, SPAN_DEQUEUED);
+  if (full)
+    return;
+#ifdef OPIC_LOCKFREE_QUEUE
+  PushHPage(ObtainHPageQueue(hpage), hpage);
+#else
+  EnqueueHPage(ObtainHPageQueue(hpage), hpage);
+#endif
+}
+
+// Keep the objects both alive at the mark and alive now.
+static void
+RollbackUSpan(OPHeapMarker* marker, MarkSSpan* mark_sspan,
+              UnarySpan* uspan)
+{
+  uint64_t* bmap;
+  uint64_t empty_bmap[64];
+  int obj_cnt;
+  bool full;
+
+  bmap = USpanBmap(uspan);
+  USpanEmptiedBMap(uspan, empty_bmap);
+  obj_cnt = 0;
+  full = true;
+  for (int i = 0; i < uspan->bitmap_cnt; i++)
+    {
+      bmap[i] &= marker->bmaps[mark_sspan->bmap_begin + i];
+      bmap[i] |= empty_bmap[i];
+      obj_cnt += __builtin_popcountl(bmap[i]) -
+        __builtin_popcountl(empty_bmap[i]);
+      if (bmap[i] != ~0UL)
+        full = false;
+    }
+  atomic_store(&uspan->obj_cnt, obj_cnt);
+  uspan->bitmap_hint = 0;
+  RequeueUSpan(uspan, full);
+}
+
+static void
+RollbackHPage(OPHeapMarker* marker, MarkHSpan* mark_hspan, HugePage* hpage)
+{
+  uint64_t occupy_bmap[8], header_bmap[8];
+  SmallSpanPtr sspan;
+  MarkSSpan* mark_sspan;
+  unsigned int spage_cnt;
+  bool full;
+
+  HPageEmptiedBMaps(hpage, occupy_bmap, header_bmap);
+  for (size_t i = mark_hspan->sspan_begin; i < mark_hspan->sspan_end; i++)
+    {
+      mark_sspan = &marker->sspans[i];
+      sspan = SSpanAt(hpage, mark_sspan->spage_idx);
+      if (!BmapTest(hpage->header_bmap, mark_sspan->spage_idx) ||
+          sspan.magic->int_value != mark_sspan->magic.int_value)
+        continue;
+      switch (mark_sspan->magic.generic.pattern)
+        {
+        case RAW_USPAN_PATTERN:
+        case LARGE_USPAN_PATTERN:
+          spage_cnt = USpanPageCount(mark_sspan->magic);
+          RollbackUSpan(marker, mark_sspan, sspan.uspan);
+          break;
+        case SMALL_BLOB_PATTERN:
+          spage_cnt = mark_sspan->magic.small_blob.pages;
+          break;
+        default:
+          op_assert(false, "Unknown sspan pattern %d\n",
+                    mark_sspan->magic.generic.pattern);
+        }
+      BmapSetRange(occupy_bmap, mark_sspan->spage_idx, spage_cnt);
+      BmapSetRange(header_bmap, mark_sspan->spage_idx, 1);
+    }
+
+  full = true;
+  for (int i = 0; i < 8; i++)
+    {
+      atomic_store(&hpage->occupy_bmap[i], occupy_bmap[i]);
+      atomic_store(&hpage->header_bmap[i], header_bmap[i]);
+      if (occupy_bmap[i] != ~0UL)
+        full = false;
+    }
+  RequeueHPage(hpage, full);
+}
+
+// Whether addr is not an allocated object after the bitmaps are
+// rolled back.  A span restored from the marker may cover pages reused
+// after the mark, so addr is also checked against its object layout.
+static bool
+RolledBackAddr(OPHeap* heap, void* addr)
+{
+  HugeSpanPtr hspan;
+  SmallSpanPtr sspan;
+  uintptr_t _addr, obj_size, obj_idx;
+  int hpage_idx, spage_idx;
+
+  hpage_idx = ((uintptr_t)addr - (uintptr_t)heap) / HPAGE_SIZE;
+  if (!BmapTest(heap->occupy_bmap, hpage_idx))
+    return true;
+  hspan = ObtainHugeSpanPtr(addr);
+  if (hspan.magic->generic.pattern == HUGE_BLOB_PATTERN)
+    return (uintptr_t)addr != hspan.uintptr + sizeof(Magic);
+
+  spage_idx = ((uintptr_t)addr - ObtainHSpanBase(hspan)) / SPAGE_SIZE;
+  if (!BmapTest(hspan.hpage->occupy_bmap, spage_idx))
+    return true;
+  sspan = HPageObtainSmallSpanPtr(hspan.hpage, addr);
+  if (sspan.magic->generic.pattern == SMALL_BLOB_PATTERN)
+    return (uintptr_t)addr != sspan.uintptr + sizeof(Magic);
+
+  _addr = (uintptr_t)addr - ObtainSSpanBase(sspan);
+  obj_size = sspan.uspan->magic.uspan_generic.obj_size;
+  obj_idx = _addr / obj_size;
+  if (_addr % obj_size ||
+      obj_idx < sspan.uspan->bitmap_headroom ||
+      obj_idx >= sspan.uspan->bitmap_cnt * 64UL -
+      sspan.uspan->bitmap_padding)
+    return true;
+  return !(USpanBmap(sspan.uspan)[obj_idx / 64] & (1UL << (obj_idx % 64)));
+}
+
+void
+OPHeapRollback(OPHeap* heap, OPHeapMarker* marker)
+{
+  uint64_t occupy_bmap[HPAGE_BMAP_NUM], header_bmap[HPAGE_BMAP_NUM];
+  MarkHSpan* mark_hspan;
+  HugeSpanPtr hspan;
+
+  op_assert(marker->heap == heap, "Marker of OPHeap %p rolled back "
+            "on OPHeap %p\n", marker->heap, heap);
+
+  OPHeapEmptiedBMaps(heap, occupy_bmap, header_bmap);
+  ResetQueues(heap);
+
+  for (size_t i = 0; i < marker->hspan_cnt; i++)
+    {
+      mark_hspan = &marker->hspans[i];
+      hspan = HSpanAt(heap, mark_hspan->hpage_idx);
+      if (!BmapTest(heap->header_bmap, mark_hspan->hpage_idx) ||
+          hspan.magic->int_value != mark_hspan->magic.int_value)
+        continue;
+      switch (mark_hspan->magic.generic.pattern)
+        {
+        case RAW_HPAGE_PATTERN:
+          RollbackHPage(marker, mark_hspan, hspan.hpage);
+          BmapSetRange(occupy_bmap, mark_hspan->hpage_idx, 1);
+          break;
+        case HUGE_BLOB_PATTERN:
+          BmapSetRange(occupy_bmap, mark_hspan->hpage_idx,
+                       mark_hspan->magic.huge_blob.huge_pages);
+          break;
+        default:
+          op_assert(false, "Unknown hspan pattern %d\n",
+                    mark_hspan->magic.generic.pattern);
+        }
+      BmapSetRange(header_bmap, mark_hspan->hpage_idx, 1);
+    }
+
+  for (int i = 0; i < HPAGE_BMAP_NUM; i++)
+    {
+      atomic_store(&heap->occupy_bmap[i], occupy_bmap[i]);
+      atomic_store(&heap->header_bmap[i], header_bmap[i]);
+    }
+  atomic_store(&heap->pcard, 0);
+
+  // Objects released by the rollback never pass through OPDealloc.
+  if (ProfileHasLiveSamples())
+    ProfileDropSamplesIf(heap, RolledBackAddr);
+}
+
+/* mark.c ends here */
@@ -0,0 +1,167 @@
+/* mark_test.c ---
+ *
+ * Filename: mark_test.c
+ * Description: Tests for heap mark and rollback
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include "opic/op_malloc.h"
+
+static size_t sizes[] = { 16, 64, 200, 700, 2000, 5000, 100000,
+                          3 * 1024 * 1024 };
+
+static void
+AllocScratch(OPHeap* heap, int num)
+{
+  void* addr;
+  size_t size;
+
+  for (int i = 0; i < num; i++)
+    {
+      size = sizes[i % (sizeof(sizes) / sizeof(size_t))];
+      addr = OPMallocAdviced(heap, size, i);
+      assert_non_null(addr);
+      memset(addr, 0xab, size);
+    }
+}
+
+static void
+test_OPHeapRollback(void** context)
+{
+  OPHeap* heap;
+  OPHeapMarker* marker;
+  OPHeapStats before, after;
+  uint64_t* objs[100];
+
+  assert_true(OPHeapNew(&heap));
+  for (int i = 0; i < 100; i++)
+    {
+      objs[i] = OPMalloc(heap, 64);
+      for (int j = 0; j < 8; j++)
+        objs[i][j] = i;
+    }
+  OPHeapGetStats(heap, &before);
+
+  marker = OPHeapMark(heap);
+  assert_non_null(marker);
+  AllocScratch(heap, 1000);
+  OPHeapRollback(heap, marker);
+  OPHeapGetStats(heap, &after);
+  assert_memory_equal(&before, &after, sizeof(OPHeapStats));
+
+  // The marker can be rolled back repeatedly.
+  AllocScratch(heap, 500);
+  OPHeapRollback(heap, marker);
+  OPHeapGetStats(heap, &after);
+  assert_memory_equal(&before, &after, sizeof(OPHeapStats));
+  OPHeapMarkerDestroy(marker);
+
+  for (int i = 0; i < 100; i++)
+    for (int j = 0; j < 8; j++)
+      assert_int_equal(i, objs[i][j]);
+
+  for (int i = 0; i < 100; i++)
+    OPDealloc(objs[i]);
+  OPHeapGetStats(heap, &after);
+  assert_int_equal(0, after.live_objects);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_OPHeapRollback_FreedAfterMark(void** context)
+{
+  OPHeap* heap;
+  OPHeapMarker* marker;
+  OPHeapStats stats;
+  void *objs[100], *blob;
+
+  assert_true(OPHeapNew(&heap));
+  for (int i = 0; i < 100; i++)
+    objs[i] = OPMalloc(heap, 64);
+  blob = OPMalloc(heap, 3 * 1024 * 1024);
+
+  marker = OPHeapMark(heap);
+  assert_non_null(marker);
+  for (int i = 0; i < 50; i++)
+    OPDealloc(objs[i]);
+  OPDealloc(blob);
+  for (int i = 0; i < 100; i++)
+    OPMalloc(heap, 128);
+  OPHeapRollback(heap, marker);
+  OPHeapMarkerDestroy(marker);
+
+  OPHeapGetStats(heap, &stats);
+  assert_int_equal(50, stats.live_objects);
+  assert_int_equal(50, stats.size_class[3].live_objects);
+  assert_int_equal(0, stats.huge_blob_cnt);
+
+  // Heap is still usable after the rollback.
+  for (int i = 0; i < 50; i++)
+    objs[i] = OPMalloc(heap, 64);
+  for (int i = 0; i < 100; i++)
+    OPDealloc(objs[i]);
+  OPHeapGetStats(heap, &stats);
+  assert_int_equal(0, stats.live_objects);
+  OPHeapDestroy(heap);
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest mark_tests[] =
+    {
+      cmocka_unit_test(test_OPHeapRollback),
+      cmocka_unit_test(test_OPHeapRollback_FreedAfterMark),
+    };
+
+  return cmocka_run_group_tests(mark_tests, NULL, NULL);
+}
+
+/* mark_test.c ends here */
@@ -50,6 +50,7 @@
 #define OPIC_MALLOC_OBJDEF_H 1
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include "opic/common/op_atomic.h"
 #include "opic/common/op_macros.h"
@@ -112,6 +113,32 @@ struct HugePage
   a_uint64_t header_bmap[8];
 };
 
+#ifdef OPIC_LOCKFREE_QUEUE
+
+// With lock free queues the list head is a tagged pointer: the lower
+// 48 bits hold the address of the top span and the upper 16 bits hold
+// a counter bumped on every push and pop to avoid ABA.  The head must
+// be naturally aligned for compare and swap, hence the queues are not
+// packed and the OPHeap layout differs from the default build.
+// pcard is only used as a reader count to know when a dequeued span can
+// be handed back to its container; it is never booked.
+#define QUEUE_TAG_SHIFT 48
+#define QUEUE_PTR_MASK ((1UL << QUEUE_TAG_SHIFT) - 1)
+
+struct UnarySpanQueue
+{
+  a_uint64_t tagged_uspan;
+  a_int16_t pcard;
+};
+
+struct HugePageQueue
+{
+  a_uint64_t tagged_hpage;
+  a_int16_t pcard;
+};
+
+#else
+
 struct UnarySpanQueue
 {
   UnarySpan* uspan;
@@ -124,6 +151,8 @@ struct HugePageQueue
   a_int16_t pcard;
 } __attribute__((packed));
 
+#endif
+
 // Blob contained by HPage
 struct SmallBlob
 {
@@ -180,6 +209,11 @@ struct OPHeap
   HugePage hpage;
 } __attribute__((packed));
 
+#ifdef OPIC_LOCKFREE_QUEUE
+_Static_assert(offsetof(OPHeap, raw_type) % 8 == 0,
+               "lock free queue heads must be 8 bytes aligned");
+#endif
+
 struct OPHeapCtx
 {
   SmallSpanPtr sspan;
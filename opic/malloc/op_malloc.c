@@ -47,11 +47,15 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include "opic/op_malloc.h"
 #include "opic/common/op_assert.h"
+#include "opic/common/op_atomic.h"
 #include "opic/common/op_log.h"
 #include "opic/common/op_utils.h"
 #include "opic/malloc/objdef.h"
+#include "opic/malloc/profiler.h"
 
 #ifdef __linux__
 #define MINCORE_VEC unsigned char
@@ -241,9 +245,187 @@ void* OPHeapRestorePtr(OPHeap* heap, int pos)
   return OPRef2Ptr(heap, heap->root_ptrs[pos]);
 }
 
+// Upper bound of background threads spawned by OPHeapReserve.
+#define RESERVE_THREAD_NUM 4
+
+typedef struct ReserveTask ReserveTask;
+
+struct ReserveTask
+{
+  ReserveTask* next;
+  OPHeap* heap;
+  a_int8_t cancelled;
+  int hpage_cnt;
+  int hpage_idx[];
+};
+
+// Tasks of background threads still running.  OPHeapDestroy cancels
+// the tasks of its heap and waits for them before unmapping it.
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reserve_cond = PTHREAD_COND_INITIALIZER;
+static ReserveTask* reserve_tasks;
+
+// Make the pages resident and writable without modifying their
+// content, as other threads may be initializing the memory meanwhile.
+static bool
+HPagePrefault(void* addr)
+{
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(addr, HPAGE_SIZE, MADV_POPULATE_WRITE) == 0)
+    return true;
+  if (errno != EINVAL)
+    return false;
+#endif
+  // MADV_WILLNEED does not fault in anonymous memory, write to every
+  // page instead.
+  for (uintptr_t page = (uintptr_t)addr;
+       page < (uintptr_t)addr + HPAGE_SIZE; page += SPAGE_SIZE)
+    atomic_fetch_add_explicit((a_uint64_t*)page, 0, memory_order_relaxed);
+  return true;
+}
+
+static bool
+ReserveRun(ReserveTask* task)
+{
+  uintptr_t heap_base;
+
+  heap_base = (uintptr_t)task->heap;
+  for (int i = 0; i < task->hpage_cnt; i++)
+    {
+      if (atomic_load_explicit(&task->cancelled, memory_order_relaxed))
+        return false;
+      if (!HPagePrefault((void*)(heap_base +
+                                 task->hpage_idx[i] * HPAGE_SIZE)))
+        {
+          OP_LOG_WARN(logger, "Failed to prefault hpage %d in OPHeap %p: %s",
+                      task->hpage_idx[i], task->heap, strerror(errno));
+          return false;
+        }
+    }
+  return true;
+}
+
+static void
+ReserveUnlink(ReserveTask* task)
+{
+  ReserveTask** it;
+
+  pthread_mutex_lock(&reserve_lock);
+  for (it = &reserve_tasks; *it != task; it = &(*it)->next)
+    ;
+  *it = task->next;
+  pthread_cond_broadcast(&reserve_cond);
+  pthread_mutex_unlock(&reserve_lock);
+}
+
+static void*
+ReserveThread(void* arg)
+{
+  ReserveRun(arg);
+  ReserveUnlink(arg);
+  free(arg);
+  return NULL;
+}
+
+// Cancels the background reservation of heap and waits for the huge
+// pages being prefaulted.
+static void
+ReserveCancel(OPHeap* heap)
+{
+  ReserveTask* task;
+  bool running;
+
+  pthread_mutex_lock(&reserve_lock);
+  do
+    {
+      running = false;
+      for (task = reserve_tasks; task; task = task->next)
+        {
+          if (task->heap != heap)
+            continue;
+          atomic_store_explicit(&task->cancelled, 1, memory_order_relaxed);
+          running = true;
+        }
+      if (running)
+        pthread_cond_wait(&reserve_cond, &reserve_lock);
+    }
+  while (running);
+  pthread_mutex_unlock(&reserve_lock);
+}
+
+bool
+OPHeapReserve(OPHeap* heap, size_t bytes, int flags)
+{
+  int hpage_cnt, found, thread_num, begin, end;
+  int* hpage_idx;
+  ReserveTask* task;
+  pthread_t thread;
+  pthread_attr_t attr;
+  bool success;
+
+  hpage_cnt = round_up_div(bytes, HPAGE_SIZE);
+  if (hpage_cnt == 0)
+    return true;
+  hpage_idx = malloc(hpage_cnt * sizeof(int));
+  if (!hpage_idx)
+    return false;
+
+  // Free huge pages are handed out lowest index first.
+  found = 0;
+  for (int idx = 0; idx < heap->hpage_num && found < hpage_cnt; idx++)
+    {
+      if (!(atomic_load_explicit(&heap->occupy_bmap[idx / 64],
+                                 memory_order_relaxed) & (1UL << (idx % 64))))
+        hpage_idx[found++] = idx;
+    }
+  success = found == hpage_cnt;
+
+  thread_num = flags & OPHEAP_RESERVE_ASYNC ?
+    (found < RESERVE_THREAD_NUM ? found : RESERVE_THREAD_NUM) : 1;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int t = 0; t < thread_num; t++)
+    {
+      begin = (int64_t)found * t / thread_num;
+      end = (int64_t)found * (t + 1) / thread_num;
+      task = malloc(sizeof(ReserveTask) + (end - begin) * sizeof(int));
+      if (!task)
+        {
+          success = false;
+          break;
+        }
+      task->heap = heap;
+      atomic_init(&task->cancelled, 0);
+      task->hpage_cnt = end - begin;
+      memcpy(task->hpage_idx, &hpage_idx[begin], (end - begin) * sizeof(int));
+      if (!(flags & OPHEAP_RESERVE_ASYNC))
+        {
+          success &= ReserveRun(task);
+          free(task);
+          continue;
+        }
+      pthread_mutex_lock(&reserve_lock);
+      task->next = reserve_tasks;
+      reserve_tasks = task;
+      pthread_mutex_unlock(&reserve_lock);
+      if (pthread_create(&thread, &attr, ReserveThread, task))
+        {
+          OP_LOG_WARN(logger, "Failed to spawn OPHeapReserve thread");
+          ReserveUnlink(task);
+          success &= ReserveRun(task);
+          free(task);
+        }
+    }
+  pthread_attr_destroy(&attr);
+  free(hpage_idx);
+  return success;
+}
+
 void
 OPHeapDestroy(OPHeap* heap)
 {
+  ReserveCancel(heap);
+  ProfileForgetHeap(heap);
   munmap(heap, heap->hpage_num * HPAGE_SIZE);
 }
 
@@ -50,6 +50,7 @@
 #include <setjmp.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <string.h>
 #include <cmocka.h>
 
@@ -121,6 +122,58 @@ test_OPHeapIO(void** context)
   //OPHeapDestroy(heap_read);
 }
 
+static int
+ResidentSPages(void* addr, size_t len)
+{
+  unsigned char vec[HPAGE_SIZE / SPAGE_SIZE];
+  int cnt = 0;
+
+  assert_int_equal(0, mincore(addr, len, vec));
+  for (size_t i = 0; i < len / SPAGE_SIZE; i++)
+    cnt += vec[i] & 1;
+  return cnt;
+}
+
+static void
+test_OPHeapReserve(void** context)
+{
+  OPHeap* heap;
+  void* hpage;
+
+  assert_true(OPHeapNew(&heap));
+  hpage = (char*)heap + 2 * HPAGE_SIZE;
+  assert_int_equal(0, ResidentSPages(hpage, HPAGE_SIZE));
+  assert_true(OPHeapReserve(heap, 3 * HPAGE_SIZE, OPHEAP_RESERVE_SYNC));
+  assert_int_equal(HPAGE_SIZE / SPAGE_SIZE, ResidentSPages(hpage, HPAGE_SIZE));
+
+  hpage = (char*)heap + 5 * HPAGE_SIZE;
+  assert_int_equal(0, ResidentSPages(hpage, HPAGE_SIZE));
+  assert_true(OPHeapReserve(heap, 6 * HPAGE_SIZE, OPHEAP_RESERVE_ASYNC));
+  for (int i = 0; i < 1000; i++)
+    {
+      if (ResidentSPages(hpage, HPAGE_SIZE) == HPAGE_SIZE / SPAGE_SIZE)
+        break;
+      usleep(1000);
+    }
+  assert_int_equal(HPAGE_SIZE / SPAGE_SIZE, ResidentSPages(hpage, HPAGE_SIZE));
+  OPHeapDestroy(heap);
+}
+
+static void
+test_OPHeapReserve_Destroy(void** context)
+{
+  OPHeap* heap;
+
+  // Background threads must not touch the heap once it is unmapped.
+  for (int i = 0; i < 20; i++)
+    {
+      assert_true(OPHeapNew(&heap));
+      assert_true(OPHeapReserve(heap, 64 * HPAGE_SIZE,
+                                OPHEAP_RESERVE_ASYNC));
+      OPHeapDestroy(heap);
+    }
+}
+
 int
 main (void)
 {
@@ -128,6 +181,8 @@ main (void)
     {
       cmocka_unit_test(test_OPHeapShrinkShadow),
       cmocka_unit_test(test_OPHeapIO),
+      cmocka_unit_test(test_OPHeapReserve),
+      cmocka_unit_test(test_OPHeapReserve_Destroy),
     };
 
   return cmocka_run_group_tests(op_malloc_tests, NULL, NULL);
@@ -0,0 +1,161 @@
+/* op_pool.c ---
+ *
+ * Filename: op_pool.c
+ * Description: Pool of fixed size objects addressed by 32 bit references
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include "opic/common/op_assert.h"
+#include "opic/common/op_log.h"
+#include "opic/op_pool.h"
+
+OP_LOGGER_FACTORY(logger, "opic.malloc.op_pool");
+
+static inline int
+PoolRefChunk(opref32_t ref)
+{
+  uint64_t idx;
+
+  idx = (uint64_t)ref - 1 + (1UL << OPPOOL_FIRST_CHUNK_BITS);
+  return 63 - __builtin_clzl(idx) - OPPOOL_FIRST_CHUNK_BITS;
+}
+
+static inline size_t
+PoolChunkSize(int chunk)
+{
+  return 1UL << (chunk + OPPOOL_FIRST_CHUNK_BITS);
+}
+
+bool
+OPPoolNew(OPHeap* heap, OPPool** pool_ref, size_t obj_size)
+{
+  OPPool* pool;
+
+  op_assert(obj_size > 0, "obj_size must greater than 0");
+  op_assert(obj_size <= UINT32_MAX,
+            "obj_size must fit in 32 bits, but was %zu\n", obj_size);
+
+  pool = OPCalloc(heap, 1, sizeof(OPPool));
+  if (!pool)
+    return false;
+  pool->obj_size = obj_size < sizeof(opref32_t) ?
+    sizeof(opref32_t) : obj_size;
+  pool->next_ref = 1;
+  *pool_ref = pool;
+  return true;
+}
+
+void
+OPPoolDestroy(OPPool* pool)
+{
+  for (uint32_t i = 0; i < pool->chunk_num; i++)
+    OPDealloc(OPRef2Ptr(pool, pool->chunks[i]));
+  OPDealloc(pool);
+}
+
+opref32_t
+OPPoolAlloc(OPPool* pool)
+{
+  opref32_t ref;
+  int chunk;
+  void* chunk_addr;
+
+  if (pool->free_ref)
+    {
+      ref = pool->free_ref;
+      pool->free_ref = *(opref32_t*)OPPoolRef2Ptr(pool, ref);
+      return ref;
+    }
+
+  if (op_unlikely(pool->next_ref == UINT32_MAX))
+    {
+      OP_LOG_WARN(logger, "OPPool %p exhausted", pool);
+      return 0;
+    }
+
+  ref = pool->next_ref;
+  chunk = PoolRefChunk(ref);
+  if (chunk == (int)pool->chunk_num)
+    {
+      chunk_addr = OPMalloc(ObtainOPHeap(pool),
+                            PoolChunkSize(chunk) * pool->obj_size);
+      if (!chunk_addr)
+        return 0;
+      pool->chunks[chunk] = OPPtr2Ref(chunk_addr);
+      pool->chunk_num++;
+    }
+  pool->next_ref++;
+  return ref;
+}
+
+void
+OPPoolFree(OPPool* pool, opref32_t ref)
+{
+  op_assert(ref && ref < pool->next_ref,
+            "opref32_t %" PRIu32 " not allocated by OPPool %p\n",
+            ref, pool);
+  *(opref32_t*)OPPoolRef2Ptr(pool, ref) = pool->free_ref;
+  pool->free_ref = ref;
+}
+
+opref32_t
+OPPoolPtr2Ref(OPPool* pool, void* addr)
+{
+  uintptr_t base, offset;
+
+  if (!addr)
+    return 0;
+  for (uint32_t i = 0; i < pool->chunk_num; i++)
+    {
+      base = (uintptr_t)OPRef2Ptr(pool, pool->chunks[i]);
+      offset = (uintptr_t)addr - base;
+      if ((uintptr_t)addr >= base &&
+          offset < PoolChunkSize(i) * pool->obj_size)
+        return PoolChunkSize(i) + offset / pool->obj_size
+          - (1UL << OPPOOL_FIRST_CHUNK_BITS) + 1;
+    }
+  op_assert(false, "Addr %p not in OPPool %p\n", addr, pool);
+  return 0;
+}
+
+/* op_pool.c ends here */
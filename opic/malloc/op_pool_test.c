@@ -0,0 +1,130 @@
+/* op_pool_test.c ---
+ *
+ * Filename: op_pool_test.c
+ * Description: Tests for OPPool
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include "opic/op_pool.h"
+
+struct Node
+{
+  opref32_t next;
+  uint32_t val;
+};
+
+static void
+test_OPPoolRefConversion(void** context)
+{
+  OPHeap* heap;
+  OPPool* pool;
+  opref32_t ref;
+  struct Node* node;
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(OPPoolNew(heap, &pool, sizeof(struct Node)));
+  assert_null(OPPoolRef2Ptr(pool, 0));
+  assert_int_equal(0, OPPoolPtr2Ref(pool, NULL));
+
+  for (uint32_t i = 1; i <= 10000; i++)
+    {
+      ref = OPPoolAlloc(pool);
+      assert_int_equal(i, ref);
+      node = OPPoolRef2Ptr(pool, ref);
+      node->next = ref - 1;
+      node->val = i;
+      assert_int_equal(ref, OPPoolPtr2Ref(pool, node));
+    }
+
+  // Objects do not move when the pool grows; walk the chain back.
+  for (uint32_t i = 10000; ref; i--)
+    {
+      node = OPPoolRef2Ptr(pool, ref);
+      assert_int_equal(i, node->val);
+      ref = node->next;
+    }
+  OPPoolDestroy(pool);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_OPPoolFree(void** context)
+{
+  OPHeap* heap;
+  OPPool* pool;
+  opref32_t refs[100];
+
+  assert_true(OPHeapNew(&heap));
+  assert_true(OPPoolNew(heap, &pool, 1));
+  for (int i = 0; i < 100; i++)
+    refs[i] = OPPoolAlloc(pool);
+  for (int i = 0; i < 100; i += 2)
+    OPPoolFree(pool, refs[i]);
+  // Freed objects are handed out again before the pool grows.
+  for (int i = 98; i >= 0; i -= 2)
+    assert_int_equal(refs[i], OPPoolAlloc(pool));
+  assert_int_equal(101, OPPoolAlloc(pool));
+  OPPoolDestroy(pool);
+  OPHeapDestroy(heap);
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest op_pool_tests[] =
+    {
+      cmocka_unit_test(test_OPPoolRefConversion),
+      cmocka_unit_test(test_OPPoolFree),
+    };
+
+  return cmocka_run_group_tests(op_pool_tests, NULL, NULL);
+}
+
+/* op_pool_test.c ends here */
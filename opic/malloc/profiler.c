@@ -0,0 +1,628 @@
+/* profiler.c ---
+ *
+ * Filename: profiler.c
+ * Description: Sampling heap profiler
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <execinfo.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opic/common/op_assert.h"
+#include "opic/common/op_log.h"
+#include "opic/common/op_utils.h"
+#include "magic.h"
+#include "profiler.h"
+
+#define PROFILE_MAX_DEPTH 32
+// ProfileRecordAlloc and OPMallocAdviced
+#define PROFILE_SKIP_FRAMES 2
+#define PROFILE_SITE_STRIPES 64
+#define PROFILE_SITE_STRIPE_BUCKETS 64
+#define PROFILE_STRIPES 64
+#define PROFILE_STRIPE_BUCKETS 256
+// While profiling is stopped each thread rechecks whether it was
+// started after allocating this many bytes.
+#define PROFILE_RECHECK_BYTES (1L << 20)
+
+OP_LOGGER_FACTORY(logger, "opic.malloc.profiler");
+
+typedef struct ProfileSite ProfileSite;
+typedef struct ProfileSample ProfileSample;
+typedef struct ProfileStripe ProfileStripe;
+typedef struct ProfileSiteStripe ProfileSiteStripe;
+
+// Sampled allocations aggregated by heap, call site and size class.
+struct ProfileSite
+{
+  ProfileSite* next;
+  OPHeap* heap;
+  uint64_t hash;
+  size_t size_class;
+  int depth;
+  void* frames[PROFILE_MAX_DEPTH];
+  a_uint64_t alloc_objects;
+  a_uint64_t alloc_bytes;
+  a_uint64_t live_objects;
+  a_uint64_t live_bytes;
+};
+
+struct ProfileSample
+{
+  ProfileSample* next;
+  void* addr;
+  size_t size;
+  ProfileSite* site;
+};
+
+struct ProfileStripe
+{
+  pthread_mutex_t lock;
+  ProfileSample* buckets[PROFILE_STRIPE_BUCKETS];
+};
+
+// Sites are striped by their hash so sampled allocations from
+// different call sites do not serialize on one lock.
+struct ProfileSiteStripe
+{
+  pthread_mutex_t lock;
+  ProfileSite* buckets[PROFILE_SITE_STRIPE_BUCKETS];
+};
+
+__thread int64_t profile_countdown;
+a_uint64_t profile_live_samples;
+
+static __thread uint64_t profile_rand_state;
+static a_uint64_t profile_interval;
+static uint64_t profile_dump_interval;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+// Lock order: site stripe locks first in ascending order, then the
+// sample stripe locks.
+static ProfileSiteStripe site_stripes[PROFILE_SITE_STRIPES];
+static ProfileStripe stripes[PROFILE_STRIPES];
+
+static void
+ProfileInit(void)
+{
+  for (int i = 0; i < PROFILE_SITE_STRIPES; i++)
+    pthread_mutex_init(&site_stripes[i].lock, NULL);
+  for (int i = 0; i < PROFILE_STRIPES; i++)
+    pthread_mutex_init(&stripes[i].lock, NULL);
+}
+
+static void
+ProfileLockSites(void)
+{
+  for (int i = 0; i < PROFILE_SITE_STRIPES; i++)
+    pthread_mutex_lock(&site_stripes[i].lock);
+}
+
+static void
+ProfileUnlockSites(void)
+{
+  for (int i = PROFILE_SITE_STRIPES - 1; i >= 0; i--)
+    pthread_mutex_unlock(&site_stripes[i].lock);
+}
+
+static inline uint64_t
+ProfileAddrHash(void* addr)
+{
+  return (uint64_t)(uintptr_t)addr * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline ProfileStripe*
+ProfileAddrStripe(uint64_t hash)
+{
+  return &stripes[hash >> 58];
+}
+
+static inline ProfileSample**
+ProfileAddrBucket(ProfileStripe* stripe, uint64_t hash)
+{
+  return &stripe->buckets[(hash >> 32) % PROFILE_STRIPE_BUCKETS];
+}
+
+static size_t
+ProfileSizeClass(size_t size)
+{
+  if (size <= 256)
+    return round_up_div(size, 16) * 16;
+  else if (size <= 512)
+    return 512;
+  else if (size <= 1024)
+    return 1024;
+  else if (size <= 2048)
+    return 2048;
+  else if (size <= HPAGE_SIZE - SPAGE_SIZE)
+    return round_up_div(size + sizeof(Magic), SPAGE_SIZE) * SPAGE_SIZE;
+  return round_up_div(size + sizeof(Magic), HPAGE_SIZE) * HPAGE_SIZE;
+}
+
+// Distance to the next sample is exponentially distributed with mean
+// of the sampling interval, so every byte allocated has the same
+// chance to be sampled.
+static int64_t
+ProfileNextCountdown(uint64_t interval)
+{
+  uint64_t x;
+  double u;
+
+  x = profile_rand_state;
+  if (!x)
+    x = (uintptr_t)&profile_rand_state | 1;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  profile_rand_state = x;
+  u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (int64_t)(-log(u) * interval) + 1;
+}
+
+static uint64_t
+ProfileSiteHash(OPHeap* heap, size_t size_class, void** frames, int depth)
+{
+  uint64_t hash;
+
+  hash = (uintptr_t)heap ^ size_class;
+  for (int i = 0; i < depth; i++)
+    {
+      hash ^= (uintptr_t)frames[i];
+      hash *= 0x100000001B3ULL;
+    }
+  return hash;
+}
+
+static inline ProfileSiteStripe*
+ProfileSiteStripeOf(uint64_t hash)
+{
+  return &site_stripes[hash % PROFILE_SITE_STRIPES];
+}
+
+// Must be called with the lock of the site stripe of hash held.
+static ProfileSite*
+ProfileObtainSite(OPHeap* heap, uint64_t hash, size_t size_class,
+                  void** frames, int depth)
+{
+  ProfileSite** it;
+
+  it = &ProfileSiteStripeOf(hash)->buckets
+    [hash / PROFILE_SITE_STRIPES % PROFILE_SITE_STRIPE_BUCKETS];
+  for (; *it; it = &(*it)->next)
+    {
+      if ((*it)->hash == hash && (*it)->heap == heap &&
+          (*it)->size_class == size_class && (*it)->depth == depth &&
+          !memcmp((*it)->frames, frames, depth * sizeof(void*)))
+        return *it;
+    }
+
+  *it = calloc(1, sizeof(ProfileSite));
+  if (!*it)
+    return NULL;
+  (*it)->heap = heap;
+  (*it)->hash = hash;
+  (*it)->size_class = size_class;
+  (*it)->depth = depth;
+  memcpy((*it)->frames, frames, depth * sizeof(void*));
+  return *it;
+}
+
+// Drops samples and sites matching heap, or all of them if heap is
+// NULL.  Must be called with all site stripe locks held.
+static void
+ProfileDropSites(OPHeap* heap)
+{
+  ProfileSample **sample_it, *sample;
+  ProfileSite **site_it, *site;
+
+  for (int i = 0; i < PROFILE_STRIPES; i++)
+    {
+      pthread_mutex_lock(&stripes[i].lock);
+      for (int j = 0; j < PROFILE_STRIPE_BUCKETS; j++)
+        {
+          sample_it = &stripes[i].buckets[j];
+          while (*sample_it)
+            {
+              sample = *sample_it;
+              if (heap && sample->site->heap != heap)
+                {
+                  sample_it = &sample->next;
+                  continue;
+                }
+              *sample_it = sample->next;
+              atomic_fetch_sub_explicit(&profile_live_samples, 1,
+                                        memory_order_relaxed);
+              free(sample);
+            }
+        }
+      pthread_mutex_unlock(&stripes[i].lock);
+    }
+
+  for (int i = 0; i < PROFILE_SITE_STRIPES; i++)
+    for (int j = 0; j < PROFILE_SITE_STRIPE_BUCKETS; j++)
+      {
+        site_it = &site_stripes[i].buckets[j];
+        while (*site_it)
+          {
+            site = *site_it;
+            if (heap && site->heap != heap)
+              {
+                site_it = &site->next;
+                continue;
+              }
+            *site_it = site->next;
+            free(site);
+          }
+      }
+}
+
+void
+OPHeapProfileStart(size_t sample_interval)
+{
+  op_assert(sample_interval > 0, "sample_interval must greater than 0");
+
+  pthread_once(&profile_once, ProfileInit);
+  ProfileLockSites();
+  ProfileDropSites(NULL);
+  profile_dump_interval = sample_interval;
+  atomic_store_explicit(&profile_interval, sample_interval,
+                        memory_order_relaxed);
+  ProfileUnlockSites();
+  profile_countdown = 0;
+}
+
+void
+OPHeapProfileStop(void)
+{
+  atomic_store_explicit(&profile_interval, 0, memory_order_relaxed);
+}
+
+void
+ProfileRecordAlloc(OPHeap* heap, void* addr, size_t size)
+{
+  uint64_t interval, hash, site_hash;
+  void* frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+  int depth;
+  size_t size_class;
+  ProfileSite* site;
+  ProfileSiteStripe* site_stripe;
+  ProfileSample* sample;
+  ProfileStripe* stripe;
+  ProfileSample** bucket;
+
+  interval = atomic_load_explicit(&profile_interval, memory_order_relaxed);
+  if (!interval)
+    {
+      profile_countdown = PROFILE_RECHECK_BYTES;
+      return;
+    }
+  profile_countdown = ProfileNextCountdown(interval);
+  if (!addr)
+    return;
+
+  depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES);
+  depth = depth > PROFILE_SKIP_FRAMES ? depth - PROFILE_SKIP_FRAMES : 0;
+  sample = malloc(sizeof(ProfileSample));
+  if (!sample)
+    return;
+
+  size_class = ProfileSizeClass(size);
+  site_hash = ProfileSiteHash(heap, size_class,
+                              &frames[PROFILE_SKIP_FRAMES], depth);
+  site_stripe = ProfileSiteStripeOf(site_hash);
+  pthread_mutex_lock(&site_stripe->lock);
+  site = ProfileObtainSite(heap, site_hash, size_class,
+                           &frames[PROFILE_SKIP_FRAMES], depth);
+  if (!site)
+    {
+      pthread_mutex_unlock(&site_stripe->lock);
+      free(sample);
+      OP_LOG_WARN(logger, "Failed to record profile site");
+      return;
+    }
+  atomic_fetch_add_explicit(&site->alloc_objects, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&site->alloc_bytes, size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&site->live_objects, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&site->live_bytes, size, memory_order_relaxed);
+
+  sample->addr = addr;
+  sample->size = size;
+  sample->site = site;
+  hash = ProfileAddrHash(addr);
+  stripe = ProfileAddrStripe(hash);
+  pthread_mutex_lock(&stripe->lock);
+  bucket = ProfileAddrBucket(stripe, hash);
+  sample->next = *bucket;
+  *bucket = sample;
+  atomic_fetch_add_explicit(&profile_live_samples, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&stripe->lock);
+  pthread_mutex_unlock(&site_stripe->lock);
+}
+
+// Called with the stripe lock held once sample is unlinked.
+static inline void
+ProfileReleaseSample(ProfileSample* sample)
+{
+  atomic_fetch_sub_explicit(&sample->site->live_objects, 1,
+                            memory_order_relaxed);
+  atomic_fetch_sub_explicit(&sample->site->live_bytes, sample->size,
+                            memory_order_relaxed);
+  atomic_fetch_sub_explicit(&profile_live_samples, 1,
+                            memory_order_relaxed);
+}
+
+void
+ProfileRecordDealloc(void* addr)
+{
+  uint64_t hash;
+  ProfileStripe* stripe;
+  ProfileSample **it, *sample;
+
+  hash = ProfileAddrHash(addr);
+  stripe = ProfileAddrStripe(hash);
+  pthread_mutex_lock(&stripe->lock);
+  for (it = ProfileAddrBucket(stripe, hash); *it; it = &(*it)->next)
+    {
+      if ((*it)->addr != addr)
+        continue;
+      sample = *it;
+      *it = sample->next;
+      ProfileReleaseSample(sample);
+      pthread_mutex_unlock(&stripe->lock);
+      free(sample);
+      return;
+    }
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+void
+ProfileDropSamplesIf(OPHeap* heap, bool (*freed)(OPHeap*, void*))
+{
+  ProfileSample **it, *sample;
+
+  pthread_once(&profile_once, ProfileInit);
+  for (int i = 0; i < PROFILE_STRIPES; i++)
+    {
+      pthread_mutex_lock(&stripes[i].lock);
+      for (int j = 0; j < PROFILE_STRIPE_BUCKETS; j++)
+        {
+          it = &stripes[i].buckets[j];
+          while (*it)
+            {
+              sample = *it;
+              if (sample->site->heap != heap || !freed(heap, sample->addr))
+                {
+                  it = &sample->next;
+                  continue;
+                }
+              *it = sample->next;
+              ProfileReleaseSample(sample);
+              free(sample);
+            }
+        }
+      pthread_mutex_unlock(&stripes[i].lock);
+    }
+}
+
+void
+ProfileForgetHeap(OPHeap* heap)
+{
+  pthread_once(&profile_once, ProfileInit);
+  ProfileLockSites();
+  ProfileDropSites(heap);
+  ProfileUnlockSites();
+}
+
+static int
+ProfileSiteCmp(const void* a, const void* b)
+{
+  uint64_t bytes_a, bytes_b;
+
+  bytes_a = (*(ProfileSite**)a)->live_bytes;
+  bytes_b = (*(ProfileSite**)b)->live_bytes;
+  return bytes_a < bytes_b ? 1 : bytes_a > bytes_b ? -1 : 0;
+}
+
+// Scale sampled counts back to estimated totals.  An object of size s
+// is sampled with probability 1 - exp(-s / interval).
+static double
+ProfileScale(uint64_t objects, uint64_t bytes, uint64_t interval)
+{
+  double avg_size;
+
+  if (!objects || !interval)
+    return 1.0;
+  avg_size = (double)bytes / objects;
+  return 1.0 / -expm1(-avg_size / interval);
+}
+
+static void
+ProfileDumpText(FILE* stream, OPHeap* heap, ProfileSite** site_arr,
+                size_t site_cnt)
+{
+  uint64_t interval;
+  double scale, live_objects, live_bytes, alloc_objects, alloc_bytes;
+  char** symbols;
+  ProfileSite* site;
+
+  interval = profile_dump_interval;
+  live_objects = live_bytes = alloc_objects = alloc_bytes = 0;
+  for (size_t i = 0; i < site_cnt; i++)
+    {
+      site = site_arr[i];
+      scale = ProfileScale(site->alloc_objects, site->alloc_bytes, interval);
+      live_objects += site->live_objects * scale;
+      live_bytes += site->live_bytes * scale;
+      alloc_objects += site->alloc_objects * scale;
+      alloc_bytes += site->alloc_bytes * scale;
+    }
+
+  fprintf(stream, "OPHeap %p profile, sample interval %" PRIu64 " bytes\n",
+          heap, interval);
+  fprintf(stream, "live %.0f objects %.0f bytes, "
+          "allocated %.0f objects %.0f bytes\n",
+          live_objects, live_bytes, alloc_objects, alloc_bytes);
+
+  for (size_t i = 0; i < site_cnt; i++)
+    {
+      site = site_arr[i];
+      scale = ProfileScale(site->alloc_objects, site->alloc_bytes, interval);
+      fprintf(stream, "\nsize class %zu: live %.0f objects %.0f bytes, "
+              "allocated %.0f objects %.0f bytes\n",
+              site->size_class,
+              site->live_objects * scale, site->live_bytes * scale,
+              site->alloc_objects * scale, site->alloc_bytes * scale);
+      symbols = backtrace_symbols(site->frames, site->depth);
+      for (int j = 0; j < site->depth; j++)
+        {
+          if (symbols)
+            fprintf(stream, "    %s\n", symbols[j]);
+          else
+            fprintf(stream, "    %p\n", site->frames[j]);
+        }
+      free(symbols);
+    }
+}
+
+// Legacy gperftools heap profile.  pprof unsamples the counts itself
+// using the interval in the header.
+static void
+ProfileDumpPprof(FILE* stream, ProfileSite** site_arr, size_t site_cnt)
+{
+  uint64_t live_objects, live_bytes, alloc_objects, alloc_bytes;
+  ProfileSite* site;
+  FILE* maps;
+  char buf[4096];
+  size_t len;
+
+  live_objects = live_bytes = alloc_objects = alloc_bytes = 0;
+  for (size_t i = 0; i < site_cnt; i++)
+    {
+      live_objects += site_arr[i]->live_objects;
+      live_bytes += site_arr[i]->live_bytes;
+      alloc_objects += site_arr[i]->alloc_objects;
+      alloc_bytes += site_arr[i]->alloc_bytes;
+    }
+
+  fprintf(stream, "heap profile: %" PRIu64 ": %" PRIu64
+          " [%" PRIu64 ": %" PRIu64 "] @ heap_v2/%" PRIu64 "\n",
+          live_objects, live_bytes, alloc_objects, alloc_bytes,
+          profile_dump_interval);
+  for (size_t i = 0; i < site_cnt; i++)
+    {
+      site = site_arr[i];
+      fprintf(stream, "%" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64
+              "] @", (uint64_t)site->live_objects,
+              (uint64_t)site->live_bytes, (uint64_t)site->alloc_objects,
+              (uint64_t)site->alloc_bytes);
+      for (int j = 0; j < site->depth; j++)
+        fprintf(stream, " %p", site->frames[j]);
+      fprintf(stream, "\n");
+    }
+
+  fprintf(stream, "\nMAPPED_LIBRARIES:\n");
+  maps = fopen("/proc/self/maps", "r");
+  if (!maps)
+    return;
+  while ((len = fread(buf, 1, sizeof(buf), maps)) > 0)
+    fwrite(buf, 1, len, stream);
+  fclose(maps);
+}
+
+void
+OPHeapProfileDump(OPHeap* heap, FILE* stream, OPHeapProfileFormat format)
+{
+  ProfileSite** site_arr;
+  size_t site_cnt, site_cap;
+  ProfileSite** new_arr;
+
+  site_arr = NULL;
+  site_cnt = site_cap = 0;
+
+  pthread_once(&profile_once, ProfileInit);
+  ProfileLockSites();
+  for (int i = 0; i < PROFILE_SITE_STRIPES; i++)
+    for (int j = 0; j < PROFILE_SITE_STRIPE_BUCKETS; j++)
+      {
+        for (ProfileSite* site = site_stripes[i].buckets[j]; site;
+             site = site->next)
+          {
+            if (site->heap != heap)
+              continue;
+            if (site_cnt == site_cap)
+              {
+                site_cap = site_cap ? site_cap * 2 : 64;
+                new_arr = realloc(site_arr,
+                                  site_cap * sizeof(ProfileSite*));
+                if (!new_arr)
+                  {
+                    OP_LOG_ERROR(logger, "Failed to allocate profile dump");
+                    goto unlock;
+                  }
+                site_arr = new_arr;
+              }
+            site_arr[site_cnt++] = site;
+          }
+      }
+  qsort(site_arr, site_cnt, sizeof(ProfileSite*), ProfileSiteCmp);
+
+  switch (format)
+    {
+    case OPHEAP_PROFILE_TEXT:
+      ProfileDumpText(stream, heap, site_arr, site_cnt);
+      break;
+    case OPHEAP_PROFILE_PPROF:
+      ProfileDumpPprof(stream, site_arr, site_cnt);
+      break;
+    default:
+      op_assert(false, "Unknown profile format %d\n", format);
+    }
+
+ unlock:
+  ProfileUnlockSites();
+  free(site_arr);
+}
+
+/* profiler.c ends here */
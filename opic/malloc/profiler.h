@@ -0,0 +1,103 @@
+/* profiler.h ---
+ *
+ * Filename: profiler.h
+ * Description: Sampling heap profiler
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#ifndef OPIC_MALLOC_PROFILER_H
+#define OPIC_MALLOC_PROFILER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "opic/common/op_atomic.h"
+#include "opic/common/op_macros.h"
+#include "opic/op_malloc.h"
+
+OP_BEGIN_DECLS
+
+// Bytes left for the current thread to allocate before the next
+// sample.  Starts at 0 so the first allocation of every thread takes
+// the slow path and picks up the sampling interval.
+extern __thread int64_t profile_countdown
+  __attribute__ ((visibility ("internal")));
+
+// Number of sampled objects not yet deallocated.  OPDealloc only looks
+// up the sample table when this is non zero.
+extern a_uint64_t profile_live_samples
+  __attribute__ ((visibility ("internal")));
+
+static inline bool
+ProfileSampleTick(size_t size)
+{
+  profile_countdown -= (int64_t)size;
+  return op_unlikely(profile_countdown < 0);
+}
+
+static inline bool
+ProfileHasLiveSamples(void)
+{
+  return op_unlikely(atomic_load_explicit(&profile_live_samples,
+                                          memory_order_relaxed) != 0);
+}
+
+void ProfileRecordAlloc(OPHeap* heap, void* addr, size_t size)
+  __attribute__ ((visibility ("internal")));
+
+void ProfileRecordDealloc(void* addr)
+  __attribute__ ((visibility ("internal")));
+
+void ProfileForgetHeap(OPHeap* heap)
+  __attribute__ ((visibility ("internal")));
+
+// Treats the samples of heap for which freed returns true as
+// deallocated.  Used when objects are released without OPDealloc.
+void ProfileDropSamplesIf(OPHeap* heap, bool (*freed)(OPHeap*, void*))
+  __attribute__ ((visibility ("internal")));
+
+OP_END_DECLS
+
+#endif
+
+/* profiler.h ends here */
@@ -0,0 +1,254 @@
+/* profiler_test.c ---
+ *
+ * Filename: profiler_test.c
+ * Description: Tests for the sampling heap profiler
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include "opic/op_malloc.h"
+
+static char*
+DumpToString(OPHeap* heap, OPHeapProfileFormat format)
+{
+  FILE* fd;
+  long len;
+  char* buf;
+
+  fd = tmpfile();
+  assert_non_null(fd);
+  OPHeapProfileDump(heap, fd, format);
+  len = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+  buf = calloc(1, len + 1);
+  assert_non_null(buf);
+  assert_int_equal(len, fread(buf, 1, len, fd));
+  fclose(fd);
+  return buf;
+}
+
+static void
+test_ProfileLiveObjects(void** context)
+{
+  OPHeap* heap;
+  void* addr[100];
+  char* dump;
+
+  assert_true(OPHeapNew(&heap));
+  OPHeapProfileStart(1);
+  for (int i = 0; i < 100; i++)
+    addr[i] = OPMalloc(heap, 64);
+
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 100: 6400 [100: 6400] "
+                         "@ heap_v2/1\n"));
+  assert_non_null(strstr(dump, "100: 6400 [100: 6400] @ 0x"));
+  assert_non_null(strstr(dump, "MAPPED_LIBRARIES:"));
+  free(dump);
+
+  for (int i = 0; i < 50; i++)
+    OPDealloc(addr[i]);
+
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 50: 3200 [100: 6400] "));
+  free(dump);
+
+  dump = DumpToString(heap, OPHEAP_PROFILE_TEXT);
+  assert_non_null(strstr(dump, "size class 64: live 50 objects 3200 bytes"));
+  free(dump);
+
+  OPHeapProfileStop();
+  for (int i = 50; i < 100; i++)
+    OPDealloc(addr[i]);
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 0: 0 [100: 6400] "));
+  free(dump);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_ProfileStopped(void** context)
+{
+  OPHeap* heap;
+  void* addr;
+  char* dump;
+
+  assert_true(OPHeapNew(&heap));
+  OPHeapProfileStart(1);
+  OPHeapProfileStop();
+  for (int i = 0; i < 100; i++)
+    {
+      addr = OPMalloc(heap, 64);
+      OPDealloc(addr);
+    }
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 0: 0 [0: 0] "));
+  free(dump);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_ProfileSizeClass(void** context)
+{
+  OPHeap* heap;
+  void *small, *large, *blob;
+  char* dump;
+
+  assert_true(OPHeapNew(&heap));
+  OPHeapProfileStart(1);
+  small = OPMalloc(heap, 20);
+  large = OPMalloc(heap, 600);
+  blob = OPMalloc(heap, 5000);
+
+  dump = DumpToString(heap, OPHEAP_PROFILE_TEXT);
+  assert_non_null(strstr(dump, "size class 32: live 1 objects 20 bytes"));
+  assert_non_null(strstr(dump, "size class 1024: live 1 objects 600 bytes"));
+  assert_non_null(strstr(dump, "size class 8192: live 1 objects 5000 bytes"));
+  free(dump);
+
+  OPDealloc(small);
+  OPDealloc(large);
+  OPDealloc(blob);
+  OPHeapProfileStop();
+  OPHeapDestroy(heap);
+}
+
+#define THREADS 8
+#define THREAD_OBJECTS 1000
+
+static void*
+AllocFromThread(void* heap)
+{
+  void* addr[THREAD_OBJECTS];
+
+  for (int i = 0; i < THREAD_OBJECTS; i++)
+    addr[i] = (i % 2) ? OPMalloc(heap, 64) : OPMalloc(heap, 128);
+  for (int i = 0; i < THREAD_OBJECTS; i += 2)
+    OPDealloc(addr[i]);
+  return NULL;
+}
+
+static void
+test_ProfileThreads(void** context)
+{
+  OPHeap* heap;
+  pthread_t threads[THREADS];
+  char* dump;
+
+  assert_true(OPHeapNew(&heap));
+  OPHeapProfileStart(1);
+  for (int i = 0; i < THREADS; i++)
+    assert_int_equal(0, pthread_create(&threads[i], NULL,
+                                       AllocFromThread, heap));
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  // Every sample is counted once even when sites are interned
+  // concurrently.
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 4000: 256000 "
+                         "[8000: 768000] @ heap_v2/1\n"));
+  free(dump);
+  OPHeapProfileStop();
+  OPHeapDestroy(heap);
+}
+
+static void
+test_ProfileRollback(void** context)
+{
+  OPHeap* heap;
+  OPHeapMarker* marker;
+  void* objs[10];
+  char* dump;
+
+  assert_true(OPHeapNew(&heap));
+  OPHeapProfileStart(1);
+  for (int i = 0; i < 10; i++)
+    objs[i] = OPMalloc(heap, 64);
+
+  marker = OPHeapMark(heap);
+  assert_non_null(marker);
+  for (int i = 0; i < 100; i++)
+    assert_non_null(OPMallocAdviced(heap, 16 << (i % 8), i));
+  OPHeapRollback(heap, marker);
+  OPHeapMarkerDestroy(marker);
+
+  // Samples of the objects released by the rollback are not live.
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 10: 640 ["));
+  free(dump);
+
+  for (int i = 0; i < 10; i++)
+    OPDealloc(objs[i]);
+  dump = DumpToString(heap, OPHEAP_PROFILE_PPROF);
+  assert_non_null(strstr(dump, "heap profile: 0: 0 ["));
+  free(dump);
+  OPHeapProfileStop();
+  OPHeapDestroy(heap);
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest profiler_tests[] =
+    {
+      cmocka_unit_test(test_ProfileLiveObjects),
+      cmocka_unit_test(test_ProfileStopped),
+      cmocka_unit_test(test_ProfileSizeClass),
+      cmocka_unit_test(test_ProfileThreads),
+      cmocka_unit_test(test_ProfileRollback),
+    };
+
+  return cmocka_run_group_tests(profiler_tests, NULL, NULL);
+}
+
+/* profiler_test.c ends here */
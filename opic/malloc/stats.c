@@ -0,0 +1,246 @@
+/* stats.c ---
+ *
+ * Filename: stats.c
+ * Description: Heap usage and fragmentation statistics
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <string.h>
+#include "opic/common/op_atomic.h"
+#include "opic/common/op_utils.h"
+#include "objdef.h"
+#include "lookup_helper.h"
+
+// Counts zero bits in the first nbits of bmap and updates longest_run
+// with the longest run of zero bits.
+static size_t
+BmapScanFree(a_uint64_t* bmap, unsigned int nbits, size_t* longest_run)
+{
+  uint64_t word;
+  unsigned int bits;
+  size_t free_cnt, run;
+
+  free_cnt = run = 0;
+  for (unsigned int bmidx = 0; bmidx * 64 < nbits; bmidx++)
+    {
+      word = atomic_load_explicit(&bmap[bmidx], memory_order_relaxed);
+      bits = nbits - bmidx * 64 < 64 ? nbits - bmidx * 64 : 64;
+      if (word == 0 && bits == 64)
+        {
+          run += 64;
+          free_cnt += 64;
+          continue;
+        }
+      for (unsigned int bmbit = 0; bmbit < bits; bmbit++)
+        {
+          if (word & (1UL << bmbit))
+            {
+              if (run > *longest_run)
+                *longest_run = run;
+              run = 0;
+            }
+          else
+            {
+              run++;
+              free_cnt++;
+            }
+        }
+    }
+  if (run > *longest_run)
+    *longest_run = run;
+  return free_cnt;
+}
+
+static void
+USpanStats(UnarySpan* uspan, OPHeapStats* stats)
+{
+  unsigned int obj_size, obj_cnt, capacity;
+  int class_idx;
+
+  obj_size = uspan->magic.uspan_generic.obj_size;
+  if (uspan->magic.generic.pattern == RAW_USPAN_PATTERN)
+    class_idx = obj_size / 16 - 1;
+  else if (obj_size == 512)
+    class_idx = 16;
+  else if (obj_size == 1024)
+    class_idx = 17;
+  else
+    class_idx = 18;
+  if (class_idx < 0 || class_idx >= OPHEAP_SIZE_CLASS_NUM)
+    return;
+
+  obj_cnt = atomic_load_explicit(&uspan->obj_cnt, memory_order_relaxed);
+  capacity = uspan->bitmap_cnt * 64 -
+    uspan->bitmap_headroom - uspan->bitmap_padding;
+
+  stats->size_class[class_idx].span_cnt++;
+  stats->size_class[class_idx].live_objects += obj_cnt;
+  stats->size_class[class_idx].capacity += capacity;
+  stats->live_objects += obj_cnt;
+  stats->live_bytes += (size_t)obj_cnt * obj_size;
+}
+
+static void
+HPageStats(HugePage* hpage, OPHeapStats* stats)
+{
+  uintptr_t hpage_base, sspan_end;
+  SmallSpanPtr sspan;
+  uint64_t header;
+  size_t occupied, covered, free_cnt, pages;
+  int bmbit;
+
+  hpage_base = ObtainHSpanBase(hpage);
+  free_cnt = BmapScanFree(hpage->occupy_bmap, 512,
+                          &stats->largest_free_spages);
+  occupied = 512 - free_cnt;
+  covered = 0;
+  stats->spage_free += free_cnt;
+
+  for (int bmidx = 0; bmidx < 8; bmidx++)
+    {
+      header = atomic_load_explicit(&hpage->header_bmap[bmidx],
+                                    memory_order_relaxed);
+      while (header)
+        {
+          bmbit = __builtin_ctzl(header);
+          header &= header - 1;
+          sspan.uintptr = hpage_base + (64 * bmidx + bmbit) * SPAGE_SIZE;
+          if (sspan.uintptr == hpage_base)
+            sspan.uintptr += sizeof(HugePage);
+
+          switch (sspan.magic->generic.pattern)
+            {
+            case RAW_USPAN_PATTERN:
+              pages = USpanPageCount(*sspan.magic);
+              stats->spage_uspan += pages;
+              USpanStats(sspan.uspan, stats);
+              break;
+            case LARGE_USPAN_PATTERN:
+              pages = USpanPageCount(*sspan.magic);
+              stats->spage_large_uspan += pages;
+              USpanStats(sspan.uspan, stats);
+              break;
+            case SMALL_BLOB_PATTERN:
+              pages = sspan.magic->small_blob.pages;
+              sspan_end = ObtainSSpanBase(sspan) + pages * SPAGE_SIZE;
+              stats->small_blob_cnt++;
+              stats->spage_small_blob += pages;
+              stats->live_objects++;
+              stats->live_bytes += sspan_end - sspan.uintptr - sizeof(Magic);
+              break;
+            default:
+              // Span is being created by another thread.
+              pages = 0;
+              break;
+            }
+          covered += pages;
+        }
+    }
+  if (occupied > covered)
+    stats->spage_header += occupied - covered;
+}
+
+void
+OPHeapGetStats(OPHeap* heap, OPHeapStats* stats)
+{
+  uintptr_t heap_base;
+  HugeSpanPtr hspan;
+  uint64_t header;
+  size_t free_cnt;
+  int bmbit, hpage_idx;
+
+  memset(stats, 0, sizeof(OPHeapStats));
+  for (int i = 0; i < 16; i++)
+    stats->size_class[i].obj_size = (i + 1) * 16;
+  stats->size_class[16].obj_size = 512;
+  stats->size_class[17].obj_size = 1024;
+  stats->size_class[18].obj_size = 2048;
+
+  heap_base = (uintptr_t)heap;
+  stats->hpage_total = heap->hpage_num;
+  free_cnt = BmapScanFree(heap->occupy_bmap, heap->hpage_num,
+                          &stats->largest_free_hpages);
+  stats->hpage_used = heap->hpage_num - free_cnt;
+
+  for (int bmidx = 0; bmidx * 64 < heap->hpage_num; bmidx++)
+    {
+      header = atomic_load_explicit(&heap->header_bmap[bmidx],
+                                    memory_order_relaxed);
+      while (header)
+        {
+          bmbit = __builtin_ctzl(header);
+          header &= header - 1;
+          hpage_idx = 64 * bmidx + bmbit;
+          if (hpage_idx >= heap->hpage_num)
+            break;
+          if (hpage_idx == 0)
+            hspan.hpage = &heap->hpage;
+          else
+            hspan.uintptr = heap_base + hpage_idx * HPAGE_SIZE;
+
+          switch (hspan.magic->generic.pattern)
+            {
+            case RAW_HPAGE_PATTERN:
+              stats->hpage_split++;
+              HPageStats(hspan.hpage, stats);
+              break;
+            case HUGE_BLOB_PATTERN:
+              stats->huge_blob_cnt++;
+              stats->huge_blob_hpages += hspan.magic->huge_blob.huge_pages;
+              stats->live_objects++;
+              stats->live_bytes += hspan.magic->huge_blob.huge_pages *
+                HPAGE_SIZE - sizeof(Magic);
+              break;
+            default:
+              break;
+            }
+        }
+    }
+
+  stats->used_bytes = stats->hpage_used * HPAGE_SIZE -
+    stats->spage_free * SPAGE_SIZE;
+  if (stats->used_bytes > stats->live_bytes)
+    stats->internal_frag_bytes = stats->used_bytes - stats->live_bytes;
+}
+
+/* stats.c ends here */
@@ -0,0 +1,150 @@
+/* stats_test.c ---
+ *
+ * Filename: stats_test.c
+ * Description: Tests for heap statistics
+ * Author: Felix Chern
+ * Maintainer:
+ * Copyright: (c) 2017 Felix Chern
+ * Created: Sun Oct 18 2026
+ * Version:
+ * Package-Requires: ()
+ * Last-Updated:
+ *           By:
+ *     Update #: 0
+ * URL:
+ * Doc URL:
+ * Keywords:
+ * Compatibility:
+ *
+ */
+
+/* Commentary:
+ *
+ *
+ *
+ */
+
+/* Change Log:
+ *
+ *
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include "magic.h"
+#include "opic/op_malloc.h"
+
+static void
+test_OPHeapGetStats_Empty(void** context)
+{
+  OPHeap* heap;
+  OPHeapStats stats;
+
+  assert_true(OPHeapNew(&heap));
+  OPHeapGetStats(heap, &stats);
+  assert_int_equal(HPAGE_BMAP_NUM * 64, stats.hpage_total);
+  assert_int_equal(0, stats.hpage_used);
+  assert_int_equal(0, stats.live_objects);
+  assert_int_equal(0, stats.used_bytes);
+  assert_int_equal(stats.hpage_total, stats.largest_free_hpages);
+  assert_int_equal(16, stats.size_class[0].obj_size);
+  assert_int_equal(256, stats.size_class[15].obj_size);
+  assert_int_equal(2048, stats.size_class[18].obj_size);
+  OPHeapDestroy(heap);
+}
+
+static void
+test_OPHeapGetStats_Usage(void** context)
+{
+  OPHeap* heap;
+  OPHeapStats stats;
+  void *addr[100], *large, *sblob, *hblob;
+
+  assert_true(OPHeapNew(&heap));
+  for (int i = 0; i < 100; i++)
+    addr[i] = OPMallocAdviced(heap, 64, 0);
+  large = OPMallocAdviced(heap, 1000, 0);
+  sblob = OPMallocAdviced(heap, 5000, 0);
+  hblob = OPMallocAdviced(heap, 3 * 1024 * 1024, 0);
+
+  OPHeapGetStats(heap, &stats);
+  assert_int_equal(3, stats.hpage_used);
+  assert_int_equal(1, stats.hpage_split);
+  assert_int_equal(1, stats.huge_blob_cnt);
+  assert_int_equal(2, stats.huge_blob_hpages);
+  assert_int_equal(1, stats.small_blob_cnt);
+  assert_int_equal(2, stats.spage_small_blob);
+  assert_int_equal(4, stats.spage_uspan);
+  assert_int_equal(32, stats.spage_large_uspan);
+  assert_true(stats.spage_header > 0);
+  assert_int_equal(512, stats.spage_free + stats.spage_header +
+                   stats.spage_uspan + stats.spage_large_uspan +
+                   stats.spage_small_blob);
+
+  assert_int_equal(1, stats.size_class[3].span_cnt);
+  assert_int_equal(100, stats.size_class[3].live_objects);
+  assert_true(stats.size_class[3].capacity >= 100);
+  assert_int_equal(1, stats.size_class[17].live_objects);
+  assert_int_equal(103, stats.live_objects);
+  assert_int_equal(100 * 64 + 1024 + 2 * SPAGE_SIZE - sizeof(Magic) +
+                   2 * HPAGE_SIZE - sizeof(Magic), stats.live_bytes);
+  assert_int_equal(3 * HPAGE_SIZE - stats.spage_free * SPAGE_SIZE,
+                   stats.used_bytes);
+  assert_int_equal(stats.used_bytes - stats.live_bytes,
+                   stats.internal_frag_bytes);
+  assert_int_equal(stats.hpage_total - 3, stats.largest_free_hpages);
+  assert_true(stats.largest_free_spages <= stats.spage_free);
+
+  for (int i = 0; i < 50; i++)
+    OPDealloc(addr[i]);
+  OPDealloc(hblob);
+  OPHeapGetStats(heap, &stats);
+  assert_int_equal(50, stats.size_class[3].live_objects);
+  assert_int_equal(0, stats.huge_blob_cnt);
+  assert_int_equal(1, stats.hpage_used);
+  assert_int_equal(52, stats.live_objects);
+
+  for (int i = 50; i < 100; i++)
+    OPDealloc(addr[i]);
+  OPDealloc(large);
+  OPDealloc(sblob);
+  OPHeapGetStats(heap, &stats);
+  assert_int_equal(0, stats.live_objects);
+  assert_int_equal(0, stats.live_bytes);
+  OPHeapDestroy(heap);
+}
+
+int
+main (void)
+{
+  const struct CMUnitTest stats_tests[] =
+    {
+      cmocka_unit_test(test_OPHeapGetStats_Empty),
+      cmocka_unit_test(test_OPHeapGetStats_Usage),
+    };
+
+  return cmocka_run_group_tests(stats_tests, NULL, NULL);
+}
+
+/* stats_test.c ends here */
@@ -180,6 +180,43 @@ bool OPHeapRead(OPHeap** heap_ref, FILE* stream);
  */
 void OPHeapDestroy(OPHeap* heap);
 
+/**
+ * @ingroup malloc
+ * @brief Flags of OPHeapReserve.
+ */
+enum OPHeapReserveFlags
+  {
+    /** Prefault in the calling thread and return when done. */
+    OPHEAP_RESERVE_SYNC = 0,
+    /** Prefault in background threads and return immediately. */
+    OPHEAP_RESERVE_ASYNC = 1,
+  };
+
+/**
+ * @relates OPHeap
+ * @brief Prefault free huge pages so later allocations do not take
+ * page faults.
+ *
+ * Free huge pages are prefaulted in the order the allocator hands them
+ * out, until their total size reaches bytes.  The pages are made
+ * resident without modifying their content, so other threads may keep
+ * allocating meanwhile.  Pages released by OPDealloc stay resident, so
+ * a service can pay for the page faults of its peak working set once at
+ * startup.
+ *
+ * With OPHEAP_RESERVE_ASYNC the work is split across a few detached
+ * threads.  Destroying the heap before they finish is safe;
+ * OPHeapDestroy stops them and waits for the huge pages being
+ * prefaulted.
+ *
+ * @param heap OPHeap instance.
+ * @param bytes number of bytes to prefault.
+ * @param flags OPHEAP_RESERVE_SYNC or OPHEAP_RESERVE_ASYNC.
+ * @return true if enough free huge pages were found and prefaulting
+ * succeeded or was started, false otherwise.
+ */
+bool OPHeapReserve(OPHeap* heap, size_t bytes, int flags);
+
 /**
  * @relates OPHeap
  * @brief Store a pointer to a root pointer slot in OPHeap.
@@ -257,6 +294,208 @@ void* OPCallocAdviced(OPHeap* heap, size_t num, size_t size, int advice)
 void
 OPDealloc(void* addr);
 
+/**
+ * @ingroup malloc
+ * @struct OPHeapMarker
+ * @brief Snapshot of the allocations of an OPHeap, created by
+ * OPHeapMark.
+ */
+typedef struct OPHeapMarker OPHeapMarker;
+
+/**
+ * @relates OPHeap
+ * @brief Record the objects currently allocated in the heap.
+ *
+ * Together with OPHeapRollback, this frees every object allocated
+ * after the mark in bulk, without calling OPDealloc on each of them.
+ * The marker lives in process memory and is not written with the heap.
+ *
+ * @code
+ * OPHeapMarker* marker = OPHeapMark(heap);
+ * if (!BuildIndex(heap))
+ *   OPHeapRollback(heap, marker);
+ * OPHeapMarkerDestroy(marker);
+ * @endcode
+ *
+ * No other thread may allocate or deallocate in the heap while the
+ * mark is taken.
+ *
+ * @param heap OPHeap instance.
+ * @return the marker, or NULL if memory for it could not be allocated.
+ */
+OPHeapMarker* OPHeapMark(OPHeap* heap);
+
+/**
+ * @relates OPHeap
+ * @brief Free all objects allocated after the marker was created.
+ *
+ * Objects alive at the time of the mark and not deallocated since are
+ * kept.  Spans and huge pages created after the mark are returned to
+ * the heap by resetting the heap and span bitmaps.  A slot freed after
+ * the mark and reused by an object allocated after the mark stays
+ * allocated.
+ *
+ * No other thread may allocate or deallocate in the heap during the
+ * rollback.  The marker stays valid, so it can be rolled back again,
+ * e.g. to discard the scratch objects of each query.
+ *
+ * @param heap OPHeap instance.
+ * @param marker a marker created by OPHeapMark on this heap.
+ */
+void OPHeapRollback(OPHeap* heap, OPHeapMarker* marker);
+
+/**
+ * @ingroup malloc
+ * @brief Release the memory of the marker, without touching the heap.
+ *
+ * @param marker the marker to destroy.  May be NULL.
+ */
+void OPHeapMarkerDestroy(OPHeapMarker* marker);
+
+/**
+ * @ingroup malloc
+ * @brief Number of size classes served by unary spans.
+ *
+ * 16 classes from 16 to 256 bytes in steps of 16, then 512, 1024 and
+ * 2048 bytes.
+ */
+#define OPHEAP_SIZE_CLASS_NUM 19
+
+/**
+ * @ingroup malloc
+ * @brief Usage of one size class in OPHeapStats.
+ */
+typedef struct OPHeapSizeClassStats
+{
+  /** Object size served by this class. */
+  size_t obj_size;
+  /** Number of spans allocated for this class. */
+  size_t span_cnt;
+  /** Objects currently allocated. */
+  size_t live_objects;
+  /** Objects the spans can hold in total. */
+  size_t capacity;
+} OPHeapSizeClassStats;
+
+/**
+ * @ingroup malloc
+ * @brief Allocator usage reported by OPHeapGetStats.
+ *
+ * Objects up to 2048 bytes are counted at the size of their class;
+ * blobs are counted at the size of the pages they cover, minus their
+ * header.  Sizes requested by the user are not recorded in OPHeap.
+ */
+typedef struct OPHeapStats
+{
+  /** Huge pages addressable by the heap. */
+  size_t hpage_total;
+  /** Huge pages in use, either split into small pages or by blobs. */
+  size_t hpage_used;
+  /** Huge pages split into small pages. */
+  size_t hpage_split;
+  /** Number of objects larger than a huge page. */
+  size_t huge_blob_cnt;
+  /** Huge pages used by huge blobs. */
+  size_t huge_blob_hpages;
+  /** Small pages used by spans of objects up to 256 bytes. */
+  size_t spage_uspan;
+  /** Small pages used by spans of 512 to 2048 bytes objects. */
+  size_t spage_large_uspan;
+  /** Number of objects spanning multiple small pages. */
+  size_t small_blob_cnt;
+  /** Small pages used by small blobs. */
+  size_t spage_small_blob;
+  /** Small pages used by OPHeap and huge page headers. */
+  size_t spage_header;
+  /** Free small pages in split huge pages. */
+  size_t spage_free;
+  /** Objects currently allocated. */
+  size_t live_objects;
+  /** Bytes of the objects currently allocated. */
+  size_t live_bytes;
+  /** Bytes held by the allocator: huge pages in use minus free small
+   * pages in them. */
+  size_t used_bytes;
+  /** used_bytes not occupied by live objects: empty slots in spans,
+   * span headers and bitmaps. */
+  size_t internal_frag_bytes;
+  /** Longest run of free huge pages. */
+  size_t largest_free_hpages;
+  /** Longest run of free small pages within a split huge page. */
+  size_t largest_free_spages;
+  /** Per size class usage of unary spans. */
+  OPHeapSizeClassStats size_class[OPHEAP_SIZE_CLASS_NUM];
+} OPHeapStats;
+
+/**
+ * @relates OPHeap
+ * @brief Collect usage and fragmentation statistics of the heap.
+ *
+ * The statistics are computed from the heap and span bitmaps without
+ * taking any lock, hence it is safe to poll periodically while other
+ * threads allocate.  The numbers are then a best effort snapshot and
+ * may be slightly inconsistent with each other.
+ *
+ * @param heap OPHeap instance.
+ * @param stats the statistics to fill in.
+ */
+void OPHeapGetStats(OPHeap* heap, OPHeapStats* stats);
+
+/**
+ * @ingroup malloc
+ * @brief Output formats of OPHeapProfileDump.
+ */
+typedef enum OPHeapProfileFormat
+  {
+    /** Human readable report with symbolized call sites. */
+    OPHEAP_PROFILE_TEXT = 0,
+    /** Legacy gperftools heap profile, readable by pprof. */
+    OPHEAP_PROFILE_PPROF = 1,
+  } OPHeapProfileFormat;
+
+/**
+ * @ingroup malloc
+ * @brief Start sampling allocations made by OPMalloc and its variants.
+ *
+ * Each thread records a stack trace about once every sample_interval
+ * bytes it allocates.  The distance between two samples is
+ * exponentially distributed, so objects of any size get sampled in
+ * proportion to their size.  Samples of a previous profiling session
+ * are discarded.
+ *
+ * When profiling is stopped the allocation fast path only pays for a
+ * thread local decrement, and OPDealloc for an atomic load.
+ *
+ * @param sample_interval mean number of bytes between samples.  1
+ * samples every allocation.
+ */
+void OPHeapProfileStart(size_t sample_interval);
+
+/**
+ * @ingroup malloc
+ * @brief Stop taking new samples.
+ *
+ * Samples already taken are kept, and are still updated when the
+ * sampled objects are deallocated.
+ */
+void OPHeapProfileStop(void);
+
+/**
+ * @relates OPHeap
+ * @brief Write the sampled allocations of the heap to stream.
+ *
+ * Reports live and total allocated objects and bytes grouped by call
+ * site and size class.  The text format estimates the unsampled
+ * totals; the pprof format writes raw sample counts and leaves the
+ * scaling to pprof.
+ *
+ * @param heap OPHeap instance.
+ * @param stream an opened FILE pointer.
+ * @param format OPHEAP_PROFILE_TEXT or OPHEAP_PROFILE_PPROF.
+ */
+void OPHeapProfileDump(OPHeap* heap, FILE* stream,
+                       OPHeapProfileFormat format);
+
 /**
  * @relates OPHeap
  * @brief Given any pointer in the OPHeap, returns the pointer to OPHeap.
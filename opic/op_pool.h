@@ -0,0 +1,183 @@
+/**
+ * @file op_pool.h
+ * @author Felix Chern
+ * @date Sun Oct 18 2026
+ * @copyright 2017 Felix Chern
+ */
+
+/* This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Code: */
+
+#ifndef OP_POOL_H
+#define OP_POOL_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "opic/common/op_macros.h"
+#include "opic/op_malloc.h"
+
+OP_BEGIN_DECLS
+
+/**
+ * @defgroup pool
+ */
+
+/**
+ * @ingroup pool
+ * @typedef opref32_t
+ * @brief 32 bit reference to an object in an OPPool.
+ *
+ * Node based structures whose nodes all live in one pool can use
+ * opref32_t for their edges instead of opref_t, halving the space of
+ * each edge.  Like opref_t, opref32_t stays valid after the heap is
+ * written to disk and read back.  0 is the null reference.
+ */
+typedef uint32_t opref32_t;
+
+/**
+ * @ingroup pool
+ * @brief Number of objects in the first chunk of OPPool, in bits.
+ */
+#define OPPOOL_FIRST_CHUNK_BITS 6
+
+/**
+ * @ingroup pool
+ * @brief Maximum number of chunks of OPPool.
+ *
+ * Chunk k holds 2^(k + OPPOOL_FIRST_CHUNK_BITS) objects, so 27 chunks
+ * cover the whole opref32_t range.
+ */
+#define OPPOOL_CHUNK_NUM 27
+
+/**
+ * @ingroup pool
+ * @struct OPPool
+ * @brief Pool of fixed size objects in OPHeap addressed by opref32_t.
+ *
+ * Objects are carved from chunks of doubling size, so growing the pool
+ * never moves objects and pointers obtained from OPPoolRef2Ptr stay
+ * valid until the object is freed.  The pool itself is allocated in
+ * OPHeap and can be stored as a root pointer.
+ *
+ * @code
+ * struct Node {
+ *   opref32_t left, right;
+ *   uint32_t key;
+ * };
+ *
+ * OPPool* pool;
+ * OPPoolNew(heap, &pool, sizeof(struct Node));
+ * opref32_t root = OPPoolAlloc(pool);
+ * struct Node* node = OPPoolRef2Ptr(pool, root);
+ * node->left = OPPoolAlloc(pool);
+ * @endcode
+ *
+ * This object is not thread safe.
+ */
+typedef struct OPPool OPPool;
+
+struct OPPool
+{
+  uint32_t obj_size;
+  uint32_t chunk_num;
+  opref32_t free_ref;
+  opref32_t next_ref;
+  opref_t chunks[OPPOOL_CHUNK_NUM];
+};
+
+/**
+ * @relates OPPool
+ * @brief Constructor for OPPool.
+ *
+ * @param heap OPHeap instance.
+ * @param pool_ref reference to the OPPool pointer for assigning the
+ * OPPool instance.
+ * @param obj_size size of objects in the pool.  Objects smaller than
+ * opref32_t are padded to its size.
+ * @return true when the allocation succeeded, false otherwise.
+ */
+bool OPPoolNew(OPHeap* heap, OPPool** pool_ref, size_t obj_size);
+
+/**
+ * @relates OPPool
+ * @brief Destructor for OPPool.  Frees all objects of the pool.
+ *
+ * @param pool OPPool instance to destroy.
+ */
+void OPPoolDestroy(OPPool* pool);
+
+/**
+ * @relates OPPool
+ * @brief Allocate an object from the pool.
+ *
+ * The content of the object is not initialized.
+ *
+ * @param pool OPPool instance.
+ * @return reference to the object, or 0 if the pool is exhausted or
+ * the heap is out of memory.
+ */
+opref32_t OPPoolAlloc(OPPool* pool);
+
+/**
+ * @relates OPPool
+ * @brief Return an object to the pool.
+ *
+ * @param pool OPPool instance.
+ * @param ref reference to an object allocated from this pool.
+ */
+void OPPoolFree(OPPool* pool, opref32_t ref);
+
+/**
+ * @relates OPPool
+ * @brief Converts an opref32_t of the pool to a regular pointer.
+ *
+ * @param pool OPPool instance.
+ * @param ref A opref32_t value from this pool.
+ * @return A regular pointer, or NULL if ref is 0.
+ */
+static inline void*
+OPPoolRef2Ptr(OPPool* pool, opref32_t ref)
+{
+  uint64_t idx;
+  int msb;
+
+  if (op_unlikely(!ref))
+    return NULL;
+  idx = (uint64_t)ref - 1 + (1UL << OPPOOL_FIRST_CHUNK_BITS);
+  msb = 63 - __builtin_clzl(idx);
+  return (char*)OPRef2Ptr(pool, pool->chunks[msb - OPPOOL_FIRST_CHUNK_BITS])
+    + (idx - (1UL << msb)) * pool->obj_size;
+}
+
+/**
+ * @relates OPPool
+ * @brief Converts a pointer to an object of the pool to an opref32_t.
+ *
+ * This searches the chunks of the pool and is slower than
+ * OPPoolRef2Ptr.
+ *
+ * @param pool OPPool instance.
+ * @param addr pointer to an object allocated from this pool.
+ * @return A opref32_t value, or 0 if addr is NULL.
+ */
+opref32_t OPPoolPtr2Ref(OPPool* pool, void* addr);
+
+OP_END_DECLS
+
+#endif
+
+/* op_pool.h ends here */